@@ -28,6 +28,7 @@ THE SOFTWARE.  */
 #include <stdarg.h>
 #include <htslib/hts_defs.h>
 #include <htslib/vcf.h>
+#include <htslib/synced_bcf_reader.h>
 #include <math.h>
 
 #define FT_TAB_TEXT 0       // custom tab-delimited text file
@@ -38,6 +39,9 @@ THE SOFTWARE.  */
 #define FT_BCF_GZ (FT_GZ|FT_BCF)
 #define FT_STDIN (1<<3)
 
+// Flags returned by the v2 plugin API's flags(), see vcfplugin.c
+#define PLUGIN_THREAD_SAFE 1    // process_batch() can be called concurrently
+
 char *bcftools_version(void);
 void error(const char *format, ...) HTS_NORETURN;
 void bcf_hdr_append_version(bcf_hdr_t *hdr, int argc, char **argv, const char *cmd);
@@ -45,6 +49,78 @@ const char *hts_bcf_wmode(int file_type);
 
 void *smalloc(size_t size);     // safe malloc
 
+/*
+ *  Threads shared by all readers and writers of a command, see main.c.
+ *  bcftools_threads() - the command's --threads, or the global default if not given (-1)
+ *  bcftools_set_threads() - attach the shared pool to a reader or a writer
+ *  bcftools_sr_set_threads() - attach the shared pool to all readers of a synced
+ *                  reader, must be called before adding the readers and paired
+ *                  with bcftools_sr_destroy() in place of bcf_sr_destroy()
+ *  bcftools_perf_input() - record a reader opened with hts_open() for the
+ *                  performance report, call it before closing the reader
+ */
+int bcftools_threads(int n_threads);
+htsThreadPool *bcftools_thread_pool(int n_threads);
+int bcftools_set_threads(htsFile *fp, int n_threads);
+int bcftools_sr_set_threads(bcf_srs_t *files, int n_threads);
+void bcftools_sr_destroy(bcf_srs_t *files);
+void bcftools_perf_input(htsFile *fp);
+
+/*
+ *  bcftools_cmd() - run the command argv[0], as if called "bcftools argv[0] ...",
+ *                  and return its exit status
+ */
+int bcftools_cmd(int argc, char *argv[]);
+
+/*
+ *  Stages of "bcftools pipe", see vcfpipe.c. The records are passed from stage
+ *  to stage in blocks, a stage takes the records recs[0..n) of a block and
+ *  replaces them with its output. The block owns all its records, those past
+ *  n are spare, and the records change hands only by swapping pointers:
+ *
+ *  stage_block_take() - move the records of the block to the array recs,
+ *                  which is grown as needed, giving the block the replaced
+ *                  records in return. Returns the number of records taken.
+ *  stage_block_push() - append the record *rec to the block, *rec is given
+ *                  a spare record in return
+ *
+ *  The last block of the input has eof set, the stages which buffer records
+ *  flush them into it. A command NAME is run as a stage by
+ *
+ *  NAME_stage_init() - parse the command's options, argv[0] is the command
+ *                  name, reject those which do not apply to a stage and
+ *                  create the output header. The header is owned by the stage.
+ *  NAME_stage_process() - process a block
+ *  NAME_stage_destroy() - clean up after the last block
+ *
+ *  The plugin stage loads the plugin argv[0], only plugins which implement
+ *  process_batch() and write VCF are accepted, see vcfplugin.c.
+ */
+typedef struct
+{
+    bcf1_t **recs;
+    int n, m, eof;
+}
+stage_block_t;
+int stage_block_take(stage_block_t *blk, bcf1_t ***recs, int *mrecs);
+void stage_block_push(stage_block_t *blk, bcf1_t **rec);
+
+void *view_stage_init(int argc, char **argv, bcf_hdr_t *hdr_in, bcf_hdr_t **hdr_out);
+void view_stage_process(void *stage, stage_block_t *blk);
+void view_stage_destroy(void *stage);
+void *filter_stage_init(int argc, char **argv, bcf_hdr_t *hdr_in, bcf_hdr_t **hdr_out);
+void filter_stage_process(void *stage, stage_block_t *blk);
+void filter_stage_destroy(void *stage);
+void *norm_stage_init(int argc, char **argv, bcf_hdr_t *hdr_in, bcf_hdr_t **hdr_out);
+void norm_stage_process(void *stage, stage_block_t *blk);
+void norm_stage_destroy(void *stage);
+void *annotate_stage_init(int argc, char **argv, bcf_hdr_t *hdr_in, bcf_hdr_t **hdr_out);
+void annotate_stage_process(void *stage, stage_block_t *blk);
+void annotate_stage_destroy(void *stage);
+void *plugin_stage_init(int argc, char **argv, bcf_hdr_t *hdr_in, bcf_hdr_t **hdr_out);
+void plugin_stage_process(void *stage, stage_block_t *blk);
+void plugin_stage_destroy(void *stage);
+
 static inline char gt2iupac(char a, char b)
 {
     static const char iupac[4][4] = { {'A','M','R','W'},{'M','C','S','Y'},{'R','S','G','K'},{'W','Y','K','T'} };
@@ -70,4 +146,17 @@ static inline double phred_score(double prob)
     return prob>99 ? 99 : prob;
 }
 
+// Number of bits set, used for counting samples in bitsets
+static inline int popcount64(uint64_t x)
+{
+#ifdef __GNUC__
+    return __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (x * 0x0101010101010101ULL) >> 56;
+#endif
+}
+
 #endif
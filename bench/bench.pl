@@ -0,0 +1,350 @@
+#!/usr/bin/env perl
+#
+#   Copyright (C) 2017 Genome Research Ltd.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+# THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+# FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+# DEALINGS IN THE SOFTWARE.
+
+use strict;
+use warnings;
+use Carp;
+use FindBin;
+use lib "$FindBin::Bin";
+use Getopt::Long;
+use File::Temp qw/ tempfile tempdir /;
+use JSON::PP;
+
+# Scenarios: name, input files used for the MB/s figure, command. The command
+# is run by bash with the placeholders {bcftools}, {dir} and {out} expanded.
+my @scenarios =
+(
+    [ 'view',      ['a.bcf'],          q[{bcftools} view -Ob -o {out} {dir}/a.bcf] ],
+    [ 'view-vcf',  ['a.bcf'],          q[{bcftools} view -Oz -o {out} {dir}/a.bcf] ],
+    [ 'filter',    ['a.bcf'],          q[{bcftools} filter -i 'QUAL>50 && INFO/DP>100 && FMT/GQ>20' -Ob -o {out} {dir}/a.bcf] ],
+    [ 'query',     ['a.bcf'],          q[{bcftools} query -f '%CHROM\t%POS\t%REF\t%ALT[\t%GT]\n' {dir}/a.bcf > {out}] ],
+    [ 'merge',     ['a.bcf','b.bcf'],  q[{bcftools} merge -Ob -o {out} {dir}/a.bcf {dir}/b.bcf] ],
+    [ 'norm',      ['a.bcf'],          q[{bcftools} norm -m- -f {dir}/ref.fa -Ob -o {out} {dir}/a.bcf] ],
+    [ 'annotate',  ['a.bcf','b.bcf'],  q[{bcftools} annotate -a {dir}/b.bcf -c ID,INFO/DP -Ob -o {out} {dir}/a.bcf] ],
+    [ 'stats',     ['a.bcf'],          q[{bcftools} stats -s - {dir}/a.bcf > {out}] ],
+    [ 'call',      ['a.bcf'],          q[{bcftools} call -mv -Ob -o {out} {dir}/a.bcf] ],
+    [ 'csq',       ['a.bcf'],          q[{bcftools} csq -p a -f {dir}/ref.fa -g {dir}/genes.gff -Ob -o {out} {dir}/a.bcf] ],
+    [ 'gtcheck',   ['a.bcf','b.bcf'],  q[{bcftools} gtcheck -g {dir}/b.bcf {dir}/a.bcf > {out}] ],
+    [ 'roh',       ['a.bcf'],          q[{bcftools} roh --AF-dflt 0.4 {dir}/a.bcf > {out}] ],
+);
+my @columns = qw(scenario label threads samples records wall_s user_s sys_s max_rss_mb records_per_s mb_per_s);
+
+my $opts = parse_params();
+if ( exists($$opts{compare}) ) { compare($opts); exit; }
+prepare_data($opts);
+run_scenarios($opts);
+
+exit;
+
+#--------------------------------
+
+sub error
+{
+    my (@msg) = @_;
+    if ( scalar @msg ) { confess @msg; }
+    print
+        "About: Run timed bcftools scenarios on deterministic synthetic data. The results\n",
+        "       are printed in a tab-delimited format, one line per scenario, for comparison\n",
+        "       of two builds with --compare.\n",
+        "Usage: bench.pl [OPTIONS]\n",
+        "       bench.pl --compare old.txt new.txt\n",
+        "       bench.pl --compare old.json new.json\n",
+        "Options:\n",
+        "   -b, --bcftools <path>           The bcftools binary to test [../bcftools]\n",
+        "   -c, --compare <old> <new>       Compare two result files, tab-delimited or JSON, and print speedups\n",
+        "   -d, --data-dir <path>           Keep the generated data in this directory and reuse it\n",
+        "                                   in the next run with the same data options\n",
+        "   -g, --gen-args <string>         Additional arguments to gen-vcf, see `bench/gen-vcf -h`\n",
+        "   -j, --json                      Print the results in the JSON format\n",
+        "   -l, --label <string>            Label of the build to include in the results [bcftools --version]\n",
+        "   -n, --sites <int>               Number of sites [100000]\n",
+        "   -o, --output <file>             Write the results also to this file\n",
+        "   -r, --repeat <int>              Run each scenario <int> times and report the median [3]\n",
+        "   -s, --samples <int>             Number of samples [100]\n",
+        "   -S, --scenarios <list>          Comma-separated list of scenarios to run [all]:\n",
+        "                                   ", join(',', map { $$_[0] } @scenarios), "\n",
+        "   -t, --threads <int>             Run bcftools with --threads <int> [0]\n",
+        "   -h, -?, --help                  This help message.\n",
+        "\n";
+    exit -1;
+}
+sub parse_params
+{
+    my $opts = { sites=>100000, samples=>100, repeat=>3, threads=>0, gen_args=>'' };
+    my $help;
+    Getopt::Long::Configure('bundling');
+    my $ret = GetOptions (
+            'b|bcftools=s' => \$$opts{bcftools},
+            'c|compare' => \$$opts{compare},
+            'd|data-dir=s' => \$$opts{data_dir},
+            'g|gen-args=s' => \$$opts{gen_args},
+            'j|json' => \$$opts{json},
+            'l|label=s' => \$$opts{label},
+            'n|sites=i' => \$$opts{sites},
+            'o|output=s' => \$$opts{output},
+            'r|repeat=i' => \$$opts{repeat},
+            's|samples=i' => \$$opts{samples},
+            'S|scenarios=s' => \$$opts{scenarios},
+            't|threads=i' => \$$opts{threads},
+            'h|?|help' => \$help
+            );
+    if ( !$ret or $help ) { error(); }
+    if ( $$opts{compare} )
+    {
+        if ( @ARGV!=2 ) { error("Expected two files with --compare\n"); }
+        $$opts{compare} = [ @ARGV ];
+    }
+    elsif ( @ARGV ) { error(); }
+    else { delete($$opts{compare}); }
+    if ( $$opts{repeat} < 1 ) { error("Expected positive number: --repeat $$opts{repeat}\n"); }
+
+    $$opts{bin} = $FindBin::RealBin;
+    $$opts{bin} =~ s{/bench/?$}{};
+    if ( !defined $$opts{bcftools} ) { $$opts{bcftools} = "$$opts{bin}/bcftools"; }
+    $$opts{gen_vcf} = "$FindBin::RealBin/gen-vcf";
+    $$opts{rusage}  = "$FindBin::RealBin/rusage";
+    $$opts{tmp} = tempdir(CLEANUP=>1);
+    if ( !defined $$opts{data_dir} ) { $$opts{data_dir} = $$opts{tmp}; }
+    return $opts;
+}
+
+sub _cmd
+{
+    my ($cmd) = @_;
+    my $kid_io;
+    my @out;
+    my $pid = open($kid_io, "-|");
+    if ( !defined $pid ) { error("Cannot fork: $!"); }
+    if ($pid)
+    {
+        # parent
+        @out = <$kid_io>;
+        close($kid_io);
+    }
+    else
+    {
+        # child
+        exec('/bin/bash', '-o','pipefail','-c', $cmd) or error("Cannot execute the command [/bin/sh -o pipefail -c $cmd]: $!");
+    }
+    return ($? >> 8, join('',@out));
+}
+sub cmd
+{
+    my ($cmd) = @_;
+    my ($ret,$out) = _cmd($cmd);
+    if ( $ret ) { error("The command failed: $cmd\n", $out); }
+    return $out;
+}
+
+# The data are created only once for a given set of generator options, the
+# options are recorded in the directory and compared on reuse.
+sub prepare_data
+{
+    my ($opts) = @_;
+    my $dir = $$opts{data_dir};
+    my $gen = "-n $$opts{sites} -s $$opts{samples} $$opts{gen_args}";
+    cmd("mkdir -p $dir");
+    if ( -e "$dir/gen-args.txt" && -e "$dir/b.bcf.csi" )
+    {
+        my $prev = cmd("cat $dir/gen-args.txt");
+        chomp($prev);
+        if ( $prev eq $gen ) { $$opts{nrec} = count_records($opts,"$dir/a.bcf"); return; }
+    }
+    print STDERR "Generating data in $dir: gen-vcf $gen\n";
+    cmd("rm -f $dir/gen-args.txt");
+    cmd("$$opts{gen_vcf} $gen -r $dir/ref.fa -g $dir/genes.gff | $$opts{bcftools} view -Ob -o $dir/a.bcf");
+    cmd("$$opts{bcftools} index -f $dir/a.bcf");
+    # the second file has the same sites and genotypes under different sample names
+    cmd("$$opts{gen_vcf} $gen -N T | $$opts{bcftools} view -Ob -o $dir/b.bcf");
+    cmd("$$opts{bcftools} index -f $dir/b.bcf");
+    cmd("echo '$gen' > $dir/gen-args.txt");
+    $$opts{nrec} = count_records($opts,"$dir/a.bcf");
+}
+sub count_records
+{
+    my ($opts,$file) = @_;
+    my $n = cmd("$$opts{bcftools} index -n $file");
+    chomp($n);
+    return $n;
+}
+
+sub median
+{
+    my (@vals) = sort { $a<=>$b } @_;
+    my $n = scalar @vals;
+    return $n % 2 ? $vals[$n/2] : ($vals[$n/2-1] + $vals[$n/2]) / 2;
+}
+
+sub run_scenarios
+{
+    my ($opts) = @_;
+    my %want = ();
+    if ( defined $$opts{scenarios} )
+    {
+        my %known = map { $$_[0] => 1 } @scenarios;
+        for my $name (split(/,/,$$opts{scenarios}))
+        {
+            if ( !exists($known{$name}) ) { error("No such scenario: $name\n"); }
+            $want{$name} = 1;
+        }
+    }
+    my $label = $$opts{label};
+    if ( !defined $label )
+    {
+        $label = (split(/\n/, cmd("$$opts{bcftools} --version")))[0];
+        $label =~ s/^bcftools\s+//;
+    }
+    my $bcftools = $$opts{threads} ? "$$opts{bcftools} --threads $$opts{threads}" : $$opts{bcftools};
+
+    my @results = ();
+    for my $scenario (@scenarios)
+    {
+        my ($name,$inputs,$cmd) = @$scenario;
+        if ( %want && !exists($want{$name}) ) { next; }
+
+        $cmd =~ s/{bcftools}/$bcftools/g;
+        $cmd =~ s/{dir}/$$opts{data_dir}/g;
+        $cmd =~ s/{out}/$$opts{tmp}\/out/g;
+
+        my $bytes = 0;
+        for my $file (@$inputs) { $bytes += -s "$$opts{data_dir}/$file"; }
+
+        # the command goes through a script to avoid another level of quoting
+        open(my $fh,'>',"$$opts{tmp}/cmd.sh") or error("$$opts{tmp}/cmd.sh: $!");
+        print $fh "$cmd\n";
+        close($fh) or error("close failed: $$opts{tmp}/cmd.sh");
+
+        my (@wall,@user,@sys,@rss);
+        for (my $i=0; $i<$$opts{repeat}; $i++)
+        {
+            my ($ret,$out) = _cmd("$$opts{rusage} $$opts{tmp}/rusage.txt /bin/bash -o pipefail $$opts{tmp}/cmd.sh 2>&1");
+            if ( $ret ) { error("The command failed: $cmd\n", $out); }
+            my @vals = split(/\t/, cmd("cat $$opts{tmp}/rusage.txt"));
+            chomp($vals[-1]);
+            push @wall, $vals[1];
+            push @user, $vals[2];
+            push @sys,  $vals[3];
+            push @rss,  $vals[4];
+        }
+        my $wall = median(@wall);
+        my $res =
+        {
+            scenario  => $name,
+            label     => $label,
+            threads   => $$opts{threads},
+            samples   => $$opts{samples},
+            records   => $$opts{nrec},
+            wall_s    => $wall,
+            user_s    => median(@user),
+            sys_s     => median(@sys),
+            max_rss_mb  => sprintf("%.1f", median(@rss)/1024),
+            records_per_s => $wall ? sprintf("%.0f", $$opts{nrec}/$wall) : 0,
+            mb_per_s  => $wall ? sprintf("%.2f", $bytes/1e6/$wall) : 0,
+        };
+        push @results, $res;
+        print STDERR "$name\t$wall s\n";
+    }
+    print_results($opts,\@results,\*STDOUT);
+    if ( defined $$opts{output} )
+    {
+        open(my $fh,'>',$$opts{output}) or error("$$opts{output}: $!");
+        print_results($opts,\@results,$fh);
+        close($fh) or error("close failed: $$opts{output}");
+    }
+}
+
+sub print_results
+{
+    my ($opts,$results,$fh) = @_;
+    if ( $$opts{json} )
+    {
+        my @recs = ();
+        for my $res (@$results)
+        {
+            my @fields = ();
+            for my $col (@columns)
+            {
+                my $val = $$res{$col};
+                if ( $col eq 'scenario' or $col eq 'label' or $val!~/^-?[0-9.]+$/ )
+                {
+                    $val =~ s/(["\\])/\\$1/g;
+                    $val = qq["$val"];
+                }
+                push @fields, qq["$col":$val];
+            }
+            push @recs, "  {".join(',',@fields)."}";
+        }
+        print $fh "[\n", join(",\n",@recs), "\n]\n";
+        return;
+    }
+    print $fh "#", join("\t",@columns), "\n";
+    for my $res (@$results)
+    {
+        print $fh join("\t", map { $$res{$_} } @columns), "\n";
+    }
+}
+
+sub read_results
+{
+    my ($file) = @_;
+    my %res = ();
+    my @cols;
+    open(my $fh,'<',$file) or error("$file: $!");
+    my @lines = <$fh>;
+    close($fh) or error("close failed: $file");
+
+    # the output of --json
+    if ( @lines && $lines[0]=~/^\s*\[/ )
+    {
+        my $recs = eval { decode_json(join('',@lines)) };
+        if ( !defined $recs or ref($recs) ne 'ARRAY' ) { error("Could not parse the JSON file $file\n", $@ ? $@ : ''); }
+        for my $rec (@$recs) { $res{$$rec{scenario}} = $rec; }
+        return \%res;
+    }
+
+    for my $line (@lines)
+    {
+        chomp($line);
+        if ( $line=~/^#/ ) { $line =~ s/^#//; @cols = split(/\t/,$line); next; }
+        my @vals = split(/\t/,$line);
+        my %rec = map { $cols[$_] => $vals[$_] } 0..$#cols;
+        $res{$rec{scenario}} = \%rec;
+    }
+    return \%res;
+}
+
+sub compare
+{
+    my ($opts) = @_;
+    my ($afile,$bfile) = @{$$opts{compare}};
+    my $a = read_results($afile);
+    my $b = read_results($bfile);
+    print "#scenario\twall_s.old\twall_s.new\tspeedup\tmax_rss_mb.old\tmax_rss_mb.new\n";
+    for my $name (map { $$_[0] } @scenarios)
+    {
+        if ( !exists($$a{$name}) or !exists($$b{$name}) ) { next; }
+        my $wa = $$a{$name}{wall_s};
+        my $wb = $$b{$name}{wall_s};
+        my $speedup = $wb ? sprintf("%.2f",$wa/$wb) : '.';
+        print join("\t", $name, $wa, $wb, $speedup, $$a{$name}{max_rss_mb}, $$b{$name}{max_rss_mb}), "\n";
+    }
+}
@@ -0,0 +1,560 @@
+/*  bench/gen-vcf.c -- Deterministic synthetic VCF generator for benchmarks.
+
+    gcc -g -Wall -O2 -o gen-vcf gen-vcf.c
+
+    Copyright (C) 2017 Genome Research Ltd.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+/*
+    The generator does not depend on htslib so that the benchmark data can be
+    created before anything else is built. The output is a function of the
+    command line only: the same options and seed give byte-identical files on
+    all platforms, so that timings from different builds are comparable.
+
+    The VCF is written to stdout, optionally together with a matching reference
+    (-r) whose bases agree with the REF alleles, and a GFF3 gene annotation (-g)
+    in the Ensembl flavour expected by `bcftools csq`.
+*/
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#define FMT_GT (1<<0)
+#define FMT_AD (1<<1)
+#define FMT_DP (1<<2)
+#define FMT_GQ (1<<3)
+#define FMT_PL (1<<4)
+
+typedef struct
+{
+    int nchr, nsmpl, nals_max, ploidy, fmt;
+    uint64_t chr_len, nsites, seed, rng;
+    double phased, indels, missing;
+    char *smpl_prefix, *ref_fname, *gff_fname;
+    char **seq;     // reference sequence of each chromosome
+    int *gt, *ad, *pl;
+    char *buf;      // output buffer
+    size_t nbuf, mbuf;
+}
+args_t;
+
+static void error(const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+    exit(-1);
+}
+
+// xorshift64*, used instead of rand() so that the output is the same on all platforms
+static inline uint64_t rnd(args_t *args)
+{
+    args->rng ^= args->rng >> 12;
+    args->rng ^= args->rng << 25;
+    args->rng ^= args->rng >> 27;
+    return args->rng * 2685821657736338717ULL;
+}
+static inline double rnd_dbl(args_t *args)
+{
+    return (rnd(args) >> 11) * (1.0/9007199254740992.0);
+}
+static inline int rnd_int(args_t *args, int n)
+{
+    return rnd(args) % n;
+}
+
+static void flush_buf(args_t *args, FILE *fp)
+{
+    if ( args->nbuf && fwrite(args->buf, 1, args->nbuf, fp) != args->nbuf ) error("Failed to write: %s\n", strerror(errno));
+    args->nbuf = 0;
+}
+static inline void put_chr(args_t *args, char c)
+{
+    args->buf[args->nbuf++] = c;
+}
+static inline void put_str(args_t *args, const char *str)
+{
+    while ( *str ) args->buf[args->nbuf++] = *str++;
+}
+static inline void put_int(args_t *args, int64_t val)
+{
+    char tmp[32];
+    int n = 0;
+    if ( val < 0 ) { put_chr(args,'-'); val = -val; }
+    do { tmp[n++] = '0' + val % 10; val /= 10; } while ( val );
+    while ( n ) args->buf[args->nbuf++] = tmp[--n];
+}
+static inline void reserve(args_t *args, size_t len)
+{
+    if ( args->nbuf + len <= args->mbuf ) return;
+    args->mbuf = args->nbuf + len + (args->nbuf + len)/2;
+    args->buf  = (char*) realloc(args->buf, args->mbuf);
+    if ( !args->buf ) error("Could not allocate %zu bytes\n", args->mbuf);
+}
+
+static void init_reference(args_t *args)
+{
+    static const char acgt[] = "ACGT";
+    args->seq = (char**) malloc(sizeof(char*)*args->nchr);
+    int i;
+    uint64_t j;
+    for (i=0; i<args->nchr; i++)
+    {
+        args->seq[i] = (char*) malloc(args->chr_len + 1);
+        for (j=0; j<args->chr_len; j++) args->seq[i][j] = acgt[rnd(args) >> 62];
+        args->seq[i][args->chr_len] = 0;
+    }
+    if ( !args->ref_fname ) return;
+
+    FILE *fp = fopen(args->ref_fname, "w");
+    if ( !fp ) error("%s: %s\n", args->ref_fname, strerror(errno));
+    for (i=0; i<args->nchr; i++)
+    {
+        fprintf(fp, ">%d\n", i+1);
+        for (j=0; j<args->chr_len; j+=60)
+        {
+            int n = args->chr_len - j < 60 ? args->chr_len - j : 60;
+            fwrite(args->seq[i] + j, 1, n, fp);
+            fputc('\n', fp);
+        }
+    }
+    if ( fclose(fp) ) error("%s: %s\n", args->ref_fname, strerror(errno));
+}
+
+// One three-exon protein coding transcript per 20kb, alternating strands.
+// All CDS lengths are multiples of three so that the phase is always 0.
+static void write_gff(args_t *args)
+{
+    FILE *fp = fopen(args->gff_fname, "w");
+    if ( !fp ) error("%s: %s\n", args->gff_fname, strerror(errno));
+    fprintf(fp, "##gff-version 3\n");
+    int i, id = 0;
+    uint64_t pos;
+    for (i=0; i<args->nchr; i++)
+    {
+        for (pos=5001; pos + 3000 < args->chr_len; pos += 20000)
+        {
+            char strand = id % 2 ? '-' : '+';
+            id++;
+            uint64_t beg = pos, end = pos + 2299;
+            fprintf(fp, "%d\tbench\tgene\t%"PRIu64"\t%"PRIu64"\t.\t%c\t.\tID=gene:G%d;Name=G%d;biotype=protein_coding\n", i+1,beg,end,strand,id,id);
+            fprintf(fp, "%d\tbench\ttranscript\t%"PRIu64"\t%"PRIu64"\t.\t%c\t.\tID=transcript:T%d;Parent=gene:G%d;Name=T%d;biotype=protein_coding\n", i+1,beg,end,strand,id,id,id);
+            int j;
+            for (j=0; j<3; j++)
+            {
+                uint64_t ebeg = beg + j*1000, eend = ebeg + 299;
+                uint64_t cbeg = j==0 ? ebeg + 51 : ebeg, cend = eend;
+                fprintf(fp, "%d\tbench\texon\t%"PRIu64"\t%"PRIu64"\t.\t%c\t.\tParent=transcript:T%d\n", i+1,ebeg,eend,strand,id);
+                fprintf(fp, "%d\tbench\tCDS\t%"PRIu64"\t%"PRIu64"\t.\t%c\t0\tID=CDS:P%d;Parent=transcript:T%d\n", i+1,cbeg,cend,strand,id,id);
+            }
+        }
+    }
+    if ( fclose(fp) ) error("%s: %s\n", args->gff_fname, strerror(errno));
+}
+
+static void write_header(args_t *args)
+{
+    int i;
+    printf("##fileformat=VCFv4.2\n");
+    printf("##source=bcftools-bench-gen-vcf,seed=%"PRIu64"\n", args->seed);
+    for (i=0; i<args->nchr; i++) printf("##contig=<ID=%d,length=%"PRIu64">\n", i+1, args->chr_len);
+    printf("##FILTER=<ID=LowQual,Description=\"Low quality\">\n");
+    printf("##INFO=<ID=DP,Number=1,Type=Integer,Description=\"Total depth\">\n");
+    printf("##INFO=<ID=AC,Number=A,Type=Integer,Description=\"Allele count in genotypes\">\n");
+    printf("##INFO=<ID=AN,Number=1,Type=Integer,Description=\"Total number of alleles in called genotypes\">\n");
+    if ( args->fmt & FMT_GT ) printf("##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n");
+    if ( args->fmt & FMT_AD ) printf("##FORMAT=<ID=AD,Number=R,Type=Integer,Description=\"Allelic depths\">\n");
+    if ( args->fmt & FMT_DP ) printf("##FORMAT=<ID=DP,Number=1,Type=Integer,Description=\"Read depth\">\n");
+    if ( args->fmt & FMT_GQ ) printf("##FORMAT=<ID=GQ,Number=1,Type=Integer,Description=\"Genotype quality\">\n");
+    if ( args->fmt & FMT_PL ) printf("##FORMAT=<ID=PL,Number=G,Type=Integer,Description=\"Phred-scaled genotype likelihoods\">\n");
+    printf("#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO");
+    if ( args->nsmpl ) printf("\tFORMAT");
+    for (i=0; i<args->nsmpl; i++) printf("\t%s%d", args->smpl_prefix, i+1);
+    printf("\n");
+    fflush(stdout);
+}
+
+// Alleles of one site: a SNP, an insertion or a deletion relative to the first
+// REF base; REF is taken from the reference so that `norm -f` succeeds.
+static int make_alleles(args_t *args, int ichr, uint64_t pos, char **als, int *rlen)
+{
+    static char mem[8][16];
+    static const char acgt[] = "ACGT";
+    const char *seq = args->seq[ichr] + pos - 1;
+    int i, nals = 2 + (args->nals_max > 2 ? rnd_int(args, args->nals_max - 1) : 0);
+    if ( nals > 8 ) nals = 8;
+    int indel = rnd_dbl(args) < args->indels ? 1 : 0;
+    *rlen = indel && pos + 4 < args->chr_len ? 1 + rnd_int(args,4) : 1;
+    memcpy(mem[0], seq, *rlen); mem[0][*rlen] = 0;
+    als[0] = mem[0];
+    for (i=1; i<nals; i++)
+    {
+        als[i] = mem[i];
+        if ( !indel )
+        {
+            // distinct SNP alleles, at most three
+            if ( i > 3 ) break;
+            int j, k = 0;
+            for (j=0; j<4; j++)
+            {
+                if ( acgt[j]==seq[0] ) continue;
+                if ( ++k == i ) break;
+            }
+            mem[i][0] = acgt[j]; mem[i][1] = 0;
+        }
+        else if ( *rlen > 1 && i==1 )
+        {
+            mem[i][0] = seq[0]; mem[i][1] = 0;      // deletion
+        }
+        else
+        {
+            int j, n = i + 1;                       // insertions of distinct lengths
+            memcpy(mem[i], seq, *rlen);
+            for (j=0; j<n; j++) mem[i][*rlen + j] = acgt[rnd(args) >> 62];
+            mem[i][*rlen + n] = 0;
+        }
+    }
+    return i;
+}
+
+static void write_sites(args_t *args)
+{
+    uint64_t nper_chr = args->nsites / args->nchr, isite;
+    if ( !nper_chr ) nper_chr = 1;
+    uint64_t step = args->chr_len / nper_chr;
+    if ( step < 1 ) error("Too many sites for the chromosome length: %"PRIu64" vs %"PRIu64"\n", args->nsites, args->chr_len*args->nchr);
+
+    int ngt_max = (args->nals_max*(args->nals_max+1))/2;
+    args->gt = (int*) malloc(sizeof(int)*args->ploidy);
+    args->ad = (int*) malloc(sizeof(int)*8);
+    args->pl = (int*) malloc(sizeof(int)*(ngt_max > 36 ? ngt_max : 36));
+    int *ac  = (int*) calloc(8, sizeof(int));
+
+    size_t smpl_len = 2*args->ploidy + 6*8 + 6 + 6 + 6*36 + 8;
+    char *line = NULL;
+    size_t mline = 0;
+    int ichr;
+    for (ichr=0; ichr<args->nchr; ichr++)
+    {
+        for (isite=0; isite<nper_chr; isite++)
+        {
+            uint64_t pos = isite*step + 1 + (step > 1 ? rnd(args) % step : 0);
+            if ( pos + 5 >= args->chr_len ) pos = args->chr_len - 5;
+            char *als[8];
+            int rlen, nals = make_alleles(args, ichr, pos, als, &rlen);
+            int ngt = nals*(nals+1)/2;
+
+            // per-site ALT frequency, skewed towards rare variants
+            double u = rnd_dbl(args), af = u*u*u;
+            int i, j, k, an = 0, site_dp = 0;
+            memset(ac, 0, sizeof(int)*8);
+
+            reserve(args, (size_t)args->nsmpl*smpl_len + 1024);
+            size_t site_start = args->nbuf;
+
+            // FORMAT fields first into the buffer, the fixed columns are
+            // prepended once INFO/AC,AN,DP are known
+            if ( args->nsmpl )
+            {
+                put_chr(args,'\t');
+                const char *sep = "";
+                if ( args->fmt & FMT_GT ) { put_str(args,sep); put_str(args,"GT"); sep = ":"; }
+                if ( args->fmt & FMT_AD ) { put_str(args,sep); put_str(args,"AD"); sep = ":"; }
+                if ( args->fmt & FMT_DP ) { put_str(args,sep); put_str(args,"DP"); sep = ":"; }
+                if ( args->fmt & FMT_GQ ) { put_str(args,sep); put_str(args,"GQ"); sep = ":"; }
+                if ( args->fmt & FMT_PL && args->ploidy<=2 ) { put_str(args,sep); put_str(args,"PL"); sep = ":"; }
+            }
+            for (i=0; i<args->nsmpl; i++)
+            {
+                int missing = rnd_dbl(args) < args->missing ? 1 : 0;
+                int phased  = rnd_dbl(args) < args->phased ? 1 : 0;
+                for (j=0; j<args->ploidy; j++)
+                    args->gt[j] = rnd_dbl(args) < af ? 1 + rnd_int(args, nals-1) : 0;
+                int dp = missing ? 0 : 5 + rnd_int(args,30);
+                site_dp += dp;
+
+                put_chr(args,'\t');
+                const char *sep = "";
+                if ( args->fmt & FMT_GT )
+                {
+                    for (j=0; j<args->ploidy; j++)
+                    {
+                        if ( j ) put_chr(args, phased ? '|' : '/');
+                        if ( missing ) put_chr(args,'.');
+                        else { put_int(args, args->gt[j]); ac[args->gt[j]]++; an++; }
+                    }
+                    sep = ":";
+                }
+                if ( args->fmt & FMT_AD )
+                {
+                    put_str(args,sep);
+                    for (k=0; k<nals; k++) args->ad[k] = 0;
+                    for (k=0; k<dp; k++) args->ad[ args->gt[rnd_int(args,args->ploidy)] ]++;
+                    for (k=0; k<nals; k++)
+                    {
+                        if ( k ) put_chr(args,',');
+                        if ( missing ) put_chr(args,'.'); else put_int(args,args->ad[k]);
+                    }
+                    sep = ":";
+                }
+                if ( args->fmt & FMT_DP )
+                {
+                    put_str(args,sep);
+                    if ( missing ) put_chr(args,'.'); else put_int(args,dp);
+                    sep = ":";
+                }
+                // PL is 0 for the true genotype and increases with the number
+                // of differing alleles; defined for haploid and diploid only
+                int gq = 99;
+                if ( args->ploidy==1 )
+                    for (k=0; k<nals; k++) args->pl[k] = k==args->gt[0] ? 0 : 10 + rnd_int(args,90);
+                else if ( args->ploidy==2 )
+                {
+                    int a, b, igt = 0;
+                    for (b=0; b<nals; b++)
+                        for (a=0; a<=b; a++)
+                        {
+                            int diff = (a!=args->gt[0] && a!=args->gt[1]) + (b!=args->gt[0] && b!=args->gt[1]);
+                            if ( (a==args->gt[0] && b==args->gt[1]) || (a==args->gt[1] && b==args->gt[0]) ) diff = 0;
+                            else if ( !diff ) diff = 1;
+                            args->pl[igt++] = diff ? diff*10 + rnd_int(args,dp+1)*3 : 0;
+                        }
+                }
+                int npl = args->ploidy==1 ? nals : ngt;
+                if ( args->ploidy<=2 )
+                    for (k=0; k<npl; k++) if ( args->pl[k] && args->pl[k] < gq ) gq = args->pl[k];
+                if ( args->fmt & FMT_GQ )
+                {
+                    put_str(args,sep);
+                    if ( missing ) put_chr(args,'.'); else put_int(args,gq);
+                    sep = ":";
+                }
+                if ( args->fmt & FMT_PL && args->ploidy<=2 )
+                {
+                    put_str(args,sep);
+                    for (k=0; k<npl; k++)
+                    {
+                        if ( k ) put_chr(args,',');
+                        if ( missing ) put_chr(args,'.'); else put_int(args,args->pl[k]);
+                    }
+                }
+            }
+            put_chr(args,'\n');
+
+            // the fixed columns
+            size_t fmt_len = args->nbuf - site_start;
+            if ( mline < fmt_len ) { mline = fmt_len; line = (char*) realloc(line, mline); }
+            memcpy(line, args->buf + site_start, fmt_len);
+            args->nbuf = site_start;
+            reserve(args, fmt_len + 256 + 16*nals);
+
+            put_int(args, ichr+1); put_chr(args,'\t');
+            put_int(args, pos); put_chr(args,'\t');
+            if ( rnd_int(args,4)==0 ) { put_str(args,"rs"); put_int(args, ichr*args->chr_len + pos); }
+            else put_chr(args,'.');
+            put_chr(args,'\t');
+            put_str(args, als[0]); put_chr(args,'\t');
+            for (i=1; i<nals; i++) { if ( i>1 ) put_chr(args,','); put_str(args, als[i]); }
+            int qual = 3 + rnd_int(args,200);
+            put_chr(args,'\t'); put_int(args,qual);
+            put_chr(args,'\t'); put_str(args, qual < 20 ? "LowQual" : "PASS");
+            put_str(args,"\tDP="); put_int(args, args->nsmpl ? site_dp : 10 + rnd_int(args,1000));
+            if ( args->nsmpl && args->fmt & FMT_GT )
+            {
+                put_str(args,";AC=");
+                for (i=1; i<nals; i++) { if ( i>1 ) put_chr(args,','); put_int(args, ac[i]); }
+                put_str(args,";AN="); put_int(args, an);
+            }
+            if ( args->nsmpl )
+            {
+                memcpy(args->buf + args->nbuf, line, fmt_len);
+                args->nbuf += fmt_len;
+            }
+            else put_chr(args,'\n');
+            if ( args->nbuf > 1<<20 ) flush_buf(args, stdout);
+        }
+    }
+    flush_buf(args, stdout);
+    free(line);
+    free(ac);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "\n");
+    fprintf(stderr, "About: Generate deterministic synthetic VCF for benchmarking. The output is the same\n");
+    fprintf(stderr, "       for the same options on all platforms. The VCF is printed to stdout.\n");
+    fprintf(stderr, "Usage: gen-vcf [OPTIONS]\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -a, --alleles <int>             maximum number of alleles per site, REF included [3]\n");
+    fprintf(stderr, "    -c, --chroms <int>              number of chromosomes [2]\n");
+    fprintf(stderr, "    -f, --format <list>             FORMAT tags, a subset of GT,AD,DP,GQ,PL [GT,AD,DP,GQ,PL]\n");
+    fprintf(stderr, "    -g, --gff <file>                write GFF3 gene annotation for `bcftools csq`\n");
+    fprintf(stderr, "    -i, --indels <float>            fraction of indel sites [0.1]\n");
+    fprintf(stderr, "    -l, --length <int>              length of each chromosome [10000000]\n");
+    fprintf(stderr, "    -m, --missing <float>           fraction of missing genotypes [0.01]\n");
+    fprintf(stderr, "    -n, --sites <int>               total number of sites [100000]\n");
+    fprintf(stderr, "    -N, --sample-prefix <string>    prefix of sample names [S]\n");
+    fprintf(stderr, "    -p, --ploidy <int>              ploidy, PL is written for haploid and diploid only [2]\n");
+    fprintf(stderr, "    -P, --phased <float>            fraction of phased genotypes [0]\n");
+    fprintf(stderr, "    -r, --ref <file>                write the reference sequence in FASTA format\n");
+    fprintf(stderr, "    -s, --samples <int>             number of samples [100]\n");
+    fprintf(stderr, "    -S, --seed <int>                random seed [1]\n");
+    fprintf(stderr, "\n");
+    exit(-1);
+}
+
+static int parse_fmt(const char *str)
+{
+    int fmt = 0;
+    const char *beg = str;
+    while ( *beg )
+    {
+        const char *end = beg;
+        while ( *end && *end!=',' ) end++;
+        int len = end - beg;
+        if ( len==2 && !strncmp(beg,"GT",2) ) fmt |= FMT_GT;
+        else if ( len==2 && !strncmp(beg,"AD",2) ) fmt |= FMT_AD;
+        else if ( len==2 && !strncmp(beg,"DP",2) ) fmt |= FMT_DP;
+        else if ( len==2 && !strncmp(beg,"GQ",2) ) fmt |= FMT_GQ;
+        else if ( len==2 && !strncmp(beg,"PL",2) ) fmt |= FMT_PL;
+        else error("The FORMAT tag \"%.*s\" is not supported\n", len,beg);
+        beg = *end ? end + 1 : end;
+    }
+    return fmt;
+}
+
+int main(int argc, char **argv)
+{
+    args_t *args = (args_t*) calloc(1,sizeof(args_t));
+    args->nchr     = 2;
+    args->chr_len  = 10000000;
+    args->nsites   = 100000;
+    args->nsmpl    = 100;
+    args->nals_max = 3;
+    args->ploidy   = 2;
+    args->fmt      = FMT_GT|FMT_AD|FMT_DP|FMT_GQ|FMT_PL;
+    args->indels   = 0.1;
+    args->missing  = 0.01;
+    args->seed     = 1;
+    args->smpl_prefix = "S";
+
+    static struct option loptions[] =
+    {
+        {"alleles",1,0,'a'},
+        {"chroms",1,0,'c'},
+        {"format",1,0,'f'},
+        {"gff",1,0,'g'},
+        {"indels",1,0,'i'},
+        {"length",1,0,'l'},
+        {"missing",1,0,'m'},
+        {"sites",1,0,'n'},
+        {"sample-prefix",1,0,'N'},
+        {"ploidy",1,0,'p'},
+        {"phased",1,0,'P'},
+        {"ref",1,0,'r'},
+        {"samples",1,0,'s'},
+        {"seed",1,0,'S'},
+        {0,0,0,0}
+    };
+    int c;
+    char *tmp;
+    while ((c = getopt_long(argc, argv, "a:c:f:g:i:l:m:n:N:p:P:r:s:S:h?",loptions,NULL)) >= 0)
+    {
+        switch (c)
+        {
+            case 'a':
+                args->nals_max = strtol(optarg,&tmp,10);
+                if ( *tmp || args->nals_max<2 || args->nals_max>8 ) error("Could not parse: --alleles %s, expected 2-8\n", optarg);
+                break;
+            case 'c':
+                args->nchr = strtol(optarg,&tmp,10);
+                if ( *tmp || args->nchr<1 ) error("Could not parse: --chroms %s\n", optarg);
+                break;
+            case 'f': args->fmt = parse_fmt(optarg); break;
+            case 'g': args->gff_fname = optarg; break;
+            case 'i':
+                args->indels = strtod(optarg,&tmp);
+                if ( *tmp || args->indels<0 || args->indels>1 ) error("Could not parse: --indels %s\n", optarg);
+                break;
+            case 'l':
+                args->chr_len = strtoull(optarg,&tmp,10);
+                if ( *tmp || args->chr_len<100 ) error("Could not parse: --length %s, expected at least 100\n", optarg);
+                break;
+            case 'm':
+                args->missing = strtod(optarg,&tmp);
+                if ( *tmp || args->missing<0 || args->missing>1 ) error("Could not parse: --missing %s\n", optarg);
+                break;
+            case 'n':
+                args->nsites = strtoull(optarg,&tmp,10);
+                if ( *tmp ) error("Could not parse: --sites %s\n", optarg);
+                break;
+            case 'N': args->smpl_prefix = optarg; break;
+            case 'p':
+                args->ploidy = strtol(optarg,&tmp,10);
+                if ( *tmp || args->ploidy<1 ) error("Could not parse: --ploidy %s\n", optarg);
+                break;
+            case 'P':
+                args->phased = strtod(optarg,&tmp);
+                if ( *tmp || args->phased<0 || args->phased>1 ) error("Could not parse: --phased %s\n", optarg);
+                break;
+            case 'r': args->ref_fname = optarg; break;
+            case 's':
+                args->nsmpl = strtol(optarg,&tmp,10);
+                if ( *tmp || args->nsmpl<0 ) error("Could not parse: --samples %s\n", optarg);
+                break;
+            case 'S':
+                args->seed = strtoull(optarg,&tmp,10);
+                if ( *tmp ) error("Could not parse: --seed %s\n", optarg);
+                break;
+            case 'h':
+            case '?':
+            default: usage(); break;
+        }
+    }
+    if ( optind != argc ) usage();
+
+    // the state must never be zero; the seed is scrambled so that nearby seeds diverge
+    args->rng = args->seed * 0x9E3779B97F4A7C15ULL + 0x2545F4914F6CDD1DULL;
+    if ( !args->rng ) args->rng = 1;
+
+    init_reference(args);
+    if ( args->gff_fname ) write_gff(args);
+    write_header(args);
+    write_sites(args);
+
+    int i;
+    for (i=0; i<args->nchr; i++) free(args->seq[i]);
+    free(args->seq);
+    free(args->gt);
+    free(args->ad);
+    free(args->pl);
+    free(args->buf);
+    free(args);
+    return 0;
+}
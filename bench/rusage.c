@@ -0,0 +1,98 @@
+/*  bench/rusage.c -- Run a command and report its wall time, CPU time and peak RSS.
+
+    gcc -g -Wall -O2 -o rusage rusage.c
+
+    Copyright (C) 2017 Genome Research Ltd.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+/*
+    Usage: rusage <out-file> <command> [<args>...]
+
+    The command is executed directly, without a shell, and one tab-separated
+    line is written to <out-file> when it finishes:
+
+        exit_status  wall_sec  user_sec  sys_sec  max_rss_kB
+
+    The CPU times and peak RSS are those of the command and all descendants it
+    waited for, as reported by getrusage(RUSAGE_CHILDREN). The exit status of
+    the command is passed on.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+static double tv2sec(struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec*1e-6;
+}
+
+int main(int argc, char **argv)
+{
+    if ( argc < 3 )
+    {
+        fprintf(stderr, "Usage: rusage <out-file> <command> [<args>...]\n");
+        return 1;
+    }
+
+    struct timeval t0, t1;
+    gettimeofday(&t0, NULL);
+
+    pid_t pid = fork();
+    if ( pid < 0 ) { fprintf(stderr, "fork: %s\n", strerror(errno)); return 1; }
+    if ( pid == 0 )
+    {
+        execvp(argv[2], argv + 2);
+        fprintf(stderr, "%s: %s\n", argv[2], strerror(errno));
+        _exit(127);
+    }
+
+    int status;
+    while ( waitpid(pid, &status, 0) < 0 )
+    {
+        if ( errno != EINTR ) { fprintf(stderr, "waitpid: %s\n", strerror(errno)); return 1; }
+    }
+    gettimeofday(&t1, NULL);
+
+    struct rusage ru;
+    getrusage(RUSAGE_CHILDREN, &ru);
+
+    // ru_maxrss is in kilobytes on Linux and BSD, in bytes on macOS
+#ifdef __APPLE__
+    long max_rss = ru.ru_maxrss / 1024;
+#else
+    long max_rss = ru.ru_maxrss;
+#endif
+    int ret = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+    FILE *fp = fopen(argv[1], "w");
+    if ( !fp ) { fprintf(stderr, "%s: %s\n", argv[1], strerror(errno)); return 1; }
+    fprintf(fp, "%d\t%.3f\t%.3f\t%.3f\t%ld\n", ret, tv2sec(&t1) - tv2sec(&t0), tv2sec(&ru.ru_utime), tv2sec(&ru.ru_stime), max_rss);
+    if ( fclose(fp) ) { fprintf(stderr, "%s: %s\n", argv[1], strerror(errno)); return 1; }
+
+    return ret;
+}
@@ -0,0 +1,80 @@
+/*
+    Copyright (C) 2017 Genome Research Ltd.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <htslib/bgzf.h>
+#include <htslib/hfile.h>
+#include "bgzf_remap.h"
+
+uint64_t map_voffset(const voff_map_t *map, uint64_t voff)
+{
+    uint64_t coff = voff >> 16, uoff = voff & 0xffff;
+    if ( coff >= map->copy_old ) return (coff - map->copy_old + map->copy_new) << 16 | uoff;
+    if ( map->tail_off && coff==map->tail_old && uoff >= map->tail_off )
+    {
+        uoff -= map->tail_off;
+        if ( uoff < BGZF_BLOCK_SIZE ) return map->tail_new[0] << 16 | uoff;
+        return map->tail_new[1] << 16 | (uoff - BGZF_BLOCK_SIZE);
+    }
+    return voff;    // not a record offset, such as zero
+}
+
+int bgzf_remap_copy(BGZF *in, BGZF *out, voff_map_t *map)
+{
+    if ( bgzf_flush(out)<0 ) return -2;
+    map->tail_old = in->block_address;
+    map->tail_new[0] = map->tail_new[1] = bgzf_tell(out) >> 16;
+    map->tail_off = in->block_offset < in->block_length ? in->block_offset : 0;
+    map->copy_old = htell(in->fp);
+    if ( map->tail_off )
+    {
+        // the tail is written in blocks of BGZF_BLOCK_SIZE, as by bgzf_write()
+        char *tail = (char*)in->uncompressed_block + in->block_offset;
+        int len = in->block_length - in->block_offset;
+        int len0 = len < BGZF_BLOCK_SIZE ? len : BGZF_BLOCK_SIZE;
+        if ( bgzf_write(out, tail, len0)!=len0 || bgzf_flush(out)<0 ) return -2;
+        map->tail_new[1] = bgzf_tell(out) >> 16;
+        if ( len > len0 && (bgzf_write(out, tail + len0, len - len0)!=len - len0 || bgzf_flush(out)<0) ) return -2;
+    }
+    map->copy_new = bgzf_tell(out) >> 16;
+
+    const int nheader = 18, neof = 28;
+    const uint8_t *eof = (uint8_t*) "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
+    uint8_t *buf = (uint8_t*) malloc(BGZF_MAX_BLOCK_SIZE);
+    int ret = 0;
+    while (1)
+    {
+        ssize_t nread = bgzf_raw_read(in, buf, nheader);
+        if ( !nread ) break;
+        if ( nread!=nheader || buf[0]!=31 || buf[1]!=139 || buf[12]!='B' || buf[13]!='C' ) { ret = -1; break; }
+        ssize_t nblock = (buf[16] | buf[17]<<8) + 1;
+        if ( nblock < nheader ) { ret = -1; break; }
+        nread += bgzf_raw_read(in, buf+nheader, nblock - nheader);
+        if ( nread!=nblock ) { ret = -1; break; }
+        if ( nread==neof && !memcmp(buf,eof,neof) ) continue;
+        if ( bgzf_raw_write(out, buf, nread)!=nread ) { ret = -2; break; }
+    }
+    free(buf);
+    return ret;
+}
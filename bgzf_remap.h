@@ -0,0 +1,60 @@
+/*
+    Copyright (C) 2017 Genome Research Ltd.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+/*
+    Copy the records of a compressed BCF to another BGZF stream without
+    recompressing them, used by reheader and shard. Only the records which
+    share the last block with the header are recompressed, the following
+    blocks are copied as they are. The virtual offsets of the records change
+    and are mapped for rewriting the CSI index.
+*/
+
+#ifndef __BGZF_REMAP_H__
+#define __BGZF_REMAP_H__
+
+#include <stdint.h>
+#include <htslib/bgzf.h>
+
+/*
+    Virtual offsets of the input mapped to the output. The BGZF blocks from
+    copy_old on are copied as they are to copy_new, the records which shared
+    the last block of the header start the block tail_new[0]. A tail longer
+    than BGZF_BLOCK_SIZE continues in the block tail_new[1].
+*/
+typedef struct
+{
+    uint64_t tail_old, tail_new[2], copy_old, copy_new;
+    int tail_off;   // the offset of the first record in the tail_old block or 0 if none
+}
+voff_map_t;
+
+/*
+ *  bgzf_remap_copy() - copy the rest of the input, positioned after the header
+ *                      read by bcf_hdr_read(), to the end of the output and
+ *                      fill the offset map. EOF blocks of the input are
+ *                      dropped, the final one is added by bgzf_close().
+ *                      Returns 0 on success, -1 on read and -2 on write errors.
+ *  map_voffset() - map a virtual offset of the input to the output
+ */
+int bgzf_remap_copy(BGZF *in, BGZF *out, voff_map_t *map);
+uint64_t map_voffset(const voff_map_t *map, uint64_t voff);
+
+#endif
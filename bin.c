@@ -32,8 +32,21 @@ struct _bin_t
 {
     float *bins;
     int nbins;
+    float inv_width;    // non-zero for equally spaced boundaries, the index is then calculated directly
 };
 
+static void init_direct_idx(bin_t *bin)
+{
+    bin->inv_width = 0;
+    if ( bin->nbins < 3 ) return;
+    float width = (bin->bins[bin->nbins-1] - bin->bins[0]) / (bin->nbins - 1);
+    if ( width <= 0 ) return;
+    int i;
+    for (i=1; i<bin->nbins; i++)
+        if ( fabs(bin->bins[i] - bin->bins[0] - i*width) > width*1e-3 ) return;
+    bin->inv_width = 1./width;
+}
+
 bin_t *bin_init(const char *list_def, float min, float max)
 {
     bin_t *bin = (bin_t*) calloc(1,sizeof(bin_t));
@@ -72,6 +85,7 @@ bin_t *bin_init(const char *list_def, float min, float max)
             bin->bins[bin->nbins-1] = max;
         }
     }
+    init_direct_idx(bin);
     return bin;
 }
 
@@ -89,6 +103,19 @@ int bin_get_idx(bin_t *bin, float value)
 {
     if ( bin->bins[bin->nbins-1] < value ) return bin->nbins-1;
 
+    if ( bin->inv_width )
+    {
+        if ( !(value >= bin->bins[0]) ) return -1;
+
+        // The boundaries need not be exactly equidistant, e.g. 0.1 is not representable,
+        // so the estimate is corrected by comparing with the neighbouring boundaries
+        int i = (value - bin->bins[0]) * bin->inv_width;
+        if ( i > bin->nbins - 2 ) i = bin->nbins - 2;
+        while ( i > 0 && value < bin->bins[i] ) i--;
+        while ( i < bin->nbins - 2 && value >= bin->bins[i+1] ) i++;
+        return i;
+    }
+
     // Binary search in half-closed,half-open intervals [)
     int imin = 0, imax = bin->nbins - 2;
     while ( imin<imax )
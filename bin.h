@@ -51,7 +51,8 @@ void bin_destroy(bin_t *bin);
 int bin_get_size(bin_t *bin);
 
 /*
-   bin_get_idx() - find the bin index which corresponds to the value (binary search)
+   bin_get_idx() - find the bin index which corresponds to the value. The index is
+   calculated directly for equally spaced bins, otherwise by binary search.
    Returns the bin index 0 <= idx <= size-2 or -1,size-1 for out of range values.
  */
 int bin_get_idx(bin_t *bin, float value);
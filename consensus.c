@@ -39,6 +39,9 @@
 #include "regidx.h"
 #include "bcftools.h"
 #include "rbuf.h"
+#include "smpl_ilist.h"
+
+#define HAP_BUF_MAX (1<<20)   // the waiting multi-fasta output kept in memory by a haplotype
 
 typedef struct
 {
@@ -53,12 +56,45 @@ typedef struct
 chain_t;
 
 
+// A piece of the modified sequence: either a stretch of the reference or an
+// applied allele, stored in hap_t.alt
 typedef struct
 {
-    kstring_t fa_buf;   // buffered reference sequence
-    int fa_ori_pos;     // start position of the fa_buffer (wrt original sequence)
+    int is_alt;         // 0: reference piece, 1: allele piece
+    int off, len;       // reference coordinate (0-based) or offset into hap_t.alt; length
+}
+piece_t;
+
+// Per-haplotype state, one for each sample/haplotype combination requested.
+// All haplotypes share the buffered reference sequence in args_t and represent
+// their modified sequence as a list of pieces on top of it. Because variants
+// come sorted, an edit only appends to the list and the pieces are streamed
+// to the output once the reference buffer can be flushed.
+typedef struct
+{
+    int isample;        // sample index or -1 to apply all ALT alleles
+    int haplotype;      // 1-based haplotype to apply or 0 for the default behaviour
+    char *name;         // sequence name prefix in the form "SAMPLE#HAP#" or NULL with a single haplotype
+    piece_t *pieces;    // the modified sequence up to ref_pos, not written yet
+    int npieces, mpieces;
+    kstring_t alt;      // applied alleles referenced by the pieces
+    int ref_pos;        // the reference sequence from this position onwards is unmodified
     int fa_frz_pos;     // protected position to avoid conflicting variants (last pos for SNPs/ins)
     int fa_mod_off;     // position difference of fa_frz_pos in the ori and modified sequence (ins positive)
+    int ncol;           // number of characters written on the current output line
+    chain_t *chain;     // chain structure to store the sequence of ungapped blocks between the ref and alt sequences
+                        // Note that the chain is re-initialised for each chromosome/seq_region
+    FILE *fp_out;       // output file or NULL when writing a multi-fasta, see seq below
+    char *fname;        // output file name
+    kstring_t seq;      // multi-fasta output waiting for the previous haplotypes to complete the fasta record
+    FILE *fp_tmp;       // temporary file taking the waiting output beyond HAP_BUF_MAX bytes
+}
+hap_t;
+
+typedef struct
+{
+    kstring_t fa_buf;   // buffered reference sequence, shared by all haplotypes
+    int fa_ori_pos;     // start position of the fa_buffer (wrt original sequence)
     int fa_end_pos;     // region's end position in the original sequence
     int fa_length;      // region's length in the original sequence (in case end_pos not provided in the FASTA header)
     int fa_case;        // output upper case or lower case?
@@ -72,16 +108,18 @@ typedef struct
     regitr_t *itr;
 
     int chain_id;       // chain_id, to provide a unique ID to each chain in the chain output
-    chain_t *chain;     // chain structure to store the sequence of ungapped blocks between the ref and alt sequences
-                        // Note that the chain is re-initialised for each chromosome/seq_region
+
+    hap_t *haps;        // the haplotypes to generate in a single pass
+    int nhaps;
+    kstring_t tmp;      // the allele being applied, the record itself is shared by all haplotypes
 
     bcf_srs_t *files;
     bcf_hdr_t *hdr;
     FILE *fp_out;
     FILE *fp_chain;
     char **argv;
-    int argc, output_iupac, haplotype, isample;
-    char *fname, *ref_fname, *sample, *output_fname, *mask_fname, *chain_fname;
+    int argc, output_iupac, sample_is_file;
+    char *fname, *ref_fname, *sample, *haplotype, *output_fname, *output_prefix, *mask_fname, *chain_fname;
 }
 args_t;
 
@@ -99,17 +137,15 @@ static chain_t* init_chain(chain_t *chain, int ref_ori_pos)
     return chain;
 }
 
-static void destroy_chain(args_t *args)
+static void destroy_chain(chain_t *chain)
 {
-    chain_t *chain = args->chain;
     free(chain->ref_gaps);
     free(chain->alt_gaps);
     free(chain->block_lengths);
     free(chain);
-    chain = NULL;
 }
 
-static void print_chain(args_t *args)
+static void print_chain(args_t *args, hap_t *hap)
 {
     /*
         Example chain format (see: https://genome.ucsc.edu/goldenPath/help/chain.html):
@@ -138,7 +174,7 @@ static void print_chain(args_t *args)
         - gap on the ref sequence between this and the next block (all but the last line)
         - gap on the alt sequence between this and the next block (all but the last line)
     */
-    chain_t *chain = args->chain;
+    chain_t *chain = hap->chain;
     int n = chain->num;
     int ref_end_pos = args->fa_length + chain->ori_pos;
     int last_block_size = ref_end_pos - chain->ref_last_block_ori;
@@ -148,7 +184,8 @@ static void print_chain(args_t *args)
         score += chain->block_lengths[n];
     }
     score += last_block_size;
-    fprintf(args->fp_chain, "chain %d %s %d + %d %d %s %d + %d %d %d\n", score, bcf_hdr_id2name(args->hdr,args->rid), ref_end_pos, chain->ori_pos, ref_end_pos, bcf_hdr_id2name(args->hdr,args->rid), alt_end_pos, chain->ori_pos, alt_end_pos, ++args->chain_id);
+    const char *chr = bcf_hdr_id2name(args->hdr,args->rid);
+    fprintf(args->fp_chain, "chain %d %s %d + %d %d %s%s %d + %d %d %d\n", score, chr, ref_end_pos, chain->ori_pos, ref_end_pos, hap->name?hap->name:"", chr, alt_end_pos, chain->ori_pos, alt_end_pos, ++args->chain_id);
     for (n=0; n<chain->num; n++) {
         fprintf(args->fp_chain, "%d %d %d\n", chain->block_lengths[n], chain->ref_gaps[n], chain->alt_gaps[n]);
     }
@@ -183,23 +220,79 @@ static void push_chain_gap(chain_t *chain, int ref_start, int ref_len, int alt_s
     }
 }
 
-static void init_data(args_t *args)
+static void init_haps(args_t *args)
 {
-    args->files = bcf_sr_init();
-    args->files->require_index = 1;
-    if ( !bcf_sr_add_reader(args->files,args->fname) ) error("Failed to open %s: %s\n", args->fname, bcf_sr_strerror(args->files->errnum));
-    args->hdr = args->files->readers[0].header;
-    args->isample = -1;
+    smpl_ilist_t *smpl = NULL;
     if ( args->sample )
+        smpl = smpl_ilist_init(args->hdr, args->sample, args->sample_is_file, SMPL_STRICT);
+
+    int i, j, nhap = 0, *hap = NULL;
+    if ( args->haplotype )
     {
-        args->isample = bcf_hdr_id2int(args->hdr,BCF_DT_SAMPLE,args->sample);
-        if ( args->isample<0 ) error("No such sample: %s\n", args->sample);
+        int nlist;
+        char **list = hts_readlist(args->haplotype, 0, &nlist);
+        if ( !list ) error("Could not parse --haplotype %s\n", args->haplotype);
+        hap = (int*) malloc(sizeof(int)*nlist);
+        for (i=0; i<nlist; i++)
+        {
+            char *tmp;
+            hap[nhap] = strtol(list[i], &tmp, 10);
+            if ( *tmp || hap[nhap]<=0 ) error("Expected positive integer with --haplotype\n");
+            nhap++;
+            free(list[i]);
+        }
+        free(list);
     }
-    if ( args->haplotype && args->isample<0 )
+    if ( hap && !smpl )
     {
         if ( bcf_hdr_nsamples(args->hdr) > 1 ) error("The --sample option is expected with --haplotype\n");
-        args->isample = 0;
+        smpl = smpl_ilist_init(args->hdr, NULL, 0, SMPL_NONE);
+    }
+    if ( smpl && !smpl->n ) error("No samples to apply\n");
+
+    args->nhaps = (smpl ? smpl->n : 1) * (nhap ? nhap : 1);
+    args->haps  = (hap_t*) calloc(args->nhaps, sizeof(hap_t));
+    for (i=0; i<args->nhaps; i++)
+    {
+        hap_t *h = &args->haps[i];
+        h->isample   = smpl ? smpl->idx[nhap ? i/nhap : i] : -1;
+        h->haplotype = nhap ? hap[i%nhap] : 0;
+        if ( args->nhaps==1 && !args->output_prefix ) continue;
+
+        // PanSN-style naming, SAMPLE#HAP#SEQ. The haplotype is omitted in the default mode
+        kstring_t str = {0,0,0};
+        kputs(h->isample>=0 ? args->hdr->samples[h->isample] : "consensus", &str);
+        if ( h->haplotype ) ksprintf(&str, "#%d", h->haplotype);
+        if ( args->output_prefix )
+        {
+            ksprintf(&str, ".fa");
+            h->fname = (char*) malloc(strlen(args->output_prefix) + str.l + 1);
+            strcpy(h->fname, args->output_prefix);
+            for (j=0; j<str.l; j++) if ( str.s[j]=='#' ) str.s[j] = '-';
+            strcat(h->fname, str.s);
+            h->fp_out = fopen(h->fname,"w");
+            if ( !h->fp_out ) error("Failed to create %s: %s\n", h->fname, strerror(errno));
+            free(str.s);
+        }
+        else
+        {
+            kputc('#', &str);
+            h->name = str.s;
+        }
     }
+    // the first haplotype is written directly, also in a multi-fasta
+    if ( !args->output_prefix ) args->haps[0].fp_out = args->fp_out;
+
+    free(hap);
+    if ( smpl ) smpl_ilist_destroy(smpl);
+}
+
+static void init_data(args_t *args)
+{
+    args->files = bcf_sr_init();
+    args->files->require_index = 1;
+    if ( !bcf_sr_add_reader(args->files,args->fname) ) error("Failed to open %s: %s\n", args->fname, bcf_sr_strerror(args->files->errnum));
+    args->hdr = args->files->readers[0].header;
     if ( args->mask_fname )
     {
         args->mask = regidx_init(args->mask_fname,NULL,NULL,0,NULL);
@@ -220,6 +313,7 @@ static void init_data(args_t *args)
         if ( ! args->fp_out ) error("Failed to create %s: %s\n", args->output_fname, strerror(errno));
     }
     else args->fp_out = stdout;
+    init_haps(args);
 }
 
 static void destroy_data(args_t *args)
@@ -229,7 +323,24 @@ static void destroy_data(args_t *args)
     for (i=0; i<args->vcf_rbuf.m; i++)
         if ( args->vcf_buf[i] ) bcf_destroy1(args->vcf_buf[i]);
     free(args->vcf_buf);
+    for (i=0; i<args->nhaps; i++)
+    {
+        hap_t *hap = &args->haps[i];
+        free(hap->pieces);
+        free(hap->alt.s);
+        free(hap->seq.s);
+        if ( hap->fp_tmp ) fclose(hap->fp_tmp);
+        free(hap->name);
+        if ( hap->chain ) destroy_chain(hap->chain);
+        if ( hap->fname )
+        {
+            if ( fclose(hap->fp_out) ) error("Close failed: %s\n", hap->fname);
+            free(hap->fname);
+        }
+    }
+    free(args->haps);
     free(args->fa_buf.s);
+    free(args->tmp.s);
     if ( args->mask ) regidx_destroy(args->mask);
     if ( args->itr ) regitr_destroy(args->itr);
     if ( args->chain_fname )
@@ -237,6 +348,43 @@ static void destroy_data(args_t *args)
     if ( fclose(args->fp_out) ) error("Close failed: %s\n", args->output_fname);
 }
 
+static void hap_write(args_t *args, hap_t *hap, const char *buf, int len)
+{
+    if ( !hap->fp_out )
+    {
+        kputsn(buf, len, &hap->seq);
+        if ( hap->seq.l < HAP_BUF_MAX ) return;
+        if ( !hap->fp_tmp && !(hap->fp_tmp = tmpfile()) ) error("Could not create a temporary file: %s\n", strerror(errno));
+        if ( fwrite(hap->seq.s,1,hap->seq.l,hap->fp_tmp) != hap->seq.l ) error("Could not write to a temporary file\n");
+        hap->seq.l = 0;
+        return;
+    }
+    if ( fwrite(buf,1,len,hap->fp_out) != len ) error("Could not write: %s\n", hap->fname ? hap->fname : args->output_fname);
+}
+
+// With multiple haplotypes written into a single file the sequences cannot be
+// interleaved. The first haplotype is written directly, the others wait until
+// the whole fasta record is read, in memory up to HAP_BUF_MAX bytes and in a
+// temporary file beyond that.
+static void flush_hap_seq(args_t *args, hap_t *hap)
+{
+    if ( hap->fp_out ) return;
+    if ( hap->fp_tmp && ftell(hap->fp_tmp) > 0 )
+    {
+        char buf[BUFSIZ];
+        size_t n;
+        rewind(hap->fp_tmp);
+        while ( (n = fread(buf,1,sizeof(buf),hap->fp_tmp)) > 0 )
+            if ( fwrite(buf,1,n,args->fp_out) != n ) error("Could not write: %s\n", args->output_fname);
+        if ( ferror(hap->fp_tmp) ) error("Could not read a temporary file\n");
+        rewind(hap->fp_tmp);
+        if ( ftruncate(fileno(hap->fp_tmp), 0)!=0 ) error("Could not truncate a temporary file: %s\n", strerror(errno));
+    }
+    if ( !hap->seq.l ) return;
+    if ( fwrite(hap->seq.s,1,hap->seq.l,args->fp_out) != hap->seq.l ) error("Could not write: %s\n", args->output_fname);
+    hap->seq.l = 0;
+}
+
 static void init_region(args_t *args, char *line)
 {
     char *ss, *se = line;
@@ -262,21 +410,29 @@ static void init_region(args_t *args, char *line)
     if ( args->rid<0 ) fprintf(stderr,"Warning: Sequence \"%s\" not in %s\n", line,args->fname);
     args->fa_buf.l = 0;
     args->fa_length = 0;
-    args->fa_end_pos = to;
     args->fa_ori_pos = from;
+    args->fa_end_pos = to;
     args->fa_src_pos = from;
-    args->fa_mod_off = 0;
-    args->fa_frz_pos = -1;
     args->fa_case    = -1;
     args->vcf_rbuf.n = 0;
-    bcf_sr_seek(args->files,line,args->fa_ori_pos);
+    bcf_sr_seek(args->files,line,from);
     if ( tmp_ptr ) *tmp_ptr = tmp;
-    fprintf(args->fp_out,">%s\n",line);
-    if (args->chain_fname )
+
+    int i;
+    for (i=0; i<args->nhaps; i++)
     {
-        args->chain = init_chain(args->chain, args->fa_ori_pos);
-    } else {
-        args->chain = NULL;
+        hap_t *hap = &args->haps[i];
+        hap->npieces    = 0;
+        hap->alt.l      = 0;
+        hap->ref_pos    = from;
+        hap->fa_mod_off = 0;
+        hap->fa_frz_pos = -1;
+        hap->ncol       = 0;
+        hap_write(args, hap, ">", 1);
+        if ( hap->name ) hap_write(args, hap, hap->name, strlen(hap->name));
+        hap_write(args, hap, line, strlen(line));
+        hap_write(args, hap, "\n", 1);
+        hap->chain = args->chain_fname ? init_chain(hap->chain, from) : NULL;
     }
 }
 
@@ -305,44 +461,56 @@ static void unread_vcf_line(args_t *args, bcf1_t **rec_ptr)
     if ( !args->vcf_buf[i] ) args->vcf_buf[i] = bcf_init1();
     bcf1_t *tmp = rec; *rec_ptr = args->vcf_buf[i]; args->vcf_buf[i] = tmp;
 }
-static void flush_fa_buffer(args_t *args, int len)
+static void write_seq(args_t *args, hap_t *hap, const char *seq, int len)
 {
-    if ( !args->fa_buf.l ) return;
-
-    int nwr = 0;
-    while ( nwr + 60 <= args->fa_buf.l )
+    while ( len > 0 )
     {
-        if ( fwrite(args->fa_buf.s+nwr,1,60,args->fp_out) != 60 ) error("Could not write: %s\n", args->output_fname);
-        if ( fwrite("\n",1,1,args->fp_out) != 1 ) error("Could not write: %s\n", args->output_fname);
-        nwr += 60;
+        int n = 60 - hap->ncol;
+        if ( n > len ) n = len;
+        hap_write(args, hap, seq, n);
+        seq += n;
+        len -= n;
+        hap->ncol += n;
+        if ( hap->ncol < 60 ) continue;
+        hap_write(args, hap, "\n", 1);
+        hap->ncol = 0;
     }
-    if ( nwr )
-        args->fa_ori_pos += nwr;
-
-    if ( len )
+}
+static void flush_fa_buffer(args_t *args, hap_t *hap, int len)
+{
+    // All pieces are final, the next variant starts beyond the buffered reference
+    int i;
+    for (i=0; i<hap->npieces; i++)
     {
-        // not finished on this chr yet and the buffer cannot be emptied completely
-        if ( nwr && nwr < args->fa_buf.l )
-            memmove(args->fa_buf.s,args->fa_buf.s+nwr,args->fa_buf.l-nwr);
-        args->fa_buf.l -= nwr;
-        return;
+        piece_t *piece = &hap->pieces[i];
+        if ( piece->is_alt )
+            write_seq(args, hap, hap->alt.s + piece->off, piece->len);
+        else
+            write_seq(args, hap, args->fa_buf.s + piece->off - args->fa_ori_pos, piece->len);
     }
+    int ref_end = args->fa_ori_pos + args->fa_buf.l;
+    write_seq(args, hap, args->fa_buf.s + hap->ref_pos - args->fa_ori_pos, ref_end - hap->ref_pos);
+    hap->npieces = 0;
+    hap->alt.l   = 0;
+    hap->ref_pos = ref_end;
 
-    // empty the whole buffer
-    if ( nwr == args->fa_buf.l ) { args->fa_buf.l = 0; return; }
-
-    if ( fwrite(args->fa_buf.s+nwr,1,args->fa_buf.l - nwr,args->fp_out) != args->fa_buf.l - nwr ) error("Could not write: %s\n", args->output_fname);
-    if ( fwrite("\n",1,1,args->fp_out) != 1 ) error("Could not write: %s\n", args->output_fname);
+    if ( len ) return;  // not finished on this chr yet
 
-    args->fa_ori_pos += args->fa_buf.l - nwr - args->fa_mod_off;
-    args->fa_mod_off = 0;
+    if ( hap->ncol ) hap_write(args, hap, "\n", 1);
+    hap->ncol = 0;
+}
+static void flush_fa_buffers(args_t *args, int len)
+{
+    int i;
+    for (i=0; i<args->nhaps; i++) flush_fa_buffer(args, &args->haps[i], len);
+    args->fa_ori_pos += args->fa_buf.l;
     args->fa_buf.l = 0;
 }
-static void apply_variant(args_t *args, bcf1_t *rec)
+static void apply_variant(args_t *args, hap_t *hap, bcf1_t *rec)
 {
     if ( rec->n_allele==1 ) return;
 
-    if ( rec->pos <= args->fa_frz_pos )
+    if ( rec->pos <= hap->fa_frz_pos )
     {
         fprintf(stderr,"The site %s:%d overlaps with another variant, skipping...\n", bcf_seqname(args->hdr,rec),rec->pos+1);
         return;
@@ -355,22 +523,27 @@ static void apply_variant(args_t *args, bcf1_t *rec)
         if ( regidx_overlap(args->mask, chr,start,end,NULL) ) return;
     }
 
-    int i, ialt = 1;
-    if ( args->isample >= 0 )
+    // The record is shared by all haplotypes, the allele is modified in a copy
+    kstring_t *alt = &args->tmp;
+    int i, ialt = 1, rlen = rec->rlen;
+    if ( hap->isample >= 0 )
     {
         bcf_fmt_t *fmt = bcf_get_fmt(args->hdr, rec, "GT");
         if ( !fmt ) return;
-        if ( args->haplotype )
+        if ( hap->haplotype )
         {
-            if ( args->haplotype > fmt->n ) error("Can't apply %d-th haplotype at %s:%d\n", args->haplotype,bcf_seqname(args->hdr,rec),rec->pos+1);
-            uint8_t *ignore, *ptr = fmt->p + fmt->size*args->isample + args->haplotype - 1;
+            if ( hap->haplotype > fmt->n ) error("Can't apply %d-th haplotype at %s:%d\n", hap->haplotype,bcf_seqname(args->hdr,rec),rec->pos+1);
+            uint8_t *ignore, *ptr = fmt->p + fmt->size*hap->isample + hap->haplotype - 1;
             ialt = bcf_dec_int1(ptr, fmt->type, &ignore);
             if ( bcf_gt_is_missing(ialt) || ialt==bcf_int32_vector_end ) return;
             ialt = bcf_gt_allele(ialt);
+            if ( !ialt ) return;  // ref allele
+            if ( rec->n_allele <= ialt ) error("Broken VCF, too few alts at %s:%d\n", bcf_seqname(args->hdr,rec),rec->pos+1);
+            alt->l = 0; kputs(rec->d.allele[ialt], alt);
         }
-        else if ( args->output_iupac ) 
+        else if ( args->output_iupac )
         {
-            uint8_t *ignore, *ptr = fmt->p + fmt->size*args->isample;
+            uint8_t *ignore, *ptr = fmt->p + fmt->size*hap->isample;
             ialt = bcf_dec_int1(ptr, fmt->type, &ignore);
             if ( bcf_gt_is_missing(ialt) || ialt==bcf_int32_vector_end ) return;
             ialt = bcf_gt_allele(ialt);
@@ -378,133 +551,138 @@ static void apply_variant(args_t *args, bcf1_t *rec)
             int jalt;
             if ( fmt->n>1 )
             {
-                ptr = fmt->p + fmt->size*args->isample + 1;
+                ptr = fmt->p + fmt->size*hap->isample + 1;
                 jalt = bcf_dec_int1(ptr, fmt->type, &ignore);
                 if ( bcf_gt_is_missing(jalt) || jalt==bcf_int32_vector_end ) jalt = ialt;
                 else jalt = bcf_gt_allele(jalt);
             }
             else jalt = ialt;
             if ( rec->n_allele <= ialt || rec->n_allele <= jalt ) error("Broken VCF, too few alts at %s:%d\n", bcf_seqname(args->hdr,rec),rec->pos+1);
+            if ( !ialt ) return;  // ref allele
+            alt->l = 0; kputs(rec->d.allele[ialt], alt);
             if ( ialt!=jalt && !rec->d.allele[ialt][1] && !rec->d.allele[jalt][1] ) // is this a het snp?
-            {
-                char ial = rec->d.allele[ialt][0];
-                char jal = rec->d.allele[jalt][0];
-                rec->d.allele[ialt][0] = gt2iupac(ial,jal);
-            }
+                alt->s[0] = gt2iupac(rec->d.allele[ialt][0],rec->d.allele[jalt][0]);
         }
         else
         {
             for (i=0; i<fmt->n; i++)
             {
-                uint8_t *ignore, *ptr = fmt->p + fmt->size*args->isample + i;
+                uint8_t *ignore, *ptr = fmt->p + fmt->size*hap->isample + i;
                 ialt = bcf_dec_int1(ptr, fmt->type, &ignore);
                 if ( bcf_gt_is_missing(ialt) || ialt==bcf_int32_vector_end ) return;
                 ialt = bcf_gt_allele(ialt);
                 if ( ialt ) break;
             }
+            if ( !ialt ) return;  // ref allele
+            if ( rec->n_allele <= ialt ) error("Broken VCF, too few alts at %s:%d\n", bcf_seqname(args->hdr,rec),rec->pos+1);
+            alt->l = 0; kputs(rec->d.allele[ialt], alt);
         }
-        if ( !ialt ) return;  // ref allele
-        if ( rec->n_allele <= ialt ) error("Broken VCF, too few alts at %s:%d\n", bcf_seqname(args->hdr,rec),rec->pos+1);
     }
-    else if ( args->output_iupac && !rec->d.allele[0][1] && !rec->d.allele[1][1] )
+    else
     {
-        char ial = rec->d.allele[0][0];
-        char jal = rec->d.allele[1][0];
-        rec->d.allele[1][0] = gt2iupac(ial,jal);
+        alt->l = 0; kputs(rec->d.allele[ialt], alt);
+        if ( args->output_iupac && !rec->d.allele[0][1] && !rec->d.allele[1][1] )
+            alt->s[0] = gt2iupac(rec->d.allele[0][0],rec->d.allele[1][0]);
     }
 
     int len_diff = 0, alen = 0;
-    int idx = rec->pos - args->fa_ori_pos + args->fa_mod_off;
-    if ( idx<0 )
+    int idx = rec->pos - args->fa_ori_pos;
+    if ( idx<0 || rec->pos < hap->ref_pos )
     {
         fprintf(stderr,"Warning: ignoring overlapping variant starting at %s:%d\n", bcf_seqname(args->hdr,rec),rec->pos+1);
         return;
     }
-    if ( rec->rlen > args->fa_buf.l - idx )
+    if ( rlen > args->fa_buf.l - idx )
     {
-        rec->rlen = args->fa_buf.l - idx;
-        alen = strlen(rec->d.allele[ialt]);
-        if ( alen > rec->rlen )
+        rlen = args->fa_buf.l - idx;
+        alen = alt->l;
+        if ( alen > rlen )
         {
-            rec->d.allele[ialt][rec->rlen] = 0;
+            alt->s[rlen] = 0; alt->l = rlen;
             fprintf(stderr,"Warning: trimming variant starting at %s:%d\n", bcf_seqname(args->hdr,rec),rec->pos+1);
         }
     }
-    if ( idx>=args->fa_buf.l ) 
-        error("FIXME: %s:%d .. idx=%d, ori_pos=%d, len=%d, off=%d\n",bcf_seqname(args->hdr,rec),rec->pos+1,idx,args->fa_ori_pos,args->fa_buf.l,args->fa_mod_off);
+    if ( idx>=args->fa_buf.l )
+        error("FIXME: %s:%d .. idx=%d, ori_pos=%d, len=%d, off=%d\n",bcf_seqname(args->hdr,rec),rec->pos+1,idx,args->fa_ori_pos,(int)args->fa_buf.l,hap->fa_mod_off);
 
     // sanity check the reference base
-    if ( rec->d.allele[ialt][0]=='<' )
+    if ( alt->s[0]=='<' )
     {
-        if ( strcasecmp(rec->d.allele[ialt], "<DEL>") )
-            error("Symbolic alleles other than <DEL> are currently not supported: %s at %s:%d\n",rec->d.allele[ialt],bcf_seqname(args->hdr,rec),rec->pos+1);
+        if ( strcasecmp(alt->s, "<DEL>") )
+            error("Symbolic alleles other than <DEL> are currently not supported: %s at %s:%d\n",alt->s,bcf_seqname(args->hdr,rec),rec->pos+1);
         assert( rec->d.allele[0][1]==0 );           // todo: for now expecting strlen(REF) = 1
-        len_diff = 1-rec->rlen;
-        rec->d.allele[ialt] = rec->d.allele[0];     // according to VCF spec, REF must precede the event
-        alen = strlen(rec->d.allele[ialt]);
+        len_diff = 1-rlen;
+        alt->l = 0; kputs(rec->d.allele[0], alt);   // according to VCF spec, REF must precede the event
+        alen = alt->l;
     }
-    else if ( strncasecmp(rec->d.allele[0],args->fa_buf.s+idx,rec->rlen) )
+    else if ( strncasecmp(rec->d.allele[0],args->fa_buf.s+idx,rlen) )
     {
-        // fprintf(stderr,"%d .. [%s], idx=%d ori=%d off=%d\n",args->fa_ori_pos,args->fa_buf.s,idx,args->fa_ori_pos,args->fa_mod_off);
+        // fprintf(stderr,"%d .. [%s], idx=%d ori=%d off=%d\n",args->fa_ori_pos,args->fa_buf.s,idx,args->fa_ori_pos,hap->fa_mod_off);
         char tmp = 0;
-        if ( args->fa_buf.l - idx > rec->rlen ) 
-        { 
-            tmp = args->fa_buf.s[idx+rec->rlen];
-            args->fa_buf.s[idx+rec->rlen] = 0;
+        if ( args->fa_buf.l - idx > rlen )
+        {
+            tmp = args->fa_buf.s[idx+rlen];
+            args->fa_buf.s[idx+rlen] = 0;
         }
         error(
             "The fasta sequence does not match the REF allele at %s:%d:\n"
-            "   .vcf: [%s]\n" 
-            "   .vcf: [%s] <- (ALT)\n" 
+            "   .vcf: [%s]\n"
+            "   .vcf: [%s] <- (ALT)\n"
             "   .fa:  [%s]%c%s\n",
-            bcf_seqname(args->hdr,rec),rec->pos+1, rec->d.allele[0], rec->d.allele[ialt], args->fa_buf.s+idx, 
-            tmp?tmp:' ',tmp?args->fa_buf.s+idx+rec->rlen+1:""
+            bcf_seqname(args->hdr,rec),rec->pos+1, rec->d.allele[0], alt->s, args->fa_buf.s+idx,
+            tmp?tmp:' ',tmp?args->fa_buf.s+idx+rlen+1:""
             );
     }
     else
     {
-        alen = strlen(rec->d.allele[ialt]);
-        len_diff = alen - rec->rlen;
+        alen = alt->l;
+        len_diff = alen - rlen;
     }
 
     if ( args->fa_case )
-        for (i=0; i<alen; i++) rec->d.allele[ialt][i] = toupper(rec->d.allele[ialt][i]);
+        for (i=0; i<alen; i++) alt->s[i] = toupper(alt->s[i]);
     else
-        for (i=0; i<alen; i++) rec->d.allele[ialt][i] = tolower(rec->d.allele[ialt][i]);
+        for (i=0; i<alen; i++) alt->s[i] = tolower(alt->s[i]);
 
-    if ( len_diff <= 0 )
+    // the unmodified reference preceding the variant and the allele itself
+    hts_expand(piece_t, hap->npieces+2, hap->mpieces, hap->pieces);
+    if ( rec->pos > hap->ref_pos )
     {
-        // deletion or same size event
-        for (i=0; i<alen; i++)
-            args->fa_buf.s[idx+i] = rec->d.allele[ialt][i];
-        if ( len_diff )
-            memmove(args->fa_buf.s+idx+alen,args->fa_buf.s+idx+rec->rlen,args->fa_buf.l-idx-rec->rlen);
+        piece_t *piece = &hap->pieces[hap->npieces++];
+        piece->is_alt = 0;
+        piece->off = hap->ref_pos;
+        piece->len = rec->pos - hap->ref_pos;
     }
-    else
+    if ( alen )
     {
-        // insertion
-        ks_resize(&args->fa_buf, args->fa_buf.l + len_diff);
-        memmove(args->fa_buf.s + idx + rec->rlen + len_diff, args->fa_buf.s + idx + rec->rlen, args->fa_buf.l - idx - rec->rlen);
-        for (i=0; i<alen; i++)
-            args->fa_buf.s[idx+i] = rec->d.allele[ialt][i];
+        piece_t *piece = &hap->pieces[hap->npieces++];
+        piece->is_alt = 1;
+        piece->off = hap->alt.l;
+        piece->len = alen;
+        kputsn(alt->s, alen, &hap->alt);
     }
-    if (args->chain && len_diff != 0)
+    hap->ref_pos = rec->pos + rlen;
+    if (hap->chain && len_diff != 0)
     {
         // If first nucleotide of both REF and ALT are the same... (indels typically include the nucleotide before the variant)
-        if ( strncasecmp(rec->d.allele[0],rec->d.allele[ialt],1) == 0)
+        if ( strncasecmp(rec->d.allele[0],alt->s,1) == 0)
         {
             // ...extend the block by 1 bp: start is 1 bp further and alleles are 1 bp shorter
-            push_chain_gap(args->chain, rec->pos + 1, rec->rlen - 1, rec->pos + 1 + args->fa_mod_off, alen - 1);
+            push_chain_gap(hap->chain, rec->pos + 1, rlen - 1, rec->pos + 1 + hap->fa_mod_off, alen - 1);
         }
         else
         {
             // otherwise, just the coordinates of the variant as given
-            push_chain_gap(args->chain, rec->pos, rec->rlen, rec->pos + args->fa_mod_off, alen);
+            push_chain_gap(hap->chain, rec->pos, rlen, rec->pos + hap->fa_mod_off, alen);
         }
     }
-    args->fa_buf.l += len_diff;
-    args->fa_mod_off += len_diff;
-    args->fa_frz_pos  = rec->pos + rec->rlen - 1;
+    hap->fa_mod_off += len_diff;
+    hap->fa_frz_pos  = rec->pos + rlen - 1;
+}
+static void apply_variants(args_t *args, bcf1_t *rec)
+{
+    int i;
+    for (i=0; i<args->nhaps; i++) apply_variant(args, &args->haps[i], rec);
 }
 
 
@@ -527,11 +705,27 @@ static void mask_region(args_t *args, char *seq, int len)
     }
 }
 
+static void finish_region(args_t *args)
+{
+    int i;
+    for (i=0; i<args->nhaps; i++)
+    {
+        hap_t *hap = &args->haps[i];
+        if ( !hap->chain ) continue;
+        if ( args->rid>=0 ) print_chain(args, hap);
+        destroy_chain(hap->chain);
+        hap->chain = NULL;
+    }
+    flush_fa_buffers(args, 0);
+    for (i=0; i<args->nhaps; i++) flush_hap_seq(args, &args->haps[i]);
+}
+
 static void consensus(args_t *args)
 {
     htsFile *fasta = hts_open(args->ref_fname, "rb");
     if ( !fasta ) error("Error reading %s\n", args->ref_fname);
     kstring_t str = {0,0,0};
+    int in_region = 0;
     while ( hts_getline(fasta, KS_SEP_LINE, &str) > 0 )
     {
         if ( str.s[0]=='>' )
@@ -539,17 +733,14 @@ static void consensus(args_t *args)
             // new sequence encountered, apply all cached variants
             while ( args->vcf_rbuf.n )
             {
-                if (args->chain) {
-                    print_chain(args);
-                    destroy_chain(args);
-                }
                 bcf1_t *rec = args->vcf_buf[args->vcf_rbuf.f];
                 if ( rec->rid!=args->rid || ( args->fa_end_pos && rec->pos > args->fa_end_pos ) ) break;
-                int i = rbuf_shift(&args->vcf_rbuf);
-                apply_variant(args, args->vcf_buf[i]);
+                int j = rbuf_shift(&args->vcf_rbuf);
+                apply_variants(args, args->vcf_buf[j]);
             }
-            flush_fa_buffer(args, 0);
+            if ( in_region ) finish_region(args);
             init_region(args, str.s+1);
+            in_region = 1;
             continue;
         }
         args->fa_length  += str.l;
@@ -576,7 +767,7 @@ static void consensus(args_t *args)
             }
 
             // is the vcf record well beyond cached fasta buffer? if yes, the buf can be flushed
-            if ( args->fa_ori_pos + args->fa_buf.l - args->fa_mod_off <= rec->pos )
+            if ( args->fa_ori_pos + args->fa_buf.l <= rec->pos )
             {
                 unread_vcf_line(args, rec_ptr);
                 rec_ptr = NULL;
@@ -584,14 +775,14 @@ static void consensus(args_t *args)
             }
 
             // is the cached fasta buffer full enough? if not, read more fasta, no flushing
-            if ( args->fa_ori_pos + args->fa_buf.l - args->fa_mod_off < rec->pos + rec->rlen )
+            if ( args->fa_ori_pos + args->fa_buf.l < rec->pos + rec->rlen )
             {
                 unread_vcf_line(args, rec_ptr);
                 break;
             }
-            apply_variant(args, rec);
+            apply_variants(args, rec);
         }
-        if ( !rec_ptr ) flush_fa_buffer(args, 60);
+        if ( !rec_ptr ) flush_fa_buffers(args, 60);
     }
     bcf1_t **rec_ptr = NULL;
     while ( args->rid>=0 && (rec_ptr = next_vcf_line(args)) )
@@ -599,15 +790,10 @@ static void consensus(args_t *args)
         bcf1_t *rec = *rec_ptr;
         if ( rec->rid!=args->rid ) break;
         if ( args->fa_end_pos && rec->pos > args->fa_end_pos ) break;
-        if ( args->fa_ori_pos + args->fa_buf.l - args->fa_mod_off <= rec->pos ) break;
-        apply_variant(args, rec);
+        if ( args->fa_ori_pos + args->fa_buf.l <= rec->pos ) break;
+        apply_variants(args, rec);
     }
-    if (args->chain)
-    {
-        print_chain(args);
-        destroy_chain(args);
-    }
-    flush_fa_buffer(args, 0);
+    if ( in_region ) finish_region(args);
     hts_close(fasta);
     free(str.s);
 }
@@ -623,17 +809,23 @@ static void usage(args_t *args)
     fprintf(stderr, "Usage:   bcftools consensus [OPTIONS] <file.vcf>\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -f, --fasta-ref <file>     reference sequence in fasta format\n");
-    fprintf(stderr, "    -H, --haplotype <1|2>      apply variants for the given haplotype\n");
+    fprintf(stderr, "    -H, --haplotype <1|2>[,...] apply variants for the given haplotype(s)\n");
     fprintf(stderr, "    -i, --iupac-codes          output variants in the form of IUPAC ambiguity codes\n");
     fprintf(stderr, "    -m, --mask <file>          replace regions with N\n");
     fprintf(stderr, "    -o, --output <file>        write output to a file [standard output]\n");
     fprintf(stderr, "    -c, --chain <file>         write a chain file for liftover\n");
-    fprintf(stderr, "    -s, --sample <name>        apply variants of the given sample\n");
+    fprintf(stderr, "    -p, --output-prefix <str>  write each sample/haplotype to a separate file <str><sample>[-<hap>].fa\n");
+    fprintf(stderr, "    -s, --sample <list>        apply variants of the given sample(s), comma-separated list\n");
+    fprintf(stderr, "    -S, --samples-file <file>  apply variants of the samples listed in the file\n");
     fprintf(stderr, "Examples:\n");
     fprintf(stderr, "   # Get the consensus for one region. The fasta header lines are then expected\n");
     fprintf(stderr, "   # in the form \">chr:from-to\".\n");
     fprintf(stderr, "   samtools faidx ref.fa 8:11870-11890 | bcftools consensus in.vcf.gz > out.fa\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "   # Create both haplotypes of two samples in a single pass, written as a multi-fasta\n");
+    fprintf(stderr, "   # with sequence names in the form \">sample#haplotype#chr\"\n");
+    fprintf(stderr, "   bcftools consensus -s A,B -H 1,2 -f ref.fa in.vcf.gz > out.fa\n");
+    fprintf(stderr, "\n");
     exit(1);
 }
 
@@ -642,32 +834,33 @@ int main_consensus(int argc, char *argv[])
     args_t *args = (args_t*) calloc(1,sizeof(args_t));
     args->argc   = argc; args->argv = argv;
 
-    static struct option loptions[] = 
+    static struct option loptions[] =
     {
         {"sample",1,0,'s'},
+        {"samples-file",1,0,'S'},
         {"iupac-codes",0,0,'i'},
         {"haplotype",1,0,'H'},
         {"output",1,0,'o'},
+        {"output-prefix",1,0,'p'},
         {"fasta-ref",1,0,'f'},
         {"mask",1,0,'m'},
         {"chain",1,0,'c'},
         {0,0,0,0}
     };
     int c;
-    while ((c = getopt_long(argc, argv, "h?s:1iH:f:o:m:c:",loptions,NULL)) >= 0) 
+    while ((c = getopt_long(argc, argv, "h?s:S:1iH:f:o:p:m:c:",loptions,NULL)) >= 0)
     {
-        switch (c) 
+        switch (c)
         {
             case 's': args->sample = optarg; break;
+            case 'S': args->sample = optarg; args->sample_is_file = 1; break;
             case 'o': args->output_fname = optarg; break;
+            case 'p': args->output_prefix = optarg; break;
             case 'i': args->output_iupac = 1; break;
             case 'f': args->ref_fname = optarg; break;
             case 'm': args->mask_fname = optarg; break;
             case 'c': args->chain_fname = optarg; break;
-            case 'H': 
-                args->haplotype = optarg[0] - '0'; 
-                if ( args->haplotype <=0 ) error("Expected positive integer with --haplotype\n");
-                break;
+            case 'H': args->haplotype = optarg; break;
             default: usage(args); break;
         }
     }
@@ -684,5 +877,3 @@ int main_consensus(int argc, char *argv[])
 
     return 0;
 }
-
-
@@ -575,7 +575,7 @@ typedef struct _args_t
 
     char *outdir, **argv, *fa_fname, *gff_fname, *output_fname;
     char *bcsq_tag;
-    int argc, output_type;
+    int argc, output_type, n_threads;
     int phase, quiet, local_csq;
     int ncsq_max, nfmt_bcsq;    // maximum number of csq per site that can be accessed from FORMAT/BCSQ
     int ncsq_small_warned;
@@ -1256,6 +1256,12 @@ void init_gff(args_t *args)
     }
     tscript_init_cds(args);
 
+    // the indexes are read-only from now on
+    regidx_build(args->idx_tscript);
+    regidx_build(args->idx_cds);
+    regidx_build(args->idx_utr);
+    regidx_build(args->idx_exon);
+
     if ( !args->quiet )
     {
         fprintf(stderr,"Indexed %d transcripts, %d exons, %d CDSs, %d UTRs\n", 
@@ -1343,6 +1349,7 @@ void init_data(args_t *args)
     {
         args->out_fh = hts_open(args->output_fname? args->output_fname : "-",hts_bcf_wmode(args->output_type));
         if ( args->out_fh == NULL ) error("Can't write to %s: %s\n", args->output_fname? args->output_fname : "standard output", strerror(errno));
+        bcftools_set_threads(args->out_fh, args->n_threads);
         bcf_hdr_append_version(args->hdr,args->argc,args->argv,"bcftools/csq");
         bcf_hdr_printf(args->hdr,"##INFO=<ID=%s,Number=.,Type=String,Description=\"%s consequence annotation from BCFtools/csq. Format: '[*]consequence|gene|transcript|biotype[|strand|amino_acid_change|dna_change]' or, for consequences of variants split across multiple sites, a pointer to the record storing the consequences '@position'. '*' prefix indicates a consequence downstream from a stop \">",args->bcsq_tag, args->local_csq ? "Local" : "Haplotype-aware");
         if ( args->hdr_nsmpl ) 
@@ -3699,6 +3706,7 @@ const char *usage(void)
         "   -S, --samples-file <file>       samples to include\n"
         "   -t, --targets <region>          similar to -r but streams rather than index-jumps\n"
         "   -T, --targets-file <file>       similar to -R but streams rather than index-jumps\n"
+        "       --threads <int>             number of extra compression/decompression threads [0]\n"
         "\n"
         "Example:\n"
         "   bcftools csq -f hs37d5.fa -g Homo_sapiens.GRCh37.82.gff3.gz in.vcf\n"
@@ -3716,6 +3724,7 @@ int main_csq(int argc, char *argv[])
     args->output_type = FT_VCF;
     args->bcsq_tag = "BCSQ";
     args->ncsq_max = 2*16;
+    args->n_threads = -1;
 
     static struct option loptions[] =
     {
@@ -3737,6 +3746,7 @@ int main_csq(int argc, char *argv[])
         {"samples-file",1,0,'S'},
         {"targets",1,0,'t'},
         {"targets-file",1,0,'T'},
+        {"threads",1,0,9},
         {0,0,0,0}
     };
     int c, targets_is_file = 0, regions_is_file = 0; 
@@ -3784,6 +3794,7 @@ int main_csq(int argc, char *argv[])
             case 'S': args->sample_list = optarg; args->sample_is_file = 1; break;
             case 't': targets_list = optarg; break;
             case 'T': targets_list = optarg; targets_is_file = 1; break;
+            case  9 : args->n_threads = strtol(optarg, 0, 0); break;
             case 'h':
             case '?': error("%s",usage());
             default: error("The option not recognised: %s\n\n", optarg); break;
@@ -3800,6 +3811,8 @@ int main_csq(int argc, char *argv[])
     if ( !args->fa_fname ) error("Missing the --fa-ref option\n");
     if ( !args->gff_fname ) error("Missing the --gff option\n");
     args->sr = bcf_sr_init();
+    args->n_threads = bcftools_threads(args->n_threads);
+    bcftools_sr_set_threads(args->sr, args->n_threads);
     if ( targets_list && bcf_sr_set_targets(args->sr, targets_list, targets_is_file, 0)<0 )
         error("Failed to read the targets: %s\n", targets_list);
     if ( regions_list && bcf_sr_set_regions(args->sr, regions_list, regions_is_file)<0 )
@@ -3816,7 +3829,7 @@ int main_csq(int argc, char *argv[])
     process(args,NULL);
 
     destroy_data(args);
-    bcf_sr_destroy(args->sr);
+    bcftools_sr_destroy(args->sr);
     free(args);
 
     return 0;
@@ -0,0 +1,110 @@
+/*  lru_cache.h -- memoization of expensive functions of small integer tuples.
+
+    Copyright (C) 2017 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.  */
+
+/*
+    A fixed-size set-associative cache keyed by up to four integers, such as
+    the counts of a contingency table. The least recently used entry of a set
+    is replaced. The cache is not thread-safe, each thread needs its own.
+
+        lru_cache_t *cache = lru_cache_init(1024, 4);
+        int hit;
+        lru_entry_t *entry = lru_cache_get(cache, a,b,c,0, &hit);
+        if ( !hit ) entry->val = expensive_function(a,b,c);
+        return entry->val;
+*/
+
+#ifndef __LRU_CACHE_H__
+#define __LRU_CACHE_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+
+typedef struct
+{
+    int key[4];
+    double val;
+    uint64_t used;      // 0 for empty entries
+}
+lru_entry_t;
+
+typedef struct
+{
+    lru_entry_t *dat;
+    int nsets, nways;
+    uint64_t clock;
+}
+lru_cache_t;
+
+/**
+ *  lru_cache_init() - create a cache of nsets*nways entries
+ *  @nsets:  number of sets, the key hash selects the set
+ *  @nways:  number of entries in each set
+ */
+static inline lru_cache_t *lru_cache_init(int nsets, int nways)
+{
+    lru_cache_t *cache = (lru_cache_t*) calloc(1, sizeof(lru_cache_t));
+    cache->dat   = (lru_entry_t*) calloc((size_t)nsets*nways, sizeof(lru_entry_t));
+    cache->nsets = nsets;
+    cache->nways = nways;
+    return cache;
+}
+
+static inline void lru_cache_destroy(lru_cache_t *cache)
+{
+    if ( !cache ) return;
+    free(cache->dat);
+    free(cache);
+}
+
+/**
+ *  lru_cache_get() - look up the key (a,b,c,d)
+ *  @hit:  set to 1 if the entry was cached, 0 if it is a new entry with
+ *         the key set and the value to be filled in by the caller
+ *
+ *  Returns the entry, which stays valid until the next call.
+ */
+static inline lru_entry_t *lru_cache_get(lru_cache_t *cache, int a, int b, int c, int d, int *hit)
+{
+    uint32_t hash = (uint32_t)a*2654435761U ^ (uint32_t)b*2246822519U ^ (uint32_t)c*3266489917U ^ (uint32_t)d*668265263U;
+    lru_entry_t *set = &cache->dat[(size_t)(hash % cache->nsets)*cache->nways];
+    int i, ilru = 0;
+    cache->clock++;
+    for (i=0; i<cache->nways; i++)
+    {
+        if ( set[i].used && set[i].key[0]==a && set[i].key[1]==b && set[i].key[2]==c && set[i].key[3]==d )
+        {
+            set[i].used = cache->clock;
+            *hit = 1;
+            return &set[i];
+        }
+        if ( set[i].used < set[ilru].used ) ilru = i;
+    }
+    set[ilru].key[0] = a;
+    set[ilru].key[1] = b;
+    set[ilru].key[2] = c;
+    set[ilru].key[3] = d;
+    set[ilru].used   = cache->clock;
+    *hit = 0;
+    return &set[ilru];
+}
+
+#endif
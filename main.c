@@ -28,8 +28,84 @@ THE SOFTWARE.  */
 #include <string.h>
 #include <ctype.h>
 #include <htslib/hts.h>
+#include <htslib/bgzf.h>
+#include <htslib/hfile.h>
+#include <htslib/tbx.h> // for hts_get_bgzfp()
+#include <htslib/thread_pool.h>
 #include "version.h"
 #include "bcftools.h"
+#include "perf.h"
+
+/*
+    The thread pool shared by all readers and writers of a command. The
+    number of threads is given by the command's --threads, by the global
+    "bcftools --threads INT" or by the BCFTOOLS_THREADS environment variable.
+    The pool is created on the first use and destroyed when the command
+    returns.
+*/
+static int global_threads = 0;
+static htsThreadPool thread_pool = {NULL, 0};
+
+int bcftools_threads(int n_threads)
+{
+    return n_threads >= 0 ? n_threads : global_threads;
+}
+
+htsThreadPool *bcftools_thread_pool(int n_threads)
+{
+    if ( n_threads <= 0 ) return NULL;
+    if ( !thread_pool.pool && !(thread_pool.pool = hts_tpool_init(n_threads)) )
+        error("Failed to create %d threads\n", n_threads);
+    return &thread_pool;
+}
+
+int bcftools_set_threads(htsFile *fp, int n_threads)
+{
+    // all output files pass through here, record them for the performance report
+    if ( perf_enabled && fp->is_write ) perf_file(fp->fn, 1, 0);
+    htsThreadPool *p = bcftools_thread_pool(n_threads);
+    return p ? hts_set_opt(fp, HTS_OPT_THREAD_POOL, p) : 0;
+}
+
+int bcftools_sr_set_threads(bcf_srs_t *files, int n_threads)
+{
+    files->p = bcftools_thread_pool(n_threads);
+    files->n_threads = files->p ? n_threads : 0;
+    return 0;
+}
+
+void bcftools_perf_input(htsFile *fp)
+{
+    if ( !perf_enabled ) return;
+    BGZF *bgzf = hts_get_bgzfp(fp);
+    perf_file(fp->fn, 0, bgzf ? htell(bgzf->fp) : 0);
+}
+
+void bcftools_sr_destroy(bcf_srs_t *files)
+{
+    if ( perf_enabled )
+    {
+        int i;
+        for (i=0; i<files->nreaders; i++)
+        {
+            BGZF *bgzf = files->readers[i].file ? hts_get_bgzfp(files->readers[i].file) : NULL;
+            perf_file(files->readers[i].fname, 0, bgzf ? htell(bgzf->fp) : 0);
+        }
+    }
+
+    // the shared pool must not be destroyed by bcf_sr_destroy()
+    files->p = NULL;
+    files->n_threads = 0;
+    bcf_sr_destroy(files);
+}
+
+static int parse_threads(const char *str)
+{
+    char *tmp;
+    int n = strtol(str, &tmp, 10);
+    if ( *tmp || n<0 ) error("Could not parse the number of threads: %s\n", str);
+    return n;
+}
 
 int main_tabix(int argc, char *argv[]);
 int main_vcfindex(int argc, char *argv[]);
@@ -47,6 +123,9 @@ int main_vcfannotate(int argc, char *argv[]);
 int main_vcfroh(int argc, char *argv[]);
 int main_vcfconcat(int argc, char *argv[]);
 int main_reheader(int argc, char *argv[]);
+int main_vcfsort(int argc, char *argv[]);
+int main_vcfpipe(int argc, char *argv[]);
+int main_vcfshard(int argc, char *argv[]);
 int main_vcfconvert(int argc, char *argv[]);
 int main_vcfcnv(int argc, char *argv[]);
 #if USE_GPL
@@ -112,6 +191,10 @@ static cmd_t cmds[] =
       .alias = "plugin",
       .help  = "user-defined plugins"
     },
+    { .func  = main_vcfpipe,
+      .alias = "pipe",
+      .help  = "run a chain of commands in a single process"
+    },
     { .func  = main_vcfquery,
       .alias = "query",
       .help  = "transform VCF/BCF into user-defined formats"
@@ -120,6 +203,14 @@ static cmd_t cmds[] =
       .alias = "reheader",
       .help  = "modify VCF/BCF header, change sample names"
     },
+    { .func  = main_vcfshard,
+      .alias = "shard",
+      .help  = "run a command on genome shards in parallel"
+    },
+    { .func  = main_vcfsort,
+      .alias = "sort",
+      .help  = "sort VCF/BCF file"
+    },
     { .func  = main_vcfview,
       .alias = "view",
       .help  = "VCF/BCF conversion, view, subset and filter VCF/BCF files"
@@ -184,6 +275,23 @@ static cmd_t cmds[] =
     }
 };
 
+int bcftools_cmd(int argc, char *argv[])
+{
+    int i = 0;
+    while (cmds[i].alias)
+    {
+        if (cmds[i].func && strcmp(argv[0],cmds[i].alias)==0)
+        {
+            int ret = cmds[i].func(argc,argv);
+            if ( thread_pool.pool ) hts_tpool_destroy(thread_pool.pool);
+            thread_pool.pool = NULL;
+            return ret;
+        }
+        i++;
+    }
+    error("[E::%s] unrecognized command '%s'\n", __func__, argv[0]);
+}
+
 char *bcftools_version(void)
 {
     return BCFTOOLS_VERSION;
@@ -198,7 +306,7 @@ static void usage(FILE *fp)
 #endif
     fprintf(fp, "Version: %s (using htslib %s)\n", bcftools_version(), hts_version());
     fprintf(fp, "\n");
-    fprintf(fp, "Usage:   bcftools [--version|--version-only] [--help] <command> <argument>\n");
+    fprintf(fp, "Usage:   bcftools [--version|--version-only] [--help] [--threads INT] [--perf-report FILE] <command> <argument>\n");
     fprintf(fp, "\n");
     fprintf(fp, "Commands:\n");
 
@@ -222,10 +330,29 @@ static void usage(FILE *fp)
             " in all situations. Un-indexed VCF and BCF and streams will work in most but\n"
             " not all situations.\n");
     fprintf(fp,"\n");
+    fprintf(fp,
+            " The global --threads option or the BCFTOOLS_THREADS environment variable set\n"
+            " the default number of compression and decompression threads of all commands.\n");
+    fprintf(fp,"\n");
+    fprintf(fp,
+            " The global --perf-report option or the BCFTOOLS_PERF_REPORT environment variable\n"
+            " write a JSON report with time spent per stage, I/O and memory usage at exit.\n");
+    fprintf(fp,"\n");
 }
 
 int main(int argc, char *argv[])
 {
+    const char *perf_report = getenv("BCFTOOLS_PERF_REPORT");
+    if ( getenv("BCFTOOLS_THREADS") ) global_threads = parse_threads(getenv("BCFTOOLS_THREADS"));
+    while ( argc > 2 )
+    {
+        if ( !strcmp(argv[1], "--threads") ) global_threads = parse_threads(argv[2]);
+        else if ( !strcmp(argv[1], "--perf-report") ) perf_report = argv[2];
+        else break;
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
     if (argc < 2) { usage(stderr); return 1; }
 
     if (strcmp(argv[1], "version") == 0 || strcmp(argv[1], "--version") == 0 || strcmp(argv[1], "-v") == 0) {
@@ -264,7 +391,10 @@ int main(int argc, char *argv[])
     {
         if (cmds[i].func && strcmp(argv[1],cmds[i].alias)==0)
         {
-            return cmds[i].func(argc-1,argv+1);
+            if ( perf_report ) perf_init(perf_report, argc, argv);
+            int ret = cmds[i].func(argc-1,argv+1);
+            if ( thread_pool.pool ) hts_tpool_destroy(thread_pool.pool);
+            return ret;
         }
         i++;
     }
@@ -0,0 +1,83 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Carp;
+
+my $opts = parse_params();
+merge($opts);
+
+exit;
+
+#--------------------------------
+
+sub error
+{
+    my (@msg) = @_;
+    if ( scalar @msg ) { confess @msg,"\n"; }
+    print
+        "About: Merge the output of \"bcftools +af-dist\" runs on different regions or files,\n",
+        "       for example chromosomes processed in parallel. The histograms must have been\n",
+        "       created with the same -d and -p bins. The counts are summed, comment lines and\n",
+        "       the GT lines of --list are taken over from all files in the input order.\n",
+        "Usage: merge-af-dist.pl [OPTIONS] file1.txt file2.txt ...\n",
+        "Options:\n",
+        "   -h, -?, --help              This help message\n",
+        "\n";
+    exit -1;
+}
+sub parse_params
+{
+    my $opts = { files=>[] };
+    while (defined(my $arg=shift(@ARGV)))
+    {
+        if ( $arg eq '-?' || $arg eq '-h' || $arg eq '--help' ) { error(); }
+        if ( -e $arg ) { push @{$$opts{files}}, $arg; next; }
+        error("Unknown parameter or non-existent file \"$arg\". Run -h for help.\n");
+    }
+    if ( !@{$$opts{files}} ) { error(); }
+    return $opts;
+}
+
+sub merge
+{
+    my ($opts) = @_;
+    my (%hist, @order, @gts);
+    my $ifile = 0;
+    for my $file (@{$$opts{files}})
+    {
+        open(my $fh,'<',$file) or error("$file: $!");
+        my %seen;
+        while (my $line=<$fh>)
+        {
+            if ( $line=~/^#/ )
+            {
+                if ( !$ifile ) { push @order, $line; }
+                next;
+            }
+            if ( $line=~/^GT\t/ ) { push @gts, $line; next; }
+            my @items = split(/\t/,$line);
+            chomp($items[-1]);
+            if ( @items!=4 ) { error("Could not parse $file: $line"); }
+            my ($type,$min,$max,$cnt) = @items;
+            my $key = "$type\t$min\t$max";
+            $seen{$key} = 1;
+            if ( !$ifile ) { $hist{$key} = $cnt; push @order, $key; next; }
+            if ( !exists($hist{$key}) ) { error("The bins in $file differ from $$opts{files}[0]: $key\n"); }
+            $hist{$key} += $cnt;
+        }
+        close($fh) or error("close failed: $file");
+        if ( scalar keys %seen != scalar keys %hist ) { error("The bins in $file differ from $$opts{files}[0]\n"); }
+        $ifile++;
+    }
+    for my $line (@order)
+    {
+        if ( $line=~/^#/ )
+        {
+            print $line;
+            if ( $line=~/^# GT,/ ) { print @gts; @gts = (); }
+            next;
+        }
+        print "$line\t$hist{$line}\n";
+    }
+}
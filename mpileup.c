@@ -406,6 +406,7 @@ static int mpileup(mplp_conf_t *conf)
             fprintf(stderr, "[%s] failed to open %s: %s\n", __func__, conf->files[i], strerror(errno));
             exit(EXIT_FAILURE);
         }
+        bcftools_set_threads(conf->mplp_data[i]->fp, conf->n_threads);
         if (hts_set_opt(conf->mplp_data[i]->fp, CRAM_OPT_DECODE_MD, 0)) {
             fprintf(stderr, "Failed to set CRAM_OPT_DECODE_MD value\n");
             exit(EXIT_FAILURE);
@@ -484,7 +485,7 @@ static int mpileup(mplp_conf_t *conf)
         fprintf(stderr, "[%s] failed to write to %s: %s\n", __func__, conf->output_fname? conf->output_fname : "standard output", strerror(errno));
         exit(EXIT_FAILURE);
     }
-    if ( conf->n_threads ) hts_set_threads(conf->bcf_fp, conf->n_threads);
+    bcftools_set_threads(conf->bcf_fp, conf->n_threads);
 
     // BCF header creation
     conf->bcf_hdr = bcf_hdr_init("w");
@@ -850,7 +851,7 @@ static void print_usage(FILE *fp, const mplp_conf_t *mplp)
 "  -o, --output FILE       write output to FILE [standard output]\n"
 "  -O, --output-type TYPE  'b' compressed BCF; 'u' uncompressed BCF;\n"
 "                          'z' compressed VCF; 'v' uncompressed VCF [v]\n"
-"      --threads INT       number of extra output compression threads [0]\n"
+"      --threads INT       number of extra compression/decompression threads [0]\n"
 "\n"
 "SNP/INDEL genotype likelihoods options:\n"
 "  -e, --ext-prob INT      Phred-scaled gap extension seq error probability [%d]\n", mplp->extQ);
@@ -895,7 +896,7 @@ int bam_mpileup(int argc, char *argv[])
     mplp.output_fname = NULL;
     mplp.output_type = FT_VCF;
     mplp.record_cmd_line = 1;
-    mplp.n_threads = 0;
+    mplp.n_threads = -1;
     mplp.bsmpl = bam_smpl_init();
 
     static const struct option lopts[] =
@@ -1093,6 +1094,7 @@ int bam_mpileup(int argc, char *argv[])
         mplp.files  = (char**) malloc(mplp.nfiles*sizeof(char*));
         for (i=0; i<mplp.nfiles; i++) mplp.files[i] = strdup(argv[optind+i]);
     }
+    mplp.n_threads = bcftools_threads(mplp.n_threads);
     ret = mpileup(&mplp);
 
     for (i=0; i<mplp.nfiles; i++) free(mplp.files[i]);
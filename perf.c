@@ -0,0 +1,279 @@
+/* The MIT License
+
+   Copyright (c) 2017 Genome Research Ltd.
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <htslib/kstring.h>
+#include "bcftools.h"
+#include "perf.h"
+
+#define MAX_DEPTH 16
+
+typedef struct
+{
+    uint64_t wall_ns, cpu_ns, ncalls, nrec;
+}
+stage_t;
+
+typedef struct
+{
+    char *fname;
+    int is_write;
+    uint64_t offset;
+}
+file_t;
+
+typedef struct
+{
+    char *report_fname;
+    kstring_t args;
+    stage_t stage[PERF_NSTAGES];
+    int stack[MAX_DEPTH], depth, overflow;
+    uint64_t init_wall, last_wall, last_cpu;
+    file_t *files;
+    int nfiles, mfiles;
+    pthread_t main_tid;     // the hooks are ignored in other threads
+}
+perf_t;
+
+int perf_enabled = 0;
+static perf_t perf;
+
+static const char *stage_names[PERF_NSTAGES] = { "read", "unpack", "filter_test", "core", "write" };
+
+static inline uint64_t clock_ns(clockid_t clk)
+{
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+// Charge the time elapsed since the last transition to the running stage
+static inline void charge(void)
+{
+    uint64_t wall = clock_ns(CLOCK_MONOTONIC);
+    uint64_t cpu  = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    stage_t *stage = &perf.stage[ perf.stack[perf.depth-1] ];
+    stage->wall_ns += wall - perf.last_wall;
+    stage->cpu_ns  += cpu - perf.last_cpu;
+    perf.last_wall = wall;
+    perf.last_cpu  = cpu;
+}
+
+void perf_stage_beg(int stage)
+{
+    if ( !pthread_equal(pthread_self(), perf.main_tid) ) return;
+    charge();
+    perf.stage[stage].ncalls++;
+    if ( perf.depth == MAX_DEPTH ) { perf.overflow++; return; }
+    perf.stack[perf.depth++] = stage;
+}
+
+void perf_stage_end(int stage, int nrec)
+{
+    if ( !pthread_equal(pthread_self(), perf.main_tid) ) return;
+    charge();
+    perf.stage[stage].nrec += nrec;
+    if ( perf.overflow ) { perf.overflow--; return; }
+    // unbalanced calls are tolerated, the base PERF_CORE is never removed
+    int i = perf.depth - 1;
+    while ( i>0 && perf.stack[i]!=stage ) i--;
+    if ( i>0 ) perf.depth = i;
+}
+
+void perf_file(const char *fname, int is_write, uint64_t offset)
+{
+    if ( !perf_enabled || !fname ) return;
+    perf.nfiles++;
+    hts_expand0(file_t, perf.nfiles, perf.mfiles, perf.files);
+    file_t *file = &perf.files[perf.nfiles-1];
+    file->fname    = strdup(fname);
+    file->is_write = is_write;
+    file->offset   = offset;
+}
+
+// Walk BGZF block headers up to the offset, all blocks if 0. Returns -1 if the
+// file is not a regular BGZF file.
+static int scan_bgzf(file_t *file, uint64_t *size, uint64_t *nblocks, uint64_t *usize)
+{
+    struct stat st;
+    *size = *nblocks = *usize = 0;
+    if ( !strcmp("-",file->fname) || stat(file->fname, &st)!=0 || !S_ISREG(st.st_mode) ) return -1;
+    *size = st.st_size;
+
+    FILE *fp = fopen(file->fname, "rb");
+    if ( !fp ) return -1;
+    uint64_t end = file->offset && file->offset < (uint64_t)st.st_size ? file->offset : st.st_size;
+    uint64_t off = 0;
+    uint8_t buf[18];
+    int ret = -1;
+    while ( off < end )
+    {
+        if ( fseeko(fp, off, SEEK_SET)!=0 || fread(buf,1,18,fp)!=18 ) break;
+        if ( buf[0]!=31 || buf[1]!=139 || buf[2]!=8 || !(buf[3]&4) || buf[12]!='B' || buf[13]!='C' )
+            break;
+        uint64_t bsize = (buf[16] | buf[17]<<8) + 1;
+        if ( fseeko(fp, off + bsize - 4, SEEK_SET)!=0 || fread(buf,1,4,fp)!=4 ) break;
+        *usize += (uint32_t)buf[0] | (uint32_t)buf[1]<<8 | (uint32_t)buf[2]<<16 | (uint32_t)buf[3]<<24;
+        (*nblocks)++;
+        off += bsize;
+        ret = 0;
+    }
+    fclose(fp);
+    if ( file->offset && file->offset < *size ) *size = file->offset;
+    return ret;
+}
+
+static void print_json_str(FILE *fp, const char *str)
+{
+    fputc('"', fp);
+    for (; *str; str++)
+    {
+        if ( *str=='"' || *str=='\\' ) fprintf(fp, "\\%c", *str);
+        else if ( (unsigned char)*str < 0x20 ) fprintf(fp, "\\u%04x", (unsigned char)*str);
+        else fputc(*str, fp);
+    }
+    fputc('"', fp);
+}
+
+static void perf_report(void)
+{
+    if ( !perf_enabled ) return;
+    charge();
+
+    FILE *fp = strcmp("-",perf.report_fname) ? fopen(perf.report_fname, "w") : stderr;
+    if ( !fp )
+    {
+        fprintf(stderr, "Could not write the performance report %s: %s\n", perf.report_fname, strerror(errno));
+        return;
+    }
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+    long max_rss = ru.ru_maxrss / 1024;
+#else
+    long max_rss = ru.ru_maxrss;
+#endif
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"version\": "); print_json_str(fp, bcftools_version()); fprintf(fp, ",\n");
+    fprintf(fp, "  \"command\": "); print_json_str(fp, perf.args.s ? perf.args.s : ""); fprintf(fp, ",\n");
+    fprintf(fp, "  \"wall_s\": %.6f,\n", (clock_ns(CLOCK_MONOTONIC) - perf.init_wall)*1e-9);
+    fprintf(fp, "  \"user_s\": %.6f,\n", ru.ru_utime.tv_sec + ru.ru_utime.tv_usec*1e-6);
+    fprintf(fp, "  \"sys_s\": %.6f,\n", ru.ru_stime.tv_sec + ru.ru_stime.tv_usec*1e-6);
+    fprintf(fp, "  \"max_rss_kb\": %ld,\n", max_rss);
+
+    // the stage CPU times are of the main thread only, user_s and sys_s include all threads
+    int i;
+    fprintf(fp, "  \"stages\": {\n");
+    for (i=0; i<PERF_NSTAGES; i++)
+    {
+        stage_t *stage = &perf.stage[i];
+        fprintf(fp, "    \"%s\": { \"wall_s\": %.6f, \"cpu_s\": %.6f, \"calls\": %"PRIu64", \"records\": %"PRIu64" }%s\n",
+                stage_names[i], stage->wall_ns*1e-9, stage->cpu_ns*1e-9, stage->ncalls, stage->nrec, i+1<PERF_NSTAGES ? "," : "");
+    }
+    fprintf(fp, "  },\n");
+
+    fprintf(fp, "  \"files\": [");
+    for (i=0; i<perf.nfiles; i++)
+    {
+        file_t *file = &perf.files[i];
+        uint64_t size, nblocks, usize;
+        int is_bgzf = scan_bgzf(file, &size, &nblocks, &usize)==0 ? 1 : 0;
+        fprintf(fp, "%s\n    { \"name\": ", i ? "," : "");
+        print_json_str(fp, file->fname);
+        fprintf(fp, ", \"mode\": \"%s\", \"bytes\": %"PRIu64, file->is_write ? "w" : "r", size);
+        if ( is_bgzf ) fprintf(fp, ", \"bgzf_blocks\": %"PRIu64", \"uncompressed_bytes\": %"PRIu64, nblocks, usize);
+        fprintf(fp, " }");
+    }
+    fprintf(fp, "%s],\n", perf.nfiles ? "\n  " : "");
+
+    // process-wide I/O including pipes, Linux only
+    FILE *io = fopen("/proc/self/io", "r");
+    if ( io )
+    {
+        char key[64];
+        unsigned long long val, rchar = 0, wchar = 0;
+        while ( fscanf(io, "%63[^:]: %llu\n", key, &val)==2 )
+        {
+            if ( !strcmp(key,"rchar") ) rchar = val;
+            else if ( !strcmp(key,"wchar") ) wchar = val;
+        }
+        fclose(io);
+        fprintf(fp, "  \"io\": { \"read_bytes\": %llu, \"write_bytes\": %llu },\n", rchar, wchar);
+    }
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 mi = mallinfo2();
+    fprintf(fp, "  \"malloc\": { \"arena\": %zu, \"in_use\": %zu, \"free\": %zu, \"mmap\": %zu },\n",
+            mi.arena, mi.uordblks, mi.fordblks, mi.hblkhd);
+#elif defined(__GLIBC__)
+    struct mallinfo mi = mallinfo();
+    fprintf(fp, "  \"malloc\": { \"arena\": %u, \"in_use\": %u, \"free\": %u, \"mmap\": %u },\n",
+            (unsigned)mi.arena, (unsigned)mi.uordblks, (unsigned)mi.fordblks, (unsigned)mi.hblkhd);
+#endif
+    fprintf(fp, "  \"page_faults\": { \"minor\": %ld, \"major\": %ld }\n", ru.ru_minflt, ru.ru_majflt);
+    fprintf(fp, "}\n");
+
+    if ( fp!=stderr && fclose(fp)!=0 ) fprintf(stderr, "Could not write the performance report %s: %s\n", perf.report_fname, strerror(errno));
+
+    for (i=0; i<perf.nfiles; i++) free(perf.files[i].fname);
+    free(perf.files);
+    free(perf.args.s);
+    free(perf.report_fname);
+    perf_enabled = 0;
+}
+
+void perf_init(const char *fname, int argc, char **argv)
+{
+    if ( perf_enabled ) return;
+    memset(&perf, 0, sizeof(perf));
+    perf.report_fname = strdup(fname);
+    int i;
+    for (i=1; i<argc; i++)
+    {
+        if ( i>1 ) kputc(' ', &perf.args);
+        kputs(argv[i], &perf.args);
+    }
+    perf.stack[perf.depth++] = PERF_CORE;
+    perf.main_tid = pthread_self();
+    perf.init_wall = perf.last_wall = clock_ns(CLOCK_MONOTONIC);
+    perf.last_cpu  = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    perf_enabled = 1;
+
+    // error() exits too, the report is then still written
+    atexit(perf_report);
+}
@@ -0,0 +1,94 @@
+/* The MIT License
+
+   Copyright (c) 2017 Genome Research Ltd.
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+/*
+    Per-stage runtime instrumentation, enabled by `bcftools --perf-report FILE`
+    or the BCFTOOLS_PERF_REPORT environment variable. A JSON report with wall
+    and CPU time per stage, record counts, file sizes and BGZF block counts,
+    allocator statistics and peak RSS is written when the program exits.
+
+    The main loops of commands mark their stages:
+
+        while ( perf_beg(PERF_READ), bcf_sr_next_line(files) )
+        {
+            perf_end(PERF_READ, 1);
+            ...
+            perf_beg(PERF_WRITE);
+            bcf_write1(out, hdr, rec);
+            perf_end(PERF_WRITE, 1);
+        }
+        perf_end(PERF_READ, 0);
+
+    Starting the read stage in the loop condition keeps it balanced also when
+    the body skips a record with `continue`.
+
+    Stages nest and the time is exclusive: while a stage runs, the time of the
+    enclosing stage is paused. Whatever is not marked counts as PERF_CORE. When
+    the instrumentation is disabled, the cost of perf_beg() and perf_end() is a
+    single test of a global variable.
+
+    The state is global and not thread-safe, the stages are accounted in the
+    thread which called perf_init() only. The hooks called from other threads,
+    such as the stages of "bcftools pipe", are ignored. With a thread pool,
+    decompression runs ahead of the records handed out, the byte positions of
+    input files are taken by htell() and include the blocks already read ahead.
+*/
+
+#ifndef __PERF_H__
+#define __PERF_H__
+
+#include <stdint.h>
+
+#define PERF_READ     0     // reading and decoding, bcf_sr_next_line() or bcf_read()
+#define PERF_UNPACK   1     // bcf_unpack()
+#define PERF_FILTER   2     // filter_test()
+#define PERF_CORE     3     // the command's own work; the default stage
+#define PERF_WRITE    4     // encoding and writing, bcf_write()
+#define PERF_NSTAGES  5
+
+extern int perf_enabled;
+
+/*
+ *  perf_init() - enable the instrumentation and register the report to be
+ *                written to fname ("-" for stderr) at exit
+ *  perf_file() - record a file read or written by the command. The size, the
+ *                number of BGZF blocks and the uncompressed size are obtained
+ *                at exit by scanning the file up to the offset (0 for all).
+ */
+void perf_init(const char *fname, int argc, char **argv);
+void perf_file(const char *fname, int is_write, uint64_t offset);
+
+void perf_stage_beg(int stage);
+void perf_stage_end(int stage, int nrec);
+
+static inline void perf_beg(int stage)
+{
+    if ( perf_enabled ) perf_stage_beg(stage);
+}
+static inline void perf_end(int stage, int nrec)
+{
+    if ( perf_enabled ) perf_stage_end(stage, nrec);
+}
+
+#endif
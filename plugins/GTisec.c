@@ -40,8 +40,6 @@ DEALINGS IN THE SOFTWARE.  */
 
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
-#include <htslib/khash.h>
-KHASH_MAP_INIT_INT(gts2smps, uint32_t)
 
 #include "bcftools.h"
 
@@ -61,6 +59,12 @@ typedef struct _args_t
     int nsmpp2; /*! 2^(nsmp) (is needed multiple times) */
     int *gt_arr; /*! temporary array, to store GTs of current line/record */
     int ngt_arr; /*! hold the number of current GT array entries */
+    uint64_t *gt_smps; /*! for each genotype, a bitmask of samples carrying it. Indexed by bcf_alleles2gt()
+                                for diploid genotypes followed by one entry per allele for haploid genotypes.
+                                Only the entries listed in gt_used are non-zero and they are cleared
+                                after each record, so the array can be reused */
+    int mgt_smps;
+    int *gt_used, ngt_used, mgt_used; /*! genotypes present in the current record */
     uint32_t *bankers; /*! array to store banker's sequence for all possible sample subsets for
                                 programmatic indexing into smp_is for output printing, e.g. for three
                                 samples A, B and C this would be the following order:
@@ -315,7 +319,7 @@ uint32_t compute_bankers(unsigned long a)
  */
 bcf1_t *process(bcf1_t *rec)
 {
-    uint64_t i;
+    int i;
     bcf_unpack(rec, BCF_UN_FMT); // unpack the Format fields, including the GT field
     int gte_smp = 0; // number GT array entries per sample (should be 2, one entry per allele)
     if ( (gte_smp = bcf_get_genotypes(args.hdr, rec, &(args.gt_arr), &(args.ngt_arr) ) ) <= 0 )
@@ -324,11 +328,15 @@ bcf1_t *process(bcf1_t *rec)
     }
 
     gte_smp /= args.nsmp; // divide total number of genotypes array entries (= args.ngt_arr) by number of samples
-    int ret;
+    if ( gte_smp > 2 ) error("gtisec does not support ploidy higher than 2.\n");
+
+    // make room for all diploid and haploid genotypes possible at this site
+    int nals = rec->n_allele, ndip = nals * (nals + 1) / 2;
+    hts_expand0(uint64_t, ndip + nals, args.mgt_smps, args.gt_smps);
+    hts_expand(int, args.nsmp, args.mgt_used, args.gt_used);
+    args.ngt_used = 0;
 
-    // stick all genotypes in a hash as keys and store up to 32 samples in a corresponding flag as its value
-    khiter_t bucket;
-    khash_t(gts2smps) *gts = kh_init(gts2smps); // create hash
+    // set the sample's bit in its genotype's bitmask
     for ( i = 0; i < args.nsmp; i++ )
     {
         int *gt_ptr = args.gt_arr + gte_smp * i;
@@ -340,41 +348,30 @@ bcf1_t *process(bcf1_t *rec)
         }
 
         int a = bcf_gt_allele(gt_ptr[0]);
-        int b;
-        if ( gte_smp == 2 ) // two entries available per sample, padded with missing values for haploid genotypes
+        int idx;
+        if ( gte_smp == 2 && gt_ptr[1] != bcf_int32_vector_end ) // diploid genotype
         {
-            b = bcf_gt_allele(gt_ptr[1]);
+            int b = bcf_gt_allele(gt_ptr[1]);
+            if ( a >= nals || b >= nals ) error("Incorrect allele at %s:%d\n", bcf_seqname(args.hdr,rec), rec->pos+1);
+            idx = bcf_alleles2gt(a,b);
         }
-        else if (gte_smp == 1 ) // use missing value for second entry in hash key generation below, if only one is available
-        {
-            b = bcf_gt_allele(bcf_int32_vector_end);
-        }
-        else
+        else    // haploid genotype, either a single entry or padded with the vector end
         {
-            error("gtisec does not support ploidy higher than 2.\n");
+            if ( a >= nals ) error("Incorrect allele at %s:%d\n", bcf_seqname(args.hdr,rec), rec->pos+1);
+            idx = ndip + a;
         }
 
-        int idx = bcf_alleles2gt(a,b); // generate genotype specific hash key
-
-        bucket = kh_get(gts2smps, gts, idx); // get the genotype's hash bucket
-
-        if ( bucket == kh_end(gts) ) { // means that key does not exist
-            bucket = kh_put(gts2smps, gts, idx, &ret); // create bucket with genotype index as key and return its iterator
-            kh_val(gts, bucket) = 0; // initialize the bucket with all sample bits unset
-        }
-        kh_value(gts, bucket) |= (1<<i); // set the sample's bit to 1 in this genotype's bucket
+        if ( !args.gt_smps[idx] ) args.gt_used[args.ngt_used++] = idx;
+        args.gt_smps[idx] |= (uint64_t)1 << i;
     }
 
-    // iterate over genotypes and for each genotype increment the appropriate smp_is entry
-    for ( bucket = kh_begin(gts); bucket != kh_end(gts); ++bucket ) // iterate over all genotypes at this position
+    // for each genotype increment the appropriate smp_is entry and reset the bitmask for the next record
+    for ( i = 0; i < args.ngt_used; i++ )
     {
-        if ( kh_exist(gts, bucket) ) // for existing genotype buckets
-        {
-            uint32_t s = kh_val(gts, bucket); // get the 32 bit flag
-            args.smp_is[s]++; // add to the corresponding subset
-        }
+        int idx = args.gt_used[i];
+        args.smp_is[ args.gt_smps[idx] ]++;
+        args.gt_smps[idx] = 0;
     }
-    kh_destroy(gts2smps, gts); // destroy hash
 
     return NULL;
 }
@@ -463,6 +460,8 @@ void destroy(void)
 
     /* freeing up args */
     free(args.gt_arr);
+    free(args.gt_smps);
+    free(args.gt_used);
     free(args.bankers);
     free(args.quick);
     if (args.flag & MISSING) free(args.missing_gts);
@@ -34,8 +34,10 @@
 #include <htslib/kseq.h>
 #include <htslib/kfunc.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include "bcftools.h"
 #include "convert.h"
+#include "lru_cache.h"
 
 typedef struct
 {
@@ -44,22 +46,37 @@ typedef struct
 }
 pair_t;
 
+// Memoized Fisher test p-values, the same small-count tables repeat often
+#define FISHER_CACHE_NSETS 4096
+#define FISHER_CACHE_NWAYS 4
+
+// The state of one process_batch_txt() call. Workers are reused by later calls,
+// there are as many as there were concurrent calls
+typedef struct _worker_t
+{
+    lru_cache_t *cache;
+    int32_t *ad;        // the first two AD values of each sample, -1 if missing
+    convert_t *convert;
+    kstring_t str;
+    uint64_t nsite, ncmp;
+    struct _worker_t *next;
+}
+worker_t;
+
 typedef struct
 {
     bcf_hdr_t *hdr;
     pair_t *pair;
-    int npair, mpair, min_dp, min_alt_dp;
-    int32_t *ad_arr;
-    int mad_arr;
+    int npair, mpair, min_dp, min_alt_dp, nsmpl;
     double th;
-    convert_t *convert;
-    kstring_t str;
-    uint64_t nsite,ncmp;
+    char *format;
+    pthread_mutex_t lock;
+    worker_t *idle;     // workers not in use, linked by worker_t.next
+    worker_t **all;     // all workers
+    int nall, mall;
 }
 args_t;
 
-args_t args;
-
 const char *about(void)
 {
     return "Find positions with wildly varying ALT allele frequency (Fisher test on FMT/AD).\n";
@@ -81,12 +98,15 @@ const char *usage(void)
         "   -s, --samples <file>        List of sample pairs, one tab-delimited pair per line\n"
         "   -t, --threshold <float>     Output only hits with p-value smaller than <float> [1e-3]\n"
         "\n"
+        "The plugin is thread-safe, the blocks of records are processed in parallel with\n"
+        "the --threads option of \"bcftools plugin\", the output order is preserved.\n"
+        "\n"
         "Example:\n"
         "   bcftools +ad-bias file.bcf -- -t 1e-3 -s samples.txt\n"
         "\n";
 }
 
-void parse_samples(args_t *args, char *fname)
+static void parse_samples(args_t *args, char *fname)
 {
     htsFile *fp = hts_open(fname, "r");
     if ( !fp ) error("Could not read: %s\n", fname);
@@ -120,12 +140,18 @@ void parse_samples(args_t *args, char *fname)
     hts_close(fp);
 }
 
-int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
+int flags(void)
+{
+    return PLUGIN_THREAD_SAFE;
+}
+
+void *init2(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out, int *ret)
 {
-    memset(&args,0,sizeof(args_t));
-    args.hdr = in;
-    args.th  = 1e-3;
-    args.min_alt_dp = 1;
+    args_t *args = (args_t*) calloc(1,sizeof(args_t));
+    args->hdr = in;
+    args->th  = 1e-3;
+    args->min_alt_dp = 1;
+    args->nsmpl = bcf_hdr_nsamples(in);
     char *fname = NULL, *format = NULL;
     static struct option loptions[] =
     {
@@ -143,15 +169,15 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
         switch (c) 
         {
             case 'a':
-                args.min_alt_dp = strtol(optarg,&tmp,10);
+                args->min_alt_dp = strtol(optarg,&tmp,10);
                 if ( *tmp ) error("Could not parse: -a %s\n", optarg);
                 break;
             case 'd':
-                args.min_dp = strtol(optarg,&tmp,10);
+                args->min_dp = strtol(optarg,&tmp,10);
                 if ( *tmp ) error("Could not parse: -d %s\n", optarg);
                 break;
             case 't':
-                args.th = strtod(optarg,&tmp);
+                args->th = strtod(optarg,&tmp);
                 if ( *tmp ) error("Could not parse: -t %s\n", optarg);
                 break;
             case 's': fname = optarg; break;
@@ -162,8 +188,10 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
         }
     }
     if ( !fname ) error("Expected the -s option\n");
-    parse_samples(&args, fname);
-    if ( format ) args.convert = convert_init(args.hdr, NULL, 0, format);
+    parse_samples(args, fname);
+    args->format = format;
+    if ( format ) convert_destroy(convert_init(args->hdr, NULL, 0, format));   // check the format early
+    pthread_mutex_init(&args->lock, NULL);
     printf("# This file was produced by: bcftools +ad-bias(%s+htslib-%s)\n", bcftools_version(),hts_version());
     printf("# The command line was:\tbcftools +ad-bias %s", argv[0]);
     for (c=1; c<argc; c++) printf(" %s",argv[c]);
@@ -171,56 +199,146 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     printf("# FT, Fisher Test\t[2]Sample\t[3]Control\t[4]Chrom\t[5]Pos\t[6]smpl.nREF\t[7]smpl.nALT\t[8]ctrl.nREF\t[9]ctrl.nALT\t[10]P-value");
     if ( format ) printf("\t[11-]User data: %s", format);
     printf("\n");
+    *ret = 1;
+    return args;
+}
+
+static worker_t *get_worker(args_t *args)
+{
+    pthread_mutex_lock(&args->lock);
+    worker_t *wrk = args->idle;
+    if ( wrk ) args->idle = wrk->next;
+    else
+    {
+        wrk = (worker_t*) calloc(1,sizeof(worker_t));
+        wrk->cache = lru_cache_init(FISHER_CACHE_NSETS, FISHER_CACHE_NWAYS);
+        wrk->ad = (int32_t*) malloc(sizeof(int32_t)*2*args->nsmpl);
+        if ( args->format ) wrk->convert = convert_init(args->hdr, NULL, 0, args->format);
+        args->nall++;
+        hts_expand(worker_t*,args->nall,args->mall,args->all);
+        args->all[args->nall-1] = wrk;
+    }
+    pthread_mutex_unlock(&args->lock);
+    return wrk;
+}
+
+static void put_worker(args_t *args, worker_t *wrk)
+{
+    pthread_mutex_lock(&args->lock);
+    wrk->next = args->idle;
+    args->idle = wrk;
+    pthread_mutex_unlock(&args->lock);
+}
+
+static double get_fisher(worker_t *wrk, int n11, int n12, int n21, int n22)
+{
+    int hit;
+    lru_entry_t *entry = lru_cache_get(wrk->cache, n11,n12,n21,n22, &hit);
+    if ( !hit )
+    {
+        double left, right;
+        kt_fisher_exact(n11,n12,n21,n22, &left,&right,&entry->val);
+    }
+    return entry->val;
+}
+
+// Extract the REF and the first ALT depth of all samples directly from the typed buffer
+#define BRANCH(type_t, missing, vector_end) \
+{ \
+    for (i=0; i<args->nsmpl; i++) \
+    { \
+        type_t *p = (type_t*) (fmt->p + i*fmt->size); \
+        wrk->ad[2*i]   = p[0]==missing || p[0]==vector_end ? -1 : p[0]; \
+        wrk->ad[2*i+1] = p[1]==missing || p[1]==vector_end ? -1 : p[1]; \
+    } \
+}
+static int get_ad(args_t *args, worker_t *wrk, bcf1_t *rec)
+{
+    bcf_fmt_t *fmt = bcf_get_fmt(args->hdr, rec, "AD");
+    if ( !fmt || fmt->n<2 ) return 0;
+    int i;
+    switch (fmt->type)
+    {
+        case BCF_BT_INT8:  BRANCH(int8_t, bcf_int8_missing, bcf_int8_vector_end); break;
+        case BCF_BT_INT16: BRANCH(int16_t, bcf_int16_missing, bcf_int16_vector_end); break;
+        case BCF_BT_INT32: BRANCH(int32_t, bcf_int32_missing, bcf_int32_vector_end); break;
+        default: error("Unexpected AD type: %d\n", fmt->type);
+    }
     return 1;
 }
+#undef BRANCH
 
-bcf1_t *process(bcf1_t *rec)
+static void process_rec(args_t *args, worker_t *wrk, bcf1_t *rec, kstring_t *txt)
 {
-    int nad = bcf_get_format_int32(args.hdr, rec, "AD", &args.ad_arr, &args.mad_arr);
-    if ( nad<0 ) return NULL;
-    nad /= bcf_hdr_nsamples(args.hdr);
-    
-    if ( args.convert ) convert_line(args.convert, rec, &args.str);
-    args.nsite++;
+    if ( !get_ad(args, wrk, rec) ) return;
+
+    if ( wrk->convert ) convert_line(wrk->convert, rec, &wrk->str);
+    wrk->nsite++;
 
     int i;
-    for (i=0; i<args.npair; i++)
+    for (i=0; i<args->npair; i++)
     {
-        pair_t *pair = &args.pair[i];
-        int32_t *aptr = args.ad_arr + nad*pair->smpl;
-        int32_t *bptr = args.ad_arr + nad*pair->ctrl;
+        pair_t *pair = &args->pair[i];
+        int32_t *aptr = wrk->ad + 2*pair->smpl;
+        int32_t *bptr = wrk->ad + 2*pair->ctrl;
 
-        if ( aptr[0]==bcf_int32_missing ) continue;
-        if ( bptr[0]==bcf_int32_missing ) continue;
-        if ( aptr[0]+aptr[1] < args.min_dp ) continue;
-        if ( bptr[0]+bptr[1] < args.min_dp ) continue;
-        if ( aptr[1] < args.min_alt_dp && bptr[1] < args.min_alt_dp ) continue;
+        if ( aptr[0]<0 || aptr[1]<0 ) continue;
+        if ( bptr[0]<0 || bptr[1]<0 ) continue;
+        if ( aptr[0]+aptr[1] < args->min_dp ) continue;
+        if ( bptr[0]+bptr[1] < args->min_dp ) continue;
+        if ( aptr[1] < args->min_alt_dp && bptr[1] < args->min_alt_dp ) continue;
 
-        args.ncmp++;
+        wrk->ncmp++;
 
         int n11 = aptr[0], n12 = aptr[1];
         int n21 = bptr[0], n22 = bptr[1];
-        double left, right, fisher;
-        kt_fisher_exact(n11,n12,n21,n22, &left,&right,&fisher);
-        if ( fisher >= args.th ) continue;
+        double fisher = get_fisher(wrk, n11,n12,n21,n22);
+        if ( fisher >= args->th ) continue;
 
-        printf("FT\t%s\t%s\t%s\t%d\t%d\t%d\t%d\t%d\t%e",
+        ksprintf(txt, "FT\t%s\t%s\t%s\t%d\t%d\t%d\t%d\t%d\t%e",
             pair->smpl_name,pair->ctrl_name,
-            bcf_hdr_id2name(args.hdr,rec->rid), rec->pos+1,
+            bcf_hdr_id2name(args->hdr,rec->rid), rec->pos+1,
             n11,n12,n21,n22, fisher
             );
-        if ( args.convert ) printf("\t%s", args.str.s);
-        printf("\n");
+        if ( wrk->convert ) ksprintf(txt, "\t%s", wrk->str.s);
+        kputc('\n', txt);
+    }
+}
+
+int process_batch_txt(void *ctx, bcf1_t **recs, int nrecs, kstring_t *txt)
+{
+    args_t *args = (args_t*) ctx;
+    worker_t *wrk = get_worker(args);
+    int i;
+    for (i=0; i<nrecs; i++)
+    {
+        process_rec(args, wrk, recs[i], txt);
+        recs[i] = NULL;
     }
-    return NULL;
+    put_worker(args, wrk);
+    return 0;
 }
 
-void destroy(void)
+void destroy2(void *ctx)
 {
+    args_t *args = (args_t*) ctx;
+    uint64_t nsite = 0, ncmp = 0;
+    int i;
+    for (i=0; i<args->nall; i++)
+    {
+        worker_t *wrk = args->all[i];
+        nsite += wrk->nsite;
+        ncmp  += wrk->ncmp;
+        if ( wrk->convert ) convert_destroy(wrk->convert);
+        free(wrk->str.s);
+        lru_cache_destroy(wrk->cache);
+        free(wrk->ad);
+        free(wrk);
+    }
     printf("# SN, Summary Numbers\t[2]Number of Pairs\t[3]Number of Sites\t[4]Number of comparisons\t[5]P-value output threshold\n");
-    printf("SN\t%d\t%"PRId64"\t%"PRId64"\t%e\n",args.npair,args.nsite,args.ncmp,args.th);
-    if (args.convert) convert_destroy(args.convert);
-    free(args.str.s);
-    free(args.pair);
-    free(args.ad_arr);
+    printf("SN\t%d\t%"PRId64"\t%"PRId64"\t%e\n",args->npair,nsite,ncmp,args->th);
+    pthread_mutex_destroy(&args->lock);
+    free(args->all);
+    free(args->pair);
+    free(args);
 }
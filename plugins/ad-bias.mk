@@ -1,2 +1,2 @@
-plugins/ad-bias.so: plugins/ad-bias.c version.h version.c convert.h convert.c
+plugins/ad-bias.so: plugins/ad-bias.c version.h version.c convert.h convert.c lru_cache.h
 	$(CC) $(PLUGIN_FLAGS) $(CFLAGS) $(EXTRA_CPPFLAGS) $(CPPFLAGS) $(LDFLAGS) -o $@ convert.c version.c $< $(LIBS)
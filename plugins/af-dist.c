@@ -72,6 +72,8 @@ const char *usage(void)
         "   -p: 0,0.1,0.2,0.3,0.4,0.5,0.6,0.7,0.8,0.9,1\n"
         "Example:\n"
         "   bcftools +af-tag file.bcf -- -t EUR_AF -p bins.txt\n"
+        "\n"
+        "The outputs of runs on different regions can be combined with misc/merge-af-dist.pl\n"
         "\n";
 }
 
@@ -133,22 +135,72 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     return 1;
 }
 
-bcf1_t *process(bcf1_t *rec)
+#define BRANCH(type_t) \
+{ \
+    if ( fmt->n==2 ) \
+    { \
+        /* branch-free diploid case: GT values are bigger than 1 unless missing or vector_end */ \
+        for (i=0; i<nsmpl; i++) \
+        { \
+            type_t *p = (type_t*) (fmt->p + i*fmt->size); \
+            int valid  = (p[0]>1) & (p[1]>1); \
+            int dosage = ((p[0]>>1)==2) + ((p[1]>>1)==2); \
+            nvalid += valid; \
+            alt += valid * dosage; \
+            nhet += valid & (dosage==1); \
+            nhom += valid & (dosage==2); \
+        } \
+    } \
+    else \
+    { \
+        for (i=0; i<nsmpl; i++) \
+        { \
+            type_t *p = (type_t*) (fmt->p + i*fmt->size); \
+            int dosage = 0; \
+            for (j=0; j<fmt->n; j++) \
+            { \
+                if ( p[j]<=1 ) break; \
+                if ( (p[j]>>1)==2 ) dosage++; \
+            } \
+            if ( j!=fmt->n ) continue; \
+            nvalid++; \
+            alt  += dosage; \
+            nhet += dosage==1; \
+            nhom += dosage==2; \
+        } \
+    } \
+}
+
+// Count the alternate dosage of samples with complete genotypes directly from the typed
+// GT buffer and update the probability histogram once per site
+static void count_dosage(bcf1_t *rec, int iRA, int iAA, int *nals, int *nalt)
 {
-    int naf = bcf_get_info_float(args->hdr,rec,args->af_tag,&args->af,&args->naf);
-    if ( naf<=0 ) return NULL;
-    float af = args->af[0];
+    bcf_fmt_t *fmt = bcf_get_fmt(args->hdr, rec, "GT");
+    if ( !fmt ) return;
 
-    float pRA = 2*af*(1-af);
-    float pAA = af*af;
-    int iRA = bin_get_idx(args->prob_bins,pRA);
-    int iAA = bin_get_idx(args->prob_bins,pAA);
+    int i, j, nsmpl = bcf_hdr_nsamples(args->hdr);
+    uint64_t nvalid = 0, alt = 0, nhet = 0, nhom = 0;
+    switch (fmt->type)
+    {
+        case BCF_BT_INT8:  BRANCH(int8_t); break;
+        case BCF_BT_INT16: BRANCH(int16_t); break;
+        case BCF_BT_INT32: BRANCH(int32_t); break;
+        default: error("Unexpected GT type: %d\n", fmt->type);
+    }
+    if ( nhet ) args->prob_dist[iRA] += nhet;
+    if ( nhom ) args->prob_dist[iAA] += nhom;
+    *nals = nvalid * fmt->n;
+    *nalt = alt;
+}
+#undef BRANCH
 
-    int list_RA = args->list_min==-1 || pRA < args->list_min || pRA > args->list_max ? 0 : 1;
-    int list_AA = args->list_min==-1 || pAA < args->list_min || pAA > args->list_max ? 0 : 1;
+// The slow path used with --list, prints the genotypes from the requested bin
+static void count_and_list(bcf1_t *rec, float pRA, float pAA, int list_RA, int list_AA, int iRA, int iAA, int *nals_ptr, int *nalt_ptr)
+{
     const char *chr = bcf_seqname(args->hdr,rec);
 
     int ngt = bcf_get_genotypes(args->hdr, rec, &args->gt, &args->ngt);
+    if ( ngt<=0 ) return;
     int i, j, nsmpl = bcf_hdr_nsamples(args->hdr);
     int nals = 0, nalt = 0;
     ngt /= nsmpl;
@@ -178,6 +230,29 @@ bcf1_t *process(bcf1_t *rec)
             if ( list_AA ) printf("GT\t%s\t%d\t%s\t2\t%f\n",chr,rec->pos+1,args->hdr->samples[i],pAA);
         }
     }
+    *nals_ptr = nals;
+    *nalt_ptr = nalt;
+}
+
+bcf1_t *process(bcf1_t *rec)
+{
+    int naf = bcf_get_info_float(args->hdr,rec,args->af_tag,&args->af,&args->naf);
+    if ( naf<=0 ) return NULL;
+    float af = args->af[0];
+
+    float pRA = 2*af*(1-af);
+    float pAA = af*af;
+    int iRA = bin_get_idx(args->prob_bins,pRA);
+    int iAA = bin_get_idx(args->prob_bins,pAA);
+
+    int list_RA = args->list_min==-1 || pRA < args->list_min || pRA > args->list_max ? 0 : 1;
+    int list_AA = args->list_min==-1 || pAA < args->list_min || pAA > args->list_max ? 0 : 1;
+
+    int nals = 0, nalt = 0;
+    if ( list_RA || list_AA )
+        count_and_list(rec, pRA, pAA, list_RA, list_AA, iRA, iAA, &nals, &nalt);
+    else
+        count_dosage(rec, iRA, iAA, &nals, &nalt);
 
     if ( nals && (nalt || af) )
     {
@@ -34,15 +34,16 @@
 #include <htslib/kseq.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "bcftools.h"
 
 typedef struct
 {
     int argc;
     char **argv, *fname, *region, **regs;
-    int region_is_file, nregs, regs_free;
+    int region_is_file, nregs, regs_free, nthreads;
     int *smpl, nsmpl, *nsites, min_sites, gt_id;
-    kstring_t tmps;
+    kstring_t tmps, *out;       // out: output buffer of the current region, used with --threads
     bcf1_t *rec;
     tbx_t *tbx;
     hts_idx_t *idx;
@@ -68,10 +69,11 @@ static const char *usage_text(void)
         "   -n, --n-markers <int>           minimum number of required markers [1]\n"
         "   -r, --regions <chr:beg-end>     restrict to comma-separated list of regions\n"
         "   -R, --regions-file <file>       restrict to regions listed in a file\n"
+        "       --threads <int>             process regions in parallel using <int> worker threads [0]\n"
         "\n";
 }
 
-static void init_data(args_t *args)
+static void open_reader(args_t *args)
 {
     args->fp = hts_open(args->fname,"r");
     if ( !args->fp ) error("Could not read %s\n", args->fname);
@@ -102,7 +104,22 @@ static void init_data(args_t *args)
         }
     }
     else if ( args->region ) error("Cannot use index with this file, please drop the -r/-R option\n");
-
+}
+static void close_reader(args_t *args)
+{
+    bcf_hdr_destroy(args->hdr);
+    bcf_destroy(args->rec);
+    free(args->tmps.s);
+    free(args->smpl);
+    free(args->nsites);
+    if ( args->itr ) hts_itr_destroy(args->itr);
+    if ( args->tbx ) tbx_destroy(args->tbx);
+    if ( args->idx ) hts_idx_destroy(args->idx);
+    hts_close(args->fp);
+}
+static void init_data(args_t *args)
+{
+    open_reader(args);
     if ( args->tbx || args->idx )
     {
         if ( args->region )
@@ -114,6 +131,7 @@ static void init_data(args_t *args)
         else
             args->regs = (char**) (args->tbx ? tbx_seqnames(args->tbx, &args->nregs) : bcf_index_seqnames(args->idx, args->hdr, &args->nregs));
     }
+    if ( args->nthreads > args->nregs ) args->nthreads = args->nregs;
 }
 static void destroy_data(args_t *args)
 {
@@ -121,22 +139,19 @@ static void destroy_data(args_t *args)
     if ( args->regs_free )
         for (i=0; i<args->nregs; i++) free(args->regs[i]);
     free(args->regs);
-    bcf_hdr_destroy(args->hdr);
-    bcf_destroy(args->rec);
-    free(args->tmps.s);
-    free(args->smpl);
-    free(args->nsites);
-    if ( args->itr ) hts_itr_destroy(args->itr);
-    if ( args->tbx ) tbx_destroy(args->tbx);
-    if ( args->idx ) hts_idx_destroy(args->idx);
-    hts_close(args->fp);
+    close_reader(args);
 }
 
 static void report(args_t *args, const char *reg)
 {
     int i;
     for (i=0; i<args->nsmpl; i++)
-        printf("%s\t%s\n", reg, args->hdr->samples[args->smpl[i]]);
+    {
+        if ( args->out )
+            ksprintf(args->out, "%s\t%s\n", reg, args->hdr->samples[args->smpl[i]]);
+        else
+            printf("%s\t%s\n", reg, args->hdr->samples[args->smpl[i]]);
+    }
     args->nsmpl = bcf_hdr_nsamples(args->hdr);
     for (i=0; i<args->nsmpl; i++) args->smpl[i] = i;
     memset(args->nsites, 0, sizeof(int)*args->nsmpl);
@@ -225,6 +240,62 @@ static void test_region(args_t *args, char *reg)
     args->itr = NULL;
 }
 
+typedef struct
+{
+    args_t *args;
+    pthread_mutex_t lock;
+    int ireg;               // the next region to process
+    kstring_t *out;         // per-region output buffers, out[nregs]
+}
+workers_t;
+
+// Each worker opens its own reader and index and takes the next unprocessed region.
+// The output is buffered per region so that it can be printed in the original order.
+static void *run_worker(void *arg)
+{
+    workers_t *wrk = (workers_t*) arg;
+    args_t args = *wrk->args;
+    memset(&args.tmps, 0, sizeof(args.tmps));
+    args.itr = NULL;
+    open_reader(&args);
+    while (1)
+    {
+        pthread_mutex_lock(&wrk->lock);
+        int ireg = wrk->ireg++;
+        pthread_mutex_unlock(&wrk->lock);
+        if ( ireg >= args.nregs ) break;
+        args.out = &wrk->out[ireg];
+        test_region(&args, args.regs[ireg]);
+    }
+    close_reader(&args);
+    return NULL;
+}
+
+static void run_threads(args_t *args)
+{
+    int i;
+    workers_t wrk;
+    wrk.args = args;
+    wrk.ireg = 0;
+    wrk.out  = (kstring_t*) calloc(args->nregs, sizeof(kstring_t));
+    pthread_mutex_init(&wrk.lock, NULL);
+
+    pthread_t *tid = (pthread_t*) malloc(sizeof(pthread_t)*args->nthreads);
+    for (i=0; i<args->nthreads; i++)
+        if ( pthread_create(&tid[i], NULL, run_worker, &wrk) ) error("Failed to create a thread\n");
+    for (i=0; i<args->nthreads; i++)
+        if ( pthread_join(tid[i], NULL) ) error("Failed to join a thread\n");
+    free(tid);
+    pthread_mutex_destroy(&wrk.lock);
+
+    for (i=0; i<args->nregs; i++)
+    {
+        if ( wrk.out[i].l ) fwrite(wrk.out[i].s, 1, wrk.out[i].l, stdout);
+        free(wrk.out[i].s);
+    }
+    free(wrk.out);
+}
+
 int run(int argc, char **argv)
 {
     args_t *args = (args_t*) calloc(1,sizeof(args_t));
@@ -235,6 +306,7 @@ int run(int argc, char **argv)
         {"n-markers",required_argument,NULL,'n'},
         {"regions",required_argument,NULL,'r'},
         {"regions-file",required_argument,NULL,'R'},
+        {"threads",required_argument,NULL,1},
         {NULL,0,NULL,0}
     };
     int c,i;
@@ -247,6 +319,10 @@ int run(int argc, char **argv)
                 args->min_sites = strtol(optarg,&tmp,10);
                 if ( *tmp ) error("Could not parse: -n %s\n", optarg);
                 break;
+            case  1 :
+                args->nthreads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->nthreads<0 ) error("Could not parse: --threads %s\n", optarg);
+                break;
             case 'R': args->region_is_file = 1; 
             case 'r': args->region = optarg; break; 
             case 'h':
@@ -263,8 +339,13 @@ int run(int argc, char **argv)
     else args->fname = argv[optind];
     init_data(args);
 
-    for (i=0; i<args->nregs; i++) test_region(args, args->regs[i]);
-    if ( !args->nregs ) test_region(args, NULL);
+    if ( args->nthreads > 1 )
+        run_threads(args);
+    else
+    {
+        for (i=0; i<args->nregs; i++) test_region(args, args->regs[i]);
+        if ( !args->nregs ) test_region(args, NULL);
+    }
 
     destroy_data(args);
     free(args);
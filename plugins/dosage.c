@@ -65,6 +65,15 @@ typedef int (*dosage_f) (bcf1_t *);
 dosage_f *handlers = NULL;
 int nhandlers = 0;
 
+// Lookup table for the conversion of integer PLs, computed at init
+#define PL2PROB_MAX 256
+float pl2prob[PL2PROB_MAX];
+
+static inline float pl_to_prob(int32_t pl)
+{
+    return pl>=0 && pl<PL2PROB_MAX ? pl2prob[pl] : exp(-0.1*pl);
+}
+
 
 int calc_dosage_PL(bcf1_t *rec)
 {
@@ -72,44 +81,48 @@ int calc_dosage_PL(bcf1_t *rec)
     if ( nret<0 ) return -1;
 
     nret /= rec->n_sample;
-    #define BRANCH(type_t,is_missing,is_vector_end) \
+    int nvals = nret < 3 ? nret : 3;     // only the first ALT allele is considered
+    #define BRANCH(type_t,is_missing,is_vector_end,to_prob) \
     { \
         type_t *ptr = (type_t*) buf; \
         for (i=0; i<rec->n_sample; i++) \
         { \
             float vals[3] = {0,0,0}; \
-            for (j=0; j<nret; j++) \
+            for (j=0; j<nvals; j++) \
             { \
                 if ( is_missing || is_vector_end ) break; \
-                vals[j] = exp(-0.1*ptr[j]); \
+                vals[j] = to_prob(ptr[j]); \
             } \
             float sum = vals[0] + vals[1] + vals[2]; \
             printf("\t%.1f", sum==0 ? -1 : (vals[1] + 2*vals[2]) / sum); \
             ptr += nret; \
         } \
     }
+    #define float_to_prob(x) exp(-0.1*(x))
     switch (pl_type)
     {
-        case BCF_HT_INT:  BRANCH(int32_t,ptr[j]==bcf_int32_missing,ptr[j]==bcf_int32_vector_end); break;
-        case BCF_HT_REAL: BRANCH(float,bcf_float_is_missing(ptr[j]),bcf_float_is_vector_end(ptr[j])); break;
+        case BCF_HT_INT:  BRANCH(int32_t,ptr[j]==bcf_int32_missing,ptr[j]==bcf_int32_vector_end,pl_to_prob); break;
+        case BCF_HT_REAL: BRANCH(float,bcf_float_is_missing(ptr[j]),bcf_float_is_vector_end(ptr[j]),float_to_prob); break;
     }
+    #undef float_to_prob
     #undef BRANCH
     return 0;
 }
 
 int calc_dosage_GL(bcf1_t *rec)
 {
-    int i, j, nret = bcf_get_format_values(in_hdr,rec,"GL",(void**)&buf,&nbuf,pl_type);
+    int i, j, nret = bcf_get_format_values(in_hdr,rec,"GL",(void**)&buf,&nbuf,gl_type);
     if ( nret<0 ) return -1;
 
     nret /= rec->n_sample;
+    int nvals = nret < 3 ? nret : 3;     // only the first ALT allele is considered
     #define BRANCH(type_t,is_missing,is_vector_end) \
     { \
         type_t *ptr = (type_t*) buf; \
         for (i=0; i<rec->n_sample; i++) \
         { \
             float vals[3] = {0,0,0}; \
-            for (j=0; j<nret; j++) \
+            for (j=0; j<nvals; j++) \
             { \
                 if ( is_missing || is_vector_end ) break; \
                 vals[j] = exp(ptr[j]); \
@@ -119,7 +132,7 @@ int calc_dosage_GL(bcf1_t *rec)
             ptr  += nret; \
         } \
     }
-    switch (pl_type)
+    switch (gl_type)
     {
         case BCF_HT_INT:  BRANCH(int32_t,ptr[j]==bcf_int32_missing,ptr[j]==bcf_int32_vector_end); break;
         case BCF_HT_REAL: BRANCH(float,bcf_float_is_missing(ptr[j]),bcf_float_is_vector_end(ptr[j])); break;
@@ -191,6 +204,8 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     }
     tags = split_list(tags_str, &ntags);
 
+    for (i=0; i<PL2PROB_MAX; i++) pl2prob[i] = exp(-0.1*i);
+
     in_hdr = in;
     for (i=0; i<ntags; i++)
     {
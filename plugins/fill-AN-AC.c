@@ -27,41 +27,61 @@ DEALINGS IN THE SOFTWARE.  */
 #include <htslib/hts.h>
 #include <htslib/vcf.h>
 #include <htslib/vcfutils.h>
+#include "bcftools.h"
 
-bcf_hdr_t *in_hdr, *out_hdr;
-int *arr = NULL, marr = 0;
+// Uses the v2 plugin API: no global state, the scratch array is local to
+// each call of process_batch() so that blocks can be processed in parallel
+typedef struct
+{
+    bcf_hdr_t *in_hdr, *out_hdr;
+}
+args_t;
 
 const char *about(void)
 {
     return "Fill INFO fields AN and AC.\n";
 }
 
-int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
+int flags(void)
 {
-    in_hdr  = in;
-    out_hdr = out;
-    bcf_hdr_append(out_hdr, "##INFO=<ID=AC,Number=A,Type=Integer,Description=\"Allele count in genotypes\">");
-    bcf_hdr_append(out_hdr, "##INFO=<ID=AN,Number=1,Type=Integer,Description=\"Total number of alleles in called genotypes\">");
-    return 0;
+    return PLUGIN_THREAD_SAFE;
 }
 
-bcf1_t *process(bcf1_t *rec)
+void *init2(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out, int *ret)
 {
-    hts_expand(int,rec->n_allele,marr,arr);
-    int ret = bcf_calc_ac(in_hdr,rec,arr,BCF_UN_FMT);
-    if ( ret>0 )
+    args_t *args = (args_t*) calloc(1,sizeof(args_t));
+    args->in_hdr  = in;
+    args->out_hdr = out;
+    bcf_hdr_append(args->out_hdr, "##INFO=<ID=AC,Number=A,Type=Integer,Description=\"Allele count in genotypes\">");
+    bcf_hdr_append(args->out_hdr, "##INFO=<ID=AN,Number=1,Type=Integer,Description=\"Total number of alleles in called genotypes\">");
+    *ret = 0;
+    return args;
+}
+
+int process_batch(void *ctx, bcf1_t **recs, int nrecs)
+{
+    args_t *args = (args_t*) ctx;
+    int *arr = NULL, marr = 0, irec;
+    for (irec=0; irec<nrecs; irec++)
     {
-        int i, an = 0;
-        for (i=0; i<rec->n_allele; i++) an += arr[i];
-        bcf_update_info_int32(out_hdr, rec, "AN", &an, 1);
-        bcf_update_info_int32(out_hdr, rec, "AC", arr+1, rec->n_allele-1);
+        bcf1_t *rec = recs[irec];
+        hts_expand(int,rec->n_allele,marr,arr);
+        int ret = bcf_calc_ac(args->in_hdr,rec,arr,BCF_UN_FMT);
+        if ( ret>0 )
+        {
+            int i, an = 0;
+            for (i=0; i<rec->n_allele; i++) an += arr[i];
+            bcf_update_info_int32(args->out_hdr, rec, "AN", &an, 1);
+            bcf_update_info_int32(args->out_hdr, rec, "AC", arr+1, rec->n_allele-1);
+        }
     }
-    return rec;
+    free(arr);
+    return 0;
 }
 
-void destroy(void)
+void destroy2(void *ctx)
 {
-    free(arr);
+    free(ctx);
 }
 
 
@@ -34,6 +34,7 @@
 #include <htslib/vcf.h>
 #include <htslib/khash_str2int.h>
 #include "bcftools.h"
+#include "lru_cache.h"
 
 #define SET_AN      (1<<0)
 #define SET_AC      (1<<1)
@@ -58,24 +59,47 @@ typedef struct
     counts_t *counts;
     char *name, *suffix;
     int nsmpl, *smpl;
+    uint64_t *bits;     // the samples as a bitset
 }
 pop_t;
 
+// Genotype classes
+#define GT_HET  0
+#define GT_HOM  1
+#define GT_HEMI 2
+#define GT_HALF 3
+
+// Samples with the same genotype class and the same alleles. The per-sample
+// pass only classifies the genotypes, the classes are then added to the
+// populations by intersecting the bitsets
+typedef struct
+{
+    int als, type, n;   // bitmask of alleles, one of GT_*, number of samples
+    int wmin, wmax;     // range of non-zero words in bits
+    uint64_t *bits;     // the samples, used only with multiple populations
+}
+gtcls_t;
+
+// Memoized HWE p-values, the (nref,nalt,nhet) triples repeat often
+#define HWE_CACHE_NSETS 1024
+#define HWE_CACHE_NWAYS 4
+
 typedef struct
 {
     bcf_hdr_t *in_hdr, *out_hdr;
     int npop, tags, drop_missing, gt_id;
-    pop_t *pop, **smpl2pop;
+    pop_t *pop;
+    gtcls_t *cls;
+    int ncls, mcls, nwords;
     float *farr;
     int32_t *iarr, niarr, miarr, nfarr, mfarr;
     double *hwe_probs;
     int mhwe_probs;
+    lru_cache_t *hwe_cache;
     kstring_t str;
 }
 args_t;
 
-static args_t *args;
-
 const char *about(void)
 {
     return "Set INFO tags AF, AC, AC_Hemi, AC_Hom, AC_Het, AN, HWE, MAF, NS.\n";
@@ -192,20 +216,15 @@ void init_pops(args_t *args)
     args->pop[args->npop-1].name   = strdup("");
     args->pop[args->npop-1].suffix = strdup("");
 
+    // the population "ALL" is counted directly, the others by intersecting bitsets
     nsmpl = bcf_hdr_nsamples(args->in_hdr);
-    args->smpl2pop = (pop_t**) calloc(nsmpl*(args->npop+1),sizeof(pop_t*));
-    for (i=0; i<nsmpl; i++)
-        args->smpl2pop[i*(args->npop+1)] = &args->pop[args->npop-1];
-
-    for (i=0; i<args->npop; i++)
+    args->nwords = (nsmpl + 63) / 64;
+    for (i=0; i<args->npop-1; i++)
     {
-        for (j=0; j<args->pop[i].nsmpl; j++)
-        {
-            int ismpl = args->pop[i].smpl[j];
-            pop_t **smpl2pop = &args->smpl2pop[ismpl*(args->npop+1)];
-            while (*smpl2pop) smpl2pop++;
-            *smpl2pop = &args->pop[i];
-        }
+        pop_t *pop = &args->pop[i];
+        pop->bits = (uint64_t*) calloc(args->nwords,sizeof(uint64_t));
+        for (j=0; j<pop->nsmpl; j++)
+            pop->bits[pop->smpl[j]/64] |= (uint64_t)1 << (pop->smpl[j] % 64);
     }
 }
 
@@ -242,9 +261,9 @@ void hdr_append(args_t *args, char *fmt)
         bcf_hdr_printf(args->out_hdr, fmt, args->pop[i].suffix,*args->pop[i].name ? " in " : "",args->pop[i].name);
 }
 
-int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
+void *init2(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out, int *ret)
 {
-    args = (args_t*) calloc(1,sizeof(args_t));
+    args_t *args = (args_t*) calloc(1,sizeof(args_t));
     args->in_hdr  = in;
     args->out_hdr = out;
     char *samples_fname = NULL;
@@ -290,7 +309,8 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     if ( args->tags & SET_MAF ) hdr_append(args, "##INFO=<ID=MAF%s,Number=A,Type=Float,Description=\"Minor Allele frequency%s%s\">");
     if ( args->tags & SET_HWE ) hdr_append(args, "##INFO=<ID=HWE%s,Number=A,Type=Float,Description=\"HWE test%s%s (PMID:15789306)\">");
 
-    return 0;
+    *ret = 0;
+    return args;
 }
 
 /* 
@@ -362,21 +382,82 @@ float calc_hwe(args_t *args, int nref, int nalt, int nhet)
     return p_rank > 1 ? 1.0 : p_rank;
 }
 
-static inline void set_counts(pop_t *pop, int is_half, int is_hom, int is_hemi, int als)
+static float get_hwe(args_t *args, int nref, int nalt, int nhet)
+{
+    if ( !args->hwe_cache ) args->hwe_cache = lru_cache_init(HWE_CACHE_NSETS, HWE_CACHE_NWAYS);
+
+    int hit;
+    lru_entry_t *entry = lru_cache_get(args->hwe_cache, nref,nalt,nhet,0, &hit);
+    if ( !hit ) entry->val = (float) calc_hwe(args, nref, nalt, nhet);
+    return entry->val;
+}
+
+static inline void set_counts(pop_t *pop, int type, int als, int n)
 {
     int ial;
     for (ial=0; als; ial++)
     {
         if ( als&1 )
         { 
-            if ( is_half ) pop->counts[ial].nac++;
-            else if ( !is_hom ) pop->counts[ial].nhet++;
-            else if ( !is_hemi ) pop->counts[ial].nhom += 2;
-            else pop->counts[ial].nhemi++;
+            if ( type==GT_HALF ) pop->counts[ial].nac += n;
+            else if ( type==GT_HET ) pop->counts[ial].nhet += n;
+            else if ( type==GT_HOM ) pop->counts[ial].nhom += 2*n;
+            else pop->counts[ial].nhemi += n;
         }
         als >>= 1;
     }
-    pop->ns++;
+    pop->ns += n;
+}
+
+static inline gtcls_t *get_cls(args_t *args, int als, int type)
+{
+    int i;
+    for (i=0; i<args->ncls; i++)
+        if ( args->cls[i].als==als && args->cls[i].type==type ) return &args->cls[i];
+
+    hts_expand0(gtcls_t, args->ncls+1, args->mcls, args->cls);
+    gtcls_t *cls = &args->cls[args->ncls++];
+    cls->als  = als;
+    cls->type = type;
+    cls->n    = 0;
+    if ( args->npop > 1 )
+    {
+        if ( !cls->bits ) cls->bits = (uint64_t*) malloc(sizeof(uint64_t)*args->nwords);
+        memset(cls->bits, 0, sizeof(uint64_t)*args->nwords);
+        cls->wmin = args->nwords;
+        cls->wmax = -1;
+    }
+    return cls;
+}
+
+static inline void add_sample(args_t *args, gtcls_t *cls, int ismpl)
+{
+    cls->n++;
+    if ( args->npop > 1 )
+    {
+        int iword = ismpl / 64;
+        cls->bits[iword] |= (uint64_t)1 << (ismpl % 64);
+        if ( cls->wmin > iword ) cls->wmin = iword;
+        if ( cls->wmax < iword ) cls->wmax = iword;
+    }
+}
+
+// Add the genotype classes to the populations
+static void count_pops(args_t *args)
+{
+    int i, j, k;
+    for (k=0; k<args->ncls; k++)
+    {
+        gtcls_t *cls = &args->cls[k];
+        set_counts(&args->pop[args->npop-1], cls->type, cls->als, cls->n);
+        for (i=0; i<args->npop-1; i++)
+        {
+            pop_t *pop = &args->pop[i];
+            int n = 0;
+            for (j=cls->wmin; j<=cls->wmax; j++) n += popcount64(pop->bits[j] & cls->bits[j]);
+            if ( n ) set_counts(pop, cls->type, cls->als, n);
+        }
+    }
 }
 static void clean_counts(pop_t *pop, int nals)
 {
@@ -384,15 +465,15 @@ static void clean_counts(pop_t *pop, int nals)
     memset(pop->counts,0,sizeof(counts_t)*nals);
 }
 
-bcf1_t *process(bcf1_t *rec)
+static void process_rec(args_t *args, bcf1_t *rec)
 {
-    int i,j, nsmpl = bcf_hdr_nsamples(args->in_hdr);;
+    int i,j, nsmpl = bcf_hdr_nsamples(args->in_hdr);
 
     bcf_unpack(rec, BCF_UN_FMT);
     bcf_fmt_t *fmt_gt = NULL;
     for (i=0; i<rec->n_fmt; i++)
         if ( rec->d.fmt[i].id==args->gt_id ) { fmt_gt = &rec->d.fmt[i]; break; }
-    if ( !fmt_gt ) return rec;    // no GT tag
+    if ( !fmt_gt ) return;    // no GT tag
 
     hts_expand(int32_t,rec->n_allele, args->miarr, args->iarr);
     hts_expand(float,rec->n_allele, args->mfarr, args->farr);
@@ -404,12 +485,17 @@ bcf1_t *process(bcf1_t *rec)
 
     assert( rec->n_allele < 8*sizeof(int) );
 
+    // Classify the genotypes. The same class is usually shared by consecutive
+    // samples, so the last one is tried first
+    args->ncls = 0;
     #define BRANCH_INT(type_t,vector_end) \
     { \
+        int last_als = -1, last_type = -1; \
+        gtcls_t *last = NULL; \
         for (i=0; i<nsmpl; i++) \
         { \
             type_t *p = (type_t*) (fmt_gt->p + i*fmt_gt->size); \
-            int ial, als = 0, nals = 0, is_half, is_hom, is_hemi; \
+            int ial, als = 0, nals = 0, type; \
             for (ial=0; ial<fmt_gt->n; ial++) \
             { \
                 if ( p[ial]==vector_end ) break; /* smaller ploidy */ \
@@ -422,16 +508,16 @@ bcf1_t *process(bcf1_t *rec)
                 als |= (1<<idx);  /* this breaks with too many alleles */ \
             } \
             if ( nals==0 ) continue; /* missing genotype */ \
-            is_hom = als && !(als & (als-1)); /* only one bit is set */ \
-            if ( nals!=ial ) \
+            if ( nals!=ial && args->drop_missing ) type = GT_HALF; \
+            else if ( als & (als-1) ) type = GT_HET; /* more than one bit is set */ \
+            else if ( nals!=ial || nals==1 ) type = GT_HEMI; \
+            else type = GT_HOM; \
+            if ( als!=last_als || type!=last_type ) \
             { \
-                if ( args->drop_missing ) is_hemi = 0, is_half = 1; \
-                else is_hemi = 1, is_half = 0; \
+                last = get_cls(args, als, type); \
+                last_als = als, last_type = type; \
             } \
-            else if ( nals==1 ) is_hemi = 1, is_half = 0; \
-            else is_hemi = 0, is_half = 0; \
-            pop_t **pop = &args->smpl2pop[i*(args->npop+1)]; \
-            while ( *pop ) { set_counts(*pop,is_half,is_hom,is_hemi,als); pop++; }\
+            add_sample(args, last, i); \
         } \
     }
     switch (fmt_gt->type) {
@@ -441,6 +527,7 @@ bcf1_t *process(bcf1_t *rec)
         default: error("The GT type is not recognised: %d at %s:%d\n",fmt_gt->type, bcf_seqname(args->in_hdr,rec),rec->pos+1); break;
     }
     #undef BRANCH_INT
+    count_pops(args);
 
     if ( args->tags & SET_NS )
     {
@@ -585,7 +672,7 @@ bcf1_t *process(bcf1_t *rec)
                     int nref = nref_tot - pop->counts[j].nhet;
                     int nalt = pop->counts[j].nhet + pop->counts[j].nhom;
                     int nhet = pop->counts[j].nhet;
-                    args->farr[j-1] = (nref>0 && nalt>0) ? calc_hwe(args, nref, nalt, nhet) : 1;
+                    args->farr[j-1] = (nref>0 && nalt>0) ? get_hwe(args, nref, nalt, nhet) : 1;
                 }
             }
             args->str.l = 0;
@@ -594,12 +681,21 @@ bcf1_t *process(bcf1_t *rec)
                 error("Error occurred while updating %s at %s:%d\n", args->str.s,bcf_seqname(args->in_hdr,rec),rec->pos+1);
         }
     }
+}
 
-    return rec;
+// The counts, genotype classes and the HWE cache are reused from record to
+// record, the plugin is therefore not thread-safe
+int process_batch(void *ctx, bcf1_t **recs, int nrecs)
+{
+    args_t *args = (args_t*) ctx;
+    int i;
+    for (i=0; i<nrecs; i++) process_rec(args, recs[i]);
+    return 0;
 }
 
-void destroy(void)
+void destroy2(void *ctx)
 {
+    args_t *args = (args_t*) ctx;
     int i; 
     for (i=0; i<args->npop; i++)
     {
@@ -607,10 +703,13 @@ void destroy(void)
         free(args->pop[i].suffix);
         free(args->pop[i].smpl);
         free(args->pop[i].counts);
+        free(args->pop[i].bits);
     }
+    for (i=0; i<args->mcls; i++) free(args->cls[i].bits);
+    free(args->cls);
+    lru_cache_destroy(args->hwe_cache);
     free(args->str.s);
     free(args->pop);
-    free(args->smpl2pop);
     free(args->iarr);
     free(args->farr);
     free(args->hwe_probs);
@@ -76,6 +76,11 @@
 #include <strings.h>
 #include <getopt.h>
 #include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <htslib/hts.h>
 #include <htslib/vcf.h>
 #include <htslib/kstring.h>
@@ -83,6 +88,7 @@
 #include <htslib/kfunc.h>
 #include <htslib/faidx.h>
 #include <htslib/khash.h>
+#include <htslib/khash_str2int.h>
 #include <htslib/synced_bcf_reader.h>
 #include "bcftools.h"
 
@@ -101,14 +107,63 @@ marker_t;
 KHASH_MAP_INIT_INT(i2m, marker_t)
 typedef khash_t(i2m) i2m_t;
 
+/*
+    The rsID database created with --build-db. The file is memory-mapped and
+    used as is, the markers of each chromosome are sorted by rsID and looked
+    up by binary search. All numbers are in native byte order:
+
+        char     magic[8]           "FIXREFDB"
+        uint32_t version, nchr
+        nchr x:
+            uint64_t offset         of the marker arrays from the file start
+            uint32_t n              number of markers
+            uint32_t len            length of the chromosome name, including the NUL byte
+            char     name[len]      padded to a multiple of 8 bytes
+        nchr x, at the given offsets:
+            uint32_t id[n], pos[n]
+            uint8_t  als[n]         ref<<4 | alt, padded to a multiple of 8 bytes
+*/
+#define DB_MAGIC    "FIXREFDB"
+#define DB_VERSION  1
+#define DB_PAD8(x)  (((x) + 7) & ~(uint64_t)7)
+
 typedef struct
 {
-    char *dbsnp_fname;
+    char *name;
+    uint32_t n;
+    const uint32_t *id, *pos;
+    const uint8_t *als;
+}
+db_chr_t;
+
+typedef struct
+{
+    uint32_t id, pos, idx;
+    uint8_t als;
+}
+db_marker_t;
+
+typedef struct
+{
+    db_marker_t *dat;
+    int n, m;
+}
+db_build_t;
+
+typedef struct
+{
+    char *dbsnp_fname, *db_fname;
     int mode, discard;
     bcf_hdr_t *hdr;
     faidx_t *fai;
     int rid, skip_rid;
     i2m_t *i2m;
+    void *db_map, *db_chr2i;    // the memory-mapped rsID database
+    size_t db_size;
+    db_chr_t *db_chr, *db_cur;
+    int ndb_chr;
+    db_build_t *db_build;       // --build-db, the markers indexed by rid
+    int ndb_build;
     int32_t *gts, ngts, pos;
     uint32_t nsite,nok,nflip,nunresolved,nswap,nflip_swap,nonSNP,nonACGT,nonbiallelic;
     uint32_t count[4][4], npos_err, unsorted;
@@ -143,9 +198,11 @@ const char *usage(void)
         "   run \"bcftools plugin\" for a list of common options\n"
         "\n"
         "Plugin options:\n"
+        "   -b, --build-db <file.db>    Create a binary rsID database from the input dbSNP VCF for use with -i\n"
         "   -d, --discard               Discard sites which could not be resolved\n"
         "   -f, --fasta-ref <file.fa>   Reference sequence\n"
-        "   -i, --use-id <file.vcf>     Swap REF/ALT using the ID column to determine the REF allele, implies -m id.\n"
+        "   -i, --use-id <file>         Swap REF/ALT using the ID column to determine the REF allele, implies -m id.\n"
+        "                               The file is a dbSNP VCF or a database created with --build-db.\n"
         "                               Download the dbSNP file from\n"
         "                                   https://www.ncbi.nlm.nih.gov/variation/docs/human_variation_vcf\n"
         "   -m, --mode <string>         Collect stats (\"stats\") or convert (\"flip\", \"id\", \"top\") [stats]\n"
@@ -160,11 +217,144 @@ const char *usage(void)
         "   # match the REF/ALT alleles based on the ID column, discard unknown sites\n"
         "   bcftools +fixref file.bcf -Ob -o out.bcf -- -d -f ref.fa -i All_20151104.vcf.gz\n"
         "\n"
+        "   # the same using a database which is much faster to load, create it once with\n"
+        "   bcftools +fixref All_20151104.vcf.gz -- --build-db All_20151104.db\n"
+        "   bcftools +fixref file.bcf -Ob -o out.bcf -- -d -f ref.fa -i All_20151104.db\n"
+        "\n"
         "   # assuming the reference build is correct, just flip to fwd, discarding the rest\n"
         "   bcftools +fixref file.bcf -Ob -o out.bcf -- -d -f ref.fa -m flip\n"
         "\n";
 }
 
+// Memory-map the database if -i is not a VCF
+static void db_open(args_t *args)
+{
+    if ( !args->dbsnp_fname ) error("Expected the -i option with -m id\n");
+    char magic[8];
+    int fd = open(args->dbsnp_fname, O_RDONLY);
+    if ( fd<0 ) error("Failed to open %s: %s\n", args->dbsnp_fname, strerror(errno));
+    if ( read(fd, magic, 8)!=8 || memcmp(magic, DB_MAGIC, 8) ) { close(fd); return; }
+
+    struct stat st;
+    if ( fstat(fd, &st)!=0 ) error("Failed to stat %s: %s\n", args->dbsnp_fname, strerror(errno));
+    args->db_size = st.st_size;
+    args->db_map  = mmap(NULL, args->db_size, PROT_READ, MAP_SHARED, fd, 0);
+    if ( args->db_map==MAP_FAILED ) error("Failed to mmap %s: %s\n", args->dbsnp_fname, strerror(errno));
+    close(fd);
+
+    const uint8_t *beg = (const uint8_t*) args->db_map, *ptr = beg + 8, *end = beg + args->db_size;
+    uint32_t version, nchr, i;
+    if ( end - ptr < 8 ) error("Truncated database: %s\n", args->dbsnp_fname);
+    memcpy(&version, ptr, 4);
+    memcpy(&nchr, ptr + 4, 4);
+    ptr += 8;
+    if ( version!=DB_VERSION ) error("Unsupported database version or byte order: %s\n", args->dbsnp_fname);
+
+    args->db_chr   = (db_chr_t*) calloc(nchr, sizeof(db_chr_t));
+    args->ndb_chr  = nchr;
+    args->db_chr2i = khash_str2int_init();
+    for (i=0; i<nchr; i++)
+    {
+        uint64_t off;
+        uint32_t len;
+        db_chr_t *chr = &args->db_chr[i];
+        if ( end - ptr < 16 ) error("Truncated database: %s\n", args->dbsnp_fname);
+        memcpy(&off, ptr, 8);
+        memcpy(&chr->n, ptr + 8, 4);
+        memcpy(&len, ptr + 12, 4);
+        ptr += 16;
+        if ( (uint64_t)(end - ptr) < DB_PAD8(len) || !len || ptr[len-1] ) error("Truncated database: %s\n", args->dbsnp_fname);
+        chr->name = (char*) ptr;
+        ptr += DB_PAD8(len);
+        if ( off & 7 || off + (uint64_t)chr->n*9 > args->db_size ) error("Truncated database: %s\n", args->dbsnp_fname);
+        chr->id  = (const uint32_t*) (beg + off);
+        chr->pos = chr->id + chr->n;
+        chr->als = (const uint8_t*) (chr->pos + chr->n);
+        khash_str2int_set(args->db_chr2i, chr->name, i);
+    }
+}
+
+static void db_close(args_t *args)
+{
+    if ( !args->db_map ) return;
+    khash_str2int_destroy(args->db_chr2i);
+    free(args->db_chr);
+    munmap(args->db_map, args->db_size);
+}
+
+static int cmp_db_marker(const void *aptr, const void *bptr)
+{
+    const db_marker_t *a = (const db_marker_t*) aptr;
+    const db_marker_t *b = (const db_marker_t*) bptr;
+    if ( a->id < b->id ) return -1;
+    if ( a->id > b->id ) return 1;
+    if ( a->idx < b->idx ) return -1;
+    if ( a->idx > b->idx ) return 1;
+    return 0;
+}
+
+static void db_write(args_t *args)
+{
+    int i, j, nchr = 0;
+    uint64_t off = 16;
+    for (i=0; i<args->ndb_build; i++)
+    {
+        db_build_t *build = &args->db_build[i];
+        if ( !build->n ) continue;
+        nchr++;
+        off += 16 + DB_PAD8(strlen(bcf_hdr_id2name(args->hdr,i)) + 1);
+
+        // sort by rsID, duplicate IDs are ambiguous and only the first is kept
+        qsort(build->dat, build->n, sizeof(*build->dat), cmp_db_marker);
+        int n = 0;
+        for (j=0; j<build->n; j++)
+            if ( !n || build->dat[j].id!=build->dat[n-1].id ) build->dat[n++] = build->dat[j];
+        build->n = n;
+    }
+
+    FILE *fp = fopen(args->db_fname, "wb");
+    if ( !fp ) error("Failed to open %s: %s\n", args->db_fname, strerror(errno));
+    uint32_t version = DB_VERSION, n32 = nchr;
+    static const char pad[8] = {0,0,0,0,0,0,0,0};
+    int ret = 0;
+    ret |= fwrite(DB_MAGIC, 8, 1, fp) != 1;
+    ret |= fwrite(&version, 4, 1, fp) != 1;
+    ret |= fwrite(&n32, 4, 1, fp) != 1;
+    for (i=0; i<args->ndb_build; i++)
+    {
+        db_build_t *build = &args->db_build[i];
+        if ( !build->n ) continue;
+        const char *name = bcf_hdr_id2name(args->hdr,i);
+        uint32_t n = build->n, len = strlen(name) + 1;
+        ret |= fwrite(&off, 8, 1, fp) != 1;
+        ret |= fwrite(&n, 4, 1, fp) != 1;
+        ret |= fwrite(&len, 4, 1, fp) != 1;
+        ret |= fwrite(name, len, 1, fp) != 1;
+        if ( DB_PAD8(len) > len ) ret |= fwrite(pad, DB_PAD8(len) - len, 1, fp) != 1;
+        off += DB_PAD8((uint64_t)n*9);
+    }
+    for (i=0; i<args->ndb_build; i++)
+    {
+        db_build_t *build = &args->db_build[i];
+        if ( !build->n ) continue;
+        for (j=0; j<build->n; j++) ret |= fwrite(&build->dat[j].id, 4, 1, fp) != 1;
+        for (j=0; j<build->n; j++) ret |= fwrite(&build->dat[j].pos, 4, 1, fp) != 1;
+        for (j=0; j<build->n; j++) ret |= fwrite(&build->dat[j].als, 1, 1, fp) != 1;
+        uint64_t len = (uint64_t)build->n*9;
+        if ( DB_PAD8(len) > len ) ret |= fwrite(pad, DB_PAD8(len) - len, 1, fp) != 1;
+    }
+    if ( ret || fclose(fp)!=0 ) error("Failed to write %s: %s\n", args->db_fname, strerror(errno));
+
+    int nmarkers = 0;
+    for (i=0; i<args->ndb_build; i++)
+    {
+        nmarkers += args->db_build[i].n;
+        free(args->db_build[i].dat);
+    }
+    free(args->db_build);
+    fprintf(stderr,"Wrote %d markers on %d chromosomes to %s\n", nmarkers, nchr, args->db_fname);
+}
+
 int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
 {
     memset(&args,0,sizeof(args_t));
@@ -178,10 +368,11 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
         {"discard",no_argument,NULL,'d'},
         {"fasta-ref",required_argument,NULL,'f'},
         {"use-id",required_argument,NULL,'i'},
+        {"build-db",required_argument,NULL,'b'},
         {NULL,0,NULL,0}
     };
     int c;
-    while ((c = getopt_long(argc, argv, "?hf:m:di:",loptions,NULL)) >= 0)
+    while ((c = getopt_long(argc, argv, "?hf:m:di:b:",loptions,NULL)) >= 0)
     {
         switch (c) 
         {
@@ -195,15 +386,22 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
             case 'i': args.dbsnp_fname = optarg; args.mode = MODE_USE_ID; break;
             case 'd': args.discard = 1; break;
             case 'f': ref_fname = optarg; break;
+            case 'b': args.db_fname = optarg; break;
             case 'h':
             case '?':
             default: error("%s", usage()); break;
         }
     }
+    if ( args.db_fname ) return 1;  // the input is dbSNP, no VCF output
     if ( !ref_fname ) error("Expected the -f option\n");
     args.fai = fai_load(ref_fname);
     if ( !args.fai ) error("Failed to load the fai index: %s\n", ref_fname);
 
+    if ( args.mode==MODE_USE_ID )
+    {
+        args.rid = -1;
+        db_open(&args);
+    }
     if ( args.mode==MODE_STATS ) return 1;
     return 0;
 }
@@ -282,8 +480,50 @@ static int fetch_ref(args_t *args, bcf1_t *rec)
     return ir;
 }
 
+// The biallelic SNPs with an rsID, the rest is ignored
+static int dbsnp_parse(bcf1_t *rec, uint32_t *id, int *ref, int *alt)
+{
+    if ( rec->n_allele!=2 ) return -1;      // skip multiallelic markers
+    if ( rec->d.allele[0][1]!=0 || rec->d.allele[1][1]!=0 ) return -1;   // skip non-snps
+
+    *ref = nt2int(rec->d.allele[0][0]);
+    *alt = nt2int(rec->d.allele[1][0]);
+    if ( *ref<0 || *alt<0 ) return -1;      // non-[ACGT] base
+
+    *id = parse_rsid(rec->d.id);
+    return *id ? 0 : -1;
+}
+
+static void db_add(args_t *args, bcf1_t *rec)
+{
+    uint32_t id;
+    int ref, alt;
+    bcf_unpack(rec, BCF_UN_STR);
+    if ( dbsnp_parse(rec, &id, &ref, &alt)<0 ) return;
+
+    if ( rec->rid >= args->ndb_build )
+    {
+        args->db_build = (db_build_t*) realloc(args->db_build, sizeof(db_build_t)*(rec->rid+1));
+        memset(args->db_build + args->ndb_build, 0, sizeof(db_build_t)*(rec->rid+1-args->ndb_build));
+        args->ndb_build = rec->rid + 1;
+    }
+    db_build_t *build = &args->db_build[rec->rid];
+    hts_expand(db_marker_t, build->n+1, build->m, build->dat);
+    db_marker_t *marker = &build->dat[build->n];
+    marker->id  = id;
+    marker->pos = rec->pos;
+    marker->idx = build->n++;
+    marker->als = ref<<4 | alt;
+}
+
 static void dbsnp_init(args_t *args, const char *chr)
 {
+    if ( args->db_map )
+    {
+        int i;
+        args->db_cur = khash_str2int_get(args->db_chr2i, chr, &i)==0 ? &args->db_chr[i] : NULL;
+        return;
+    }
     if ( args->i2m ) kh_destroy(i2m, args->i2m);
     args->i2m = kh_init(i2m);
     bcf_srs_t *sr = bcf_sr_init();
@@ -292,15 +532,9 @@ static void dbsnp_init(args_t *args, const char *chr)
     while ( bcf_sr_next_line(sr) )
     {
         bcf1_t *rec = bcf_sr_get_line(sr, 0);
-        if ( rec->n_allele!=2 ) continue;       // skip multiallelic markers
-        if ( rec->d.allele[0][1]!=0 || rec->d.allele[1][1]!=0 ) continue;   // skip non-snps
-
-        int ref = nt2int(rec->d.allele[0][0]);
-        int alt = nt2int(rec->d.allele[1][0]);
-        if ( ref<0 || alt<0 ) continue;     // non-[ACGT] base
-
-        uint32_t id = parse_rsid(rec->d.id);
-        if ( !id ) continue;
+        uint32_t id;
+        int ref, alt;
+        if ( dbsnp_parse(rec, &id, &ref, &alt)<0 ) continue;
 
         int ret, k;
         k = kh_put(i2m, args->i2m, id, &ret);
@@ -314,16 +548,41 @@ done:
     bcf_sr_destroy(sr);
 }
 
+static int dbsnp_get(args_t *args, uint32_t id, marker_t *marker)
+{
+    if ( args->db_map )
+    {
+        if ( !args->db_cur ) return -1;
+        const uint32_t *ids = args->db_cur->id;
+        uint32_t beg = 0, end = args->db_cur->n;
+        while ( beg < end )
+        {
+            uint32_t mid = beg + (end - beg) / 2;
+            if ( ids[mid] < id ) beg = mid + 1;
+            else end = mid;
+        }
+        if ( beg==args->db_cur->n || ids[beg]!=id ) return -1;
+        marker->pos = args->db_cur->pos[beg];
+        marker->ref = args->db_cur->als[beg] >> 4;
+        marker->alt = args->db_cur->als[beg] & 0xf;
+        return 0;
+    }
+    khint_t k = kh_get(i2m, args->i2m, id);
+    if ( k==kh_end(args->i2m) ) return -1;
+    *marker = kh_val(args->i2m, k);
+    return 0;
+}
+
 static bcf1_t *dbsnp_check(args_t *args, bcf1_t *rec, int ir, int ia, int ib)
 {
-    int k, ref,alt,pos;
+    int ref,alt,pos;
+    marker_t marker;
     uint32_t id = parse_rsid(rec->d.id);
     if ( !id ) goto no_info;
 
-    k = kh_get(i2m, args->i2m, id);
-    if ( k==kh_end(args->i2m) ) goto no_info;
+    if ( dbsnp_get(args, id, &marker)<0 ) goto no_info;
 
-    pos = (int)kh_val(args->i2m, k).pos;
+    pos = (int)marker.pos;
     if ( pos != rec->pos ) 
     {
         rec->pos = pos;
@@ -331,8 +590,8 @@ static bcf1_t *dbsnp_check(args_t *args, bcf1_t *rec, int ir, int ia, int ib)
         args->npos_err++;
     }
 
-    ref = kh_val(args->i2m, k).ref;
-    alt = kh_val(args->i2m, k).alt;
+    ref = marker.ref;
+    alt = marker.alt;
 
 	if ( ref!=ir ) 
         error("Reference base mismatch at %s:%d .. %c vs %c\n",bcf_seqname(args->hdr,rec),rec->pos+1,int2nt(ref),int2nt(ir));
@@ -347,6 +606,7 @@ no_info:
 
 bcf1_t *process(bcf1_t *rec)
 {
+    if ( args.db_fname ) { db_add(&args, rec); return NULL; }
     if ( rec->rid == args.skip_rid ) return NULL;
 
     bcf1_t *ret = args.mode==MODE_STATS ? NULL : rec;
@@ -403,7 +663,7 @@ bcf1_t *process(bcf1_t *rec)
 
     if ( args.mode==MODE_USE_ID )
     {
-        if ( !args.i2m || args.rid!=rec->rid )
+        if ( args.rid!=rec->rid )
         {
             args.pos = 0;
             args.rid = rec->rid;
@@ -526,6 +786,8 @@ int bot_mask[4][4] =
 
 void destroy(void)
 {
+    if ( args.db_fname ) { db_write(&args); return; }
+
     uint32_t i,j,tot = 0;
     uint32_t top_err = 0, bot_err = 0;
     for (i=0; i<4; i++)
@@ -573,4 +835,5 @@ void destroy(void)
     free(args.gts);
     if ( args.fai ) fai_destroy(args.fai);
     if ( args.i2m ) kh_destroy(i2m, args.i2m);
+    db_close(&args);
 }
@@ -33,6 +33,7 @@
 #include <htslib/vcfutils.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "bcftools.h"
 #include "filter.h"
 
@@ -78,9 +79,30 @@ typedef struct
     float *farr;
     bcf_srs_t *sr;
     bcf_hdr_t *hdr;
+    char *fname;
+    int nthreads;
+    int skip_pos;   // with --threads, sites before this 0-based position belong to another job
 }
 args_t;
 
+typedef struct
+{
+    char *chr;
+    int beg, end;       // 1-based, inclusive; end=0 for the whole chromosome
+    int skip_pos;
+    count_t *counts;
+}
+job_t;
+
+typedef struct
+{
+    args_t *args;
+    pthread_mutex_t lock;
+    job_t *jobs;
+    int njobs, ijob;
+}
+workers_t;
+
 const char *about(void)
 {
     return "Determine sample sex by checking genotype likelihoods in haploid regions.\n";
@@ -114,6 +136,7 @@ static const char *usage_text(void)
         "   -r, --regions <chr:beg-end>     restrict to comma-separated list of regions\n"
         "   -R, --regions-file <file>       restrict to regions listed in a file\n"
         "   -t, --tag <tag>                 genotype or genotype likelihoods: GT, PL, GL [PL]\n"
+        "       --threads <int>             process regions in parallel, requires an indexed file [0]\n"
         "   -v, --verbose                   verbose output (specify twice to increase verbosity)\n"
         "\n"
         "Region shortcuts:\n"
@@ -144,6 +167,7 @@ void process_region_guess(args_t *args)
     while ( bcf_sr_next_line(args->sr) )
     {
         bcf1_t *rec = bcf_sr_get_line(args->sr,0);
+        if ( rec->pos < args->skip_pos ) continue;
         if ( rec->n_allele==1 ) continue;
         if ( !args->include_indels && !(bcf_get_variant_types(rec)&VCF_SNP) ) continue;
 
@@ -393,6 +417,194 @@ void process_region_guess(args_t *args)
     }
 }
 
+static int cmp_jobs(const void *aptr, const void *bptr)
+{
+    job_t *a = (job_t*) aptr;
+    job_t *b = (job_t*) bptr;
+    int ret = strcmp(a->chr, b->chr);
+    if ( ret ) return ret;
+    if ( a->beg < b->beg ) return -1;
+    if ( a->beg > b->beg ) return 1;
+    return 0;
+}
+
+// Parse "chr", "chr:pos" or "chr:beg-end", or a tab-delimited line of a regions file
+static void parse_job(job_t *job, char *str, int is_file, int is_bed)
+{
+    char *tmp, *ss = str;
+    job->beg = 1;
+    job->end = 0;
+    if ( is_file )
+    {
+        while ( *ss && *ss!='\t' ) ss++;
+        job->chr = strndup(str, ss-str);
+        if ( !*ss ) return;
+        job->beg = strtol(ss+1, &tmp, 10) + (is_bed ? 1 : 0);
+        if ( tmp==ss+1 ) error("Could not parse the region: %s\n", str);
+        job->end = job->beg - (is_bed ? 1 : 0);
+        if ( *tmp=='\t' ) job->end = strtol(tmp+1, &tmp, 10);
+        return;
+    }
+    ss = strrchr(str, ':');
+    if ( ss )
+    {
+        job->beg = strtol(ss+1, &tmp, 10);
+        if ( tmp==ss+1 || (*tmp && *tmp!='-') ) ss = NULL;   // the colon is part of the chromosome name
+        else job->end = *tmp=='-' ? strtol(tmp+1, &tmp, 10) : job->beg;
+    }
+    if ( !ss ) { job->beg = 1; job->end = 0; ss = str + strlen(str); }
+    job->chr = strndup(str, ss-str);
+}
+
+// Turn the regions into a list of jobs. When there are fewer regions than threads, bounded
+// regions are split into equal chunks. A site is counted only by the job it starts in,
+// so that indels spanning a chunk boundary and overlapping regions are not counted twice.
+static job_t *init_jobs(args_t *args, char *region, int region_is_file, int *njobs)
+{
+    int i, n = 0, m = 0;
+    job_t *jobs = NULL;
+    if ( region )
+    {
+        int nlist;
+        char **list = hts_readlist(region, region_is_file, &nlist);
+        if ( !list ) error("Failed to read the regions: %s\n", region);
+        int len = strlen(region);
+        int is_bed = region_is_file && ( (len>4 && !strcasecmp(".bed",region+len-4)) || (len>7 && !strcasecmp(".bed.gz",region+len-7)) );
+        for (i=0; i<nlist; i++)
+        {
+            if ( list[i][0] && list[i][0]!='#' )
+            {
+                hts_expand(job_t, n+1, m, jobs);
+                parse_job(&jobs[n++], list[i], region_is_file, is_bed);
+            }
+            free(list[i]);
+        }
+        free(list);
+    }
+    else
+    {
+        int nseq;
+        const char **seqs = bcf_hdr_seqnames(args->hdr, &nseq);
+        for (i=0; i<nseq; i++)
+        {
+            hts_expand(job_t, n+1, m, jobs);
+            jobs[n].chr = strdup(seqs[i]);
+            jobs[n].beg = 1;
+            jobs[n].end = 0;
+            n++;
+        }
+        free(seqs);
+    }
+    if ( n && n < args->nthreads )
+    {
+        int nsplit = (args->nthreads + n - 1) / n, nori = n;
+        for (i=0; i<nori; i++)
+        {
+            if ( !jobs[i].end || jobs[i].end - jobs[i].beg + 1 < nsplit ) continue;
+            int beg = jobs[i].beg, end = jobs[i].end, size = (end - beg + nsplit) / nsplit;
+            jobs[i].end = beg + size - 1;
+            for (beg += size; beg <= end; beg += size)
+            {
+                hts_expand(job_t, n+1, m, jobs);
+                jobs[n].chr = strdup(jobs[i].chr);
+                jobs[n].beg = beg;
+                jobs[n].end = beg + size - 1 < end ? beg + size - 1 : end;
+                n++;
+            }
+        }
+    }
+    qsort(jobs, n, sizeof(*jobs), cmp_jobs);
+    for (i=0; i<n; i++)
+    {
+        jobs[i].skip_pos = 0;
+        if ( i==0 || strcmp(jobs[i].chr,jobs[i-1].chr) ) continue;
+        // the previous jobs on the same chromosome own everything up to their largest end
+        int prev_end = jobs[i-1].end;
+        if ( prev_end && jobs[i-1].skip_pos > prev_end ) prev_end = jobs[i-1].skip_pos;
+        jobs[i].skip_pos = prev_end ? prev_end : INT32_MAX;
+    }
+    for (i=0; i<n; i++)
+        jobs[i].counts = (count_t*) calloc(args->nsample, sizeof(count_t));
+    *njobs = n;
+    return jobs;
+}
+
+static void *run_worker(void *arg)
+{
+    workers_t *wrk = (workers_t*) arg;
+    args_t args = *wrk->args;
+    args.arr  = NULL; args.narr  = 0;
+    args.farr = NULL; args.nfarr = 0;
+    args.af   = NULL; args.maf   = 0;
+    args.smpl_pass = NULL;
+    args.tmpf = (double*) malloc(sizeof(*args.tmpf)*3*args.nsample);
+    if ( args.filter_str ) args.filter = filter_init(args.hdr, args.filter_str);
+
+    kstring_t str = {0,0,0};
+    while (1)
+    {
+        pthread_mutex_lock(&wrk->lock);
+        int ijob = wrk->ijob++;
+        pthread_mutex_unlock(&wrk->lock);
+        if ( ijob >= wrk->njobs ) break;
+
+        job_t *job = &wrk->jobs[ijob];
+        str.l = 0;
+        if ( job->end ) ksprintf(&str, "%s:%d-%d", job->chr, job->beg, job->end);
+        else kputs(job->chr, &str);
+
+        args.sr = bcf_sr_init();
+        args.sr->require_index = 1;
+        if ( bcf_sr_set_regions(args.sr, str.s, 0)<0 ) error("Failed to read the regions: %s\n", str.s);
+        if ( !bcf_sr_add_reader(args.sr, args.fname) ) error("Error: %s\n", bcf_sr_strerror(args.sr->errnum));
+        args.stats.counts = job->counts;
+        args.skip_pos = job->skip_pos;
+        process_region_guess(&args);
+        bcf_sr_destroy(args.sr);
+    }
+    free(str.s);
+    if ( args.filter ) filter_destroy(args.filter);
+    free(args.tmpf);
+    free(args.arr);
+    free(args.farr);
+    free(args.af);
+    return NULL;
+}
+
+// Process the jobs in parallel, each worker with its own readers, then sum the per-sample
+// counts. The sum is done in the job order so that the result does not depend on scheduling.
+static void run_threads(args_t *args, char *region, int region_is_file)
+{
+    int i, j;
+    workers_t wrk;
+    wrk.args = args;
+    wrk.ijob = 0;
+    wrk.jobs = init_jobs(args, region, region_is_file, &wrk.njobs);
+    pthread_mutex_init(&wrk.lock, NULL);
+
+    int nthreads = args->nthreads < wrk.njobs ? args->nthreads : wrk.njobs;
+    pthread_t *tid = (pthread_t*) malloc(sizeof(pthread_t)*nthreads);
+    for (i=0; i<nthreads; i++)
+        if ( pthread_create(&tid[i], NULL, run_worker, &wrk) ) error("Failed to create a thread\n");
+    for (i=0; i<nthreads; i++)
+        if ( pthread_join(tid[i], NULL) ) error("Failed to join a thread\n");
+    free(tid);
+    pthread_mutex_destroy(&wrk.lock);
+
+    for (i=0; i<wrk.njobs; i++)
+    {
+        for (j=0; j<args->nsample; j++)
+        {
+            args->stats.counts[j].ncount += wrk.jobs[i].counts[j].ncount;
+            args->stats.counts[j].phap   += wrk.jobs[i].counts[j].phap;
+            args->stats.counts[j].pdip   += wrk.jobs[i].counts[j].pdip;
+        }
+        free(wrk.jobs[i].counts);
+        free(wrk.jobs[i].chr);
+    }
+    free(wrk.jobs);
+}
+
 int run(int argc, char **argv)
 {
     args_t *args = (args_t*) calloc(1,sizeof(args_t));
@@ -416,6 +628,7 @@ int run(int argc, char **argv)
         {"regions",required_argument,NULL,'r'},
         {"regions-file",required_argument,NULL,'R'},
         {"background",required_argument,NULL,'b'},
+        {"threads",required_argument,NULL,4},
         {NULL,0,NULL,0}
     };
     int c;
@@ -431,6 +644,10 @@ int run(int argc, char **argv)
                     break;
             case 2: args->filter_str = optarg; args->filter_logic |= FLT_EXCLUDE; break;
             case 3: args->filter_str = optarg; args->filter_logic |= FLT_INCLUDE; break;
+            case 4:
+                    args->nthreads = strtol(optarg,&tmp,10);
+                    if ( *tmp || args->nthreads<0 ) error("Could not parse: --threads %s\n", optarg);
+                    break;
             case 'i': args->include_indels = 1; break;
             case 'e':
                 args->gt_err_prob = strtod(optarg,&tmp);
@@ -468,10 +685,15 @@ int run(int argc, char **argv)
     }
     else if ( optind+1!=argc ) error(usage_text());
     else fname = argv[optind];
+    args->fname = fname;
+
+    // the per-site debugging output is printed as it goes and requires the original order
+    if ( args->verbose>1 || !strcmp("-",fname) ) args->nthreads = 0;
 
     args->sr = bcf_sr_init();
     if ( strcmp("-",fname) )
     {
+        if ( args->nthreads > 1 ) args->sr->require_index = 1;
         if ( region )
         {
             args->sr->require_index = 1;
@@ -534,7 +756,23 @@ int run(int argc, char **argv)
             printf("# [1]DBG\t[2]Chr\t[3]Pos\t[4]Sample\t[5]AF\t[6]pRR\t[7]pRA\t[8]pAA\t[9]P(Haploid)\t[10]P(Diploid)\n");
     }
 
-    process_region_guess(args);
+    if ( args->nthreads > 1 && !region )
+    {
+        // without -r/-R the jobs are the contigs from the header
+        int nseq;
+        const char **seqs = bcf_hdr_seqnames(args->hdr, &nseq);
+        free(seqs);
+        if ( !nseq )
+        {
+            fprintf(stderr, "Warning: no contig lines in the header and no -r/-R given, ignoring --threads\n");
+            args->nthreads = 0;
+        }
+    }
+
+    if ( args->nthreads > 1 )
+        run_threads(args, region, region_is_file);
+    else
+        process_region_guess(args);
 
     for (i=0; i<args->nsample; i++)
     {
@@ -38,22 +38,26 @@
 #define MODE_LIST_GOOD 2
 #define MODE_LIST_BAD  4
 #define MODE_DELETE    8
+#define MODE_MERR     16
+#define MODE_LIST_ALL 32    // -m without -l, all sites are written
 
 typedef struct
 {
-    int nok, nbad;
     int imother,ifather,ichild;
 }
 trio_t;
 
 typedef struct _args_t
 {
-    bcf_hdr_t *hdr;
-    int32_t *gt_arr;
+    bcf_hdr_t *hdr, *hdr_out;
+    int32_t *gt_arr, *merr;
     int mode;
     int ngt_arr, nrec;
     trio_t *trios;
     int ntrios;
+    int *nok, *nbad;        // per-trio counters, kept apart from the sample indexes
+    uint32_t *gt_codes;     // per-sample genotype codes of the current site, see gt_code()
+    uint8_t trio_tbl[512];  // trio_check() for all combinations of biallelic genotype codes
 }
 args_t;
 
@@ -77,6 +81,8 @@ const char *usage(void)
         "   -c, --count             count the number of consistent sites\n"
         "   -d, --delete            delete inconsistent genotypes (set to \"./.\")\n"
         "   -l, --list [+x]         list consistent (+) or inconsistent (x) sites\n"
+        "   -m, --merr              annotate FORMAT/MERR, the number of inconsistent trios the sample is member of,\n"
+        "                           all sites are written unless -l is given\n"
         "   -t, --trio <m,f,c>      names of mother, father and the child\n"
         "   -T, --trio-file <file>  list of trios, one per line\n"
         "\n"
@@ -85,11 +91,49 @@ const char *usage(void)
         "\n";
 }
 
+/*
+    The genotypes are encoded as a bitmask of the alleles present, shifted by
+    one bit, and the lowest bit set for haploid genotypes. The value 0 stands
+    for missing genotypes. At biallelic sites the codes are smaller than 8.
+*/
+static inline uint32_t gt_code(int32_t *gt, int ploidy, int nals)
+{
+    if ( gt[0]==bcf_int32_vector_end || bcf_gt_is_missing(gt[0]) ) return 0;
+    int a = bcf_gt_allele(gt[0]);
+    if ( a>=nals ) return 0;
+    if ( ploidy==1 || gt[1]==bcf_int32_vector_end ) return 1<<(a+1) | 1;
+    if ( bcf_gt_is_missing(gt[1]) ) return 0;
+    int b = bcf_gt_allele(gt[1]);
+    if ( b>=nals ) return 0;
+    return 1<<(a+1) | 1<<(b+1);
+}
+
+/*
+    Returns 0 when the trio cannot be checked, 1 when consistent and 2 when
+    inconsistent. A haploid child (e.g. a son on chrX or chrY) is compared
+    only to the mother when her genotype is known, and to the father
+    otherwise (females usually have missing genotypes on chrY).
+*/
+static inline int trio_check(uint32_t mother, uint32_t father, uint32_t child)
+{
+    uint32_t m = mother>>1, f = father>>1, c = child>>1;
+    if ( !c ) return 0;
+    if ( child & 1 )
+    {
+        if ( m ) return m&c ? 1 : 2;
+        if ( f ) return f&c ? 1 : 2;
+        return 0;
+    }
+    if ( !m || !f ) return 0;
+    return (m&c) && (f&c) ? 1 : 2;
+}
+
 int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
 {
     char *trio_samples = NULL, *trio_file = NULL;
     memset(&args,0,sizeof(args_t));
     args.hdr  = in;
+    args.hdr_out = out;
     args.mode = 0;
 
     static struct option loptions[] =
@@ -99,14 +143,16 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
         {"delete",0,0,'d'},
         {"list",1,0,'l'},
         {"count",0,0,'c'},
+        {"merr",0,0,'m'},
         {0,0,0,0}
     };
     int c;
-    while ((c = getopt_long(argc, argv, "?ht:T:l:cd",loptions,NULL)) >= 0)
+    while ((c = getopt_long(argc, argv, "?ht:T:l:cdm",loptions,NULL)) >= 0)
     {
         switch (c) 
         {
             case 'd': args.mode |= MODE_DELETE; break;
+            case 'm': args.mode |= MODE_MERR; break;
             case 'c': args.mode |= MODE_COUNT; break;
             case 'l': 
                 if ( !strcmp("+",optarg) ) args.mode |= MODE_LIST_GOOD; 
@@ -122,8 +168,9 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     }
     if ( optind != argc ) error(usage());
     if ( !trio_samples && !trio_file ) error("Expected the -t/T option\n");
-    if ( !args.mode ) error("Expected one of the -c, -d or -l options\n");
+    if ( !args.mode ) error("Expected one of the -c, -d, -l or -m options\n");
     if ( args.mode&MODE_DELETE && !(args.mode&(MODE_LIST_GOOD|MODE_LIST_BAD)) ) args.mode |= MODE_LIST_GOOD|MODE_LIST_BAD;
+    if ( args.mode&MODE_MERR && !(args.mode&(MODE_LIST_GOOD|MODE_LIST_BAD)) ) args.mode |= MODE_LIST_GOOD|MODE_LIST_BAD|MODE_LIST_ALL;
 
     int i, n = 0;
     char **list;
@@ -166,55 +213,84 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
         }
         free(list);
     }
+    args.nok  = (int*) calloc(args.ntrios,sizeof(int));
+    args.nbad = (int*) calloc(args.ntrios,sizeof(int));
+    args.gt_codes = (uint32_t*) malloc(sizeof(uint32_t)*bcf_hdr_nsamples(args.hdr));
+
+    int m, f;
+    for (m=0; m<8; m++)
+        for (f=0; f<8; f++)
+            for (c=0; c<8; c++) args.trio_tbl[m<<6|f<<3|c] = trio_check(m,f,c);
+
+    if ( args.mode&MODE_MERR )
+    {
+        args.merr = (int32_t*) malloc(sizeof(int32_t)*bcf_hdr_nsamples(args.hdr));
+        bcf_hdr_append(args.hdr_out, "##FORMAT=<ID=MERR,Number=1,Type=Integer,Description=\"Number of Mendelian errors in trios the sample is member of\">");
+    }
     return args.mode&(MODE_LIST_GOOD|MODE_LIST_BAD) ? 0 : 1;
 }
 
+static inline void set_merr(int32_t *merr, uint32_t code, int is_bad)
+{
+    if ( !code ) return;
+    if ( *merr==bcf_int32_missing ) *merr = 0;
+    *merr += is_bad;
+}
+
+static void delete_gt(int32_t *gt, int ploidy)
+{
+    int i;
+    for (i=0; i<ploidy; i++)
+        if ( gt[i]!=bcf_int32_vector_end ) gt[i] = bcf_gt_missing;
+}
+
 bcf1_t *process(bcf1_t *rec)
 {
     bcf1_t *dflt = args.mode&MODE_LIST_GOOD ? rec : NULL;
     args.nrec++;
 
+    int i, nsmpl = bcf_hdr_nsamples(args.hdr);
     int ngt = bcf_get_genotypes(args.hdr, rec, &args.gt_arr, &args.ngt_arr);
     if ( ngt<0 ) return dflt;
-    if ( ngt!=2*bcf_hdr_nsamples(args.hdr) ) return dflt;
+    int ploidy = ngt / nsmpl;
+    if ( ploidy<1 || ploidy>2 || rec->n_allele>30 ) return dflt;
+
+    // Encode all genotypes in a single pass, the trios then only look up three codes
+    for (i=0; i<nsmpl; i++)
+        args.gt_codes[i] = gt_code(args.gt_arr + i*ploidy, ploidy, rec->n_allele);
+
+    if ( args.mode&MODE_MERR )
+        for (i=0; i<nsmpl; i++) args.merr[i] = bcf_int32_missing;
 
-    int i, has_bad = 0, needs_update = 0;
+    int has_bad = 0, needs_update = 0, is_biallelic = rec->n_allele<=2;
     for (i=0; i<args.ntrios; i++)
     {
-        int mother,father,child;
-        int32_t a,b,c,d,e,f;
         trio_t *trio = &args.trios[i];
+        uint32_t mother = args.gt_codes[trio->imother];
+        uint32_t father = args.gt_codes[trio->ifather];
+        uint32_t child  = args.gt_codes[trio->ichild];
+        int ret = is_biallelic ? args.trio_tbl[mother<<6|father<<3|child] : trio_check(mother,father,child);
+        if ( !ret ) continue;
 
-        a = args.gt_arr[2*trio->imother];
-        b = args.gt_arr[2*trio->imother+1];
-        c = args.gt_arr[2*trio->ifather];
-        d = args.gt_arr[2*trio->ifather+1];
-        e = args.gt_arr[2*trio->ichild];
-        f = args.gt_arr[2*trio->ichild+1];
-        if ( bcf_gt_is_missing(a) || bcf_gt_is_missing(b) ) continue; 
-        if ( bcf_gt_is_missing(c) || bcf_gt_is_missing(d) ) continue; 
-        if ( bcf_gt_is_missing(e) || bcf_gt_is_missing(f) ) continue; 
-
-        mother = (1<<bcf_gt_allele(a)) | (1<<bcf_gt_allele(b));
-        father = (1<<bcf_gt_allele(c)) | (1<<bcf_gt_allele(d));
-        child  = (1<<bcf_gt_allele(e)) | (1<<bcf_gt_allele(f));
-
-        if ( (mother&child) && (father&child) ) 
+        if ( args.mode&MODE_MERR )
         {
-            trio->nok++;
+            set_merr(&args.merr[trio->imother], mother, ret==2);
+            set_merr(&args.merr[trio->ifather], father, ret==2);
+            set_merr(&args.merr[trio->ichild], child, ret==2);
+        }
+        if ( ret==1 )
+        {
+            args.nok[i]++;
         }
         else
         {
-            trio->nbad++;
+            args.nbad[i]++;
             has_bad = 1;
             if ( args.mode&MODE_DELETE )
             {
-                args.gt_arr[2*trio->imother]   = bcf_gt_missing;
-                args.gt_arr[2*trio->imother+1] = bcf_gt_missing;
-                args.gt_arr[2*trio->ifather]   = bcf_gt_missing;
-                args.gt_arr[2*trio->ifather+1] = bcf_gt_missing;
-                args.gt_arr[2*trio->ichild]    = bcf_gt_missing;
-                args.gt_arr[2*trio->ichild+1]  = bcf_gt_missing;
+                delete_gt(args.gt_arr + ploidy*trio->imother, ploidy);
+                delete_gt(args.gt_arr + ploidy*trio->ifather, ploidy);
+                delete_gt(args.gt_arr + ploidy*trio->ichild, ploidy);
                 needs_update = 1;
             }
         }
@@ -223,7 +299,10 @@ bcf1_t *process(bcf1_t *rec)
     if ( needs_update && bcf_update_genotypes(args.hdr,rec,args.gt_arr,ngt) )
         error("Could not update GT field at %s:%d\n", bcf_seqname(args.hdr,rec),rec->pos+1);
 
-    if ( args.mode&MODE_DELETE ) return rec;
+    if ( args.mode&MODE_MERR && bcf_update_format_int32(args.hdr_out,rec,"MERR",args.merr,nsmpl) )
+        error("Could not update FORMAT/MERR field at %s:%d\n", bcf_seqname(args.hdr,rec),rec->pos+1);
+
+    if ( args.mode&(MODE_DELETE|MODE_LIST_ALL) ) return rec;
     if ( args.mode&MODE_LIST_GOOD ) return has_bad ? NULL : rec;
     if ( args.mode&MODE_LIST_BAD ) return has_bad ? rec : NULL;
 
@@ -238,7 +317,7 @@ void destroy(void)
     {
         trio_t *trio = &args.trios[i];
         fprintf(stderr,"%d\t%d\t%d\t%s,%s,%s\n", 
-            trio->nok,trio->nbad,args.nrec-(trio->nok+trio->nbad),
+            args.nok[i],args.nbad[i],args.nrec-(args.nok[i]+args.nbad[i]),
             bcf_hdr_int2id(args.hdr, BCF_DT_SAMPLE, trio->imother),
             bcf_hdr_int2id(args.hdr, BCF_DT_SAMPLE, trio->ifather),
             bcf_hdr_int2id(args.hdr, BCF_DT_SAMPLE, trio->ichild)
@@ -246,6 +325,10 @@ void destroy(void)
     }
     free(args.gt_arr);
     free(args.trios);
+    free(args.nok);
+    free(args.nbad);
+    free(args.gt_codes);
+    free(args.merr);
 }
 
 
@@ -29,12 +29,15 @@ DEALINGS IN THE SOFTWARE.  */
 #include <inttypes.h>
 #include <getopt.h>
 
-bcf_hdr_t *in_hdr, *out_hdr;
-int32_t *gts = NULL, mgts = 0;
-int *arr = NULL, marr = 0;
-uint64_t nchanged = 0;
-int new_gt = bcf_gt_unphased(0);
-int use_major = 0;
+typedef struct
+{
+    bcf_hdr_t *in_hdr, *out_hdr;
+    int32_t *gts, mgts;
+    int *arr, marr;
+    uint64_t nchanged;
+    int new_gt, use_major;
+}
+args_t;
 
 const char *about(void)
 {
@@ -61,8 +64,10 @@ const char *usage(void)
 }
 
 
-int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
+void *init2(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out, int *ret)
 {
+    args_t *args = (args_t*) calloc(1,sizeof(args_t));
+    args->new_gt = bcf_gt_unphased(0);
     int c;
     static struct option loptions[] =
     {
@@ -74,21 +79,56 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     {
         switch (c) 
         {
-            case 'p': new_gt = bcf_gt_phased(0); break;
-            case 'm': use_major = 1; break;
+            case 'p': args->new_gt = bcf_gt_phased(0); break;
+            case 'm': args->use_major = 1; break;
             case 'h':
             case '?':
             default: fprintf(stderr,"%s", usage()); exit(1); break;
         }
     }
-    in_hdr  = in;
-    out_hdr = out;
-    return 0;
+    args->in_hdr  = in;
+    args->out_hdr = out;
+    *ret = 0;
+    return args;
+}
+
+/*
+    Replace the missing alleles directly in the record's FORMAT/GT buffer,
+    keeping the storage type, so that the FORMAT block does not have to be
+    re-encoded. The loop is branch-free so that it can be vectorized by the
+    compiler. Returns the number of changed alleles or -1 if new_gt does not
+    fit in the storage type.
+*/
+static int fill_missing_inplace(args_t *args, bcf1_t *rec)
+{
+    bcf_fmt_t *fmt = bcf_get_fmt(args->in_hdr, rec, "GT");
+    if ( !fmt ) return 0;
+
+    int i, n = fmt->n * rec->n_sample, changed = 0;
+    #define BRANCH(type_t, max) \
+    { \
+        if ( args->new_gt > max ) return -1; \
+        type_t *ptr = (type_t*) fmt->p, val = args->new_gt; \
+        for (i=0; i<n; i++) \
+        { \
+            int is_missing = ptr[i]==bcf_gt_missing; \
+            changed += is_missing; \
+            ptr[i] = is_missing ? val : ptr[i]; \
+        } \
+    }
+    switch (fmt->type)
+    {
+        case BCF_BT_INT8:  BRANCH(int8_t,  INT8_MAX); break;
+        case BCF_BT_INT16: BRANCH(int16_t, INT16_MAX); break;
+        case BCF_BT_INT32: BRANCH(int32_t, INT32_MAX); break;
+        default: return -1;
+    }
+    #undef BRANCH
+    return changed;
 }
 
-bcf1_t *process(bcf1_t *rec)
+static void process_rec(args_t *args, bcf1_t *rec)
 {
-    int ngts = bcf_get_genotypes(in_hdr, rec, &gts, &mgts);
     int i, changed = 0;
     
     // Calculating allele frequency for each allele and determining major allele
@@ -96,14 +136,14 @@ bcf1_t *process(bcf1_t *rec)
     int majorAllele = -1;
     int maxAC = -1;
     int an = 0;
-    if(use_major == 1){
-        hts_expand(int,rec->n_allele,marr,arr);
-        int ret = bcf_calc_ac(in_hdr,rec,arr,BCF_UN_FMT);
+    if(args->use_major == 1){
+        hts_expand(int,rec->n_allele,args->marr,args->arr);
+        int ret = bcf_calc_ac(args->in_hdr,rec,args->arr,BCF_UN_FMT);
         if(ret > 0){
             for(i=0; i < rec->n_allele; ++i){
-                an += arr[i];
-                if(*(arr+i) > maxAC){
-                    maxAC = *(arr+i);
+                an += args->arr[i];
+                if(*(args->arr+i) > maxAC){
+                    maxAC = *(args->arr+i);
                     majorAllele = i;
                 }
             }
@@ -114,31 +154,50 @@ bcf1_t *process(bcf1_t *rec)
         }
 
         // replacing new_gt by major allele
-        if(bcf_gt_is_phased(new_gt))
-            new_gt = bcf_gt_phased(majorAllele);
+        if(bcf_gt_is_phased(args->new_gt))
+            args->new_gt = bcf_gt_phased(majorAllele);
         else
-            new_gt = bcf_gt_unphased(majorAllele);
+            args->new_gt = bcf_gt_unphased(majorAllele);
+    }
+
+    if ( (changed = fill_missing_inplace(args, rec)) >= 0 )
+    {
+        args->nchanged += changed;
+        return;
     }
+    changed = 0;
 
     // replace gts
+    int ngts = bcf_get_genotypes(args->in_hdr, rec, &args->gts, &args->mgts);
     for (i=0; i<ngts; i++)
     {
-        if ( gts[i]==bcf_gt_missing )
+        if ( args->gts[i]==bcf_gt_missing )
         {
-            gts[i] = new_gt;
+            args->gts[i] = args->new_gt;
             changed++;
         }
     }
-    nchanged += changed;
-    if ( changed ) bcf_update_genotypes(out_hdr, rec, gts, ngts);
-    return rec;
+    args->nchanged += changed;
+    if ( changed ) bcf_update_genotypes(args->out_hdr, rec, args->gts, ngts);
+}
+
+// With -m the new genotype is set per record in the context, the plugin is
+// therefore not thread-safe
+int process_batch(void *ctx, bcf1_t **recs, int nrecs)
+{
+    args_t *args = (args_t*) ctx;
+    int i;
+    for (i=0; i<nrecs; i++) process_rec(args, recs[i]);
+    return 0;
 }
 
-void destroy(void)
+void destroy2(void *ctx)
 {
-    free(arr);
-    fprintf(stderr,"Filled %"PRId64" REF alleles\n", nchanged);
-    free(gts);
+    args_t *args = (args_t*) ctx;
+    free(args->arr);
+    fprintf(stderr,"Filled %"PRId64" REF alleles\n", args->nchanged);
+    free(args->gts);
+    free(args);
 }
 
 
@@ -35,16 +35,6 @@ DEALINGS IN THE SOFTWARE.  */
 #define FLT_INCLUDE 1
 #define FLT_EXCLUDE 2
 
-bcf_hdr_t *in_hdr, *out_hdr;
-int32_t *gts = NULL, mgts = 0;
-int *arr = NULL, marr = 0;
-uint64_t nchanged = 0;
-int tgt_mask = 0, new_mask = 0, new_gt = 0;
-filter_t *filter = NULL;
-char *filter_str = NULL;
-int filter_logic = 0;
-const uint8_t *smpl_pass = NULL;
-
 #define GT_MISSING   1
 #define GT_PARTIAL  (1<<1)
 #define GT_REF      (1<<2)
@@ -54,6 +44,20 @@ const uint8_t *smpl_pass = NULL;
 #define GT_ALL      (1<<6)
 #define GT_QUERY    (1<<7)
 
+typedef struct
+{
+    bcf_hdr_t *in_hdr, *out_hdr;
+    int32_t *gts, mgts;
+    int *arr, marr;
+    uint64_t nchanged;
+    int tgt_mask, new_mask, new_gt;
+    filter_t *filter;
+    char *filter_str;
+    int filter_logic;
+    const uint8_t *smpl_pass;
+}
+args_t;
+
 const char *about(void)
 {
     return "Set genotypes: partially missing to missing, missing to ref/major allele, etc.\n";
@@ -97,8 +101,9 @@ const char *usage(void)
 }
 
 
-int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
+void *init2(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out, int *ret)
 {
+    args_t *args = (args_t*) calloc(1,sizeof(args_t));
     int c;
     static struct option loptions[] =
     {
@@ -112,44 +117,45 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     {
         switch (c) 
         {
-            case 'i': filter_str = optarg; filter_logic = FLT_INCLUDE; break;
-            case 'e': filter_str = optarg; filter_logic = FLT_EXCLUDE; break;
-            case 'n': new_mask = bcf_gt_phased(0); 
-                if ( strchr(optarg,'.') ) new_mask |= GT_MISSING;
-                if ( strchr(optarg,'0') ) new_mask |= GT_REF;
-                if ( strchr(optarg,'M') ) new_mask |= GT_MAJOR;
-                if ( strchr(optarg,'p') ) new_mask |= GT_PHASED;
-                if ( strchr(optarg,'u') ) new_mask |= GT_UNPHASED;
-                if ( new_mask==0 ) error("Unknown parameter to --new-gt: %s\n", optarg);
+            case 'i': args->filter_str = optarg; args->filter_logic = FLT_INCLUDE; break;
+            case 'e': args->filter_str = optarg; args->filter_logic = FLT_EXCLUDE; break;
+            case 'n': args->new_mask = bcf_gt_phased(0); 
+                if ( strchr(optarg,'.') ) args->new_mask |= GT_MISSING;
+                if ( strchr(optarg,'0') ) args->new_mask |= GT_REF;
+                if ( strchr(optarg,'M') ) args->new_mask |= GT_MAJOR;
+                if ( strchr(optarg,'p') ) args->new_mask |= GT_PHASED;
+                if ( strchr(optarg,'u') ) args->new_mask |= GT_UNPHASED;
+                if ( args->new_mask==0 ) error("Unknown parameter to --new-gt: %s\n", optarg);
                 break;
             case 't':
-                if ( !strcmp(optarg,".") ) tgt_mask |= GT_MISSING|GT_PARTIAL;
-                if ( !strcmp(optarg,"./x") ) tgt_mask |= GT_PARTIAL;
-                if ( !strcmp(optarg,"./.") ) tgt_mask |= GT_MISSING;
-                if ( !strcmp(optarg,"a") ) tgt_mask |= GT_ALL;
-                if ( !strcmp(optarg,"q") ) tgt_mask |= GT_QUERY;
-                if ( !strcmp(optarg,"?") ) tgt_mask |= GT_QUERY;        // for backward compatibility
-                if ( tgt_mask==0 ) error("Unknown parameter to --target-gt: %s\n", optarg);
+                if ( !strcmp(optarg,".") ) args->tgt_mask |= GT_MISSING|GT_PARTIAL;
+                if ( !strcmp(optarg,"./x") ) args->tgt_mask |= GT_PARTIAL;
+                if ( !strcmp(optarg,"./.") ) args->tgt_mask |= GT_MISSING;
+                if ( !strcmp(optarg,"a") ) args->tgt_mask |= GT_ALL;
+                if ( !strcmp(optarg,"q") ) args->tgt_mask |= GT_QUERY;
+                if ( !strcmp(optarg,"?") ) args->tgt_mask |= GT_QUERY;        // for backward compatibility
+                if ( args->tgt_mask==0 ) error("Unknown parameter to --target-gt: %s\n", optarg);
                 break;
             case 'h':
             case '?':
             default: fprintf(stderr,"%s", usage()); exit(1); break;
         }
     }
-    in_hdr  = in;
-    out_hdr = out;
+    args->in_hdr  = in;
+    args->out_hdr = out;
 
-    if ( !new_mask ) error("Expected -n option\n");
-    if ( !tgt_mask ) error("Expected -t option\n");
+    if ( !args->new_mask ) error("Expected -n option\n");
+    if ( !args->tgt_mask ) error("Expected -t option\n");
 
-    if ( new_mask & GT_MISSING ) new_gt = bcf_gt_missing;
-    if ( new_mask & GT_REF ) new_gt = new_mask&GT_PHASED ? bcf_gt_phased(0) : bcf_gt_unphased(0);
+    if ( args->new_mask & GT_MISSING ) args->new_gt = bcf_gt_missing;
+    if ( args->new_mask & GT_REF ) args->new_gt = args->new_mask&GT_PHASED ? bcf_gt_phased(0) : bcf_gt_unphased(0);
 
-    if ( filter_str  && tgt_mask!=GT_QUERY ) error("Expected -t? with -i/-e\n");
-    if ( !filter_str && tgt_mask&GT_QUERY ) error("Expected -i/-e with -t?\n");
-    if ( filter_str ) filter = filter_init(in,filter_str);
+    if ( args->filter_str  && args->tgt_mask!=GT_QUERY ) error("Expected -t? with -i/-e\n");
+    if ( !args->filter_str && args->tgt_mask&GT_QUERY ) error("Expected -i/-e with -t?\n");
+    if ( args->filter_str ) args->filter = filter_init(in,args->filter_str);
 
-    return 0;
+    *ret = 0;
+    return args;
 }
 
 static inline int unphase_gt(int32_t *ptr, int ngts)
@@ -190,94 +196,149 @@ static inline int set_gt(int32_t *ptr, int ngts, int gt)
     return changed;
 }
 
-bcf1_t *process(bcf1_t *rec)
+// Is the sample's genotype to be changed? The site has passed the filters
+static inline int is_target(args_t *args, int isample, int ploidy, int nmiss)
 {
-    if ( !rec->n_sample ) return rec;
+    if ( args->tgt_mask&GT_QUERY )
+    {
+        if ( !args->smpl_pass ) return 1;
+        if ( !args->smpl_pass[isample] && args->filter_logic==FLT_INCLUDE ) return 0;
+        if (  args->smpl_pass[isample] && args->filter_logic==FLT_EXCLUDE ) return 0;
+        return 1;
+    }
+    if ( args->tgt_mask&GT_ALL ) return 1;
+    if ( args->tgt_mask&GT_PARTIAL && nmiss ) return 1;
+    if ( args->tgt_mask&GT_MISSING && ploidy==nmiss ) return 1;
+    return 0;
+}
+
+/*
+    Set the genotypes directly in the record's FORMAT/GT buffer, keeping
+    the storage type, so that the FORMAT block does not have to be
+    re-encoded. Returns the number of changed alleles or -1 if new_gt does
+    not fit in the storage type.
+*/
+static int set_gt_inplace(args_t *args, bcf1_t *rec)
+{
+    bcf_fmt_t *fmt = bcf_get_fmt(args->in_hdr, rec, "GT");
+    if ( !fmt ) return 0;
+
+    int i, j, changed = 0;
+    #define BRANCH(type_t, vector_end, max) \
+    { \
+        if ( args->new_gt > max ) return -1; \
+        for (i=0; i<rec->n_sample; i++) \
+        { \
+            type_t *ptr = (type_t*) (fmt->p + i*fmt->size); \
+            int ploidy = 0, nmiss = 0; \
+            for (j=0; j<fmt->n; j++) \
+            { \
+                if ( ptr[j]==vector_end ) break; \
+                ploidy++; \
+                if ( ptr[j]==bcf_gt_missing ) nmiss++; \
+            } \
+            if ( !is_target(args, i, ploidy, nmiss) ) continue; \
+            for (j=0; j<ploidy; j++) ptr[j] = args->new_gt; \
+            changed += ploidy; \
+        } \
+    }
+    switch (fmt->type)
+    {
+        case BCF_BT_INT8:  BRANCH(int8_t,  bcf_int8_vector_end,  INT8_MAX); break;
+        case BCF_BT_INT16: BRANCH(int16_t, bcf_int16_vector_end, INT16_MAX); break;
+        case BCF_BT_INT32: BRANCH(int32_t, bcf_int32_vector_end, INT32_MAX); break;
+        default: return -1;
+    }
+    #undef BRANCH
+    return changed;
+}
+
+static void process_rec(args_t *args, bcf1_t *rec)
+{
+    if ( !rec->n_sample ) return;
 
-    int ngts = bcf_get_genotypes(in_hdr, rec, &gts, &mgts);
-    ngts /= rec->n_sample;
     int i, j, changed = 0;
     
     // Calculating allele frequency for each allele and determining major allele
     // only do this if use_major is true
     int an = 0, maxAC = -1, majorAllele = -1;
-    if ( new_mask & GT_MAJOR )
+    if ( args->new_mask & GT_MAJOR )
     {
-        hts_expand(int,rec->n_allele,marr,arr);
-        int ret = bcf_calc_ac(in_hdr,rec,arr,BCF_UN_FMT);
+        hts_expand(int,rec->n_allele,args->marr,args->arr);
+        int ret = bcf_calc_ac(args->in_hdr,rec,args->arr,BCF_UN_FMT);
         if ( ret<= 0 )
-            error("Could not calculate allele count at %s:%d\n", bcf_seqname(in_hdr,rec),rec->pos+1);
+            error("Could not calculate allele count at %s:%d\n", bcf_seqname(args->in_hdr,rec),rec->pos+1);
 
         for(i=0; i < rec->n_allele; ++i)
         {
-            an += arr[i];
-            if (arr[i] > maxAC)
+            an += args->arr[i];
+            if (args->arr[i] > maxAC)
             {
-                maxAC = arr[i];
+                maxAC = args->arr[i];
                 majorAllele = i;
             }
         }
 
         // replacing new_gt by major allele
-        new_gt = new_mask & GT_PHASED ?  bcf_gt_phased(majorAllele) : bcf_gt_unphased(majorAllele);
+        args->new_gt = args->new_mask & GT_PHASED ?  bcf_gt_phased(majorAllele) : bcf_gt_unphased(majorAllele);
     }
 
-    // replace gts
-    if ( tgt_mask&GT_QUERY )
+    if ( args->tgt_mask&GT_QUERY )
     {
-        int pass_site = filter_test(filter,rec,&smpl_pass);
-        if ( (pass_site && filter_logic==FLT_EXCLUDE) || (!pass_site && filter_logic==FLT_INCLUDE) ) return rec;
-        for (i=0; i<rec->n_sample; i++)
-        {
-            if ( smpl_pass )
-            {
-                if ( !smpl_pass[i] && filter_logic==FLT_INCLUDE ) continue;
-                if (  smpl_pass[i] && filter_logic==FLT_EXCLUDE ) continue;
-            }
+        int pass_site = filter_test(args->filter,rec,&args->smpl_pass);
+        if ( (pass_site && args->filter_logic==FLT_EXCLUDE) || (!pass_site && args->filter_logic==FLT_INCLUDE) ) return;
+    }
 
-            if ( new_mask&GT_UNPHASED )
-                changed += unphase_gt(gts + i*ngts, ngts);
-            else
-                changed += set_gt(gts + i*ngts, ngts, new_gt);
-        }
+    // the genotypes can be overwritten in place unless they are to be unphased and sorted
+    if ( !(args->new_mask&GT_UNPHASED) && (changed = set_gt_inplace(args, rec)) >= 0 )
+    {
+        args->nchanged += changed;
+        return;
     }
-    else
+    changed = 0;
+
+    // replace gts
+    int ngts = bcf_get_genotypes(args->in_hdr, rec, &args->gts, &args->mgts);
+    ngts /= rec->n_sample;
+    for (i=0; i<rec->n_sample; i++)
     {
-        for (i=0; i<rec->n_sample; i++)
+        int ploidy = 0, nmiss = 0;
+        int32_t *ptr = args->gts + i*ngts;
+        for (j=0; j<ngts; j++)
         {
-            int ploidy = 0, nmiss = 0;
-            int32_t *ptr = gts + i*ngts;
-            for (j=0; j<ngts; j++)
-            {
-                if ( ptr[j]==bcf_int32_vector_end ) break;
-                ploidy++;
-                if ( ptr[j]==bcf_gt_missing ) nmiss++;
-            }
-
-            int do_set = 0;
-            if ( tgt_mask&GT_ALL ) do_set = 1;
-            else if ( tgt_mask&GT_PARTIAL && nmiss ) do_set = 1;
-            else if ( tgt_mask&GT_MISSING && ploidy==nmiss ) do_set = 1;
-
-            if ( !do_set ) continue;
-
-            if ( new_mask&GT_UNPHASED )
-                changed += unphase_gt(ptr, ngts);
-            else
-                changed += set_gt(ptr, ngts, new_gt);
+            if ( ptr[j]==bcf_int32_vector_end ) break;
+            ploidy++;
+            if ( ptr[j]==bcf_gt_missing ) nmiss++;
         }
+        if ( !is_target(args, i, ploidy, nmiss) ) continue;
+
+        if ( args->new_mask&GT_UNPHASED )
+            changed += unphase_gt(ptr, ngts);
+        else
+            changed += set_gt(ptr, ngts, args->new_gt);
     }
-    nchanged += changed;
-    if ( changed ) bcf_update_genotypes(out_hdr, rec, gts, ngts*rec->n_sample);
-    return rec;
+    args->nchanged += changed;
+    if ( changed ) bcf_update_genotypes(args->out_hdr, rec, args->gts, ngts*rec->n_sample);
+}
+
+// The major allele and the filter's sample flags are set per record in the
+// context, the plugin is therefore not thread-safe
+int process_batch(void *ctx, bcf1_t **recs, int nrecs)
+{
+    args_t *args = (args_t*) ctx;
+    int i;
+    for (i=0; i<nrecs; i++) process_rec(args, recs[i]);
+    return 0;
 }
 
-void destroy(void)
+void destroy2(void *ctx)
 {
-    if ( filter ) filter_destroy(filter);
-    free(arr);
-    fprintf(stderr,"Filled %"PRId64" alleles\n", nchanged);
-    free(gts);
+    args_t *args = (args_t*) ctx;
+    if ( args->filter ) filter_destroy(args->filter);
+    free(args->arr);
+    fprintf(stderr,"Filled %"PRId64" alleles\n", args->nchanged);
+    free(args->gts);
+    free(args);
 }
 
 
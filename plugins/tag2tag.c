@@ -35,12 +35,22 @@ DEALINGS IN THE SOFTWARE.  */
 #define GL_TO_PL 2
 #define GP_TO_GT 3
 #define PL_TO_GL 4
+#define GL_TO_GP 5
+#define PL_TO_GP 6
 
-static int mode = 0, drop_source_tag = 0;
-static bcf_hdr_t *in_hdr, *out_hdr;
-static float *farr = NULL, thresh = 0.1;
-static int32_t *iarr = NULL;
-static int mfarr = 0, miarr = 0;
+// PL to probability conversion table, larger PLs are indistinguishable from 0 in float
+#define PL2PROB_MAX 512
+
+typedef struct
+{
+    int mode, drop_source_tag, write_ds;
+    bcf_hdr_t *in_hdr, *out_hdr;
+    float *farr, *dsarr, thresh;
+    float pl2prob[PL2PROB_MAX];
+    int32_t *iarr;
+    int mfarr, miarr, mdsarr;
+}
+args_t;
 
 const char *about(void)
 {
@@ -61,11 +71,15 @@ const char *usage(void)
         "       --gp-to-gt           convert FORMAT/GP to FORMAT/GT by taking argmax of GP\n"
         "       --gl-to-pl           convert FORMAT/GL to FORMAT/PL\n"
         "       --pl-to-gl           convert FORMAT/PL to FORMAT/GL\n"
+        "       --gl-to-gp           convert FORMAT/GL to FORMAT/GP\n"
+        "       --pl-to-gp           convert FORMAT/PL to FORMAT/GP\n"
+        "       --ds                 add also FORMAT/DS, the genotype dosage, when converting from or to GP\n"
         "   -r, --replace            drop the source tag\n"
         "   -t, --threshold <float>  threshold for GP to GT hard-call [0.1]\n"
         "\n"
         "Example:\n"
         "   bcftools +tag2tag in.vcf -- -r --gp-to-gl\n"
+        "   bcftools +tag2tag in.vcf -- --pl-to-gp --ds\n"
         "\n";
 }
 
@@ -78,8 +92,10 @@ static void init_header(bcf_hdr_t *hdr, const char *ori, int ori_type, const cha
     bcf_hdr_append(hdr, new_hdr_line);
 }
 
-int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
+void *init2(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out, int *ret)
 {
+    args_t *args = (args_t*) calloc(1,sizeof(args_t));
+    args->thresh = 0.1;
     static struct option loptions[] =
     {
         {"replace",no_argument,NULL,'r'},
@@ -87,6 +103,9 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
         {"gl-to-pl",no_argument,NULL,2},
         {"gp-to-gt",no_argument,NULL,3},
         {"pl-to-gl",no_argument,NULL,4},
+        {"gl-to-gp",no_argument,NULL,5},
+        {"pl-to-gp",no_argument,NULL,6},
+        {"ds",no_argument,NULL,7},
         {"threshold",required_argument,NULL,'t'},
         {NULL,0,NULL,0}
     };
@@ -96,108 +115,237 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     {
         switch (c) 
         {
-            case  1 : src_tag = "GP"; mode = GP_TO_GL; break;
-            case  2 : src_tag = "GL"; mode = GL_TO_PL; break;
-            case  3 : src_tag = "GP"; mode = GP_TO_GT; break;
-            case  4 : src_tag = "PL"; mode = PL_TO_GL; break;
-            case 'r': drop_source_tag = 1; break;
-            case 't': thresh = atof(optarg); break;
+            case  1 : src_tag = "GP"; args->mode = GP_TO_GL; break;
+            case  2 : src_tag = "GL"; args->mode = GL_TO_PL; break;
+            case  3 : src_tag = "GP"; args->mode = GP_TO_GT; break;
+            case  4 : src_tag = "PL"; args->mode = PL_TO_GL; break;
+            case  5 : src_tag = "GL"; args->mode = GL_TO_GP; break;
+            case  6 : src_tag = "PL"; args->mode = PL_TO_GP; break;
+            case  7 : args->write_ds = 1; break;
+            case 'r': args->drop_source_tag = 1; break;
+            case 't': args->thresh = atof(optarg); break;
             case 'h':
             case '?':
             default: error("%s", usage()); break;
         }
     }
-    if ( !mode ) mode = GP_TO_GL;
-
-    in_hdr  = in;
-    out_hdr = out;
-
-    if ( mode==GP_TO_GL )
-        init_header(out_hdr,drop_source_tag?"GP":NULL,BCF_HL_FMT,"##FORMAT=<ID=GL,Number=G,Type=Float,Description=\"Genotype Likelihoods\">");
-    else if ( mode==GL_TO_PL )
-        init_header(out_hdr,drop_source_tag?"GL":NULL,BCF_HL_FMT,"##FORMAT=<ID=PL,Number=G,Type=Integer,Description=\"Phred scaled genotype likelihoods\">");
-    else if ( mode==PL_TO_GL )
-        init_header(out_hdr,drop_source_tag?"PL":NULL,BCF_HL_FMT,"##FORMAT=<ID=GL,Number=G,Type=Float,Description=\"Genotype likelihoods\">");
-    else if ( mode==GP_TO_GT ) {
-        if (thresh<0||thresh>1) error("--threshold must be in the range [0,1]: %f\n", thresh);
-        init_header(out_hdr,drop_source_tag?"GP":NULL,BCF_HL_FMT,"##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">");
+    if ( !args->mode ) args->mode = GP_TO_GL;
+
+    args->in_hdr  = in;
+    args->out_hdr = out;
+
+    if ( args->mode==GP_TO_GL )
+        init_header(args->out_hdr,args->drop_source_tag?"GP":NULL,BCF_HL_FMT,"##FORMAT=<ID=GL,Number=G,Type=Float,Description=\"Genotype Likelihoods\">");
+    else if ( args->mode==GL_TO_PL )
+        init_header(args->out_hdr,args->drop_source_tag?"GL":NULL,BCF_HL_FMT,"##FORMAT=<ID=PL,Number=G,Type=Integer,Description=\"Phred scaled genotype likelihoods\">");
+    else if ( args->mode==PL_TO_GL )
+        init_header(args->out_hdr,args->drop_source_tag?"PL":NULL,BCF_HL_FMT,"##FORMAT=<ID=GL,Number=G,Type=Float,Description=\"Genotype likelihoods\">");
+    else if ( args->mode==GP_TO_GT ) {
+        if (args->thresh<0||args->thresh>1) error("--threshold must be in the range [0,1]: %f\n", args->thresh);
+        init_header(args->out_hdr,args->drop_source_tag?"GP":NULL,BCF_HL_FMT,"##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">");
     }
+    else if ( args->mode==GL_TO_GP )
+        init_header(args->out_hdr,args->drop_source_tag?"GL":NULL,BCF_HL_FMT,"##FORMAT=<ID=GP,Number=G,Type=Float,Description=\"Genotype probabilities\">");
+    else if ( args->mode==PL_TO_GP )
+        init_header(args->out_hdr,args->drop_source_tag?"PL":NULL,BCF_HL_FMT,"##FORMAT=<ID=GP,Number=G,Type=Float,Description=\"Genotype probabilities\">");
+
+    if ( args->write_ds )
+    {
+        if ( args->mode==GL_TO_PL || args->mode==PL_TO_GL ) error("The --ds option requires one of --gp-to-gl, --gp-to-gt, --gl-to-gp or --pl-to-gp\n");
+        init_header(args->out_hdr,NULL,BCF_HL_FMT,"##FORMAT=<ID=DS,Number=A,Type=Float,Description=\"Genotype dosage, the expected number of ALT alleles\">");
+    }
+
+    int i;
+    for (i=0; i<PL2PROB_MAX; i++) args->pl2prob[i] = pow(10, -0.1*i);
 
     int tag_id;
-    if ( (tag_id=bcf_hdr_id2int(in_hdr,BCF_DT_ID,src_tag))<0 || !bcf_hdr_idinfo_exists(in_hdr,BCF_HL_FMT,tag_id) )
+    if ( (tag_id=bcf_hdr_id2int(args->in_hdr,BCF_DT_ID,src_tag))<0 || !bcf_hdr_idinfo_exists(args->in_hdr,BCF_HL_FMT,tag_id) )
         error("The source tag does not exist: %s\n", src_tag);
 
-    return 0;
+    *ret = 0;
+    return args;
+}
+
+/*
+    Expected number of each ALT allele computed from genotype probabilities,
+    n is the number of values per sample
+*/
+static void update_ds(args_t *args, bcf1_t *rec, float *gp, int n)
+{
+    int i, j, a, b, nals = rec->n_allele, nsmpl = bcf_hdr_nsamples(args->in_hdr);
+    if ( nals<2 ) return;
+    hts_expand(float, nsmpl*(nals-1), args->mdsarr, args->dsarr);
+    for (i=0; i<nsmpl; i++)
+    {
+        float *ptr = gp + i*n, *ds = args->dsarr + i*(nals-1);
+        for (j=0; j<n; j++)
+            if ( bcf_float_is_missing(ptr[j]) || bcf_float_is_vector_end(ptr[j]) ) break;
+        if ( j!=nals && j!=nals*(nals+1)/2 )
+        {
+            for (a=0; a<nals-1; a++) bcf_float_set_missing(ds[a]);
+            continue;
+        }
+        for (a=0; a<nals-1; a++) ds[a] = 0;
+        if ( j==nals )  // haploid
+        {
+            for (j=1; j<nals; j++) ds[j-1] += ptr[j];
+            continue;
+        }
+        for (j=1; j<nals*(nals+1)/2; j++)
+        {
+            bcf_gt2alleles(j,&a,&b);
+            if ( a ) ds[a-1] += ptr[j];
+            if ( b ) ds[b-1] += ptr[j];
+        }
+    }
+    bcf_update_format_float(args->out_hdr,rec,"DS",args->dsarr,nsmpl*(nals-1));
+}
+
+/*
+    Normalized genotype probabilities from PL or GL. The likelihoods are
+    scaled by the most likely genotype first so that the conversion of PLs
+    can use a lookup table.
+*/
+static void lk_to_gp(args_t *args, int32_t *pl, float *gl, float *gp, int n, int nsmpl)
+{
+    int i, j;
+    for (i=0; i<nsmpl; i++)
+    {
+        float sum = 0, *dst = gp + i*n;
+        if ( pl )
+        {
+            int32_t *src = pl + i*n, min = INT32_MAX;
+            for (j=0; j<n; j++)
+            {
+                if ( src[j]==bcf_int32_vector_end ) break;
+                if ( src[j]!=bcf_int32_missing && min > src[j] ) min = src[j];
+            }
+            for (j=0; j<n; j++)
+            {
+                if ( src[j]==bcf_int32_missing ) bcf_float_set_missing(dst[j]);
+                else if ( src[j]==bcf_int32_vector_end ) bcf_float_set_vector_end(dst[j]);
+                else { dst[j] = src[j] - min < PL2PROB_MAX ? args->pl2prob[src[j] - min] : 0; sum += dst[j]; }
+            }
+        }
+        else
+        {
+            float *src = gl + i*n, max = -HUGE_VALF;
+            for (j=0; j<n; j++)
+            {
+                if ( bcf_float_is_vector_end(src[j]) ) break;
+                if ( !bcf_float_is_missing(src[j]) && max < src[j] ) max = src[j];
+            }
+            for (j=0; j<n; j++)
+            {
+                if ( bcf_float_is_missing(src[j]) ) bcf_float_set_missing(dst[j]);
+                else if ( bcf_float_is_vector_end(src[j]) ) bcf_float_set_vector_end(dst[j]);
+                else { dst[j] = expf((src[j] - max) * M_LN10); sum += dst[j]; }
+            }
+        }
+        if ( sum==0 ) continue;
+        for (j=0; j<n; j++)
+        {
+            if ( bcf_float_is_vector_end(dst[j]) ) break;
+            if ( !bcf_float_is_missing(dst[j]) ) dst[j] /= sum;
+        }
+    }
 }
 
-bcf1_t *process(bcf1_t *rec)
+static void process_rec(args_t *args, bcf1_t *rec)
 {
     int i, n;
-    if ( mode==GP_TO_GL )
+    if ( args->mode==GL_TO_GP || args->mode==PL_TO_GP )
     {
-        n = bcf_get_format_float(in_hdr,rec,"GP",&farr,&mfarr);
-        if ( n<=0 ) return rec;
+        int nsmpl = bcf_hdr_nsamples(args->in_hdr);
+        if ( args->mode==PL_TO_GP )
+        {
+            n = bcf_get_format_int32(args->in_hdr,rec,"PL",&args->iarr,&args->miarr);
+            if ( n<=0 ) return;
+            hts_expand(float, n, args->mfarr, args->farr);
+            lk_to_gp(args, args->iarr, NULL, args->farr, n/nsmpl, nsmpl);
+        }
+        else
+        {
+            // the GLs are converted in place, the float is read before the probability is written
+            n = bcf_get_format_float(args->in_hdr,rec,"GL",&args->farr,&args->mfarr);
+            if ( n<=0 ) return;
+            lk_to_gp(args, NULL, args->farr, args->farr, n/nsmpl, nsmpl);
+        }
+        bcf_update_format_float(args->out_hdr,rec,"GP",args->farr,n);
+        if ( args->write_ds ) update_ds(args, rec, args->farr, n/nsmpl);
+        if ( args->drop_source_tag )
+        {
+            if ( args->mode==PL_TO_GP ) bcf_update_format_int32(args->out_hdr,rec,"PL",NULL,0);
+            else bcf_update_format_float(args->out_hdr,rec,"GL",NULL,0);
+        }
+    }
+    else if ( args->mode==GP_TO_GL )
+    {
+        n = bcf_get_format_float(args->in_hdr,rec,"GP",&args->farr,&args->mfarr);
+        if ( n<=0 ) return;
+        if ( args->write_ds ) update_ds(args, rec, args->farr, n/bcf_hdr_nsamples(args->in_hdr));
         for (i=0; i<n; i++)
         {
-            if ( bcf_float_is_missing(farr[i]) || bcf_float_is_vector_end(farr[i]) ) continue;
-            farr[i] = farr[i] ? log10(farr[i]) : -99;
+            if ( bcf_float_is_missing(args->farr[i]) || bcf_float_is_vector_end(args->farr[i]) ) continue;
+            args->farr[i] = args->farr[i] ? log10(args->farr[i]) : -99;
         }
-        bcf_update_format_float(out_hdr,rec,"GL",farr,n);
-        if ( drop_source_tag )
-            bcf_update_format_float(out_hdr,rec,"GP",NULL,0);
+        bcf_update_format_float(args->out_hdr,rec,"GL",args->farr,n);
+        if ( args->drop_source_tag )
+            bcf_update_format_float(args->out_hdr,rec,"GP",NULL,0);
     }
-    else if ( mode==PL_TO_GL )
+    else if ( args->mode==PL_TO_GL )
     {
-        n = bcf_get_format_int32(in_hdr,rec,"PL",&iarr,&miarr);
-        if ( n<=0 ) return rec;
-        hts_expand(float, n, mfarr, farr);
+        n = bcf_get_format_int32(args->in_hdr,rec,"PL",&args->iarr,&args->miarr);
+        if ( n<=0 ) return;
+        hts_expand(float, n, args->mfarr, args->farr);
         for (i=0; i<n; i++)
         {
-            if ( iarr[i]==bcf_int32_missing )
-                bcf_float_set_missing(farr[i]);
-            else if ( iarr[i]==bcf_int32_vector_end )
-                bcf_float_set_vector_end(farr[i]);
+            if ( args->iarr[i]==bcf_int32_missing )
+                bcf_float_set_missing(args->farr[i]);
+            else if ( args->iarr[i]==bcf_int32_vector_end )
+                bcf_float_set_vector_end(args->farr[i]);
             else
-                farr[i] = -0.1 * iarr[i];
+                args->farr[i] = -0.1 * args->iarr[i];
         }
-        bcf_update_format_float(out_hdr,rec,"GL",farr,n);
-        if ( drop_source_tag )
-            bcf_update_format_int32(out_hdr,rec,"PL",NULL,0);
+        bcf_update_format_float(args->out_hdr,rec,"GL",args->farr,n);
+        if ( args->drop_source_tag )
+            bcf_update_format_int32(args->out_hdr,rec,"PL",NULL,0);
     }
-    else if ( mode==GL_TO_PL )
+    else if ( args->mode==GL_TO_PL )
     {
-        n = bcf_get_format_float(in_hdr,rec,"GL",&farr,&mfarr);
-        if ( n<=0 ) return rec;
-        hts_expand(int32_t, n, miarr, iarr);
+        n = bcf_get_format_float(args->in_hdr,rec,"GL",&args->farr,&args->mfarr);
+        if ( n<=0 ) return;
+        hts_expand(int32_t, n, args->miarr, args->iarr);
         for (i=0; i<n; i++)
         {
-            if ( bcf_float_is_missing(farr[i]) )
-                iarr[i] = bcf_int32_missing;
-            else if ( bcf_float_is_vector_end(farr[i]) )
-                iarr[i] = bcf_int32_vector_end;
+            if ( bcf_float_is_missing(args->farr[i]) )
+                args->iarr[i] = bcf_int32_missing;
+            else if ( bcf_float_is_vector_end(args->farr[i]) )
+                args->iarr[i] = bcf_int32_vector_end;
             else
-                iarr[i] = lroundf(-10 * farr[i]);
+                args->iarr[i] = lroundf(-10 * args->farr[i]);
         }
-        bcf_update_format_int32(out_hdr,rec,"PL",iarr,n);
-        if ( drop_source_tag )
-            bcf_update_format_float(out_hdr,rec,"GL",NULL,0);
+        bcf_update_format_int32(args->out_hdr,rec,"PL",args->iarr,n);
+        if ( args->drop_source_tag )
+            bcf_update_format_float(args->out_hdr,rec,"GL",NULL,0);
     }
-    else if ( mode==GP_TO_GT )
+    else if ( args->mode==GP_TO_GT )
     {
         int nals  = rec->n_allele;
-        int nsmpl = bcf_hdr_nsamples(in_hdr);
-        hts_expand(int32_t,nsmpl*2,miarr,iarr);
+        int nsmpl = bcf_hdr_nsamples(args->in_hdr);
+        hts_expand(int32_t,nsmpl*2,args->miarr,args->iarr);
 
-        n = bcf_get_format_float(in_hdr,rec,"GP",&farr,&mfarr);
-        if ( n<=0 ) return rec;
+        n = bcf_get_format_float(args->in_hdr,rec,"GP",&args->farr,&args->mfarr);
+        if ( n<=0 ) return;
 
         n /= nsmpl;
+        if ( args->write_ds ) update_ds(args, rec, args->farr, n);
         for (i=0; i<nsmpl; i++)
         {
-            float *ptr = farr + i*n;
+            float *ptr = args->farr + i*n;
             if ( bcf_float_is_missing(ptr[0]) )
             {
-                iarr[2*i] = iarr[2*i+1] = bcf_gt_missing;
+                args->iarr[2*i] = args->iarr[2*i+1] = bcf_gt_missing;
                 continue;
             }
 
@@ -211,44 +359,56 @@ bcf1_t *process(bcf1_t *rec)
             // haploid genotype
             if ( j==nals )
             {
-                iarr[2*i]   = ptr[jmax] < 1-thresh ? bcf_gt_missing : bcf_gt_unphased(jmax);
-                iarr[2*i+1] = bcf_int32_vector_end;
+                args->iarr[2*i]   = ptr[jmax] < 1-args->thresh ? bcf_gt_missing : bcf_gt_unphased(jmax);
+                args->iarr[2*i+1] = bcf_int32_vector_end;
                 continue;
             }
 
             if ( j!=nals*(nals+1)/2 )
                 error("Wrong number of GP values for diploid genotype at %s:%d, expected %d, found %d\n",
-                    bcf_seqname(in_hdr,rec),rec->pos+1, nals*(nals+1)/2,j);
+                    bcf_seqname(args->in_hdr,rec),rec->pos+1, nals*(nals+1)/2,j);
 
-            if (ptr[jmax] < 1-thresh)
+            if (ptr[jmax] < 1-args->thresh)
             {
-                iarr[2*i] = iarr[2*i+1] = bcf_gt_missing;
+                args->iarr[2*i] = args->iarr[2*i+1] = bcf_gt_missing;
                 continue;
             }
 
             // most common case: RR
             if ( jmax==0 )
             {
-                iarr[2*i] = iarr[2*i+1] = bcf_gt_unphased(0);
+                args->iarr[2*i] = args->iarr[2*i+1] = bcf_gt_unphased(0);
                 continue;
             }
 
             int a,b;
             bcf_gt2alleles(jmax,&a,&b);
-            iarr[2*i]   = bcf_gt_unphased(a);
-            iarr[2*i+1] = bcf_gt_unphased(b);
+            args->iarr[2*i]   = bcf_gt_unphased(a);
+            args->iarr[2*i+1] = bcf_gt_unphased(b);
         }
-        bcf_update_genotypes(out_hdr,rec,iarr,nsmpl*2);
-        if ( drop_source_tag )
-            bcf_update_format_float(out_hdr,rec,"GP",NULL,0);
+        bcf_update_genotypes(args->out_hdr,rec,args->iarr,nsmpl*2);
+        if ( args->drop_source_tag )
+            bcf_update_format_float(args->out_hdr,rec,"GP",NULL,0);
     }
-    return rec;
 }
 
-void destroy(void)
+// The conversion buffers are kept in the context, the plugin is therefore
+// not thread-safe
+int process_batch(void *ctx, bcf1_t **recs, int nrecs)
+{
+    args_t *args = (args_t*) ctx;
+    int i;
+    for (i=0; i<nrecs; i++) process_rec(args, recs[i]);
+    return 0;
+}
+
+void destroy2(void *ctx)
 {
-    free(farr);
-    free(iarr);
+    args_t *args = (args_t*) ctx;
+    free(args->farr);
+    free(args->iarr);
+    free(args->dsarr);
+    free(args);
 }
 
 
@@ -51,6 +51,20 @@ typedef struct
 }
 pop_t;
 
+typedef struct
+{
+    int rid, iwin;
+    int beg, end;                   // the first and the last informative site, 0-based
+    uint32_t err, nswitch, ntest;
+}
+reg_t;
+
+// Outcome of a trio at a site, see trio_check()
+#define TRIO_SKIP   0
+#define TRIO_MERR   1
+#define TRIO_PHASE1 2
+#define TRIO_PHASE2 3
+
 typedef struct
 {
     int argc;
@@ -58,10 +72,13 @@ typedef struct
     bcf_hdr_t *hdr;
     trio_t *trio;
     int ntrio, mtrio;
-    int32_t *gt_arr;
     int npop;
     pop_t *pop;
-    int mgt_arr, prev_rid;
+    int prev_rid, win;
+    reg_t *reg;
+    int nreg, mreg;
+    uint8_t *gt_codes;              // per-sample genotype codes of the current site, see process()
+    uint8_t trio_tbl[4096];         // trio_check() for all combinations of child,father,mother codes
 }
 args_t;
 
@@ -84,6 +101,8 @@ const char *usage(void)
         "Plugin options:\n"
         "   -p, --ped <file>        PED file with optional 7th column to group\n"
         "                           results by population\n"
+        "   -w, --window <int>      report switch rates in windows of <int> bp, rather than\n"
+        "                           per chromosome\n"
         "\n"
         "Example:\n"
         "   bcftools +trio-switch-rate file.bcf -- -p file.ped\n"
@@ -144,6 +163,32 @@ void parse_ped(args_t *args, char *fname)
     hts_close(fp);
 }
 
+/*
+    Diploid genotypes with alleles 0 and 1 are encoded in four bits as
+        a | b<<1 | phased<<2 | 1<<3
+    where a,b are the two alleles and the phase is taken from the second
+    allele. All other genotypes (missing, haploid, multiallelic) are 0.
+*/
+#define GT_VALID  8
+#define GT_PHASED 4
+#define GT_A(x) ((x)&1)
+#define GT_B(x) (((x)>>1)&1)
+
+static int trio_check(int child, int father, int mother)
+{
+    if ( !(child&GT_VALID) || !(child&GT_PHASED) ) return TRIO_SKIP;
+    if ( GT_A(child)+GT_B(child) != 1 ) return TRIO_SKIP;     // child is not a het
+    if ( !(father&GT_VALID) || !(mother&GT_VALID) ) return TRIO_SKIP;
+
+    int fsum = GT_A(father)+GT_B(father), msum = GT_A(mother)+GT_B(mother);
+    if ( fsum==1 && msum==1 ) return TRIO_SKIP;                     // both parents are hets
+    if ( fsum==msum ) return TRIO_MERR;                             // mendelian error
+
+    // which of the child's haplotypes was transmitted by the homozygous parent
+    if ( GT_A(father)==GT_B(father) ) return GT_A(child)==GT_A(father) ? TRIO_PHASE2 : TRIO_PHASE1;
+    return GT_B(child)==GT_A(mother) ? TRIO_PHASE2 : TRIO_PHASE1;
+}
+
 int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
 {
     memset(&args,0,sizeof(args_t));
@@ -154,14 +199,20 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     static struct option loptions[] =
     {
         {"ped",required_argument,NULL,'p'},
+        {"window",required_argument,NULL,'w'},
         {0,0,0,0}
     };
     int c;
-    while ((c = getopt_long(argc, argv, "?hp:",loptions,NULL)) >= 0)
+    char *tmp;
+    while ((c = getopt_long(argc, argv, "?hp:w:",loptions,NULL)) >= 0)
     {
         switch (c) 
         {
             case 'p': ped_fname = optarg; break;
+            case 'w': 
+                args.win = strtol(optarg,&tmp,10);
+                if ( *tmp || args.win<=0 ) error("Could not parse: -w %s\n", optarg);
+                break;
             case 'h':
             case '?':
             default: error("%s", usage()); break;
@@ -169,34 +220,45 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     }
     if ( !ped_fname ) error("Expected the -p option\n");
     parse_ped(&args, ped_fname);
+
+    args.gt_codes = (uint8_t*) malloc(bcf_hdr_nsamples(args.hdr));
+    int child, father, mother;
+    for (child=0; child<16; child++)
+        for (father=0; father<16; father++)
+            for (mother=0; mother<16; mother++)
+                args.trio_tbl[child<<8|father<<4|mother] = trio_check(child,father,mother);
     return 1;
 }
 
-typedef struct
-{
-    int a, b, phased;
+// Encode the genotypes of all samples once per site, straight from the typed BCF buffer
+#define BRANCH(type_t) \
+{ \
+    for (i=0; i<nsmpl; i++) \
+    { \
+        type_t *p = (type_t*) (fmt->p + i*fmt->size); \
+        int a = (p[0]>>1) - 1, b = (p[1]>>1) - 1; \
+        args.gt_codes[i] = (unsigned)a<2 && (unsigned)b<2 ? GT_VALID | (p[1]&1)<<2 | b<<1 | a : 0; \
+    } \
 }
-gt_t;
-
-int parse_genotype(gt_t *gt, int32_t *ptr);
-
-inline int parse_genotype(gt_t *gt, int32_t *ptr)
+static int set_gt_codes(bcf1_t *rec)
 {
-    if ( ptr[0]==bcf_gt_missing ) return 0;
-    if ( ptr[1]==bcf_gt_missing ) return 0;
-    if ( ptr[1]==bcf_int32_vector_end ) return 0;
-    gt->phased = bcf_gt_is_phased(ptr[1]) ? 1 : 0;
-    gt->a = bcf_gt_allele(ptr[0]); if ( gt->a > 1 ) return 0;  // consider only the first two alleles at biallelic sites
-    gt->b = bcf_gt_allele(ptr[1]); if ( gt->b > 1 ) return 0;
+    bcf_fmt_t *fmt = bcf_get_fmt(args.hdr, rec, "GT");
+    if ( !fmt || fmt->n!=2 ) return 0;
+    int i, nsmpl = bcf_hdr_nsamples(args.hdr);
+    switch (fmt->type)
+    {
+        case BCF_BT_INT8:  BRANCH(int8_t); break;
+        case BCF_BT_INT16: BRANCH(int16_t); break;
+        case BCF_BT_INT32: BRANCH(int32_t); break;
+        default: error("Unexpected GT type: %d\n", fmt->type);
+    }
     return 1;
 }
+#undef BRANCH
 
 bcf1_t *process(bcf1_t *rec)
 {
-    int ngt = bcf_get_genotypes(args.hdr, rec, &args.gt_arr, &args.mgt_arr);
-    if ( ngt<0 ) return NULL;
-    ngt /= bcf_hdr_nsamples(args.hdr);
-    if ( ngt!=2 ) return NULL;
+    if ( !set_gt_codes(rec) ) return NULL;
 
     int i;
     if ( rec->rid!=args.prev_rid )
@@ -205,30 +267,37 @@ bcf1_t *process(bcf1_t *rec)
         for (i=0; i<args.ntrio; i++) args.trio[i].prev = 0;
     }
 
-    gt_t child, father, mother;
+    uint32_t err = 0, nswitch = 0, ntest = 0;
     for (i=0; i<args.ntrio; i++)
     {
         trio_t *trio = &args.trio[i];
+        int ret = args.trio_tbl[args.gt_codes[trio->child]<<8 | args.gt_codes[trio->father]<<4 | args.gt_codes[trio->mother]];
+        if ( ret==TRIO_SKIP ) continue;
+        if ( ret==TRIO_MERR ) { trio->err++; err++; continue; }
 
-        if ( !parse_genotype(&child, args.gt_arr + ngt*trio->child) ) continue;
-        if ( !child.phased ) continue;
-        if ( child.a+child.b != 1 ) continue;       // child is not a het
-
-        if ( !parse_genotype(&father, args.gt_arr + ngt*trio->father) ) continue;
-        if ( !parse_genotype(&mother, args.gt_arr + ngt*trio->mother) ) continue;
-        if ( father.a+father.b == 1 && mother.a+mother.b == 1 ) continue;     // both parents are hets
-        if ( father.a+father.b == mother.a+mother.b ) { trio->err++; continue; }    // mendelian error
-
-        int test_phase = 0; 
-        if ( father.a==father.b ) test_phase = 1 + (child.a==father.a);
-        else if ( mother.a==mother.b ) test_phase = 1 + (child.b==mother.a);
-        if ( trio->prev > 0 )
-        {
-            if ( trio->prev!=test_phase ) trio->nswitch++;
-        }
+        int test_phase = ret==TRIO_PHASE1 ? 1 : 2;
+        if ( trio->prev > 0 && trio->prev!=test_phase ) { trio->nswitch++; nswitch++; }
         trio->ntest++;
+        ntest++;
         trio->prev = test_phase;
     }
+    if ( !err && !ntest ) return NULL;
+
+    int iwin = args.win ? rec->pos / args.win : 0;
+    reg_t *reg = args.nreg ? &args.reg[args.nreg-1] : NULL;
+    if ( !reg || reg->rid!=rec->rid || reg->iwin!=iwin )
+    {
+        args.nreg++;
+        hts_expand0(reg_t,args.nreg,args.mreg,args.reg);
+        reg = &args.reg[args.nreg-1];
+        reg->rid  = rec->rid;
+        reg->iwin = iwin;
+        reg->beg  = rec->pos;
+    }
+    reg->end = rec->pos;
+    reg->err     += err;
+    reg->nswitch += nswitch;
+    reg->ntest   += ntest;
     return NULL;
 }
 
@@ -266,8 +335,17 @@ void destroy(void)
             (float)pop->ntest/pop->ntrio,(float)pop->err/pop->ntrio,(float)pop->nswitch/pop->ntrio,
             pop->pswitch/pop->ntrio);
     }
+    printf("# REG\tswitch rates of all trios per chromosome, or per window with -w\n");
+    printf("# REG\t[2]Chromosome\t[3]First site\t[4]Last site\t[5]nTested\t[6]nMendelian Errors\t[7]nSwitch\t[8]nSwitch (%%)\n");
+    for (i=0; i<args.nreg; i++)
+    {
+        reg_t *reg = &args.reg[i];
+        printf("REG\t%s\t%d\t%d\t%d\t%d\t%d\t%.2f\n", bcf_hdr_id2name(args.hdr,reg->rid),reg->beg+1,reg->end+1,
+            reg->ntest, reg->err, reg->nswitch, reg->ntest ? reg->nswitch*100./reg->ntest : 0);
+    }
     for (i=0; i<args.npop; i++) free(args.pop[i].name);
     free(args.pop);
     free(args.trio);
-    free(args.gt_arr);
+    free(args.gt_codes);
+    free(args.reg);
 }
@@ -23,6 +23,10 @@
 */
 
 #include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <htslib/hts.h>
 #include <htslib/kstring.h>
 #include <htslib/kseq.h>
@@ -31,7 +35,34 @@
 
 #define MAX_COOR_0 REGIDX_MAX   // CSI and hts_itr_query limit, 0-based
 
-#define iBIN(x) ((x)>>13)
+// Subtrees of the interval tree up to this level are scanned linearly
+#define ITR_SCAN_LEVEL 3
+
+/*
+    The binary image written by regidx_save() and mapped by regidx_load_mmap().
+    The regions are stored sorted with the interval tree already built so that
+    the arrays can be used directly from the mapping. All numbers are in native
+    byte order:
+
+        char     magic[8]           "REGIDXDB"
+        uint32_t version, nseq
+        uint32_t payload_size, unused
+        nseq x:
+            uint64_t offset         of the region arrays from the file start
+            uint32_t nreg           number of regions
+            uint32_t max_level      the level of the root of the interval tree
+            uint32_t len            length of the sequence name, including the NUL byte
+            uint32_t unused
+            char     name[len]      padded to a multiple of 8 bytes
+        nseq x, at the given offsets:
+            reg_t    reg[nreg]
+            uint32_t max[nreg]                      padded to a multiple of 8 bytes
+            uint8_t  dat[nreg*payload_size]         padded to a multiple of 8 bytes
+*/
+#define IMG_MAGIC    "REGIDXDB"
+#define IMG_VERSION  1
+#define IMG_PAD8(x)  (((x) + 7) & ~(uint64_t)7)
+#define IMG_SUFFIX   ".ridx"
 
 typedef struct
 {
@@ -47,19 +78,40 @@ pos_t;
 
 typedef struct _reglist_t reglist_t;
 
+typedef struct
+{
+    uint32_t x;     // node of the interval tree, an index to reglist.reg
+    int k, w;       // level of the node and the number of visits
+}
+_itr_node_t;
+
 typedef struct
 {
     uint32_t beg, end, ireg;      // query coordinates and the active region
     regidx_t *ridx;
     reglist_t *list;
     int active;
+    _itr_node_t stack[64];      // traversal of the interval tree, see _itr_next()
+    int nstack;
+    uint32_t iscan, nscan;      // linear scan of a small subtree
 }
 _itr_t;
 
-// List of regions for one chromosome.
+/*
+    List of regions for one chromosome.
+
+    The regions are sorted by start and form an implicit augmented interval
+    tree: the node at level k is the region with index x whose lowest k bits
+    are set and the (k+1)-th bit is not, its children are x-2^(k-1) and
+    x+2^(k-1). Each node stores the maximum end of its subtree in max[x].
+    The root is (1<<max_level)-1, nodes past the end of the list are
+    imaginary. Unlike a binning index, long intervals do not slow down the
+    queries. The layout follows cgranges by Heng Li.
+*/
 struct _reglist_t
 {
-    uint32_t *idx, nidx;    // index to list.reg+1
+    uint32_t *max;          // interval tree, the maximum end in the subtree; NULL if not built yet
+    int max_level;          // the level of the root node
     uint32_t nreg, mreg;    // n:used, m:allocated
     reg_t *reg;             // regions
     void *dat;              // payload data
@@ -68,6 +120,8 @@ struct _reglist_t
 
 };
 
+static int _reglist_build_index(regidx_t *regidx, reglist_t *list);
+
 // Container of all sequences
 struct _regidx_t
 {
@@ -81,6 +135,8 @@ struct _regidx_t
     int payload_size;
     void *payload;          // temporary payload data set by regidx_parse_f (sequence is not known beforehand)
     kstring_t str;
+    void *map;              // the image mapped by regidx_load_mmap(), the lists point into it and are read-only
+    size_t map_size;
 };
 
 int regidx_seq_nregs(regidx_t *idx, const char *seq)
@@ -144,6 +200,8 @@ static int cmp_reg_ptrs2(const void *a, const void *b)
 
 inline int regidx_push(regidx_t *idx, char *chr_beg, char *chr_end, uint32_t beg, uint32_t end, void *payload)
 {
+    if ( idx->map ) return -1;  // mapped images are read-only
+
     if ( beg > MAX_COOR_0 ) beg = MAX_COOR_0;
     if ( end > MAX_COOR_0 ) end = MAX_COOR_0;
 
@@ -163,6 +221,12 @@ inline int regidx_push(regidx_t *idx, char *chr_beg, char *chr_end, uint32_t beg
 
     reglist_t *list = &idx->seq[rid];
     list->seq = idx->seq_names[rid];
+    if ( list->max )
+    {
+        // the index is rebuilt on the next query
+        free(list->max);
+        list->max = NULL;
+    }
     list->nreg++;
     int mreg = list->mreg;
     hts_expand(reg_t,list->nreg,list->mreg,list->reg);
@@ -177,37 +241,84 @@ inline int regidx_push(regidx_t *idx, char *chr_beg, char *chr_end, uint32_t beg
     return 0;
 }
 
+int regidx_build(regidx_t *idx)
+{
+    int i;
+    for (i=0; i<idx->nseq; i++)
+    {
+        reglist_t *list = &idx->seq[i];
+        if ( list->nreg && !list->max ) _reglist_build_index(idx,list);
+    }
+    return 0;
+}
 int regidx_insert(regidx_t *idx, char *line)
 {
-    if ( !line ) return 0;
+    if ( !line ) return regidx_build(idx);   // no more regions, the index can be shared
     char *chr_from, *chr_to;
     uint32_t beg,end;
+    if ( idx->map ) return -1;  // mapped images are read-only
     int ret = idx->parse(line,&chr_from,&chr_to,&beg,&end,idx->payload,idx->usr);
     if ( ret==-2 ) return -1;   // error
     if ( ret==-1 ) return 0;    // skip the line
-    regidx_push(idx, chr_from,chr_to,beg,end,idx->payload);
-    return 0;
+    return regidx_push(idx, chr_from,chr_to,beg,end,idx->payload);
+}
+
+// Is this a regular file starting with the image magic? Pipes must not be read here
+int regidx_is_image(const char *fname)
+{
+    struct stat st;
+    if ( stat(fname, &st)!=0 || !S_ISREG(st.st_mode) ) return 0;
+    int fd = open(fname, O_RDONLY);
+    if ( fd<0 ) return 0;
+    char magic[8];
+    int ret = read(fd, magic, 8)==8 && !memcmp(magic, IMG_MAGIC, 8);
+    close(fd);
+    return ret;
+}
+
+// The image given directly or FNAME.ridx if not older than the text file
+static regidx_t *_regidx_init_image(const char *fname, int *is_image)
+{
+    *is_image = regidx_is_image(fname);
+    if ( *is_image ) return regidx_load_mmap(fname);
+
+    struct stat st_txt, st_img;
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s%s", fname, IMG_SUFFIX);
+    regidx_t *idx = NULL;
+    if ( stat(fname, &st_txt)==0 && stat(str.s, &st_img)==0 && st_img.st_mtime >= st_txt.st_mtime )
+        idx = regidx_load_mmap(str.s);
+    free(str.s);
+    if ( idx && idx->payload_size )
+    {
+        regidx_destroy(idx);
+        idx = NULL;
+    }
+    return idx;
+}
+
+regidx_parse_f regidx_default_parser(const char *fname)
+{
+    if ( !fname ) return regidx_parse_tab;
+    int len = strlen(fname);
+    if ( len>=7 && !strcasecmp(".bed.gz",fname+len-7) ) return regidx_parse_bed;
+    if ( len>=8 && !strcasecmp(".bed.bgz",fname+len-8) ) return regidx_parse_bed;
+    if ( len>=4 && !strcasecmp(".bed",fname+len-4) ) return regidx_parse_bed;
+    return regidx_parse_tab;
 }
 
 regidx_t *regidx_init(const char *fname, regidx_parse_f parser, regidx_free_f free_f, size_t payload_size, void *usr_dat)
 {
-    if ( !parser )
+    if ( fname && !parser && !free_f && !payload_size )
     {
-        if ( !fname ) parser = regidx_parse_tab;
-        else
-        {
-            int len = strlen(fname);
-            if ( len>=7 && !strcasecmp(".bed.gz",fname+len-7) )
-                parser = regidx_parse_bed;
-            else if ( len>=8 && !strcasecmp(".bed.bgz",fname+len-8) )
-                parser = regidx_parse_bed;
-            else if ( len>=4 && !strcasecmp(".bed",fname+len-4) )
-                parser = regidx_parse_bed;
-            else
-                parser = regidx_parse_tab;
-        }
+        // the default parsers with no payload can use a binary image instead of the text file
+        int is_image;
+        regidx_t *idx = _regidx_init_image(fname, &is_image);
+        if ( idx || is_image ) return idx;
     }
 
+    if ( !parser ) parser = regidx_default_parser(fname);
+
     regidx_t *idx = (regidx_t*) calloc(1,sizeof(regidx_t));
     idx->free  = free_f;
     idx->parse = parser;
@@ -227,6 +338,7 @@ regidx_t *regidx_init(const char *fname, regidx_parse_f parser, regidx_free_f fr
     {
         if ( regidx_insert(idx, str.s) ) goto error;
     }
+    regidx_build(idx);
 
     free(str.s);
     hts_close(fp);
@@ -245,6 +357,7 @@ void regidx_destroy(regidx_t *idx)
     for (i=0; i<idx->nseq; i++)
     {
         reglist_t *list = &idx->seq[i];
+        if ( idx->map ) continue;   // the arrays point into the mapped image
         if ( idx->free )
         {
             for (j=0; j<list->nreg; j++)
@@ -252,17 +365,18 @@ void regidx_destroy(regidx_t *idx)
         }
         free(list->dat);
         free(list->reg);
-        free(list->idx);
+        free(list->max);
     }
     free(idx->seq_names);
     free(idx->seq);
     free(idx->str.s);
     free(idx->payload);
     khash_str2int_destroy_free(idx->seq2regs);
+    if ( idx->map ) munmap(idx->map, idx->map_size);
     free(idx);
 }
 
-int _reglist_build_index(regidx_t *regidx, reglist_t *list)
+static int _reglist_build_index(regidx_t *regidx, reglist_t *list)
 {
     int i;
     if ( list->unsorted )
@@ -300,33 +414,95 @@ int _reglist_build_index(regidx_t *regidx, reglist_t *list)
         list->unsorted = 0;
     }
 
-    list->nidx = 0;
-    int j,k, midx = 0;
-    for (j=0; j<list->nreg; j++)
+    // The maximum end of each subtree, imaginary right children take the value of
+    // the last existing node at the same level
+    int64_t n = list->nreg, last_i = 0;
+    uint32_t last = 0;
+    int k;
+    list->max = (uint32_t*) malloc(sizeof(uint32_t)*n);
+    for (i=0; i<n; i+=2)
+    {
+        last_i = i;
+        last = list->max[i] = list->reg[i].end;
+    }
+    for (k=1; (1LL<<k) <= n; k++)
+    {
+        int64_t j, x = 1LL<<(k-1), j0 = (x<<1) - 1, step = x<<2;
+        for (j=j0; j<n; j+=step)
+        {
+            uint32_t el = list->max[j-x];
+            uint32_t er = j+x < n ? list->max[j+x] : last;
+            uint32_t e  = list->reg[j].end;
+            if ( e < el ) e = el;
+            if ( e < er ) e = er;
+            list->max[j] = e;
+        }
+        last_i = last_i>>k&1 ? last_i - x : last_i + x;
+        if ( last_i < n && list->max[last_i] > last ) last = list->max[last_i];
+    }
+    list->max_level = k - 1;
+
+    return 0;
+}
+
+static inline void _itr_push(_itr_t *itr, uint32_t x, int k, int w)
+{
+    _itr_node_t *node = &itr->stack[itr->nstack++];
+    node->x = x;
+    node->k = k;
+    node->w = w;
+}
+
+static void _itr_start(_itr_t *itr, reglist_t *list, uint32_t beg, uint32_t end)
+{
+    itr->list  = list;
+    itr->beg   = beg;
+    itr->end   = end;
+    itr->iscan = itr->nscan = 0;
+    itr->nstack = 0;
+    _itr_push(itr, (1U<<list->max_level) - 1, list->max_level, 0);
+}
+
+/*
+    In-order traversal of the interval tree, returns the index of the next
+    overlapping region or -1 when done. The regions are returned in the
+    sorted order and all state is kept in the iterator.
+*/
+static int _itr_next(_itr_t *itr)
+{
+    reglist_t *list = itr->list;
+    reg_t *reg = list->reg;
+    while (1)
     {
-        int ibeg = iBIN(list->reg[j].beg);
-        int iend = iBIN(list->reg[j].end);
-        if ( midx <= iend )
+        while ( itr->iscan < itr->nscan )
         {
-            int old_midx = midx; 
-            midx = iend + 1;
-            kroundup32(midx);
-            list->idx = (uint32_t*) realloc(list->idx, midx*sizeof(uint32_t));
-            memset(list->idx+old_midx, 0, sizeof(uint32_t)*(midx-old_midx));
+            uint32_t i = itr->iscan++;
+            if ( reg[i].beg > itr->end ) { itr->nscan = itr->nstack = 0; return -1; }  // past the query region
+            if ( reg[i].end >= itr->beg ) return i;
         }
-        if ( ibeg==iend )
+        if ( !itr->nstack ) return -1;
+
+        _itr_node_t z = itr->stack[--itr->nstack];
+        if ( z.k <= ITR_SCAN_LEVEL )
         {
-            if ( !list->idx[ibeg] ) list->idx[ibeg] = j + 1;
+            itr->iscan = z.x >> z.k << z.k;
+            itr->nscan = itr->iscan + (1U<<(z.k+1)) - 1;
+            if ( itr->nscan > list->nreg ) itr->nscan = list->nreg;
         }
-        else
+        else if ( !z.w )
+        {
+            // visit the left subtree first, then come back to this node
+            uint32_t y = z.x - (1U<<(z.k-1));
+            _itr_push(itr, z.x, z.k, 1);
+            if ( y >= list->nreg || list->max[y] >= itr->beg ) _itr_push(itr, y, z.k-1, 0);
+        }
+        else if ( z.x < list->nreg && reg[z.x].beg <= itr->end )
         {
-            for (k=ibeg; k<=iend; k++)
-                if ( !list->idx[k] ) list->idx[k] = j + 1;
+            _itr_push(itr, z.x + (1U<<(z.k-1)), z.k-1, 0);
+            if ( reg[z.x].end >= itr->beg ) return z.x;
         }
-        if ( list->nidx < iend+1 ) list->nidx = iend+1;
     }
-
-    return 0;
+    return -1;
 }
 
 int regidx_overlap(regidx_t *regidx, const char *chr, uint32_t beg, uint32_t end, regitr_t *regitr)
@@ -339,49 +515,18 @@ int regidx_overlap(regidx_t *regidx, const char *chr, uint32_t beg, uint32_t end
     reglist_t *list = &regidx->seq[iseq];
     if ( !list->nreg ) return 0;
 
-    if ( list->nreg==1 )
-    {
-        if ( beg > list->reg[0].end ) return 0;
-        if ( end < list->reg[0].beg ) return 0;
-        ireg = 0;
-    }
-    else
-    {
-        if ( !list->idx )
-            _reglist_build_index(regidx,list);
-
-        int ibeg = iBIN(beg);
-        if ( ibeg >= list->nidx ) return 0;     // beg is too big
+    if ( !list->max )
+        _reglist_build_index(regidx,list);     // not built by regidx_build(), single-threaded use only
 
-        // find a matching region
-        uint32_t i = list->idx[ibeg];
-        if ( !i )
-        {
-            int iend = iBIN(end);
-            if ( iend > list->nidx ) iend = list->nidx;
-            for (i=ibeg; i<iend; i++)
-                if ( list->idx[i] ) break;
-            if ( i==iend ) return 0;
-            i = list->idx[i];
-        }
-
-        for (ireg=i-1; ireg<list->nreg; ireg++)
-        {
-            if ( list->reg[ireg].beg > end ) return 0;   // no match, past the query region
-            if ( list->reg[ireg].end >= beg && list->reg[ireg].beg <= end ) break; // found
-        }
-
-        if ( ireg >= list->nreg ) return 0;   // no match
-    }
+    _itr_t tmp, *itr = regitr ? (_itr_t*)regitr->itr : &tmp;
+    _itr_start(itr, list, beg, end);
+    ireg = _itr_next(itr);
+    if ( ireg < 0 ) return 0;   // no match
 
     if ( !regitr ) return 1;    // match, but no more info to save
 
     // may need to iterate over the matching regions later
-    _itr_t *itr = (_itr_t*)regitr->itr;
     itr->ridx = regidx;
-    itr->list = list;
-    itr->beg  = beg;
-    itr->end  = end;
     itr->ireg = ireg;
     itr->active = 0;
 
@@ -537,22 +682,14 @@ int regitr_overlap(regitr_t *regitr)
     {
         // is this the first call after regidx_overlap?
         itr->active = 1;
-        itr->ireg++;
         return 1;
     }
 
     reglist_t *list = itr->list;
+    int i = _itr_next(itr);
+    if ( i < 0 ) return 0;   // no more matches
 
-    int i;
-    for (i=itr->ireg; i<list->nreg; i++)
-    {
-        if ( list->reg[i].beg > itr->end ) return 0;   // no match, past the query region
-        if ( list->reg[i].end >= itr->beg && list->reg[i].beg <= itr->end ) break; // found
-    }
-
-    if ( i >= list->nreg ) return 0;   // no match
-
-    itr->ireg = i + 1;
+    itr->ireg = i;
     regitr->seq = list->seq;
     regitr->beg = list->reg[i].beg;
     regitr->end = list->reg[i].end;
@@ -594,5 +731,109 @@ int regitr_loop(regitr_t *regitr)
     return 1;
 }
 
+int regidx_save(regidx_t *idx, const char *fname)
+{
+    if ( idx->free || idx->map ) return -1;     // payload with pointers cannot be saved, images are saved already
 
+    int i;
+    uint64_t off = 24;
+    regidx_build(idx);
+    for (i=0; i<idx->nseq; i++)
+        off += 24 + IMG_PAD8(strlen(idx->seq[i].seq) + 1);
+
+    FILE *fp = fopen(fname, "wb");
+    if ( !fp ) return -1;
+    static const char pad[8] = {0,0,0,0,0,0,0,0};
+    uint32_t hdr[4] = { IMG_VERSION, idx->nseq, idx->payload_size, 0 };
+    int ret = 0;
+    ret |= fwrite(IMG_MAGIC, 8, 1, fp) != 1;
+    ret |= fwrite(hdr, 4, 4, fp) != 4;
+    for (i=0; i<idx->nseq; i++)
+    {
+        reglist_t *list = &idx->seq[i];
+        uint32_t len = strlen(list->seq) + 1;
+        uint32_t dat[4] = { list->nreg, list->max_level, len, 0 };
+        ret |= fwrite(&off, 8, 1, fp) != 1;
+        ret |= fwrite(dat, 4, 4, fp) != 4;
+        ret |= fwrite(list->seq, len, 1, fp) != 1;
+        if ( IMG_PAD8(len) > len ) ret |= fwrite(pad, IMG_PAD8(len) - len, 1, fp) != 1;
+        off += sizeof(reg_t)*list->nreg + IMG_PAD8(4*(uint64_t)list->nreg) + IMG_PAD8((uint64_t)idx->payload_size*list->nreg);
+    }
+    for (i=0; i<idx->nseq && !ret; i++)
+    {
+        reglist_t *list = &idx->seq[i];
+        if ( !list->nreg ) continue;
+        uint64_t len = 4*(uint64_t)list->nreg;
+        ret |= fwrite(list->reg, sizeof(reg_t), list->nreg, fp) != list->nreg;
+        ret |= fwrite(list->max, 4, list->nreg, fp) != list->nreg;
+        if ( IMG_PAD8(len) > len ) ret |= fwrite(pad, IMG_PAD8(len) - len, 1, fp) != 1;
+        if ( !idx->payload_size ) continue;
+        len = (uint64_t)idx->payload_size*list->nreg;
+        ret |= fwrite(list->dat, idx->payload_size, list->nreg, fp) != list->nreg;
+        if ( IMG_PAD8(len) > len ) ret |= fwrite(pad, IMG_PAD8(len) - len, 1, fp) != 1;
+    }
+    if ( fclose(fp)!=0 ) ret = 1;
+    if ( ret ) unlink(fname);
+    return ret ? -1 : 0;
+}
+
+regidx_t *regidx_load_mmap(const char *fname)
+{
+    int fd = open(fname, O_RDONLY);
+    if ( fd<0 ) return NULL;
+    struct stat st;
+    if ( fstat(fd, &st)!=0 || st.st_size < 24 ) { close(fd); return NULL; }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( map==MAP_FAILED ) return NULL;
+
+    regidx_t *idx = (regidx_t*) calloc(1,sizeof(regidx_t));
+    idx->map = map;
+    idx->map_size = st.st_size;
+    idx->seq2regs = khash_str2int_init();
 
+    const uint8_t *beg = (const uint8_t*) map, *ptr = beg + 8, *end = beg + idx->map_size;
+    uint32_t hdr[4];
+    memcpy(hdr, ptr, 16);
+    ptr += 16;
+    if ( memcmp(beg, IMG_MAGIC, 8) || hdr[0]!=IMG_VERSION ) goto error;    // not an image, different version or byte order
+
+    int i;
+    idx->payload_size = hdr[2];
+    idx->seq = (reglist_t*) calloc(hdr[1], sizeof(reglist_t));
+    idx->seq_names = (char**) calloc(hdr[1], sizeof(char*));
+    idx->mseq = hdr[1];
+    for (i=0; i<hdr[1]; i++)
+    {
+        uint64_t off;
+        uint32_t dat[4];
+        if ( end - ptr < 24 ) goto error;
+        memcpy(&off, ptr, 8);
+        memcpy(dat, ptr + 8, 16);
+        ptr += 24;
+        uint32_t nreg = dat[0], len = dat[2];
+        if ( (uint64_t)(end - ptr) < IMG_PAD8(len) || !len || ptr[len-1] ) goto error;
+        if ( khash_str2int_has_key(idx->seq2regs, (char*)ptr) ) goto error;
+
+        reglist_t *list = &idx->seq[i];
+        idx->seq_names[i] = list->seq = strdup((char*)ptr);
+        khash_str2int_set(idx->seq2regs, list->seq, i);
+        idx->nseq++;
+        ptr += IMG_PAD8(len);
+
+        uint64_t size = sizeof(reg_t)*(uint64_t)nreg + IMG_PAD8(4*(uint64_t)nreg) + IMG_PAD8((uint64_t)idx->payload_size*nreg);
+        if ( off & 7 || off > idx->map_size || size > idx->map_size - off ) goto error;
+        if ( nreg && (dat[1] > 31 || (1ULL<<dat[1]) > nreg) ) goto error;
+        list->nreg = nreg;
+        if ( !nreg ) continue;
+        list->max_level = dat[1];
+        list->reg = (reg_t*) (beg + off);
+        list->max = (uint32_t*) (list->reg + nreg);
+        if ( idx->payload_size ) list->dat = (void*) (beg + off + sizeof(reg_t)*(uint64_t)nreg + IMG_PAD8(4*(uint64_t)nreg));
+    }
+    return idx;
+
+error:
+    regidx_destroy(idx);
+    return NULL;
+}
@@ -106,6 +106,7 @@ typedef void (*regidx_free_f)(void *payload);
 int regidx_parse_bed(const char*,char**,char**,uint32_t*,uint32_t*,void*,void*);   // CHROM or whitespace-sepatated CHROM,FROM,TO (0-based,right-open)
 int regidx_parse_tab(const char*,char**,char**,uint32_t*,uint32_t*,void*,void*);   // CHROM or whitespace-separated CHROM,POS (1-based, inclusive)
 int regidx_parse_reg(const char*,char**,char**,uint32_t*,uint32_t*,void*,void*);   // CHROM, CHROM:POS, CHROM:FROM-TO, CHROM:FROM- (1-based, inclusive)
+regidx_parse_f regidx_default_parser(const char *fname);    // the parser autodetected by regidx_init() from the file name
 
 /*
  *  regidx_init() - creates new index
@@ -118,6 +119,10 @@ int regidx_parse_reg(const char*,char**,char**,uint32_t*,uint32_t*,void*,void*);
  *  @param payload_size: 0 with regidx_parse_bed, regidx_parse_tab or see regidx_parse_f
  *  @param usr:    optional user data passed to regidx_parse_f
  *
+ *  With the default parsers and no payload, a binary image created by regidx_save()
+ *  is used instead of the text file when given directly or when a file named
+ *  `fname`.ridx is present and not older than `fname`.
+ *
  *  Returns index on success or NULL on error.
  */
 regidx_t *regidx_init(const char *fname, regidx_parse_f parsef, regidx_free_f freef, size_t payload_size, void *usr);
@@ -127,18 +132,41 @@ regidx_t *regidx_init(const char *fname, regidx_parse_f parsef, regidx_free_f fr
  */
 void regidx_destroy(regidx_t *idx);
 
+/*
+ *  regidx_save() - write the index to a binary image which can be memory-mapped
+ *                  by regidx_load_mmap(). The payload is saved as is and must not
+ *                  contain pointers, therefore indexes with regidx_free_f cannot
+ *                  be saved.
+ *  regidx_load_mmap() - map the image created by regidx_save(). The regions are
+ *                  used directly from the page cache and shared between processes,
+ *                  the index is read-only and regidx_insert() fails.
+ *
+ *  regidx_save() returns 0 on success or -1 on error, regidx_load_mmap() returns
+ *  NULL if the file cannot be mapped or is not a valid image.
+ */
+int regidx_save(regidx_t *idx, const char *fname);
+regidx_t *regidx_load_mmap(const char *fname);
+
+/*
+ *  regidx_is_image() - returns 1 if the file is a binary image created by
+ *                  regidx_save(), 0 otherwise
+ */
+int regidx_is_image(const char *fname);
+
 /*
  *  regidx_overlap() - check overlap of the location chr:from-to with regions
  *  @param beg,end:     0-based start, end coordinate (inclusive)
  *  @param itr:         pointer to iterator, can be NULL if regidx_loop not needed
  *
  *  Returns 0 if there is no overlap or 1 if overlap is found. The overlapping
- *  regions can be iterated as shown in the example above.
+ *  regions can be iterated as shown in the example above, they are returned
+ *  sorted by start, longer regions first.
  */
 int regidx_overlap(regidx_t *idx, const char *chr, uint32_t beg, uint32_t end, regitr_t *itr);
 
 /*
- *  regidx_insert() - add a new region. 
+ *  regidx_insert() - add a new region. Call with line=NULL when done to
+ *                  build the index, same as regidx_build().
  *  regidx_insert_list() - add new regions from a list
  *  regidx_push() - low level insertion of a new region
  *
@@ -148,6 +176,21 @@ int regidx_insert(regidx_t *idx, char *line);
 int regidx_insert_list(regidx_t *idx, char *line, char delim);
 int regidx_push(regidx_t *idx, char *chr_beg, char *chr_end, uint32_t beg, uint32_t end, void *payload);
 
+/*
+ *  regidx_build() - sort the regions and build the index after the last
+ *                  insertion. Indexes created from a file by regidx_init()
+ *                  or mapped by regidx_load_mmap() are built already.
+ *
+ *  A built index is not modified by queries: all query state is kept in the
+ *  iterators, and one index can be shared by multiple threads as long as each
+ *  uses its own regitr_t. Without regidx_build(), the index is built lazily by
+ *  the first regidx_overlap() call, which is safe only in a single thread.
+ *  Inserting new regions invalidates the index.
+ *
+ *  Returns 0 on success or -1 on error.
+ */
+int regidx_build(regidx_t *idx);
+
 /*
  *  regidx_seq_names() - return list of all sequence names
  */
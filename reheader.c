@@ -34,9 +34,11 @@ THE SOFTWARE.  */
 #include <math.h>
 #include <htslib/vcf.h>
 #include <htslib/bgzf.h>
+#include <htslib/hfile.h>
 #include <htslib/tbx.h> // for hts_get_bgzfp()
 #include <htslib/kseq.h>
 #include "bcftools.h"
+#include "bgzf_remap.h"
 #include "khash_str2str.h"
 
 typedef struct _args_t
@@ -366,6 +368,102 @@ static bcf_hdr_t *strip_header(bcf_hdr_t *src, bcf_hdr_t *dst)
     return out;
 }
 
+// Can the records be copied as they are, do all IDs of the old header keep their index?
+static int same_dictionary(bcf_hdr_t *src, bcf_hdr_t *dst)
+{
+    int i, j;
+    if ( src->n[BCF_DT_CTG] > dst->n[BCF_DT_CTG] ) return 0;
+    for (i=0; i<src->n[BCF_DT_CTG]; i++)
+        if ( strcmp(src->id[BCF_DT_CTG][i].key,dst->id[BCF_DT_CTG][i].key) ) return 0;
+    for (i=0; i<src->n[BCF_DT_ID]; i++)
+    {
+        if ( !src->id[BCF_DT_ID][i].key ) continue;
+        if ( i >= dst->n[BCF_DT_ID] || !dst->id[BCF_DT_ID][i].key ) return 0;
+        if ( strcmp(src->id[BCF_DT_ID][i].key,dst->id[BCF_DT_ID][i].key) ) return 0;
+        for (j=BCF_HL_FLT; j<=BCF_HL_FMT; j++)
+            if ( bcf_hdr_idinfo_exists(src,j,i) && !bcf_hdr_idinfo_exists(dst,j,i) ) return 0;
+    }
+    return 1;
+}
+
+/*
+    Copy the CSI index with all offsets adjusted, see hts_idx_save() for the
+    format. The pseudo-bin holds the number of mapped and unmapped records in
+    place of the second chunk.
+*/
+static void reheader_csi(args_t *args, voff_map_t *map)
+{
+    union { uint32_t i; char c[4]; } endian = { 1 };
+    if ( !endian.c[0] ) return;     // big-endian, leave it to "bcftools index"
+
+    kstring_t str = {0,0,0};
+    ksprintf(&str,"%s.csi",args->fname);
+    struct stat st_idx, st_in;
+    if ( stat(str.s,&st_idx)!=0 || stat(args->fname,&st_in)!=0 || st_idx.st_mtime < st_in.st_mtime ) { free(str.s); return; }
+
+    BGZF *in = bgzf_open(str.s,"r");
+    if ( !in ) error("Failed to read %s\n", str.s);
+    str.l = 0;
+    ksprintf(&str,"%s.csi",args->output_fname);
+    BGZF *out = bgzf_open(str.s,"w");
+    if ( !out ) error("Failed to write %s: %s\n", str.s, strerror(errno));
+
+    #define IDX_READ(dst,n) if ( bgzf_read(in,(dst),(n))!=(n) ) error("Failed to read the index of %s\n", args->fname)
+    #define IDX_WRITE(src,n) if ( bgzf_write(out,(src),(n))!=(n) ) error("Failed to write %s\n", str.s)
+    char magic[4];
+    int32_t hdr[3], nref, nbin, nchunk, i, j, k;
+    IDX_READ(magic,4);
+    if ( memcmp(magic,"CSI\1",4) ) error("Not a CSI index: %s.csi\n", args->fname);
+    IDX_READ(hdr,12);           // min_shift, n_lvls, l_meta
+    IDX_WRITE(magic,4);
+    IDX_WRITE(hdr,12);
+    char *meta = (char*) malloc(hdr[2]);
+    IDX_READ(meta,hdr[2]);
+    IDX_WRITE(meta,hdr[2]);
+    free(meta);
+    uint32_t meta_bin = ((1ULL<<(3*hdr[1]+3)) - 1) / 7 + 1, bin;
+    uint64_t off[2];
+    IDX_READ(&nref,4);
+    IDX_WRITE(&nref,4);
+    for (i=0; i<nref; i++)
+    {
+        IDX_READ(&nbin,4);
+        IDX_WRITE(&nbin,4);
+        for (j=0; j<nbin; j++)
+        {
+            IDX_READ(&bin,4);
+            IDX_READ(off,8);
+            IDX_READ(&nchunk,4);
+            off[0] = map_voffset(map,off[0]);
+            IDX_WRITE(&bin,4);
+            IDX_WRITE(off,8);
+            IDX_WRITE(&nchunk,4);
+            for (k=0; k<nchunk; k++)
+            {
+                IDX_READ(off,16);
+                if ( bin!=meta_bin || !k )
+                {
+                    off[0] = map_voffset(map,off[0]);
+                    off[1] = map_voffset(map,off[1]);
+                }
+                IDX_WRITE(off,16);
+            }
+        }
+    }
+    if ( bgzf_read(in,off,8)==8 ) IDX_WRITE(off,8);     // the number of records with no coordinates
+    #undef IDX_READ
+    #undef IDX_WRITE
+
+    if ( bgzf_close(out)<0 ) error("Error closing %s\n", str.s);
+    bgzf_close(in);
+    free(str.s);
+}
+
+/*
+    When the IDs keep their index, only the header is written anew and the
+    BGZF blocks with the records are copied as they are. Otherwise the IDs
+    are translated record by record and the output is compressed anew.
+*/
 static void reheader_bcf(args_t *args, int is_compressed)
 {
     htsFile *fp = args->fp;
@@ -392,61 +490,65 @@ static void reheader_bcf(args_t *args, int is_compressed)
     bcf_hdr_t *hdr_out = bcf_hdr_init("r");
     if ( bcf_hdr_parse(hdr_out, htxt.s) < 0 ) error("An error occurred while parsing the header\n");
     if ( args->header_fname ) hdr_out = strip_header(hdr, hdr_out);
+    if ( bcf_hdr_nsamples(hdr)!=bcf_hdr_nsamples(hdr_out) )
+        error("The number of samples differs: %d vs %d\n", bcf_hdr_nsamples(hdr),bcf_hdr_nsamples(hdr_out));
 
     // write the header and the body
     htsFile *fp_out = hts_open(args->output_fname ? args->output_fname : "-",is_compressed ? "wb" : "wbu");
     if ( !fp_out ) error("%s: %s\n", args->output_fname ? args->output_fname : "-", strerror(errno));
     bcf_hdr_write(fp_out, hdr_out);
 
-    bcf1_t *rec = bcf_init();
-    while ( bcf_read(fp, hdr, rec)==0 )
+    BGZF *bgzf = hts_get_bgzfp(fp);
+    if ( bgzf && is_compressed && same_dictionary(hdr,hdr_out) )
     {
-        // sanity checking, this slows things down. Make it optional?
-        bcf_unpack(rec, BCF_UN_ALL);
-        if ( rec->rid >= hdr_out->n[BCF_DT_CTG] || strcmp(bcf_hdr_int2id(hdr,BCF_DT_CTG,rec->rid),bcf_hdr_int2id(hdr_out,BCF_DT_CTG,rec->rid)) )
-            error("The CHROM is not defined: \"%s\"\n", bcf_hdr_int2id(hdr,BCF_DT_CTG,rec->rid));
-
-        for (i=0; i<rec->d.n_flt; i++)
+        // Output the records which share the last block with the header, then
+        // stream the rest of the file as it is, without decompressing
+        voff_map_t map;
+        BGZF *bgzf_out = hts_get_bgzfp(fp_out);
+        int ret = bgzf_remap_copy(bgzf, bgzf_out, &map);
+        if ( ret==-1 ) error("Error reading %s\n", args->fname);
+        if ( ret<0 ) error("Error: %d\n",bgzf_out->errcode);
+        if ( hts_close(fp_out) ) error("Error closing %s\n", args->output_fname ? args->output_fname : "-");
+        if ( args->output_fname && strcmp("-",args->fname) ) reheader_csi(args, &map);
+    }
+    else
+    {
+        bcf1_t *rec = bcf_init();
+        while ( bcf_read(fp, hdr, rec)==0 )
         {
-            int id = rec->d.flt[i];
-            if ( id >= hdr_out->n[BCF_DT_ID] ) break;
-            if ( !bcf_hdr_idinfo_exists(hdr_out,BCF_HL_FLT,id) ) break;
-            if ( strcmp(hdr->id[BCF_DT_ID][id].key,hdr_out->id[BCF_DT_ID][id].key) )
-                error("FIXME: Broken FILTER ids: %s vs %s\n", hdr->id[BCF_DT_ID][id].key,hdr_out->id[BCF_DT_ID][id].key);
-        }
-        if ( i!=rec->d.n_flt )
-            error("The FILTER is not defined: \"%s\"\n", bcf_hdr_int2id(hdr,BCF_DT_ID,rec->d.flt[i]));
+            // check that all tags are defined in the new header, this slows things down
+            bcf_unpack(rec, BCF_UN_ALL);
+            if ( bcf_hdr_name2id(hdr_out,bcf_seqname(hdr,rec)) < 0 )
+                error("The CHROM is not defined: \"%s\"\n", bcf_seqname(hdr,rec));
 
-        for (i=0; i<rec->n_info; i++)
-        {
-            int id = rec->d.info[i].key;
-            if ( id >= hdr_out->n[BCF_DT_ID] ) break;
-            if ( !hdr_out->id[BCF_DT_ID][id].key ) break;
-            if ( !bcf_hdr_idinfo_exists(hdr_out,BCF_HL_INFO,id) ) break;
-            if ( strcmp(hdr->id[BCF_DT_ID][id].key,hdr_out->id[BCF_DT_ID][id].key) )
-                error("FIXME: Broken INFO ids: %s vs %s\n", hdr->id[BCF_DT_ID][id].key,hdr_out->id[BCF_DT_ID][id].key);
-        }
-        if ( i!=rec->n_info )
-            error("The INFO tag is not defined: \"%s\"\n", bcf_hdr_int2id(hdr,BCF_DT_ID,rec->d.info[i].key));
+            for (i=0; i<rec->d.n_flt; i++)
+            {
+                const char *key = hdr->id[BCF_DT_ID][rec->d.flt[i]].key;
+                if ( !bcf_hdr_idinfo_exists(hdr_out,BCF_HL_FLT,bcf_hdr_id2int(hdr_out,BCF_DT_ID,key)) )
+                    error("The FILTER is not defined: \"%s\"\n", key);
+            }
+            for (i=0; i<rec->n_info; i++)
+            {
+                const char *key = hdr->id[BCF_DT_ID][rec->d.info[i].key].key;
+                if ( !bcf_hdr_idinfo_exists(hdr_out,BCF_HL_INFO,bcf_hdr_id2int(hdr_out,BCF_DT_ID,key)) )
+                    error("The INFO tag is not defined: \"%s\"\n", key);
+            }
+            for (i=0; i<rec->n_fmt; i++)
+            {
+                const char *key = hdr->id[BCF_DT_ID][rec->d.fmt[i].id].key;
+                if ( !bcf_hdr_idinfo_exists(hdr_out,BCF_HL_FMT,bcf_hdr_id2int(hdr_out,BCF_DT_ID,key)) )
+                    error("The FORMAT tag is not defined: \"%s\"\n", key);
+            }
 
-        for (i=0; i<rec->n_fmt; i++)
-        {
-            int id = rec->d.fmt[i].id;
-            if ( id >= hdr_out->n[BCF_DT_ID] ) break;
-            if ( !hdr_out->id[BCF_DT_ID][id].key ) break;
-            if ( !bcf_hdr_idinfo_exists(hdr_out,BCF_HL_FMT,id) ) break;
-            if ( strcmp(hdr->id[BCF_DT_ID][id].key,hdr_out->id[BCF_DT_ID][id].key) )
-                error("FIXME: Broken FORMAT ids: %s vs %s\n", hdr->id[BCF_DT_ID][id].key,hdr_out->id[BCF_DT_ID][id].key);
+            // the IDs changed their index, update the record
+            bcf_translate(hdr_out, hdr, rec);
+            bcf_write(fp_out,hdr_out,rec);
         }
-        if ( i!=rec->n_fmt )
-            error("The FORMAT tag is not defined: \"%s\"\n", bcf_hdr_int2id(hdr,BCF_DT_ID,rec->d.fmt[i].id));
-
-        bcf_write(fp_out,hdr_out,rec);
+        bcf_destroy(rec);
+        hts_close(fp_out);
     }
-    bcf_destroy(rec);
 
     free(htxt.s);
-    hts_close(fp_out);
     hts_close(fp);
     bcf_hdr_destroy(hdr_out);
     bcf_hdr_destroy(hdr);
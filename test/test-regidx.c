@@ -33,6 +33,8 @@
 #include <getopt.h>
 #include <htslib/kstring.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "regidx.h"
 
 static int verbose = 0;
@@ -226,6 +228,225 @@ void test_random(int nregs, uint32_t min, uint32_t max)
     free(str.s);
 }
 
+static int cmp_reg(const void *aptr, const void *bptr)
+{
+    const uint32_t *a = (const uint32_t*) aptr, *b = (const uint32_t*) bptr;
+    if ( a[0] < b[0] ) return -1;
+    if ( a[0] > b[0] ) return 1;
+    if ( a[1] < b[1] ) return 1;   // longer intervals come first
+    if ( a[1] > b[1] ) return -1;
+    return 0;
+}
+
+// Many short regions mixed with long and nested ones, such as chromosome arms or large genes,
+// checked against a brute-force search, including the order of the hits
+void test_nested(int nregs, uint32_t max)
+{
+    regidx_t *idx = regidx_init(NULL,regidx_parse_tab,NULL,0,NULL);
+    if ( !idx ) error("init failed\n");
+
+    uint32_t *regs = (uint32_t*) malloc(sizeof(uint32_t)*2*(nregs+1));
+    kstring_t str = {0,0,0};
+    int i, j, n = 0;
+    for (i=0; i<nregs; i++)
+    {
+        uint32_t b,e;
+        if ( i%100==0 )
+            get_random_region(1,max,&b,&e);     // long
+        else
+        {
+            b = 1 + (float)random() * (max-1) / RAND_MAX;
+            e = b + random() % 100;
+        }
+        str.l = 0;
+        ksprintf(&str,"1\t%"PRIu32"\t%"PRIu32,b,e);
+        if ( regidx_insert(idx,str.s)!=0 ) error("insert failed: %s\n", str.s);
+        regs[2*n] = b-1; regs[2*n+1] = e-1; n++;
+    }
+    if ( regidx_insert(idx,"1")!=0 ) error("insert failed: 1\n");   // the whole chromosome
+    regs[2*n] = 0; regs[2*n+1] = REGIDX_MAX; n++;
+    qsort(regs, n, sizeof(uint32_t)*2, cmp_reg);
+
+    regitr_t *itr = regitr_init(idx);
+    for (i=0; i<1000; i++)
+    {
+        uint32_t beg,end;
+        get_random_region(0,max,&beg,&end);
+        if ( i%2 ) end = beg + random() % 1000;
+
+        int nexp = 0, nhit = 0;
+        for (j=0; j<n; j++)
+            if ( regs[2*j+1]>=beg && regs[2*j]<=end ) nexp++;
+
+        int ret = regidx_overlap(idx,"1",beg,end,itr);
+        if ( !ret ) error("query failed, expected %d overlap(s), found none: %d-%d\n", nexp,beg+1,end+1);
+        j = 0;
+        while ( regitr_overlap(itr) )
+        {
+            while ( j<n && (regs[2*j+1]<beg || regs[2*j]>end) ) j++;
+            if ( j>=n || itr->beg!=regs[2*j] || itr->end!=regs[2*j+1] )
+                error("query failed, unexpected hit %d-%d for %d-%d\n", itr->beg+1,itr->end+1,beg+1,end+1);
+            j++;
+            nhit++;
+        }
+        if ( nexp!=nhit ) error("query failed, expected %d overlap(s), found %d: %d-%d\n",nexp,nhit,beg+1,end+1);
+    }
+    debug("ok: nested regions\n");
+
+    regitr_destroy(itr);
+    regidx_destroy(idx);
+    free(regs);
+    free(str.s);
+}
+
+static int parse_tab_id(const char *line, char **chr_beg, char **chr_end, uint32_t *beg, uint32_t *end, void *payload, void *usr)
+{
+    int ret = regidx_parse_tab(line,chr_beg,chr_end,beg,end,payload,usr);
+    if ( ret>=0 ) *((uint32_t*)payload) = *beg ^ *end;
+    return ret;
+}
+
+// Save the index, map the image and compare the queries including the payload
+void test_save_load(int nregs, uint32_t max)
+{
+    regidx_t *idx = regidx_init(NULL,parse_tab_id,NULL,sizeof(uint32_t),NULL);
+    if ( !idx ) error("init failed\n");
+
+    kstring_t str = {0,0,0};
+    int i;
+    for (i=0; i<nregs; i++)
+    {
+        uint32_t b,e;
+        get_random_region(1,max,&b,&e);
+        if ( i%10 ) e = b + random() % 100;
+        str.l = 0;
+        ksprintf(&str,"%d\t%"PRIu32"\t%"PRIu32,i%3+1,b,e);
+        if ( regidx_insert(idx,str.s)!=0 ) error("insert failed: %s\n", str.s);
+    }
+
+    const char *tmpdir = getenv("TMPDIR");
+    str.l = 0;
+    ksprintf(&str,"%s/test-regidx.XXXXXX", tmpdir ? tmpdir : "/tmp");
+    int fd = mkstemp(str.s);
+    if ( fd<0 ) error("mkstemp failed: %s\n", str.s);
+    close(fd);
+    if ( regidx_save(idx,str.s)!=0 ) error("save failed: %s\n", str.s);
+    regidx_t *img = regidx_load_mmap(str.s);
+    if ( !img ) error("load failed: %s\n", str.s);
+    unlink(str.s);
+
+    if ( regidx_nregs(img)!=nregs ) error("expected %d regions, found %d\n", nregs,regidx_nregs(img));
+    if ( regidx_insert(img,"1\t1\t1")==0 ) error("insert into a mapped image succeeded\n");
+
+    regitr_t *itr = regitr_init(idx), *itr_img = regitr_init(img);
+    for (i=0; i<1000; i++)
+    {
+        char chr[2] = { '1' + i%4, 0 };     // sequence "4" is not present
+        uint32_t beg,end;
+        get_random_region(0,max,&beg,&end);
+        if ( i%2 ) end = beg + random() % 1000;
+
+        int ret = regidx_overlap(idx,chr,beg,end,itr);
+        if ( ret!=regidx_overlap(img,chr,beg,end,itr_img) ) error("query failed, the image differs: %s:%d-%d\n", chr,beg+1,end+1);
+        while ( ret && (ret = regitr_overlap(itr)) )
+        {
+            if ( !regitr_overlap(itr_img) ) error("query failed, missing hit in the image: %s:%d-%d\n", chr,beg+1,end+1);
+            if ( itr->beg!=itr_img->beg || itr->end!=itr_img->end || regitr_payload(itr_img,uint32_t)!=(itr->beg^itr->end) )
+                error("query failed, the image differs: %d-%d vs %d-%d\n", itr->beg+1,itr->end+1,itr_img->beg+1,itr_img->end+1);
+        }
+        if ( regitr_overlap(itr_img) ) error("query failed, extra hit in the image: %s:%d-%d\n", chr,beg+1,end+1);
+    }
+    debug("ok: save and load\n");
+
+    regitr_destroy(itr);
+    regitr_destroy(itr_img);
+    regidx_destroy(idx);
+    regidx_destroy(img);
+    free(str.s);
+}
+
+typedef struct
+{
+    regidx_t *idx;
+    uint32_t *regs, max;
+    int nregs, nquery;
+    unsigned int seed;
+}
+thread_dat_t;
+
+static void *test_thread(void *arg)
+{
+    thread_dat_t *dat = (thread_dat_t*) arg;
+    regitr_t *itr = regitr_init(dat->idx);
+    int i, j;
+    for (i=0; i<dat->nquery; i++)
+    {
+        uint32_t beg = rand_r(&dat->seed) % dat->max, end = beg + rand_r(&dat->seed) % 1000;
+        int nexp = 0, nhit = 0;
+        for (j=0; j<dat->nregs; j++)
+            if ( dat->regs[2*j+1]>=beg && dat->regs[2*j]<=end ) nexp++;
+
+        int ret = regidx_overlap(dat->idx,"1",beg,end,itr);
+        if ( ret!=(nexp ? 1 : 0) ) error("query failed, expected %d overlap(s): %d-%d\n", nexp,beg+1,end+1);
+        j = 0;
+        while ( ret && regitr_overlap(itr) )
+        {
+            while ( j<dat->nregs && (dat->regs[2*j+1]<beg || dat->regs[2*j]>end) ) j++;
+            if ( j>=dat->nregs || itr->beg!=dat->regs[2*j] || itr->end!=dat->regs[2*j+1] || regitr_payload(itr,uint32_t)!=(itr->beg^itr->end) )
+                error("query failed, unexpected hit %d-%d for %d-%d\n", itr->beg+1,itr->end+1,beg+1,end+1);
+            j++;
+            nhit++;
+        }
+        if ( nexp!=nhit ) error("query failed, expected %d overlap(s), found %d: %d-%d\n",nexp,nhit,beg+1,end+1);
+    }
+    regitr_destroy(itr);
+    return NULL;
+}
+
+// Concurrent queries of one shared index, each thread with its own iterator
+void test_threads(int nthreads, int nregs, uint32_t max)
+{
+    regidx_t *idx = regidx_init(NULL,parse_tab_id,NULL,sizeof(uint32_t),NULL);
+    if ( !idx ) error("init failed\n");
+
+    uint32_t *regs = (uint32_t*) malloc(sizeof(uint32_t)*2*nregs);
+    kstring_t str = {0,0,0};
+    int i;
+    for (i=0; i<nregs; i++)
+    {
+        uint32_t b,e;
+        get_random_region(1,max,&b,&e);
+        if ( i%100 ) e = b + random() % 100;
+        str.l = 0;
+        ksprintf(&str,"1\t%"PRIu32"\t%"PRIu32,b,e);
+        if ( regidx_insert(idx,str.s)!=0 ) error("insert failed: %s\n", str.s);
+        regs[2*i] = b-1; regs[2*i+1] = e-1;
+    }
+    if ( regidx_insert(idx,NULL)!=0 ) error("build failed\n");
+    qsort(regs, nregs, sizeof(uint32_t)*2, cmp_reg);
+
+    pthread_t *tid = (pthread_t*) malloc(sizeof(pthread_t)*nthreads);
+    thread_dat_t *dat = (thread_dat_t*) malloc(sizeof(thread_dat_t)*nthreads);
+    for (i=0; i<nthreads; i++)
+    {
+        dat[i].idx = idx;
+        dat[i].regs = regs;
+        dat[i].nregs = nregs;
+        dat[i].max = max;
+        dat[i].nquery = 2000;
+        dat[i].seed = random();
+        if ( pthread_create(&tid[i], NULL, test_thread, &dat[i])!=0 ) error("pthread_create failed\n");
+    }
+    for (i=0; i<nthreads; i++) pthread_join(tid[i], NULL);
+    debug("ok: %d threads\n", nthreads);
+
+    regidx_destroy(idx);
+    free(tid);
+    free(dat);
+    free(regs);
+    free(str.s);
+}
+
 void create_line_bed(char *line, char *chr, int start, int end)
 {
     sprintf(line,"%s\t%d\t%d\n",chr,start-1,end);
@@ -368,6 +589,15 @@ int main(int argc, char **argv)
     info("%d randomized tests, %d regions per test. Random seed is %d\n", ntest,nreg,seed);
     for (i=0; i<ntest; i++) test_random(nreg,1,1000);
 
+    info("Testing nested and long regions\n");
+    test_nested(10000,1000000);
+
+    info("Testing save and memory-mapped load\n");
+    test_save_load(10000,1000000);
+
+    info("Testing concurrent queries\n");
+    test_threads(8,10000,1000000);
+
     return 0;
 }
 
@@ -53,6 +53,7 @@ test_vcf_isec($opts,in=>['isec.a','isec.b'],out=>'isec.ab.any.out',args=>'-n =2
 test_vcf_isec($opts,in=>['isec.a','isec.b'],out=>'isec.ab.C.out',args=>'-C -c any');
 test_vcf_isec2($opts,vcf_in=>['isec.a'],tab_in=>'isec',out=>'isec.tab.out',args=>'');
 test_vcf_merge($opts,in=>['merge.a','merge.b','merge.c'],out=>'merge.abc.out',args=>'--force-samples');
+test_index_regions($opts,in=>['merge.a','merge.b'],regs=>'index.regs.tab');
 test_vcf_merge($opts,in=>['merge.a','merge.b','merge.c'],out=>'merge.abc.2.out',args=>'--force-samples -Fx');
 test_vcf_merge($opts,in=>['merge.a','merge.b','merge.c'],out=>'merge.abc.3.out',args=>'--force-samples -0');
 test_vcf_merge($opts,in=>['merge.2.a','merge.2.b'],out=>'merge.2.none.out',args=>'--force-samples -m none');
@@ -201,15 +202,27 @@ test_vcf_annotate($opts,in=>'annotate2',vcf=>'annots2',out=>'annotate12.out',arg
 test_vcf_annotate($opts,in=>'annotate2',vcf=>'annots2',out=>'annotate13.out',args=>'-x INFO -c INFO/IINT');
 test_vcf_plugin($opts,in=>'plugin1',out=>'missing2ref.out',cmd=>'+missing2ref --no-version');
 test_vcf_plugin($opts,in=>'plugin1',out=>'missing2ref.out',cmd=>'+setGT --no-version',args=>'-- -t . -n 0');
+test_vcf_plugin($opts,in=>'plugin1',out=>'missing2ref.fill-AN-AC.out',cmd=>'+setGT --no-version',args=>'-- -t . -n 0 ::: +fill-AN-AC');
 test_vcf_plugin($opts,in=>'setGT',out=>'setGT.1.out',cmd=>'+setGT --no-version',args=>'-- -t q -n 0 -i \'GT~"." && FMT/DP=30 && GQ=150\'');
 test_vcf_annotate($opts,in=>'annotate9',tab=>'annots9',out=>'annotate9.out',args=>'-c CHROM,POS,REF,ALT,+ID');
 test_vcf_plugin($opts,in=>'plugin1',out=>'fill-AN-AC.out',cmd=>'+fill-AN-AC --no-version');
+test_vcf_plugin($opts,in=>'plugin1',out=>'fill-AN-AC.out',cmd=>'+fill-AN-AC --no-version --threads 2');
+test_vcf_plugin($opts,in=>'plugin1',out=>'fill-AN-AC.out',cmd=>'+fill-AN-AC --no-version --threads 3',batch=>2);
 test_vcf_plugin($opts,in=>'plugin1',out=>'dosage.out',cmd=>'+dosage');
 test_vcf_plugin($opts,in=>'fixploidy',out=>'fixploidy.out',cmd=>'+fixploidy --no-version',args=>'-- -s {PATH}/fixploidy.samples -p {PATH}/fixploidy.ploidy');
 test_vcf_plugin($opts,in=>'view.PL',out=>'guess-ploidy.PL.out',cmd=>'+guess-ploidy',args=>'-vrX | grep -v bcftools');
 test_vcf_plugin($opts,in=>'view.GL',out=>'guess-ploidy.GL.out',cmd=>'+guess-ploidy',args=>'-vrX | grep -v bcftools');
+test_vcf_plugin($opts,in=>'view.PL',out=>'guess-ploidy.PL.out',cmd=>'+guess-ploidy',args=>'-vrX --threads 2 | grep -v bcftools');
+test_vcf_plugin($opts,in=>'view.PL',out=>'guess-ploidy.PL.out',cmd=>'+guess-ploidy',args=>'-v -r X:2900000-3100000 --threads 4 | grep -v bcftools');
+test_vcf_plugin($opts,in=>'check-sparsity',out=>'check-sparsity.1.out',cmd=>'+check-sparsity');
+test_vcf_plugin($opts,in=>'check-sparsity',out=>'check-sparsity.1.out',cmd=>'+check-sparsity',args=>'--threads 2');
+test_vcf_plugin($opts,in=>'check-sparsity',out=>'check-sparsity.2.out',cmd=>'+check-sparsity',args=>'-n 2 --threads 3');
 test_vcf_plugin($opts,in=>'view.GL',out=>'view.PL.vcf',cmd=>'+tag2tag --no-version',args=>'-- -r --gl-to-pl');
 test_vcf_plugin($opts,in=>'view.GP',out=>'view.GT.vcf',cmd=>'+tag2tag --no-version',args=>'-- -r --gp-to-gt -t 0.2');
+test_vcf_plugin($opts,in=>'tag2tag.GL',out=>'tag2tag.GP.out',cmd=>'+tag2tag --no-version',args=>'-- -r --gl-to-gp');
+test_vcf_plugin($opts,in=>'tag2tag.PL',out=>'tag2tag.GP.out',cmd=>'+tag2tag --no-version',args=>'-- -r --pl-to-gp');
+test_vcf_plugin($opts,in=>'tag2tag.GL',out=>'tag2tag.GP.DS.out',cmd=>'+tag2tag --no-version',args=>'-- -r --gl-to-gp --ds');
+test_vcf_plugin($opts,in=>'tag2tag.PL',out=>'tag2tag.GP.DS.out',cmd=>'+tag2tag --no-version',args=>'-- -r --pl-to-gp --ds');
 test_vcf_plugin($opts,in=>'merge.a',out=>'fill-tags.out',cmd=>'+fill-tags --no-version',args=>'-- -t AN,AC,AC_Hom,AC_Het,AC_Hemi');
 test_vcf_plugin($opts,in=>'view',out=>'fill-tags.2.out',cmd=>'+fill-tags --no-version',args=>'-- -t AC,AN,AF,MAF,NS');
 test_vcf_plugin($opts,in=>'view',out=>'fill-tags.3.out',cmd=>'+fill-tags --no-version',args=>'-- -t AC -S {PATH}/fill-tags.3.smpl');
@@ -224,9 +237,14 @@ test_vcf_plugin($opts,in=>'view',out=>'view.GTisec.m.out',cmd=>'+GTisec',args=>'
 test_vcf_plugin($opts,in=>'view',out=>'view.GTisec.mv.out',cmd=>'+GTisec',args=>'-- -mv | grep -v bcftools');
 test_vcf_plugin($opts,in=>'view',out=>'view.GTisec.v.out',cmd=>'+GTisec',args=>'-- -v | grep -v bcftools');
 test_vcf_plugin($opts,in=>'trio',out=>'trio.out',cmd=>'+trio-switch-rate',args=>'-- -p {PATH}/trio.ped | grep -v bcftools');
+test_vcf_plugin($opts,in=>'trio',out=>'trio.w.out',cmd=>'+trio-switch-rate',args=>'-- -p {PATH}/trio.ped -w 2000 | grep -v bcftools');
 test_vcf_plugin($opts,in=>'ad-bias',out=>'ad-bias.out',cmd=>'+ad-bias',args=>'-- -s {PATH}/ad-bias.samples | grep -v bcftools');
+test_vcf_plugin($opts,in=>'ad-bias',out=>'ad-bias.out',cmd=>'+ad-bias',args=>'--threads 2 -- -s {PATH}/ad-bias.samples | grep -v bcftools');
+test_vcf_plugin($opts,in=>'ad-bias',out=>'ad-bias.out',cmd=>'+ad-bias',args=>'--threads 3 -- -s {PATH}/ad-bias.samples | grep -v bcftools',batch=>4);
 test_vcf_plugin($opts,in=>'af-dist',out=>'af-dist.out',cmd=>'+af-dist',args=>' | grep -v bcftools');
+test_merge_af_dist($opts,in=>'af-dist',out=>'af-dist.out',regs=>['11','20']);
 test_vcf_plugin($opts,in=>'fixref',out=>'fixref.1.out',cmd=>'+fixref',args=>'-- -f {PATH}/norm.fa -m top');
+test_vcf_fixref_db($opts,in=>'fixref.id',db=>'fixref.dbsnp',out=>'fixref.id.out',args=>'-f {PATH}/norm.fa');
 test_vcf_plugin($opts,in=>'aa',out=>'aa.out',cmd=>'+fill-from-fasta',args=>'-- -f {PATH}/aa.fa -c AA -h {PATH}/aa.hdr -i \'TYPE="snp"\'');
 test_vcf_plugin($opts,in=>'ref',out=>'ref.out',cmd=>'+fill-from-fasta',args=>'-- -f {PATH}/norm.fa -c REF');
 test_vcf_plugin($opts,in=>'view',out=>'view.GTsubset.NA1.out',cmd=>'+GTsubset --no-version',args=>'-- -s NA00001');
@@ -235,6 +253,10 @@ test_vcf_plugin($opts,in=>'view',out=>'view.GTsubset.NA1NA2NA3.out',cmd=>'+GTsub
 test_vcf_plugin($opts,in=>'mendelian',out=>'mendelian.1.out',cmd=>'+mendelian --no-version',args=>'-- -t mom1,dad1,child1 -d');
 test_vcf_plugin($opts,in=>'mendelian',out=>'mendelian.2.out',cmd=>'+mendelian --no-version',args=>'-- -t mom1,dad1,child1 -l+');
 test_vcf_plugin($opts,in=>'mendelian',out=>'mendelian.3.out',cmd=>'+mendelian --no-version',args=>'-- -t mom1,dad1,child1 -lx');
+test_vcf_plugin($opts,in=>'mendelian',out=>'mendelian.4.out',cmd=>'+mendelian --no-version',args=>'-- -t mom1,dad1,child1 -lx -m');
+test_vcf_plugin($opts,in=>'mendelian',out=>'mendelian.2.out',cmd=>'+mendelian --no-version',args=>'-- -t mom1,dad1,child1 -l+ -lx');
+test_vcf_plugin($opts,in=>'mendelian.haploid',out=>'mendelian.haploid.1.out',cmd=>'+mendelian --no-version',args=>'-- -t mom,dad,son -m');
+test_vcf_plugin($opts,in=>'mendelian.haploid',out=>'mendelian.haploid.2.out',cmd=>'+mendelian --no-version',args=>'-- -t mom,dad,son -lx');
 test_vcf_concat($opts,in=>['concat.1.a','concat.1.b'],out=>'concat.1.vcf.out',do_bcf=>0,args=>'');
 test_vcf_concat($opts,in=>['concat.1.a','concat.1.b'],out=>'concat.1.bcf.out',do_bcf=>1,args=>'');
 test_vcf_concat($opts,in=>['concat.2.a','concat.2.b'],out=>'concat.2.vcf.out',do_bcf=>0,args=>'-a');
@@ -250,7 +272,25 @@ test_vcf_reheader($opts,in=>'reheader',out=>'reheader.2.out',samples=>'reheader.
 test_vcf_reheader($opts,in=>'reheader',out=>'reheader.3.out',samples=>'reheader.samples3');
 test_vcf_reheader($opts,in=>'reheader',out=>'reheader.4.out',samples=>'reheader.samples4');
 test_vcf_reheader($opts,in=>'empty',out=>'reheader.empty.out',header=>'reheader.empty.hdr');
+test_vcf_reheader_index($opts,in=>'reheader',out=>'reheader.2.reg.out',samples=>'reheader.samples',reg=>'20:50-100,5');
+test_vcf_reheader_tail($opts,in=>'reheader',out=>'reheader.2.out',reg_out=>'reheader.2.reg.out',samples=>'reheader.samples',reg=>'20:50-100,5',hdr_out=>'reheader.1.out.bcf',header=>'reheader.hdr');
+test_vcf_sort($opts,in=>'sort',out=>'sort.out',args=>'');
+test_vcf_sort($opts,in=>'sort',out=>'sort.out',args=>'-m 1');
+test_vcf_sort($opts,in=>'sort',out=>'sort.out',args=>'-m 1 --threads 2');
+test_vcf_sort($opts,in=>'sort.runs',out=>'sort.runs.out',args=>'-m 1');
+test_vcf_sort($opts,in=>'sort.runs',out=>'sort.runs.out',args=>'-m 1 --threads 2');
+test_vcf_sort_index($opts,in=>'sort',out=>'sort.reg.out',args=>'-m 1',reg=>'1:100-500');
+test_vcf_shard($opts,in=>'view',out=>'shard.out');
+test_vcf_shard_split($opts,in=>'shard',out=>'shard.split.out',reg=>'1:24995-25005,1:50001,2',reg_out=>'shard.split.reg.out');
 test_rename_chrs($opts,in=>'annotate');
+test_vcf_pipe($opts,in=>'view',pipe=>'view -e "INFO/DP<1000" ; filter -s LowMQ -i "INFO/MQ>46"');
+test_vcf_pipe($opts,in=>'view',pipe=>'view -e "INFO/DP<1000" ; +fill-AN-AC ; filter -m+ -s LowMQ -i "INFO/MQ>46" ; view -i "INFO/AN>2"',plugins=>1);
+test_vcf_pipe($opts,in=>'norm.split',pipe=>'view -s XY00001 -e "INFO/DP>100" ; norm -m- -f {PATH}/norm.fa ; annotate -x INFO/XRS,FORMAT/FRS ; filter -g 2 -s LowQual -e "QUAL<10" ; +fill-tags -t AN,AC,MAF',plugins=>1);
+test_global_threads($opts,in=>'view',cmd=>'view --no-version -Ob');
+test_vcf_som($opts,in=>'som',args=>'-s 6 -f 5 -d 2');
+test_perf_report($opts,in=>'view',out=>'perf.out',cmd=>'view --no-version -Ob',bcf=>'perf.bcf');
+test_perf_report($opts,in=>'view',out=>'perf.sort.out',cmd=>'sort --no-version -Ob',bcf=>'perf.sort.bcf');
+test_perf_report($opts,in=>'view',out=>'perf.pipe.out',cmd=>'pipe --no-version -Ob',pipeline=>q['view -e "INFO/DP<0"'],bcf=>'perf.pipe.bcf');
 test_vcf_convert($opts,in=>'convert',out=>'convert.gs.gt.gen',args=>'-g -,.');
 test_vcf_convert($opts,in=>'convert',out=>'convert.gs.gt.samples',args=>'-g .,-');
 test_vcf_convert($opts,in=>'convert',out=>'convert.gs.pl.gen',args=>'-g -,. --tag PL');
@@ -280,6 +320,7 @@ test_vcf_consensus($opts,in=>'consensus',out=>'consensus.4.out',fa=>'consensus.f
 test_vcf_consensus_chain($opts,in=>'consensus',out=>'consensus.4.chain',chain=>'consensus.4.chain',fa=>'consensus.fa',args=>'-H 1');
 test_vcf_consensus($opts,in=>'consensus2',out=>'consensus2.1.out',fa=>'consensus2.fa',args=>'-H 1');
 test_vcf_consensus($opts,in=>'consensus2',out=>'consensus2.2.out',fa=>'consensus2.fa',args=>'-H 2');
+test_vcf_consensus($opts,in=>'consensus2',out=>'consensus2.3.out',fa=>'consensus2.fa',args=>'-s NA001 -H 1,2');
 test_vcf_consensus($opts,in=>'empty',out=>'consensus.5.out',fa=>'consensus.fa',args=>'');
 test_mpileup($opts,in=>[qw(1 2 3)],out=>'mpileup/mpileup.1.out',args=>q[-r17:100-150],test_list=>1);
 test_mpileup($opts,in=>[qw(1 2 3)],out=>'mpileup/mpileup.2.out',args=>q[-a DP,DV -r17:100-600]); # test files from samtools mpileup test suite
@@ -582,6 +623,30 @@ sub test_vcf_merge
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools merge --no-version $args $files");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools merge -Ob $args $files | $$opts{bin}/bcftools view | grep -v ^##bcftools_");
 }
+sub test_index_regions
+{
+    my ($opts,%args) = @_;
+    my @files;
+    for my $file (@{$args{in}})
+    {
+        bgzip_tabix_vcf($opts,$file);
+        push @files, "$$opts{tmp}/$file.vcf.gz";
+    }
+    my $files = join(' ',@files);
+    my $regs  = "$$opts{tmp}/$args{regs}";
+    cmd("cp $$opts{path}/$args{regs} $regs");
+    unlink("$regs.ridx");
+
+    # the output with the text regions file is the reference for the runs with the image
+    cmd("$$opts{bin}/bcftools merge --no-version --force-samples -R $regs $files > $$opts{path}/index.regs.out.tmp");
+    cmd("$$opts{bin}/bcftools index -r $regs");
+    my $prevfailed = $$opts{nfailed};
+    test_cmd($opts,%args,out=>'index.regs.out.tmp',cmd=>"$$opts{bin}/bcftools merge --no-version --force-samples -R $regs $files");
+
+    # FILE.ridx exists now and must not be used when writing another image
+    test_cmd($opts,%args,out=>'index.regs.out.tmp',cmd=>"$$opts{bin}/bcftools index -r -o $$opts{tmp}/index.regs.other.ridx $regs && cmp $regs.ridx $$opts{tmp}/index.regs.other.ridx && $$opts{bin}/bcftools merge --no-version --force-samples -R $regs $files");
+    unlink "$$opts{path}/index.regs.out.tmp" if $$opts{nfailed} == $prevfailed;
+}
 sub test_vcf_isec
 {
     my ($opts,%args) = @_;
@@ -663,6 +728,35 @@ sub test_vcf_norm
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools norm --no-version $params $$opts{tmp}/$args{in}.vcf.gz 2>/dev/null");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools norm -Ob $params $$opts{tmp}/$args{in}.vcf.gz 2>/dev/null | $$opts{bin}/bcftools view | grep -v ^##bcftools_");
 }
+sub test_vcf_pipe
+{
+    my ($opts,%args) = @_;
+    if ( $args{plugins} && !$$opts{test_plugins} ) { return; }
+    bgzip_tabix_vcf($opts,$args{in});
+    my $file = "$$opts{tmp}/$args{in}.vcf.gz";
+    $args{pipe} =~ s/{PATH}/$$opts{path}/g;
+
+    # the same commands connected by shell pipes give the expected output,
+    # the options of plugins follow the input file and "--"
+    my @cmds = ();
+    for my $stage (split(/\s*;\s*/,$args{pipe}))
+    {
+        my ($cmd,$opt) = ($stage=~/^(\S+)\s*(.*)$/);
+        my $in = @cmds ? '' : " $file";
+        if ( $cmd=~/^\+/ ) { push @cmds, "$$opts{bin}/bcftools $cmd --no-version$in".($opt ne '' ? " -- $opt" : ''); }
+        else { push @cmds, "$$opts{bin}/bcftools $cmd --no-version $opt$in"; }
+    }
+    cmd(join(' | ',@cmds)." > $$opts{path}/pipe.out.tmp");
+
+    my $prevfailed = $$opts{nfailed};
+    test_cmd($opts,%args,out=>'pipe.out.tmp',cmd=>"$$opts{bin}/bcftools pipe --no-version --threads 1 '$args{pipe}' $file");
+    test_cmd($opts,%args,out=>'pipe.out.tmp',cmd=>"$$opts{bin}/bcftools pipe -Ob '$args{pipe}' $file | $$opts{bin}/bcftools view --no-version | grep -v ^##bcftools_pipe");
+    {
+        local $ENV{BCFTOOLS_PIPE_BATCH} = 2;
+        test_cmd($opts,%args,out=>'pipe.out.tmp',cmd=>"cat $file | $$opts{bin}/bcftools pipe --no-version --threads 4 '$args{pipe}'");
+    }
+    unlink "$$opts{path}/pipe.out.tmp" if $$opts{nfailed} == $prevfailed;
+}
 sub test_vcf_view
 {
     my ($opts,%args) = @_;
@@ -860,6 +954,8 @@ sub test_vcf_plugin
     my ($opts,%args) = @_;
     if ( !$$opts{test_plugins} ) { return; }
     $ENV{BCFTOOLS_PLUGINS} = "$$opts{bin}/plugins";
+    # small blocks so that even short test files are split between the worker threads
+    local $ENV{BCFTOOLS_PLUGIN_BATCH} = $args{batch} if exists($args{batch});
     if ( !exists($args{args}) ) { $args{args} = ''; }
     $args{args} =~ s/{PATH}/$$opts{path}/g;
     $args{cmd}  =~ s/{PATH}/$$opts{path}/g;
@@ -870,6 +966,34 @@ sub test_vcf_plugin
     cmd("$$opts{bin}/bcftools index -f $$opts{tmp}/$args{in}.bcf");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools $args{cmd} $$opts{tmp}/$args{in}.bcf $args{args} 2>/dev/null | grep -v ^##bcftools_");
 }
+sub test_vcf_fixref_db
+{
+    my ($opts,%args) = @_;
+    if ( !$$opts{test_plugins} ) { return; }
+    $ENV{BCFTOOLS_PLUGINS} = "$$opts{bin}/plugins";
+    $args{args} =~ s/{PATH}/$$opts{path}/g;
+    bgzip_tabix_vcf($opts,$args{in});
+    bgzip_tabix_vcf($opts,$args{db});
+
+    # the dbSNP VCF is read directly and then through the binary database, the outputs must be the same
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools +fixref --no-version $$opts{tmp}/$args{in}.vcf.gz -- $args{args} -i $$opts{tmp}/$args{db}.vcf.gz 2>/dev/null");
+    cmd("$$opts{bin}/bcftools +fixref $$opts{tmp}/$args{db}.vcf.gz -- --build-db $$opts{tmp}/$args{db}.db 2>/dev/null");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools +fixref --no-version $$opts{tmp}/$args{in}.vcf.gz -- $args{args} -i $$opts{tmp}/$args{db}.db 2>/dev/null");
+}
+sub test_merge_af_dist
+{
+    my ($opts,%args) = @_;
+    if ( !$$opts{test_plugins} ) { return; }
+    $ENV{BCFTOOLS_PLUGINS} = "$$opts{bin}/plugins";
+    bgzip_tabix_vcf($opts,$args{in});
+    my $files = '';
+    for my $reg (@{$args{regs}})
+    {
+        cmd("$$opts{bin}/bcftools +af-dist $$opts{tmp}/$args{in}.vcf.gz -r $reg > $$opts{tmp}/$args{in}.$reg.txt");
+        $files .= " $$opts{tmp}/$args{in}.$reg.txt";
+    }
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/misc/merge-af-dist.pl $files | grep -v bcftools");
+}
 sub test_vcf_concat
 {
     my ($opts,%args) = @_;
@@ -907,6 +1031,88 @@ sub test_vcf_reheader
         test_cmd($opts,%args,%bcf_args,cmd=>"cat $file | $$opts{bin}/bcftools reheader $arg | $$opts{bin}/bcftools view --no-version");
     }
 }
+sub test_vcf_sort
+{
+    my ($opts,%args) = @_;
+    cmd("$$opts{bin}/bcftools view --no-version -Ob $$opts{path}/$args{in}.vcf > $$opts{tmp}/$args{in}.bcf");
+    for my $file ("$$opts{path}/$args{in}.vcf","$$opts{tmp}/$args{in}.bcf")
+    {
+        test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools sort -T $$opts{tmp} $args{args} $file | $$opts{bin}/bcftools query -f'%CHROM\\t%POS\\t%ID\\n'");
+        test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools sort -T $$opts{tmp} $args{args} -Ob $file | $$opts{bin}/bcftools query -f'%CHROM\\t%POS\\t%ID\\n'");
+    }
+}
+sub test_vcf_sort_index
+{
+    my ($opts,%args) = @_;
+    for my $type ('b','z')
+    {
+        my $file = "$$opts{tmp}/$args{in}.W.".($type eq 'b' ? 'bcf' : 'vcf.gz');
+        unlink("$file.csi");
+        cmd("$$opts{bin}/bcftools sort -T $$opts{tmp} $args{args} -W -O$type -o $file $$opts{path}/$args{in}.vcf");
+        test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools query -r $args{reg} -f'%CHROM\\t%POS\\t%ID\\n' $file");
+    }
+}
+sub test_vcf_shard
+{
+    my ($opts,%args) = @_;
+    bgzip_tabix_vcf($opts,$args{in});
+    cmd("$$opts{bin}/bcftools view -Ob -o $$opts{tmp}/$args{in}.bcf $$opts{tmp}/$args{in}.vcf.gz");
+    cmd("$$opts{bin}/bcftools index -f $$opts{tmp}/$args{in}.bcf");
+    my $shard = "$$opts{bin}/bcftools shard -j2 -n5 -T $$opts{tmp}";
+    my $query = "$$opts{bin}/bcftools query -f'%CHROM\\t%POS\\n'";
+    test_cmd($opts,%args,cmd=>"$shard $$opts{tmp}/$args{in}.vcf.gz -- query -f'%CHROM\\t%POS\\n'");
+    test_cmd($opts,%args,cmd=>"$shard $$opts{tmp}/$args{in}.vcf.gz -- view | $query");
+
+    # stitched BCF with a merged index
+    cmd("$shard -Ob -W -o $$opts{tmp}/$args{in}.shard.bcf $$opts{tmp}/$args{in}.bcf -- view");
+    test_cmd($opts,%args,cmd=>"$query $$opts{tmp}/$args{in}.shard.bcf");
+    test_cmd($opts,%args,cmd=>"$query -r 11,20,X,Y $$opts{tmp}/$args{in}.shard.bcf");
+}
+sub test_vcf_shard_split
+{
+    my ($opts,%args) = @_;
+    # contig 1 is split in four shards, records sit at and span the split points and share CSI bins across them
+    cmd("$$opts{bin}/bcftools view -Ob -o $$opts{tmp}/$args{in}.bcf $$opts{path}/$args{in}.vcf");
+    cmd("$$opts{bin}/bcftools index -f $$opts{tmp}/$args{in}.bcf");
+    my $shard = "$$opts{bin}/bcftools shard -j2 -n4 -T $$opts{tmp}";
+    my $query = "$$opts{bin}/bcftools query -f'%CHROM\\t%POS\\t%ID\\n'";
+    cmd("$shard -Ob -W -o $$opts{tmp}/$args{in}.shard.bcf $$opts{tmp}/$args{in}.bcf -- view");
+    test_cmd($opts,%args,cmd=>"$query $$opts{tmp}/$args{in}.shard.bcf");
+    test_cmd($opts,%args,out=>$args{reg_out},cmd=>"$query -r $args{reg} $$opts{tmp}/$args{in}.shard.bcf");
+    test_cmd($opts,%args,cmd=>"$shard $$opts{tmp}/$args{in}.bcf -- query -f'%CHROM\\t%POS\\t%ID\\n'");
+
+    # commands and options which need records across the shard borders are refused
+    for my $cmd ('norm -f /dev/null','filter -g3','filter --IndelGap=5','+ad-bias','view -h','view -H')
+    {
+        test_cmd($opts,%args,exp=>"refused\n",cmd=>"$shard $$opts{tmp}/$args{in}.bcf -- $cmd 2>/dev/null && echo accepted || echo refused");
+    }
+
+    # the temporary files are removed when the shards fail
+    cmd("rm -rf $$opts{tmp}/shard.fail && mkdir $$opts{tmp}/shard.fail");
+    test_cmd($opts,%args,exp=>"0\n",cmd=>"$$opts{bin}/bcftools shard -j2 -n4 -T $$opts{tmp}/shard.fail $$opts{tmp}/$args{in}.bcf -- view -i 'INFO/NOT_DEFINED>1' 2>/dev/null; ls $$opts{tmp}/shard.fail | wc -l | tr -d ' '");
+}
+sub test_vcf_reheader_index
+{
+    my ($opts,%args) = @_;
+    cmd("$$opts{bin}/bcftools view --no-version -Ob $$opts{path}/$args{in}.vcf > $$opts{tmp}/$args{in}.idx.bcf");
+    cmd("$$opts{bin}/bcftools index -f $$opts{tmp}/$args{in}.idx.bcf");
+    cmd("$$opts{bin}/bcftools reheader -s $$opts{path}/$args{samples} -o $$opts{tmp}/$args{in}.idx.out.bcf $$opts{tmp}/$args{in}.idx.bcf");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view --no-version -r $args{reg} $$opts{tmp}/$args{in}.idx.out.bcf");
+}
+sub test_vcf_reheader_tail
+{
+    my ($opts,%args) = @_;
+    # uncompressed BCF compressed with bgzip, the records share the last BGZF block with the header
+    cmd("$$opts{bin}/bcftools view --no-version -Ou $$opts{path}/$args{in}.vcf | $$opts{bgzip} -c > $$opts{tmp}/$args{in}.tail.bcf");
+    cmd("$$opts{bin}/bcftools index -f $$opts{tmp}/$args{in}.tail.bcf");
+    cmd("$$opts{bin}/bcftools reheader -s $$opts{path}/$args{samples} -o $$opts{tmp}/$args{in}.tail.out.bcf $$opts{tmp}/$args{in}.tail.bcf");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view --no-version $$opts{tmp}/$args{in}.tail.out.bcf");
+    test_cmd($opts,%args,out=>$args{reg_out},cmd=>"$$opts{bin}/bcftools view --no-version -r $args{reg} $$opts{tmp}/$args{in}.tail.out.bcf");
+
+    # the IDs change with the new header, the records are translated one by one
+    cmd("$$opts{bin}/bcftools reheader -h $$opts{path}/$args{header} -o $$opts{tmp}/$args{in}.tail.hdr.bcf $$opts{tmp}/$args{in}.tail.bcf");
+    test_cmd($opts,%args,out=>$args{hdr_out},cmd=>"$$opts{bin}/bcftools view --no-version $$opts{tmp}/$args{in}.tail.hdr.bcf");
+}
 sub test_rename_chrs
 {
     my ($opts,%args) = @_;
@@ -921,6 +1127,51 @@ sub test_rename_chrs
     }
     unlink "$$opts{path}/rename.out.tmp" if $$opts{nfailed} == $prevfailed;
 }
+sub test_global_threads
+{
+    my ($opts,%args) = @_;
+    bgzip_tabix_vcf($opts,$args{in});
+    my $file = "$$opts{tmp}/$args{in}.vcf.gz";
+    cmd("$$opts{bin}/bcftools --threads 0 $args{cmd} $file | $$opts{bin}/bcftools view --no-version > $$opts{path}/threads.out.tmp");
+    my $prevfailed = $$opts{nfailed};
+    test_cmd($opts,%args,out=>"threads.out.tmp",cmd=>"$$opts{bin}/bcftools --threads 3 $args{cmd} $file | $$opts{bin}/bcftools view --no-version");
+    {
+        local $ENV{BCFTOOLS_THREADS} = 3;
+        test_cmd($opts,%args,out=>"threads.out.tmp",cmd=>"$$opts{bin}/bcftools $args{cmd} $file | $$opts{bin}/bcftools view --no-version");
+    }
+    unlink "$$opts{path}/threads.out.tmp" if $$opts{nfailed} == $prevfailed;
+}
+sub test_vcf_som
+{
+    my ($opts,%args) = @_;
+    # each map is trained by one thread and the scores are split between threads, the results must not depend on their number
+    my $som = "$$opts{bin}/bcftools som";
+    my $in  = "$$opts{path}/$args{in}.tab";
+    cmd("$som -t $args{args} --threads 1 -p $$opts{tmp}/som.t1 $in > $$opts{path}/som.out.tmp && $som -c --threads 1 -p $$opts{tmp}/som.t1 $in >> $$opts{path}/som.out.tmp");
+    my $prevfailed = $$opts{nfailed};
+    test_cmd($opts,%args,out=>"som.out.tmp",cmd=>"$som -t $args{args} --threads 4 -p $$opts{tmp}/som.t4 $in && $som -c --threads 4 -p $$opts{tmp}/som.t4 $in && cmp $$opts{tmp}/som.t1.som $$opts{tmp}/som.t4.som");
+    unlink "$$opts{path}/som.out.tmp" if $$opts{nfailed} == $prevfailed;
+}
+sub test_perf_report
+{
+    my ($opts,%args) = @_;
+    bgzip_tabix_vcf($opts,$args{in});
+    my $json = "$$opts{tmp}/perf.json";
+    unlink($json);
+    # the report must parse as JSON, print the deterministic parts of it
+    my $check = q{
+        my $rep = decode_json($_);
+        print "$_\t$$rep{stages}{$_}{records}\n" for qw(read write);
+        for my $file (sort { $$a{name} cmp $$b{name} } @{$$rep{files}})
+        {
+            my $name = (split(m{/},$$file{name}))[-1];
+            print join("\t", $name, $$file{mode}, exists($$file{bgzf_blocks}) ? "bgzf" : "-"), "\n";
+        }
+        print "times\n" if $$rep{wall_s} >= 0 && $$rep{user_s} >= 0 && $$rep{max_rss_kb} > 0;
+    };
+    my $pipeline = exists($args{pipeline}) ? $args{pipeline} : '';
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools --perf-report $json $args{cmd} -o $$opts{tmp}/$args{bcf} $pipeline $$opts{tmp}/$args{in}.vcf.gz && perl -MJSON::PP -0777 -ne '$check' $json");
+}
 sub test_vcf_consensus
 {
     my ($opts,%args) = @_;
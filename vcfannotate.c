@@ -43,6 +43,7 @@ THE SOFTWARE.  */
 #include "filter.h"
 #include "convert.h"
 #include "smpl_ilist.h"
+#include "perf.h"
 
 struct _args_t;
 
@@ -121,9 +122,12 @@ typedef struct _args_t
     char *tmps, *tmps2, **tmpp, **tmpp2;
     kstring_t tmpks;
 
+    bcf1_t **recs;          // the records of a block in the pipe
+    int mrecs;
+
     char **argv, *output_fname, *targets_fname, *regions_list, *header_fname;
     char *remove_annots, *columns, *rename_chrs, *sample_names, *mark_sites;
-    int argc, drop_header, record_cmd_line, tgts_is_vcf, mark_sites_logic;
+    int argc, drop_header, record_cmd_line, tgts_is_vcf, mark_sites_logic, regions_is_file, collapse;
 }
 args_t;
 
@@ -1607,7 +1611,6 @@ static void rename_chrs(args_t *args, char *fname)
 
 static void init_data(args_t *args)
 {
-    args->hdr = args->files->readers[0].header;
     args->hdr_out = bcf_hdr_dup(args->hdr);
 
     if ( args->remove_annots ) init_remove_annots(args);
@@ -1649,16 +1652,7 @@ static void init_data(args_t *args)
     }
 
      if (args->record_cmd_line) bcf_hdr_append_version(args->hdr_out, args->argc, args->argv, "bcftools_annotate");
-    if ( !args->drop_header )
-    {
-        if ( args->rename_chrs ) rename_chrs(args, args->rename_chrs);
-
-        args->out_fh = hts_open(args->output_fname,hts_bcf_wmode(args->output_type));
-        if ( args->out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->output_fname, strerror(errno));
-        if ( args->n_threads )
-            hts_set_opt(args->out_fh, HTS_OPT_THREAD_POOL, args->files->p);
-        bcf_hdr_write(args->out_fh, args->hdr_out);
-    }
+    if ( !args->drop_header && args->rename_chrs ) rename_chrs(args, args->rename_chrs);
 }
 
 static void destroy_data(args_t *args)
@@ -1826,7 +1820,7 @@ static void annotate(args_t *args, bcf1_t *line)
                 bcf_update_info_flag(args->hdr_out,line,args->mark_sites,NULL,i<args->nalines?0:1);
         }
     }
-    else if ( args->files->nreaders == 2 )
+    else if ( args->files && args->files->nreaders == 2 )
     {
         if ( bcf_sr_has_line(args->files,1) )
         {
@@ -1856,6 +1850,21 @@ static void annotate(args_t *args, bcf1_t *line)
     }
 }
 
+// Returns 0 if the record is filtered out, otherwise annotates it
+static int annotate_line(args_t *args, bcf1_t *line)
+{
+    if ( args->filter )
+    {
+        perf_beg(PERF_FILTER);
+        int pass = filter_test(args->filter, line, NULL);
+        perf_end(PERF_FILTER, 1);
+        if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
+        if ( !pass ) return 0;
+    }
+    annotate(args, line);
+    return 1;
+}
+
 static void usage(args_t *args)
 {
     fprintf(stderr, "\n");
@@ -1880,24 +1889,22 @@ static void usage(args_t *args)
     fprintf(stderr, "   -s, --samples [^]<list>        comma separated list of samples to annotate (or exclude with \"^\" prefix)\n");
     fprintf(stderr, "   -S, --samples-file [^]<file>   file of samples to annotate (or exclude with \"^\" prefix)\n");
     fprintf(stderr, "   -x, --remove <list>            list of annotations to remove (e.g. ID,INFO/DP,FORMAT/DP,FILTER). See man page for details\n");
-    fprintf(stderr, "       --threads <int>            number of extra output compression threads [0]\n");
+    fprintf(stderr, "       --threads <int>            number of extra compression/decompression threads [0]\n");
     fprintf(stderr, "\n");
     exit(1);
 }
 
-int main_vcfannotate(int argc, char *argv[])
+static args_t *parse_args(int argc, char *argv[])
 {
     int c;
     args_t *args  = (args_t*) calloc(1,sizeof(args_t));
     args->argc    = argc; args->argv = argv;
-    args->files   = bcf_sr_init();
     args->output_fname = "-";
     args->output_type = FT_VCF;
-    args->n_threads = 0;
+    args->n_threads = -1;
     args->record_cmd_line = 1;
     args->ref_idx = args->alt_idx = args->chr_idx = args->from_idx = args->to_idx = -1;
     args->set_ids_replace = 1;
-    int regions_is_file = 0, collapse = 0;
 
     static struct option loptions[] =
     {
@@ -1949,17 +1956,17 @@ int main_vcfannotate(int argc, char *argv[])
             case 'x': args->remove_annots = optarg; break;
             case 'a': args->targets_fname = optarg; break;
             case 'r': args->regions_list = optarg; break;
-            case 'R': args->regions_list = optarg; regions_is_file = 1; break;
+            case 'R': args->regions_list = optarg; args->regions_is_file = 1; break;
             case 'h': args->header_fname = optarg; break;
             case  1 : args->rename_chrs = optarg; break;
             case  2 :
-                if ( !strcmp(optarg,"snps") ) collapse |= COLLAPSE_SNPS;
-                else if ( !strcmp(optarg,"indels") ) collapse |= COLLAPSE_INDELS;
-                else if ( !strcmp(optarg,"both") ) collapse |= COLLAPSE_SNPS | COLLAPSE_INDELS;
-                else if ( !strcmp(optarg,"any") ) collapse |= COLLAPSE_ANY;
-                else if ( !strcmp(optarg,"all") ) collapse |= COLLAPSE_ANY;
-                else if ( !strcmp(optarg,"some") ) collapse |= COLLAPSE_SOME;
-                else if ( !strcmp(optarg,"none") ) collapse = COLLAPSE_NONE;
+                if ( !strcmp(optarg,"snps") ) args->collapse |= COLLAPSE_SNPS;
+                else if ( !strcmp(optarg,"indels") ) args->collapse |= COLLAPSE_INDELS;
+                else if ( !strcmp(optarg,"both") ) args->collapse |= COLLAPSE_SNPS | COLLAPSE_INDELS;
+                else if ( !strcmp(optarg,"any") ) args->collapse |= COLLAPSE_ANY;
+                else if ( !strcmp(optarg,"all") ) args->collapse |= COLLAPSE_ANY;
+                else if ( !strcmp(optarg,"some") ) args->collapse |= COLLAPSE_SOME;
+                else if ( !strcmp(optarg,"none") ) args->collapse = COLLAPSE_NONE;
                 else error("The --collapse string \"%s\" not recognised.\n", optarg);
                 break;
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
@@ -1968,6 +1975,59 @@ int main_vcfannotate(int argc, char *argv[])
             default: error("Unknown argument: %s\n", optarg);
         }
     }
+    if ( args->targets_fname )
+    {
+        htsFile *fp = hts_open(args->targets_fname,"r"); 
+        htsFormat type = *hts_get_format(fp);
+        hts_close(fp);
+
+        if ( type.format==vcf || type.format==bcf ) args->tgts_is_vcf = 1;
+    }
+    return args;
+}
+
+// The annotate command as a stage of "bcftools pipe", see bcftools.h
+void *annotate_stage_init(int argc, char **argv, bcf_hdr_t *hdr_in, bcf_hdr_t **hdr_out)
+{
+    optind = 0;
+    args_t *args = parse_args(argc, argv);
+    if ( optind < argc ) error("Unexpected argument of \"annotate\" in the pipe: %s\n", argv[optind]);
+    if ( strcmp(args->output_fname,"-") || args->output_type!=FT_VCF || args->n_threads>=0 )
+        error("The output options of \"annotate\" are not supported in the pipe, see the options of \"pipe\"\n");
+    if ( args->regions_list ) error("The options -r and -R of \"annotate\" apply when reading and are not supported in the pipe\n");
+    if ( args->tgts_is_vcf )
+        error("Annotations from a VCF/BCF file are read in sync with the input and are not supported in the pipe, use a tabix-indexed file: %s\n", args->targets_fname);
+    args->record_cmd_line = 0;
+    args->hdr = bcf_hdr_dup(hdr_in);
+    init_data(args);
+    if ( bcf_hdr_sync(args->hdr_out)<0 ) error("Failed to update the header\n");
+    *hdr_out = args->hdr_out;
+    return args;
+}
+
+void annotate_stage_process(void *stage, stage_block_t *blk)
+{
+    args_t *args = (args_t*) stage;
+    int i, n = stage_block_take(blk, &args->recs, &args->mrecs);
+    for (i=0; i<n; i++)
+        if ( annotate_line(args, args->recs[i]) ) stage_block_push(blk, &args->recs[i]);
+}
+
+void annotate_stage_destroy(void *stage)
+{
+    args_t *args = (args_t*) stage;
+    int i;
+    for (i=0; i<args->mrecs; i++) bcf_destroy(args->recs[i]);
+    free(args->recs);
+    destroy_data(args);
+    bcf_hdr_destroy(args->hdr);
+    free(args);
+}
+
+int main_vcfannotate(int argc, char *argv[])
+{
+    args_t *args = parse_args(argc, argv);
+    args->files  = bcf_sr_init();
 
     char *fname = NULL;
     if ( optind>=argc )
@@ -1979,42 +2039,41 @@ int main_vcfannotate(int argc, char *argv[])
 
     if ( args->regions_list )
     {
-        if ( bcf_sr_set_regions(args->files, args->regions_list, regions_is_file)<0 )
+        if ( bcf_sr_set_regions(args->files, args->regions_list, args->regions_is_file)<0 )
             error("Failed to read the regions: %s\n", args->regions_list);
     }
-    if ( args->targets_fname )
+    if ( args->tgts_is_vcf )
     {
-        htsFile *fp = hts_open(args->targets_fname,"r"); 
-        htsFormat type = *hts_get_format(fp);
-        hts_close(fp);
-
-        if ( type.format==vcf || type.format==bcf )
-        {
-            args->tgts_is_vcf = 1;
-            args->files->require_index = 1;
-            args->files->collapse = collapse ? collapse : COLLAPSE_SOME;
-        }
+        args->files->require_index = 1;
+        args->files->collapse = args->collapse ? args->collapse : COLLAPSE_SOME;
     }
-    if ( bcf_sr_set_threads(args->files, args->n_threads)<0 ) error("Failed to create threads\n");
+    args->n_threads = bcftools_threads(args->n_threads);
+    bcftools_sr_set_threads(args->files, args->n_threads);
     if ( !bcf_sr_add_reader(args->files, fname) ) error("Failed to open %s: %s\n", fname,bcf_sr_strerror(args->files->errnum));
 
+    args->hdr = args->files->readers[0].header;
     init_data(args);
-    while ( bcf_sr_next_line(args->files) )
+    if ( !args->drop_header )
     {
+        args->out_fh = hts_open(args->output_fname,hts_bcf_wmode(args->output_type));
+        if ( args->out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->output_fname, strerror(errno));
+        bcftools_set_threads(args->out_fh, args->n_threads);
+        bcf_hdr_write(args->out_fh, args->hdr_out);
+    }
+    while ( perf_beg(PERF_READ), bcf_sr_next_line(args->files) )
+    {
+        perf_end(PERF_READ, 1);
         if ( !bcf_sr_has_line(args->files,0) ) continue;
         bcf1_t *line = bcf_sr_get_line(args->files,0);
         if ( line->errcode ) error("Encountered error, cannot proceed. Please check the error output above.\n");
-        if ( args->filter )
-        {
-            int pass = filter_test(args->filter, line, NULL);
-            if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
-            if ( !pass ) continue;
-        }
-        annotate(args, line);
+        if ( !annotate_line(args, line) ) continue;
+        perf_beg(PERF_WRITE);
         bcf_write1(args->out_fh, args->hdr_out, line);
+        perf_end(PERF_WRITE, 1);
     }
+    perf_end(PERF_READ, 0);
     destroy_data(args);
-    bcf_sr_destroy(args->files);
+    bcftools_sr_destroy(args->files);
     free(args);
     return 0;
 }
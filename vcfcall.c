@@ -42,6 +42,7 @@ THE SOFTWARE.  */
 #include "prob1.h"
 #include "ploidy.h"
 #include "gvcf.h"
+#include "perf.h"
 
 void error(const char *format, ...);
 
@@ -372,6 +373,8 @@ static void print_missed_line(bcf_sr_regions_t *regs, void *data)
 static void init_data(args_t *args)
 {
     args->aux.srs = bcf_sr_init();
+    args->n_threads = bcftools_threads(args->n_threads);
+    bcftools_sr_set_threads(args->aux.srs, args->n_threads);
 
     // Open files for input and output, initialize structures
     if ( args->targets )
@@ -453,7 +456,7 @@ static void init_data(args_t *args)
 
     args->out_fh = hts_open(args->output_fname, hts_bcf_wmode(args->output_type));
     if ( args->out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->output_fname, strerror(errno));
-    if ( args->n_threads ) hts_set_threads(args->out_fh, args->n_threads);
+    bcftools_set_threads(args->out_fh, args->n_threads);
 
     if ( args->flag & CF_QCALL )
         return;
@@ -499,7 +502,7 @@ static void destroy_data(args_t *args)
     if ( args->gvcf ) gvcf_destroy(args->gvcf);
     bcf_hdr_destroy(args->aux.hdr);
     hts_close(args->out_fh);
-    bcf_sr_destroy(args->aux.srs);
+    bcftools_sr_destroy(args->aux.srs);
 }
 
 void parse_novel_rate(args_t *args, const char *str)
@@ -623,7 +626,7 @@ static void usage(args_t *args)
     fprintf(stderr, "   -S, --samples-file <file>       PED file or a file with an optional column with sex (see man page for details) [all samples]\n");
     fprintf(stderr, "   -t, --targets <region>          similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "   -T, --targets-file <file>       similar to -R but streams rather than index-jumps\n");
-    fprintf(stderr, "       --threads <int>             number of extra output compression threads [0]\n");
+    fprintf(stderr, "       --threads <int>             number of extra compression/decompression threads [0]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Input/output options:\n");
     fprintf(stderr, "   -A, --keep-alts                 keep all possible alternate alleles at variant sites\n");
@@ -668,7 +671,7 @@ int main_vcfcall(int argc, char *argv[])
     args.flag           = CF_ACGT_ONLY;
     args.output_fname   = "-";
     args.output_type    = FT_VCF;
-    args.n_threads = 0;
+    args.n_threads = -1;
     args.record_cmd_line = 1;
     args.aux.trio_Pm_SNPs = 1 - 1e-8;
     args.aux.trio_Pm_ins  = args.aux.trio_Pm_del  = 1 - 1e-9;
@@ -807,8 +810,9 @@ int main_vcfcall(int argc, char *argv[])
     if ( args.aux.flag&CALL_VARONLY && args.gvcf ) error("The two options cannot be combined: --variants-only and --gvcf\n");
     init_data(&args);
 
-    while ( bcf_sr_next_line(args.aux.srs) )
+    while ( perf_beg(PERF_READ), bcf_sr_next_line(args.aux.srs) )
     {
+        perf_end(PERF_READ, 1);
         bcf1_t *bcf_rec = args.aux.srs->readers[0].buffer[0];
         if ( args.samples_map ) bcf_subset(args.aux.hdr, bcf_rec, args.nsamples, args.samples_map);
         bcf_unpack(bcf_rec, BCF_UN_STR);
@@ -835,7 +839,9 @@ int main_vcfcall(int argc, char *argv[])
         if ( is_ref && args.aux.flag&CALL_VARONLY )
             continue;
 
+        perf_beg(PERF_UNPACK);
         bcf_unpack(bcf_rec, BCF_UN_ALL);
+        perf_end(PERF_UNPACK, 1);
         if ( args.nsex ) set_ploidy(&args, bcf_rec);
 
         // Various output modes: QCall output (todo)
@@ -859,8 +865,13 @@ int main_vcfcall(int argc, char *argv[])
         if ( args.gvcf )
             bcf_rec = gvcf_write(args.gvcf, args.out_fh, args.aux.hdr, bcf_rec, ret==1?1:0);
         if ( bcf_rec )
+        {
+            perf_beg(PERF_WRITE);
             bcf_write1(args.out_fh, args.aux.hdr, bcf_rec);
+            perf_end(PERF_WRITE, 1);
+        }
     }
+    perf_end(PERF_READ, 0);
     if ( args.gvcf ) gvcf_write(args.gvcf, args.out_fh, args.aux.hdr, NULL, 0);
     if ( args.flag & CF_INS_MISSED ) bcf_sr_regions_flush(args.aux.srs->targets);
     destroy_data(&args);
@@ -111,7 +111,7 @@ static void init_data(args_t *args)
     if (args->record_cmd_line) bcf_hdr_append_version(args->out_hdr, args->argc, args->argv, "bcftools_concat");
     args->out_fh = hts_open(args->output_fname,hts_bcf_wmode(args->output_type));
     if ( args->out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->output_fname, strerror(errno));
-    if ( args->n_threads ) hts_set_threads(args->out_fh, args->n_threads);
+    bcftools_set_threads(args->out_fh, args->n_threads);
 
     bcf_hdr_write(args->out_fh, args->out_hdr);
 
@@ -119,6 +119,7 @@ static void init_data(args_t *args)
     {
         args->files = bcf_sr_init();
         args->files->require_index = 1;
+        bcftools_sr_set_threads(args->files, args->n_threads);
         if ( args->regions_list )
         {
             if ( bcf_sr_set_regions(args->files, args->regions_list, args->regions_is_file)<0 )
@@ -168,6 +169,7 @@ static void init_data(args_t *args)
         args->phase_set  = (int32_t*) malloc(bcf_hdr_nsamples(args->out_hdr)*sizeof(int32_t));
         args->files = bcf_sr_init();
         args->files->require_index = 1;
+        bcftools_sr_set_threads(args->files, args->n_threads);
         args->ifname = 0;
     }
 }
@@ -177,7 +179,7 @@ static void destroy_data(args_t *args)
     int i;
     for (i=0; i<args->nfnames; i++) free(args->fnames[i]);
     free(args->fnames);
-    if ( args->files ) bcf_sr_destroy(args->files);
+    if ( args->files ) bcftools_sr_destroy(args->files);
     if ( args->out_fh )
     {
         if ( hts_close(args->out_fh)!=0 ) error("hts_close error\n");
@@ -495,6 +497,7 @@ static void concat(args_t *args)
         for (i=0; i<args->nfnames; i++)
         {
             htsFile *fp = hts_open(args->fnames[i], "r"); if ( !fp ) error("Failed to open: %s\n", args->fnames[i]);
+            bcftools_set_threads(fp, args->n_threads);
             bcf_hdr_t *hdr = bcf_hdr_read(fp); if ( !hdr ) error("Failed to parse header: %s\n", args->fnames[i]);
             if ( !fp->is_bin && args->output_type&FT_VCF )
             {
@@ -722,7 +725,7 @@ static void usage(args_t *args)
     fprintf(stderr, "   -q, --min-PQ <int>             Break phase set if phasing quality is lower than <int> [30]\n");
     fprintf(stderr, "   -r, --regions <region>         Restrict to comma-separated list of regions\n");
     fprintf(stderr, "   -R, --regions-file <file>      Restrict to regions listed in a file\n");
-    fprintf(stderr, "       --threads <int>            Number of extra output compression threads [0]\n");
+    fprintf(stderr, "       --threads <int>            Number of extra compression/decompression threads [0]\n");
     fprintf(stderr, "\n");
     exit(1);
 }
@@ -734,7 +737,7 @@ int main_vcfconcat(int argc, char *argv[])
     args->argc    = argc; args->argv = argv;
     args->output_fname = "-";
     args->output_type = FT_VCF;
-    args->n_threads = 0;
+    args->n_threads = -1;
     args->record_cmd_line = 1;
     args->min_PQ  = 30;
 
@@ -808,6 +811,7 @@ int main_vcfconcat(int argc, char *argv[])
     if ( !args->nfnames ) usage(args);
     if ( args->remove_dups && !args->allow_overlaps ) error("The -D option is supported only with -a\n");
     if ( args->regions_list && !args->allow_overlaps ) error("The -r/-R option is supported only with -a\n");
+    args->n_threads = bcftools_threads(args->n_threads);
     if ( args->naive_concat )
     {
         if ( args->allow_overlaps ) error("The option --naive cannot be combined with --allow-overlaps\n");
@@ -76,14 +76,13 @@ static void destroy_data(args_t *args)
     if ( args->convert) convert_destroy(args->convert);
     if ( args->filter ) filter_destroy(args->filter);
     free(args->samples);
-    if ( args->files ) bcf_sr_destroy(args->files);
+    if ( args->files ) bcftools_sr_destroy(args->files);
 }
 
 static void open_vcf(args_t *args, const char *format_str)
 {
     args->files = bcf_sr_init();
-    if ( args->n_threads && bcf_sr_set_threads(args->files, args->n_threads)!=0 )
-        error("Could not initialize --threads %d\n", args->n_threads);
+    bcftools_sr_set_threads(args->files, args->n_threads);
 
     if ( args->regions_list )
     {
@@ -386,7 +385,7 @@ static void gensample_to_vcf(args_t *args)
 
     htsFile *out_fh = hts_open(args->outfname,hts_bcf_wmode(args->output_type));
     if ( out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->outfname, strerror(errno));
-    if ( args->n_threads ) hts_set_threads(out_fh, args->n_threads);
+    bcftools_set_threads(out_fh, args->n_threads);
     bcf_hdr_write(out_fh,args->header);
     bcf1_t *rec = bcf_init();
 
@@ -512,7 +511,7 @@ static void haplegendsample_to_vcf(args_t *args)
 
     htsFile *out_fh = hts_open(args->outfname,hts_bcf_wmode(args->output_type));
     if ( out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->outfname, strerror(errno));
-    if ( args->n_threads ) hts_set_threads(out_fh, args->n_threads);
+    bcftools_set_threads(out_fh, args->n_threads);
     bcf_hdr_write(out_fh,args->header);
     bcf1_t *rec = bcf_init();
 
@@ -626,7 +625,7 @@ static void hapsample_to_vcf(args_t *args)
 
     htsFile *out_fh = hts_open(args->outfname,hts_bcf_wmode(args->output_type));
     if ( out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->outfname, strerror(errno));
-    if ( args->n_threads ) hts_set_threads(out_fh, args->n_threads);
+    bcftools_set_threads(out_fh, args->n_threads);
     bcf_hdr_write(out_fh,args->header);
     bcf1_t *rec = bcf_init();
 
@@ -1212,7 +1211,7 @@ static void tsv_to_vcf(args_t *args)
 
     htsFile *out_fh = hts_open(args->outfname,hts_bcf_wmode(args->output_type));
     if ( out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->outfname, strerror(errno));
-    if ( args->n_threads ) hts_set_threads(out_fh, args->n_threads);
+    bcftools_set_threads(out_fh, args->n_threads);
     bcf_hdr_write(out_fh,args->header);
 
     tsv_t *tsv = tsv_init(args->columns ? args->columns : "ID,CHROM,POS,AA");
@@ -1262,7 +1261,7 @@ static void vcf_to_vcf(args_t *args)
     open_vcf(args,NULL);
     htsFile *out_fh = hts_open(args->outfname,hts_bcf_wmode(args->output_type));
     if ( out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->outfname, strerror(errno));
-    if ( args->n_threads ) hts_set_threads(out_fh, args->n_threads);
+    bcftools_set_threads(out_fh, args->n_threads);
 
     bcf_hdr_t *hdr = bcf_sr_get_header(args->files,0);
     bcf_hdr_write(out_fh,hdr);
@@ -1291,7 +1290,7 @@ static void gvcf_to_vcf(args_t *args)
     open_vcf(args,NULL);
     htsFile *out_fh = hts_open(args->outfname,hts_bcf_wmode(args->output_type));
     if ( out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->outfname, strerror(errno));
-    if ( args->n_threads ) hts_set_threads(out_fh, args->n_threads);
+    bcftools_set_threads(out_fh, args->n_threads);
 
     bcf_hdr_t *hdr = bcf_sr_get_header(args->files,0);
     if (args->record_cmd_line) bcf_hdr_append_version(hdr, args->argc, args->argv, "bcftools_convert");
@@ -1382,7 +1381,7 @@ static void usage(void)
     fprintf(stderr, "       --no-version               do not append version and command line to the header\n");
     fprintf(stderr, "   -o, --output <file>            output file name [stdout]\n");
     fprintf(stderr, "   -O, --output-type <b|u|z|v>    b: compressed BCF, u: uncompressed BCF, z: compressed VCF, v: uncompressed VCF [v]\n");
-    fprintf(stderr, "       --threads <int>            number of extra output compression threads [0]\n");
+    fprintf(stderr, "       --threads <int>            number of extra compression/decompression threads [0]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "GEN/SAMPLE conversion (input/output from IMPUTE2):\n");
     fprintf(stderr, "   -G, --gensample2vcf <...>   <prefix>|<gen-file>,<sample-file>\n");
@@ -1435,7 +1434,7 @@ int main_vcfconvert(int argc, char *argv[])
     args->argc   = argc; args->argv = argv;
     args->outfname = "-";
     args->output_type = FT_VCF;
-    args->n_threads = 0;
+    args->n_threads = -1;
     args->record_cmd_line = 1;
 
     static struct option loptions[] =
@@ -1520,7 +1519,8 @@ int main_vcfconvert(int argc, char *argv[])
         else args->infname = argv[optind];
     }
     if ( !args->infname ) usage();
-    
+    args->n_threads = bcftools_threads(args->n_threads);
+
     if ( args->convert_func ) args->convert_func(args);
     else vcf_to_vcf(args);
 
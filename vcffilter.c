@@ -37,6 +37,7 @@ THE SOFTWARE.  */
 #include "bcftools.h"
 #include "filter.h"
 #include "rbuf.h"
+#include "perf.h"
 
 // Logic of the filters: include or exclude sites which match the filters?
 #define FLT_INCLUDE 1
@@ -69,19 +70,17 @@ typedef struct _args_t
     bcf_hdr_t *hdr;
     htsFile *out_fh;
     int output_type, n_threads;
+    stage_block_t *blk;     // the output block in the pipe, otherwise written to out_fh
+    bcf1_t **recs;
+    int mrecs;
 
     char **argv, *output_fname, *targets_list, *regions_list;
-    int argc, record_cmd_line;
+    int argc, record_cmd_line, regions_is_file, targets_is_file;
 }
 args_t;
 
 static void init_data(args_t *args)
 {
-    args->out_fh = hts_open(args->output_fname,hts_bcf_wmode(args->output_type));
-    if ( args->out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->output_fname, strerror(errno));
-    if ( args->n_threads ) hts_set_threads(args->out_fh, args->n_threads);
-
-    args->hdr = args->files->readers[0].header;
     args->flt_pass = bcf_hdr_id2int(args->hdr,BCF_DT_ID,"PASS"); assert( !args->flt_pass );  // sanity check: required by BCF spec
 
     // -i or -e: append FILTER line
@@ -171,6 +170,14 @@ static void destroy_data(args_t *args)
     free(args->tmp_ac);
 }
 
+static void write_line(args_t *args, bcf1_t **line)
+{
+    if ( args->blk ) { stage_block_push(args->blk, line); return; }
+    perf_beg(PERF_WRITE);
+    bcf_write1(args->out_fh, args->hdr, *line);
+    perf_end(PERF_WRITE, 1);
+}
+
 static void flush_buffer(args_t *args, int n)
 {
     int i, j;
@@ -188,12 +195,12 @@ static void flush_buffer(args_t *args, int n)
                 if ( args->snp_gap && rec->d.flt[j]==args->SnpGap_id ) { pass = 0; break; }
             }
         }
-        if ( pass ) bcf_write1(args->out_fh, args->hdr, rec);
+        if ( pass ) write_line(args, &args->rbuf_lines[k]);
     }
 }
 
 #define SWAP(type_t, a, b) { type_t t = a; a = b; b = t; }
-static void buffered_filters(args_t *args, bcf1_t *line)
+static void buffered_filters(args_t *args, bcf1_t **line_ptr)
 {
     /**
      *  The logic of SnpGap=3. The SNPs at positions 1 and 7 are filtered,
@@ -221,6 +228,7 @@ static void buffered_filters(args_t *args, bcf1_t *line)
     const int IndelGap_set   = VCF_OTHER<<2;
     const int IndelGap_flush = VCF_OTHER<<3;
 
+    bcf1_t *line = line_ptr ? *line_ptr : NULL;
     int var_type = 0, i;
     if ( line )
     {
@@ -231,12 +239,11 @@ static void buffered_filters(args_t *args, bcf1_t *line)
 
         rbuf_expand0(&args->rbuf,bcf1_t*,args->rbuf.n,args->rbuf_lines);
 
-        // Insert the new record in the buffer. The line would be overwritten in
-        // the next bcf_sr_next_line call, therefore we need to swap it with an
-        // unused one
+        // Insert the new record in the buffer. The line would be overwritten by
+        // the caller, therefore we need to swap it with an unused one
         ilast = rbuf_append(&args->rbuf);
         if ( !args->rbuf_lines[ilast] ) args->rbuf_lines[ilast] = bcf_init1();
-        SWAP(bcf1_t*, args->files->readers[0].buffer[0], args->rbuf_lines[ilast]);
+        SWAP(bcf1_t*, *line_ptr, args->rbuf_lines[ilast]);
 
         var_type = bcf_get_variant_types(line);
 
@@ -397,6 +404,38 @@ static void set_genotypes(args_t *args, bcf1_t *line, int pass_site)
     if ( has_ac )  bcf_update_info_int32(args->hdr,line,"AC",args->tmp_ac,line->n_allele-1);
 }
 
+// Filter a record, the record can be swapped for an unused one when it is written or buffered
+static void filter_line(args_t *args, bcf1_t **line_ptr)
+{
+    bcf1_t *line = *line_ptr;
+    int pass = 1;
+    if ( args->filter )
+    {
+        perf_beg(PERF_FILTER);
+        pass = filter_test(args->filter, line, &args->smpl_pass);
+        perf_end(PERF_FILTER, 1);
+        if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
+    }
+    if ( args->soft_filter || args->set_gts || pass )
+    {
+        if ( pass )
+        {
+            bcf_unpack(line,BCF_UN_FLT);
+            if ( args->annot_mode & ANNOT_RESET || !line->d.n_flt ) bcf_add_filter(args->hdr, line, args->flt_pass);
+        }
+        else if ( args->soft_filter )
+        {
+            if ( (args->annot_mode & ANNOT_ADD) ) bcf_add_filter(args->hdr, line, args->flt_fail);
+            else bcf_update_filter(args->hdr, line, &args->flt_fail, 1);
+        }
+        if ( args->set_gts ) set_genotypes(args, line, pass);
+        if ( !args->rbuf_lines )
+            write_line(args, line_ptr);
+        else
+            buffered_filters(args, line_ptr);
+    }
+}
+
 static void usage(args_t *args)
 {
     fprintf(stderr, "\n");
@@ -418,22 +457,20 @@ static void usage(args_t *args)
     fprintf(stderr, "    -S, --set-GTs <.|0>           set genotypes of failed samples to missing (.) or ref (0)\n");
     fprintf(stderr, "    -t, --targets <region>        similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>     similar to -R but streams rather than index-jumps\n");
-    fprintf(stderr, "        --threads <int>           number of extra output compression threads [0]\n");
+    fprintf(stderr, "        --threads <int>           number of extra compression/decompression threads [0]\n");
     fprintf(stderr, "\n");
     exit(1);
 }
 
-int main_vcffilter(int argc, char *argv[])
+static args_t *parse_args(int argc, char *argv[])
 {
     int c;
     args_t *args  = (args_t*) calloc(1,sizeof(args_t));
     args->argc    = argc; args->argv = argv;
-    args->files   = bcf_sr_init();
     args->output_fname = "-";
     args->output_type = FT_VCF;
-    args->n_threads = 0;
+    args->n_threads = -1;
     args->record_cmd_line = 1;
-    int regions_is_file = 0, targets_is_file = 0;
 
     static struct option loptions[] =
     {
@@ -481,9 +518,9 @@ int main_vcffilter(int argc, char *argv[])
                 if ( strchr(optarg,'+') ) args->annot_mode |= ANNOT_ADD;
                 break;
             case 't': args->targets_list = optarg; break;
-            case 'T': args->targets_list = optarg; targets_is_file = 1; break;
+            case 'T': args->targets_list = optarg; args->targets_is_file = 1; break;
             case 'r': args->regions_list = optarg; break;
-            case 'R': args->regions_list = optarg; regions_is_file = 1; break;
+            case 'R': args->regions_list = optarg; args->regions_is_file = 1; break;
             case 'e': args->filter_str = optarg; args->filter_logic |= FLT_EXCLUDE; break;
             case 'i': args->filter_str = optarg; args->filter_logic |= FLT_INCLUDE; break;
             case 'S':
@@ -500,6 +537,53 @@ int main_vcffilter(int argc, char *argv[])
     }
 
     if ( args->filter_logic == (FLT_EXCLUDE|FLT_INCLUDE) ) error("Only one of -i or -e can be given.\n");
+    return args;
+}
+
+// The filter command as a stage of "bcftools pipe", see bcftools.h
+void *filter_stage_init(int argc, char **argv, bcf_hdr_t *hdr_in, bcf_hdr_t **hdr_out)
+{
+    optind = 0;
+    args_t *args = parse_args(argc, argv);
+    if ( optind < argc ) error("Unexpected argument of \"filter\" in the pipe: %s\n", argv[optind]);
+    if ( strcmp(args->output_fname,"-") || args->output_type!=FT_VCF || args->n_threads>=0 )
+        error("The output options of \"filter\" are not supported in the pipe, see the options of \"pipe\"\n");
+    if ( args->regions_list || args->targets_list )
+        error("The options -r, -R, -t and -T of \"filter\" apply when reading and are not supported in the pipe\n");
+    args->record_cmd_line = 0;
+    args->hdr = bcf_hdr_dup(hdr_in);
+    init_data(args);
+    if ( bcf_hdr_sync(args->hdr)<0 ) error("Failed to update the header\n");
+    *hdr_out = args->hdr;
+    return args;
+}
+
+void filter_stage_process(void *stage, stage_block_t *blk)
+{
+    args_t *args = (args_t*) stage;
+    int i, n = stage_block_take(blk, &args->recs, &args->mrecs);
+    args->blk = blk;
+    for (i=0; i<n; i++) filter_line(args, &args->recs[i]);
+    if ( blk->eof && args->rbuf_lines ) buffered_filters(args, NULL);
+    args->blk = NULL;
+}
+
+void filter_stage_destroy(void *stage)
+{
+    args_t *args = (args_t*) stage;
+    int i;
+    for (i=0; i<args->mrecs; i++) bcf_destroy(args->recs[i]);
+    free(args->recs);
+    destroy_data(args);
+    bcf_hdr_destroy(args->hdr);
+    free(args);
+}
+
+int main_vcffilter(int argc, char *argv[])
+{
+    args_t *args = parse_args(argc, argv);
+    args->files  = bcf_sr_init();
+
     char *fname = NULL;
     if ( optind>=argc )
     {
@@ -512,7 +596,7 @@ int main_vcffilter(int argc, char *argv[])
     if ( args->regions_list )
     {
         args->files->require_index = 1;
-        if ( bcf_sr_set_regions(args->files, args->regions_list, regions_is_file)<0 )
+        if ( bcf_sr_set_regions(args->files, args->regions_list, args->regions_is_file)<0 )
             error("Failed to read the regions: %s\n", args->regions_list);
     }
     else if ( optind+1 < argc )
@@ -522,52 +606,36 @@ int main_vcffilter(int argc, char *argv[])
         kputs(argv[optind+1],&tmp);
         for (i=optind+2; i<argc; i++) { kputc(',',&tmp); kputs(argv[i],&tmp); }
         args->files->require_index = 1;
-        if ( bcf_sr_set_regions(args->files, tmp.s, regions_is_file)<0 )
+        if ( bcf_sr_set_regions(args->files, tmp.s, args->regions_is_file)<0 )
             error("Failed to read the regions: %s\n", args->regions_list);
         free(tmp.s);
     }
     if ( args->targets_list )
     {
-        if ( bcf_sr_set_targets(args->files, args->targets_list,targets_is_file, 0)<0 )
+        if ( bcf_sr_set_targets(args->files, args->targets_list,args->targets_is_file, 0)<0 )
             error("Failed to read the targets: %s\n", args->targets_list);
     }
+    args->n_threads = bcftools_threads(args->n_threads);
+    bcftools_sr_set_threads(args->files, args->n_threads);
     if ( !bcf_sr_add_reader(args->files, fname) ) error("Failed to open %s: %s\n", fname,bcf_sr_strerror(args->files->errnum));
 
+    args->hdr = args->files->readers[0].header;
     init_data(args);
+    args->out_fh = hts_open(args->output_fname,hts_bcf_wmode(args->output_type));
+    if ( args->out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->output_fname, strerror(errno));
+    bcftools_set_threads(args->out_fh, args->n_threads);
     bcf_hdr_write(args->out_fh, args->hdr);
-    while ( bcf_sr_next_line(args->files) )
+    while ( perf_beg(PERF_READ), bcf_sr_next_line(args->files) )
     {
-        bcf1_t *line = bcf_sr_get_line(args->files, 0);
-        int pass = 1;
-        if ( args->filter )
-        {
-            pass = filter_test(args->filter, line, &args->smpl_pass);
-            if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
-        }
-        if ( args->soft_filter || args->set_gts || pass )
-        {
-            if ( pass )
-            {
-                bcf_unpack(line,BCF_UN_FLT);
-                if ( args->annot_mode & ANNOT_RESET || !line->d.n_flt ) bcf_add_filter(args->hdr, line, args->flt_pass);
-            }
-            else if ( args->soft_filter )
-            {
-                if ( (args->annot_mode & ANNOT_ADD) ) bcf_add_filter(args->hdr, line, args->flt_fail);
-                else bcf_update_filter(args->hdr, line, &args->flt_fail, 1);
-            }
-            if ( args->set_gts ) set_genotypes(args, line, pass);
-            if ( !args->rbuf_lines )
-                bcf_write1(args->out_fh, args->hdr, line);
-            else
-                buffered_filters(args, line);
-        }
+        perf_end(PERF_READ, 1);
+        filter_line(args, &args->files->readers[0].buffer[0]);
     }
+    perf_end(PERF_READ, 0);
     buffered_filters(args, NULL);
 
     hts_close(args->out_fh);
     destroy_data(args);
-    bcf_sr_destroy(args->files);
+    bcftools_sr_destroy(args->files);
     free(args);
     return 0;
 }
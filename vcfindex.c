@@ -33,6 +33,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include <inttypes.h>
 #include <htslib/kstring.h>
 #include "bcftools.h"
+#include "regidx.h"
 
 #define BCF_LIDX_SHIFT    14
 
@@ -41,12 +42,14 @@ static void usage(void)
     fprintf(stderr, "\n");
     fprintf(stderr, "About:   Index bgzip compressed VCF/BCF files for random access.\n");
     fprintf(stderr, "Usage:   bcftools index [options] <in.bcf>|<in.vcf.gz>\n");
+    fprintf(stderr, "         bcftools index --regions [options] <regions.bed>|<regions.tab>\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Indexing options:\n");
     fprintf(stderr, "    -c, --csi                generate CSI-format index for VCF/BCF files [default]\n");
     fprintf(stderr, "    -f, --force              overwrite index if it already exists\n");
     fprintf(stderr, "    -m, --min-shift INT      set minimal interval size for CSI indices to 2^INT [14]\n");
     fprintf(stderr, "    -o, --output-file FILE   optional output index file name\n");
+    fprintf(stderr, "    -r, --regions            generate a memory-mapped image of a BED/TAB regions file for -R/-T\n");
     fprintf(stderr, "    -t, --tbi                generate TBI-format index for VCF files\n");
     fprintf(stderr, "        --threads            sets the number of threads [0]\n");
     fprintf(stderr, "\n");
@@ -120,9 +123,20 @@ int vcf_index_stats(char *fname, int stats)
     return 0;
 }
 
+static int regions_index_build(const char *fname, const char *idx_fname)
+{
+    // the parser is given explicitly, otherwise regidx_init() would map an existing FILE.ridx
+    if ( regidx_is_image(fname) ) error("index: \"%s\" is already a binary image of regions\n", fname);
+    regidx_t *idx = regidx_init(fname,regidx_default_parser(fname),NULL,0,NULL);
+    if ( !idx ) error("index: failed to read the regions \"%s\"\n", fname);
+    if ( regidx_save(idx, idx_fname)!=0 ) error("index: failed to write \"%s\"\n", idx_fname);
+    regidx_destroy(idx);
+    return 0;
+}
+
 int main_vcfindex(int argc, char *argv[])
 {
-    int c, force = 0, tbi = 0, stats = 0, n_threads = 0;
+    int c, force = 0, tbi = 0, stats = 0, n_threads = -1, regions = 0;
     int min_shift = BCF_LIDX_SHIFT;
     char *outfn = NULL;
 
@@ -130,6 +144,7 @@ int main_vcfindex(int argc, char *argv[])
     {
         {"csi",no_argument,NULL,'c'},
         {"tbi",no_argument,NULL,'t'},
+        {"regions",no_argument,NULL,'r'},
         {"force",no_argument,NULL,'f'},
         {"min-shift",required_argument,NULL,'m'},
         {"stats",no_argument,NULL,'s'},
@@ -140,12 +155,13 @@ int main_vcfindex(int argc, char *argv[])
     };
 
     char *tmp;
-    while ((c = getopt_long(argc, argv, "ctfm:sno:", loptions, NULL)) >= 0)
+    while ((c = getopt_long(argc, argv, "ctrfm:sno:", loptions, NULL)) >= 0)
     {
         switch (c)
         {
             case 'c': tbi = 0; break;
             case 't': tbi = 1; min_shift = 0; break;
+            case 'r': regions = 1; break;
             case 'f': force = 1; break;
             case 'm':
                 min_shift = strtol(optarg,&tmp,10);
@@ -192,7 +208,7 @@ int main_vcfindex(int argc, char *argv[])
     else
     {
         if (!strcmp(fname, "-")) { fprintf(stderr, "[E::%s] must specify an output path for index file when reading VCF/BCF from stdin\n", __func__); return 1; }
-        ksprintf(&idx_fname, "%s.%s", fname, tbi ? "tbi" : "csi");
+        ksprintf(&idx_fname, "%s.%s", fname, regions ? "ridx" : tbi ? "tbi" : "csi");
     }
     if (!force)
     {
@@ -210,7 +226,14 @@ int main_vcfindex(int argc, char *argv[])
         }
     }
 
-    int ret = bcf_index_build3(fname, idx_fname.s, min_shift, n_threads);
+    if ( regions )
+    {
+        int ret = regions_index_build(fname, idx_fname.s);
+        free(idx_fname.s);
+        return ret;
+    }
+
+    int ret = bcf_index_build3(fname, idx_fname.s, min_shift, bcftools_threads(n_threads));
     free(idx_fname.s);
     if (ret != 0) {
         if (ret == -2)
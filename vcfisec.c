@@ -142,7 +142,7 @@ void isec_vcf(args_t *args)
     {
         out_fh = hts_open(args->output_fname? args->output_fname : "-",hts_bcf_wmode(args->output_type));
         if ( out_fh == NULL ) error("Can't write to %s: %s\n", args->output_fname? args->output_fname : "standard output", strerror(errno));
-        if ( args->n_threads ) hts_set_threads(out_fh, args->n_threads);
+        bcftools_set_threads(out_fh, args->n_threads);
         if (args->record_cmd_line) bcf_hdr_append_version(files->readers[args->iwrite].header,args->argc,args->argv,"bcftools_isec");
         bcf_hdr_write(out_fh, files->readers[args->iwrite].header);
     }
@@ -350,7 +350,7 @@ static void init_data(args_t *args)
                 open_file(&args->fnames[i], NULL, "%s/%04d.%s", args->prefix, i, suffix); \
                 args->fh_out[i] = hts_open(args->fnames[i], hts_bcf_wmode(args->output_type));  \
                 if ( !args->fh_out[i] ) error("Could not open %s\n", args->fnames[i]); \
-                if ( args->n_threads ) hts_set_threads(args->fh_out[i], args->n_threads); \
+                bcftools_set_threads(args->fh_out[i], args->n_threads); \
                 if (args->record_cmd_line) bcf_hdr_append_version(args->files->readers[j].header,args->argc,args->argv,"bcftools_isec"); \
                 bcf_hdr_write(args->fh_out[i], args->files->readers[j].header); \
             }
@@ -465,7 +465,7 @@ static void usage(void)
     fprintf(stderr, "    -R, --regions-file <file>     restrict to regions listed in a file\n");
     fprintf(stderr, "    -t, --targets <region>        similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>     similar to -R but streams rather than index-jumps\n");
-    fprintf(stderr, "        --threads <int>           number of extra output compression threads [0]\n");
+    fprintf(stderr, "        --threads <int>           number of extra compression/decompression threads [0]\n");
     fprintf(stderr, "    -w, --write <list>            list of files to write with -p given as 1-based indexes. By default, all files are written\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Examples:\n");
@@ -492,7 +492,7 @@ int main_vcfisec(int argc, char *argv[])
     args->argc   = argc; args->argv = argv;
     args->output_fname = NULL;
     args->output_type = FT_VCF;
-    args->n_threads = 0;
+    args->n_threads = -1;
     args->record_cmd_line = 1;
     int targets_is_file = 0, regions_is_file = 0;
 
@@ -585,6 +585,8 @@ int main_vcfisec(int argc, char *argv[])
         if ( !args->isec_op ) error("Expected two file names or one of the options --complement, --nfiles or --targets\n");
     }
     args->files->require_index = 1;
+    args->n_threads = bcftools_threads(args->n_threads);
+    bcftools_sr_set_threads(args->files, args->n_threads);
     while (optind<argc)
     {
         if ( !bcf_sr_add_reader(args->files, argv[optind]) ) error("Failed to open %s: %s\n", argv[optind],bcf_sr_strerror(args->files->errnum));
@@ -593,7 +595,7 @@ int main_vcfisec(int argc, char *argv[])
     init_data(args);
     isec_vcf(args);
     destroy_data(args);
-    bcf_sr_destroy(args->files);
+    bcftools_sr_destroy(args->files);
     free(args);
     return 0;
 }
@@ -38,6 +38,7 @@ THE SOFTWARE.  */
 #include "bcftools.h"
 #include "regidx.h"
 #include "vcmp.h"
+#include "perf.h"
 
 #define DBG 0
 
@@ -1768,7 +1769,9 @@ void gvcf_write_block(args_t *args, int start, int end)
     }
     else
         bcf_update_info_int32(args->out_hdr, out, "END", NULL, 0);
+    perf_beg(PERF_WRITE);
     bcf_write1(args->out_fh, args->out_hdr, out);
+    perf_end(PERF_WRITE, 1);
     bcf_clear1(out);
 
 
@@ -2209,7 +2212,9 @@ void merge_line(args_t *args)
     if ( args->do_gvcf )
         bcf_update_info_int32(args->out_hdr, out, "END", NULL, 0);
     merge_format(args, out);
+    perf_beg(PERF_WRITE);
     bcf_write1(args->out_fh, args->out_hdr, out);
+    perf_end(PERF_WRITE, 1);
     bcf_clear1(out);
 }
 
@@ -2242,7 +2247,7 @@ void merge_vcf(args_t *args)
 {
     args->out_fh  = hts_open(args->output_fname, hts_bcf_wmode(args->output_type));
     if ( args->out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->output_fname, strerror(errno));
-    if ( args->n_threads ) hts_set_opt(args->out_fh, HTS_OPT_THREAD_POOL, args->files->p); //hts_set_threads(args->out_fh, args->n_threads);
+    bcftools_set_threads(args->out_fh, args->n_threads);
     args->out_hdr = bcf_hdr_init("w");
 
     if ( args->header_fname )
@@ -2276,8 +2281,9 @@ void merge_vcf(args_t *args)
     args->out_line = bcf_init1();
     args->tmph = kh_init(strdict);
 
-    while ( bcf_sr_next_line(args->files) )
+    while ( perf_beg(PERF_READ), bcf_sr_next_line(args->files) )
     {
+        perf_end(PERF_READ, 1);
         // output cached gVCF blocks which end before the new record
         if ( args->do_gvcf )
             gvcf_flush(args,0);
@@ -2295,6 +2301,7 @@ void merge_vcf(args_t *args)
         }
         clean_buffer(args);
     }
+    perf_end(PERF_READ, 0);
     if ( args->do_gvcf )
         gvcf_flush(args,1);
 
@@ -2332,7 +2339,7 @@ static void usage(void)
     fprintf(stderr, "    -O, --output-type <b|u|z|v>        'b' compressed BCF; 'u' uncompressed BCF; 'z' compressed VCF; 'v' uncompressed VCF [v]\n");
     fprintf(stderr, "    -r, --regions <region>             restrict to comma-separated list of regions\n");
     fprintf(stderr, "    -R, --regions-file <file>          restrict to regions listed in a file\n");
-    fprintf(stderr, "        --threads <int>                number of extra output compression threads [0]\n");
+    fprintf(stderr, "        --threads <int>                number of extra compression/decompression threads [0]\n");
     fprintf(stderr, "\n");
     exit(1);
 }
@@ -2345,7 +2352,7 @@ int main_vcfmerge(int argc, char *argv[])
     args->argc   = argc; args->argv = argv;
     args->output_fname = "-";
     args->output_type = FT_VCF;
-    args->n_threads = 0;
+    args->n_threads = -1;
     args->record_cmd_line = 1;
     args->collapse = COLLAPSE_BOTH;
     int regions_is_file = 0;
@@ -2429,13 +2436,16 @@ int main_vcfmerge(int argc, char *argv[])
     args->files->require_index = 1;
     if ( args->regions_list )
     {
+        if ( regions_is_file && regidx_is_image(args->regions_list) )
+            error("The -R option expects the text regions file, not its binary image: %s\n"
+                  "The image FILE.ridx is used automatically when FILE is given.\n", args->regions_list);
         if ( bcf_sr_set_regions(args->files, args->regions_list, regions_is_file)<0 )
             error("Failed to read the regions: %s\n", args->regions_list);
         if ( regions_is_file )
-            args->regs = regidx_init(args->regions_list,NULL,NULL,sizeof(char*),NULL);
+            args->regs = regidx_init(args->regions_list,NULL,NULL,0,NULL);
         else
         {
-            args->regs = regidx_init(NULL,regidx_parse_reg,NULL,sizeof(char*),NULL);
+            args->regs = regidx_init(NULL,regidx_parse_reg,NULL,0,NULL);
             if ( regidx_insert_list(args->regs,args->regions_list,',') !=0 ) error("Could not parse the regions: %s\n", args->regions_list);
             regidx_insert(args->regs,NULL);
         }
@@ -2443,7 +2453,8 @@ int main_vcfmerge(int argc, char *argv[])
         args->regs_itr = regitr_init(args->regs);
     }
 
-    if ( bcf_sr_set_threads(args->files, args->n_threads)<0 ) error("Failed to create threads\n");
+    args->n_threads = bcftools_threads(args->n_threads);
+    bcftools_sr_set_threads(args->files, args->n_threads);
     while (optind<argc)
     {
         if ( !bcf_sr_add_reader(args->files, argv[optind]) ) error("Failed to open %s: %s\n", argv[optind],bcf_sr_strerror(args->files->errnum));
@@ -2460,7 +2471,7 @@ int main_vcfmerge(int argc, char *argv[])
         free(files);
     }
     merge_vcf(args);
-    bcf_sr_destroy(args->files);
+    bcftools_sr_destroy(args->files);
     if ( args->regs ) regidx_destroy(args->regs);
     if ( args->regs_itr ) regitr_destroy(args->regs_itr);
     if ( args->gvcf_fai ) fai_destroy(args->gvcf_fai);
@@ -36,6 +36,7 @@ THE SOFTWARE.  */
 #include <htslib/faidx.h>
 #include "bcftools.h"
 #include "rbuf.h"
+#include "perf.h"
 
 #define CHECK_REF_EXIT 0
 #define CHECK_REF_WARN 1
@@ -72,12 +73,17 @@ typedef struct
     int aln_win;            // the realignment window size (maximum repeat size)
     bcf_srs_t *files;       // using the synced reader only for -r option
     bcf_hdr_t *hdr;
+    htsFile *out_fh;
+    stage_block_t *blk;     // the output block in the pipe, otherwise written to out_fh
+    bcf1_t **recs;
+    int mrecs;
     faidx_t *fai;
     struct { int tot, set, swap; } nref;
     char **argv, *output_fname, *ref_fname, *vcf_fname, *region, *targets;
     int argc, rmdup, output_type, n_threads, check_ref, strict_filter, do_indels;
     int nchanged, nskipped, nsplit, ntotal, mrows_op, mrows_collapse, parsimonious;
-    int record_cmd_line;
+    int prev_rid, prev_pos, prev_type;  // the last site for removing duplicates
+    int record_cmd_line, region_is_file, targets_is_file;
 }
 args_t;
 
@@ -1452,7 +1458,7 @@ static int mrows_ready_to_flush(args_t *args, bcf1_t *line)
     if ( args->nblines && (args->blines[0]->rid!=line->rid || args->blines[0]->pos!=line->pos) ) return 1;
     return 0;
 }
-static bcf1_t *mrows_flush(args_t *args)
+static bcf1_t **mrows_flush(args_t *args)
 {
     if ( args->nblines && args->nalines==1 && bcf_get_variant_types(args->alines[0])==VCF_REF )
     {
@@ -1470,30 +1476,38 @@ static bcf1_t *mrows_flush(args_t *args)
         if ( args->nalines==1 )
         {
             args->nalines = 0;
-            return args->alines[0];
+            return &args->alines[0];
         }
         bcf_clear(args->mrow_out);
         merge_biallelics_to_multiallelic(args, args->mrow_out, args->alines, args->nalines);
         args->nalines = 0;
-        return args->mrow_out;
+        return &args->mrow_out;
     }
     else if ( args->nblines )
     {
         if ( args->nblines==1 )
         {
             args->nblines = 0;
-            return args->blines[0];
+            return &args->blines[0];
         }
         bcf_clear(args->mrow_out);
         merge_biallelics_to_multiallelic(args, args->mrow_out, args->blines, args->nblines);
         args->nblines = 0;
-        return args->mrow_out;
+        return &args->mrow_out;
     }
     return NULL;
 }
-static void flush_buffer(args_t *args, htsFile *file, int n)
+static inline void write_line(args_t *args, bcf1_t **line)
 {
-    bcf1_t *line;
+    if ( args->blk ) { stage_block_push(args->blk, line); return; }
+    perf_beg(PERF_WRITE);
+    bcf_write1(args->out_fh, args->hdr, *line);
+    perf_end(PERF_WRITE, 1);
+}
+
+static void flush_buffer(args_t *args, int n)
+{
+    bcf1_t **line;
     int i, k;
     for (i=0; i<n; i++)
     {
@@ -1502,7 +1516,7 @@ static void flush_buffer(args_t *args, htsFile *file, int n)
         {
             if ( mrows_ready_to_flush(args, args->lines[k]) )
             {
-                while ( (line=mrows_flush(args)) ) bcf_write1(file, args->hdr, line);
+                while ( (line=mrows_flush(args)) ) write_line(args, line);
             }
             int merge = 1;
             if ( args->mrows_collapse!=COLLAPSE_BOTH && args->mrows_collapse!=COLLAPSE_ANY )
@@ -1515,17 +1529,16 @@ static void flush_buffer(args_t *args, htsFile *file, int n)
                 continue;
             }
         }
-        bcf_write1(file, args->hdr, args->lines[k]);
+        write_line(args, &args->lines[k]);
     }
     if ( args->mrows_op==MROWS_MERGE && !args->rbuf.n )
     {
-        while ( (line=mrows_flush(args)) ) bcf_write1(file, args->hdr, line);
+        while ( (line=mrows_flush(args)) ) write_line(args, line);
     }
 }
 
 static void init_data(args_t *args)
 {
-    args->hdr = args->files->readers[0].header;
     rbuf_init(&args->rbuf, 100);
     args->lines = (bcf1_t**) calloc(args->rbuf.m, sizeof(bcf1_t*));
     if ( args->ref_fname )
@@ -1619,82 +1632,94 @@ static void normalize_line(args_t *args, bcf1_t **line_ptr)
     }
 }
 
-static void normalize_vcf(args_t *args)
+// Remove duplicates, split and normalize a record and flush the sites out of
+// the window, the record can be swapped for an unused one
+static void process_line(args_t *args, bcf1_t **line_ptr)
 {
-    htsFile *out = hts_open(args->output_fname, hts_bcf_wmode(args->output_type));
-    if ( out == NULL ) error("Can't write to \"%s\": %s\n", args->output_fname, strerror(errno));
-    if ( args->n_threads )
-        hts_set_opt(out, HTS_OPT_THREAD_POOL, args->files->p);
-    if (args->record_cmd_line) bcf_hdr_append_version(args->hdr, args->argc, args->argv, "bcftools_norm");
-    bcf_hdr_write(out, args->hdr);
+    args->ntotal++;
 
-    int prev_rid = -1, prev_pos = -1, prev_type = 0;
-    while ( bcf_sr_next_line(args->files) )
+    bcf1_t *line = *line_ptr;
+    if ( args->rmdup )
     {
-        args->ntotal++;
-
-        bcf1_t *line = args->files->readers[0].buffer[0];
-        if ( args->rmdup )
+        int line_type = bcf_get_variant_types(line);
+        if ( args->prev_rid>=0 && args->prev_rid==line->rid && args->prev_pos==line->pos )
         {
-            int line_type = bcf_get_variant_types(line);
-            if ( prev_rid>=0 && prev_rid==line->rid && prev_pos==line->pos )
-            {
-                if ( (args->rmdup>>1)&COLLAPSE_ANY ) continue;
-                if ( (args->rmdup>>1)&COLLAPSE_SNPS && line_type&(VCF_SNP|VCF_MNP) && prev_type&(VCF_SNP|VCF_MNP) ) continue;
-                if ( (args->rmdup>>1)&COLLAPSE_INDELS && line_type&(VCF_INDEL) && prev_type&(VCF_INDEL) ) continue;
-            }
-            else
-            {
-                prev_rid  = line->rid;
-                prev_pos  = line->pos;
-                prev_type = 0;
-            }
-            prev_type |= line_type;
+            if ( (args->rmdup>>1)&COLLAPSE_ANY ) return;
+            if ( (args->rmdup>>1)&COLLAPSE_SNPS && line_type&(VCF_SNP|VCF_MNP) && args->prev_type&(VCF_SNP|VCF_MNP) ) return;
+            if ( (args->rmdup>>1)&COLLAPSE_INDELS && line_type&(VCF_INDEL) && args->prev_type&(VCF_INDEL) ) return;
+        }
+        else
+        {
+            args->prev_rid  = line->rid;
+            args->prev_pos  = line->pos;
+            args->prev_type = 0;
         }
+        args->prev_type |= line_type;
+    }
 
-        // still on the same chromosome?
-        int i,j,ilast = rbuf_last(&args->rbuf);
-        if ( ilast>=0 && line->rid != args->lines[ilast]->rid ) flush_buffer(args, out, args->rbuf.n); // new chromosome
+    // still on the same chromosome?
+    int i,j,ilast = rbuf_last(&args->rbuf);
+    if ( ilast>=0 && line->rid != args->lines[ilast]->rid ) flush_buffer(args, args->rbuf.n); // new chromosome
 
-        int split = 0;
-        if ( args->mrows_op==MROWS_SPLIT )
+    int split = 0;
+    if ( args->mrows_op==MROWS_SPLIT )
+    {
+        split = 1;
+        if ( args->mrows_collapse!=COLLAPSE_BOTH && args->mrows_collapse!=COLLAPSE_ANY )
         {
-            split = 1;
-            if ( args->mrows_collapse!=COLLAPSE_BOTH && args->mrows_collapse!=COLLAPSE_ANY )
-            {
-                if ( !(bcf_get_variant_types(line) & args->mrows_collapse) ) split = 0;
-            }
-            if ( split && line->n_allele>2 )
-            {
-                args->nsplit++;
-                split_multiallelic_to_biallelics(args, line);
-                for (j=0; j<args->ntmp_lines; j++)
-                    normalize_line(args, &args->tmp_lines[j]);
-            }
-            else
-                split = 0;
+            if ( !(bcf_get_variant_types(line) & args->mrows_collapse) ) split = 0;
         }
-        if ( !split )
-            normalize_line(args, &args->files->readers[0].buffer[0]);
-
-        // find out how many sites to flush
-        ilast = rbuf_last(&args->rbuf);
-        j = 0;
-        for (i=-1; rbuf_next(&args->rbuf,&i); )
+        if ( split && line->n_allele>2 )
         {
-            if ( args->lines[ilast]->pos - args->lines[i]->pos < args->buf_win ) break;
-            j++;
+            args->nsplit++;
+            split_multiallelic_to_biallelics(args, line);
+            for (j=0; j<args->ntmp_lines; j++)
+                normalize_line(args, &args->tmp_lines[j]);
         }
-        if ( j>0 ) flush_buffer(args, out, j);
+        else
+            split = 0;
     }
-    flush_buffer(args, out, args->rbuf.n);
-    hts_close(out);
+    if ( !split )
+        normalize_line(args, line_ptr);
 
+    // find out how many sites to flush
+    ilast = rbuf_last(&args->rbuf);
+    j = 0;
+    for (i=-1; rbuf_next(&args->rbuf,&i); )
+    {
+        if ( args->lines[ilast]->pos - args->lines[i]->pos < args->buf_win ) break;
+        j++;
+    }
+    if ( j>0 ) flush_buffer(args, j);
+}
+
+static void print_stats(args_t *args)
+{
     fprintf(stderr,"Lines   total/split/realigned/skipped:\t%d/%d/%d/%d\n", args->ntotal,args->nsplit,args->nchanged,args->nskipped);
     if ( args->check_ref & CHECK_REF_FIX )
         fprintf(stderr,"REF/ALT total/modified/added:  \t%d/%d/%d\n", args->nref.tot,args->nref.swap,args->nref.set);
 }
 
+static void normalize_vcf(args_t *args)
+{
+    args->out_fh = hts_open(args->output_fname, hts_bcf_wmode(args->output_type));
+    if ( args->out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->output_fname, strerror(errno));
+    bcftools_set_threads(args->out_fh, args->n_threads);
+    if (args->record_cmd_line) bcf_hdr_append_version(args->hdr, args->argc, args->argv, "bcftools_norm");
+    bcf_hdr_write(args->out_fh, args->hdr);
+
+    while ( perf_beg(PERF_READ), bcf_sr_next_line(args->files) )
+    {
+        perf_end(PERF_READ, 1);
+        process_line(args, &args->files->readers[0].buffer[0]);
+    }
+    perf_end(PERF_READ, 0);
+    flush_buffer(args, args->rbuf.n);
+    hts_close(args->out_fh);
+
+    print_stats(args);
+}
+
 static void usage(void)
 {
     fprintf(stderr, "\n");
@@ -1724,22 +1749,20 @@ static void usage(void)
     exit(1);
 }
 
-int main_vcfnorm(int argc, char *argv[])
+static args_t *parse_args(int argc, char *argv[])
 {
     int c;
     args_t *args  = (args_t*) calloc(1,sizeof(args_t));
     args->argc    = argc; args->argv = argv;
-    args->files   = bcf_sr_init();
     args->output_fname = "-";
     args->output_type = FT_VCF;
-    args->n_threads = 0;
+    args->n_threads = -1;
     args->record_cmd_line = 1;
     args->aln_win = 100;
     args->buf_win = 1000;
     args->mrows_collapse = COLLAPSE_BOTH;
     args->do_indels = 1;
-    int region_is_file  = 0;
-    int targets_is_file = 0;
+    args->prev_rid = args->prev_pos = -1;
 
     static struct option loptions[] =
     {
@@ -1809,9 +1832,9 @@ int main_vcfnorm(int argc, char *argv[])
             case 's': args->strict_filter = 1; break;
             case 'f': args->ref_fname = optarg; break;
             case 'r': args->region = optarg; break;
-            case 'R': args->region = optarg; region_is_file = 1; break;
+            case 'R': args->region = optarg; args->region_is_file = 1; break;
             case 't': args->targets = optarg; break;
-            case 'T': args->targets = optarg; targets_is_file = 1; break;
+            case 'T': args->targets = optarg; args->targets_is_file = 1; break;
             case 'w':
                 args->buf_win = strtol(optarg,&tmp,10);
                 if ( *tmp ) error("Could not parse argument: --site-win %s\n", optarg);
@@ -1826,6 +1849,54 @@ int main_vcfnorm(int argc, char *argv[])
     if ( argc>optind+1 ) usage();
     if ( !args->ref_fname && !args->mrows_op && !args->rmdup ) usage();
     if ( !args->ref_fname && args->check_ref&CHECK_REF_FIX ) error("Expected --fasta-ref with --check-ref s\n");
+    if ( args->mrows_op&MROWS_SPLIT && args->rmdup ) error("Cannot combine -D and -m-\n");
+    return args;
+}
+
+// The norm command as a stage of "bcftools pipe", see bcftools.h
+void *norm_stage_init(int argc, char **argv, bcf_hdr_t *hdr_in, bcf_hdr_t **hdr_out)
+{
+    optind = 0;
+    args_t *args = parse_args(argc, argv);
+    if ( optind < argc ) error("Unexpected argument of \"norm\" in the pipe: %s\n", argv[optind]);
+    if ( strcmp(args->output_fname,"-") || args->output_type!=FT_VCF || args->n_threads>=0 )
+        error("The output options of \"norm\" are not supported in the pipe, see the options of \"pipe\"\n");
+    if ( args->region || args->targets )
+        error("The options -r, -R, -t and -T of \"norm\" apply when reading and are not supported in the pipe\n");
+    args->hdr = bcf_hdr_dup(hdr_in);
+    if ( bcf_hdr_sync(args->hdr)<0 ) error("Failed to update the header\n");
+    init_data(args);
+    *hdr_out = args->hdr;
+    return args;
+}
+
+void norm_stage_process(void *stage, stage_block_t *blk)
+{
+    args_t *args = (args_t*) stage;
+    int i, n = stage_block_take(blk, &args->recs, &args->mrecs);
+    args->blk = blk;
+    for (i=0; i<n; i++) process_line(args, &args->recs[i]);
+    if ( blk->eof ) flush_buffer(args, args->rbuf.n);
+    args->blk = NULL;
+}
+
+void norm_stage_destroy(void *stage)
+{
+    args_t *args = (args_t*) stage;
+    int i;
+    print_stats(args);
+    for (i=0; i<args->mrecs; i++) bcf_destroy(args->recs[i]);
+    free(args->recs);
+    destroy_data(args);
+    bcf_hdr_destroy(args->hdr);
+    free(args);
+}
+
+int main_vcfnorm(int argc, char *argv[])
+{
+    args_t *args = parse_args(argc, argv);
+    args->files  = bcf_sr_init();
+
     char *fname = NULL;
     if ( optind>=argc )
     {
@@ -1836,22 +1907,23 @@ int main_vcfnorm(int argc, char *argv[])
 
     if ( args->region )
     {
-        if ( bcf_sr_set_regions(args->files, args->region,region_is_file)<0 )
+        if ( bcf_sr_set_regions(args->files, args->region,args->region_is_file)<0 )
             error("Failed to read the regions: %s\n", args->region);
     }
     if ( args->targets )
     {
-        if ( bcf_sr_set_targets(args->files, args->targets,targets_is_file, 0)<0 )
+        if ( bcf_sr_set_targets(args->files, args->targets,args->targets_is_file, 0)<0 )
             error("Failed to read the targets: %s\n", args->targets);
     }
 
-    if ( bcf_sr_set_threads(args->files, args->n_threads)<0 ) error("Failed to create threads\n");
+    args->n_threads = bcftools_threads(args->n_threads);
+    bcftools_sr_set_threads(args->files, args->n_threads);
     if ( !bcf_sr_add_reader(args->files, fname) ) error("Failed to open %s: %s\n", fname,bcf_sr_strerror(args->files->errnum));
-    if ( args->mrows_op&MROWS_SPLIT && args->rmdup ) error("Cannot combine -D and -m-\n");
+    args->hdr = args->files->readers[0].header;
     init_data(args);
     normalize_vcf(args);
     destroy_data(args);
-    bcf_sr_destroy(args->files);
+    bcftools_sr_destroy(args->files);
     free(args);
     return 0;
 }
@@ -0,0 +1,477 @@
+/*  vcfpipe.c -- run a chain of commands in a single process.
+
+    Copyright (C) 2017 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.  */
+
+/*
+    Runs a chain of commands such as
+
+        bcftools pipe 'view -i "QUAL>10" ; norm -m- ; +fill-tags ; filter -s LowDP -e "INFO/DP<10"' in.bcf
+
+    in a single process. The records are read once into blocks of bcf1_t
+    records which are passed from stage to stage in memory and written once
+    at the end, nothing is encoded or decoded between the stages. Each stage
+    runs in its own thread and takes the blocks from a queue filled by the
+    previous stage. The number of blocks is fixed, the reader waits for the
+    writer to return a block, which bounds the queues. The stages can drop,
+    add or hold back records, the blocks grow as needed.
+
+    The stages are view, filter, norm, annotate and plugins with the batch API
+    (process_batch() of the v2 API) which write VCF, see NAME_stage_init() in
+    bcftools.h. The options which depend on the reader, such as regions or a
+    second input file, are rejected by the stages. Each stage creates its
+    output header from the output header of the previous stage.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <htslib/vcf.h>
+#include <htslib/kstring.h>
+#include "bcftools.h"
+
+typedef struct
+{
+    const char *name;
+    void *(*init)(int argc, char **argv, bcf_hdr_t *hdr_in, bcf_hdr_t **hdr_out);
+    void (*process)(void *stage, stage_block_t *blk);
+    void (*destroy)(void *stage);
+}
+command_t;
+
+static const command_t commands[] =
+{
+    { "view", view_stage_init, view_stage_process, view_stage_destroy },
+    { "filter", filter_stage_init, filter_stage_process, filter_stage_destroy },
+    { "norm", norm_stage_init, norm_stage_process, norm_stage_destroy },
+    { "annotate", annotate_stage_init, annotate_stage_process, annotate_stage_destroy },
+    { "plugin", plugin_stage_init, plugin_stage_process, plugin_stage_destroy },
+    { NULL, NULL, NULL, NULL }
+};
+
+// A queue of blocks
+typedef struct
+{
+    stage_block_t **dat;
+    int n, m, beg;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+}
+queue_t;
+
+typedef struct
+{
+    char **argv;
+    int argc, margv;
+    const command_t *cmd;
+    void *ctx;
+    bcf_hdr_t *hdr_out;     // owned by the stage
+    queue_t *in, *out;
+    pthread_t tid;
+}
+stage_t;
+
+typedef struct
+{
+    stage_t *stage;
+    int nstage, mstage;
+    queue_t *queue;     // nstage+1 queues between the reader, stages and the writer, then the free blocks
+    stage_block_t *blocks;
+    int nblocks, block_size;
+    htsFile *in_fh, *out_fh;
+    bcf_hdr_t *hdr, *hdr_out;
+    pthread_t writer;
+    char **argv, *output_fname, *fname;
+    int argc, output_type, n_threads, record_cmd_line;
+}
+args_t;
+
+// Make room for n records, the new ones are spare
+static void block_expand(stage_block_t *blk, int n)
+{
+    if ( n <= blk->m ) return;
+    int i, m = blk->m;
+    hts_expand(bcf1_t*, n, blk->m, blk->recs);
+    for (i=m; i<blk->m; i++) blk->recs[i] = bcf_init();
+}
+
+int stage_block_take(stage_block_t *blk, bcf1_t ***recs, int *mrecs)
+{
+    int i, m = *mrecs, n = blk->n;
+    hts_expand(bcf1_t*, n, *mrecs, *recs);
+    for (i=m; i<*mrecs; i++) (*recs)[i] = bcf_init();
+    for (i=0; i<n; i++)
+    {
+        bcf1_t *tmp = (*recs)[i];
+        (*recs)[i] = blk->recs[i];
+        blk->recs[i] = tmp;
+    }
+    blk->n = 0;
+    return n;
+}
+
+void stage_block_push(stage_block_t *blk, bcf1_t **rec)
+{
+    block_expand(blk, blk->n+1);
+    bcf1_t *tmp = blk->recs[blk->n];
+    blk->recs[blk->n++] = *rec;
+    *rec = tmp;
+}
+
+static void queue_init(queue_t *q, int m)
+{
+    q->m   = m;
+    q->dat = (stage_block_t**) calloc(m, sizeof(stage_block_t*));
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+}
+
+static void queue_destroy(queue_t *q)
+{
+    free(q->dat);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->cond);
+}
+
+// There are never more blocks than the queue can hold, no need to wait for space
+static void queue_push(queue_t *q, stage_block_t *blk)
+{
+    pthread_mutex_lock(&q->lock);
+    assert( q->n < q->m );
+    q->dat[(q->beg + q->n) % q->m] = blk;
+    q->n++;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static stage_block_t *queue_pop(queue_t *q)
+{
+    pthread_mutex_lock(&q->lock);
+    while ( !q->n ) pthread_cond_wait(&q->cond, &q->lock);
+    stage_block_t *blk = q->dat[q->beg];
+    q->beg = (q->beg + 1) % q->m;
+    q->n--;
+    pthread_mutex_unlock(&q->lock);
+    return blk;
+}
+
+static void push_arg(stage_t *stage, char *arg)
+{
+    stage->argc++;
+    hts_expand(char*, stage->argc, stage->margv, stage->argv);
+    stage->argv[stage->argc-1] = arg;
+}
+
+static stage_t *new_stage(args_t *args)
+{
+    args->nstage++;
+    hts_expand0(stage_t, args->nstage, args->mstage, args->stage);
+    return &args->stage[args->nstage-1];
+}
+
+/*
+    Split the pipeline into stages at semicolons and the stages into words
+    at whitespace. Single quotes, double quotes and backslash escapes are
+    interpreted as in the shell, so that expressions can be passed through.
+    A plugin stage "+name ARGS" or "plugin name ARGS" keeps "name ARGS",
+    the plugin name serves as argv[0].
+*/
+static void parse_pipeline(args_t *args, const char *str)
+{
+    kstring_t word = {0,0,0};
+    stage_t *stage = NULL;
+    const char *p = str;
+    while ( 1 )
+    {
+        while ( *p && isspace(*p) ) p++;
+        if ( !*p || *p==';' )
+        {
+            if ( !stage ) error("Empty stage in the pipeline: %s\n", str);
+            stage = NULL;
+            if ( !*p ) break;
+            p++;
+            continue;
+        }
+
+        word.l = 0;
+        char quote = 0;
+        while ( *p )
+        {
+            if ( quote )
+            {
+                if ( *p==quote ) { quote = 0; p++; continue; }
+                if ( quote=='"' && *p=='\\' && (p[1]=='"' || p[1]=='\\') ) p++;
+            }
+            else
+            {
+                if ( isspace(*p) || *p==';' ) break;
+                if ( *p=='\'' || *p=='"' ) { quote = *p++; continue; }
+                if ( *p=='\\' && p[1] ) p++;
+            }
+            kputc(*p, &word);
+            p++;
+        }
+        if ( quote ) error("Unbalanced quotes in the pipeline: %s\n", str);
+
+        if ( !stage )
+        {
+            stage = new_stage(args);
+            for (stage->cmd=commands; stage->cmd->name; stage->cmd++)
+                if ( !strcmp(stage->cmd->name,word.s) ) break;
+            if ( word.s[0]=='+' )
+            {
+                for (stage->cmd=commands; strcmp("plugin",stage->cmd->name); stage->cmd++) ;
+                push_arg(stage, strdup(word.s+1));
+                continue;
+            }
+            if ( !stage->cmd->name )
+                error("The command \"%s\" cannot be run by pipe, only view, filter, norm, annotate and plugins are supported\n", word.s);
+            if ( !strcmp("plugin",word.s) ) continue;
+        }
+        push_arg(stage, strdup(word.s));
+    }
+    free(word.s);
+    if ( !args->nstage ) error("No commands given\n");
+}
+
+static void *run_stage(void *data)
+{
+    stage_t *stage = (stage_t*) data;
+    int eof = 0;
+    while ( !eof )
+    {
+        stage_block_t *blk = queue_pop(stage->in);
+        stage->cmd->process(stage->ctx, blk);
+        eof = blk->eof;
+        queue_push(stage->out, blk);
+    }
+    return NULL;
+}
+
+static void *run_writer(void *data)
+{
+    args_t *args = (args_t*) data;
+    queue_t *in = &args->queue[args->nstage], *free_blocks = &args->queue[args->nstage+1];
+    int eof = 0;
+    while ( !eof )
+    {
+        stage_block_t *blk = queue_pop(in);
+        int i;
+        for (i=0; i<blk->n; i++)
+            if ( bcf_write1(args->out_fh, args->hdr_out, blk->recs[i])!=0 ) error("Failed to write to %s\n", args->output_fname);
+        eof = blk->eof;
+        blk->n = 0;
+        queue_push(free_blocks, blk);
+    }
+    return NULL;
+}
+
+static void init_data(args_t *args)
+{
+    args->in_fh = hts_open(args->fname, "r");
+    if ( !args->in_fh ) error("Could not read %s: %s\n", args->fname, strerror(errno));
+    bcftools_set_threads(args->in_fh, args->n_threads);
+    args->hdr = bcf_hdr_read(args->in_fh);
+    if ( !args->hdr ) error("Could not read VCF/BCF headers from %s\n", args->fname);
+
+    // The output header of each stage is the input header of the next one
+    int i;
+    bcf_hdr_t *hdr = args->hdr;
+    for (i=0; i<args->nstage; i++)
+    {
+        stage_t *stage = &args->stage[i];
+        if ( !stage->argc ) error("Expected a plugin name\n");
+        stage->ctx = stage->cmd->init(stage->argc, stage->argv, hdr, &stage->hdr_out);
+        hdr = stage->hdr_out;
+    }
+    args->hdr_out = hdr;
+
+    if ( args->record_cmd_line ) bcf_hdr_append_version(args->hdr_out, args->argc, args->argv, "bcftools_pipe");
+    args->out_fh = hts_open(args->output_fname,hts_bcf_wmode(args->output_type));
+    if ( !args->out_fh ) error("Can't write to \"%s\": %s\n", args->output_fname, strerror(errno));
+    bcftools_set_threads(args->out_fh, args->n_threads);
+    if ( bcf_hdr_write(args->out_fh, args->hdr_out)!=0 ) error("Failed to write to %s\n", args->output_fname);
+
+    // one block for each stage to work on, one to read into and one to write
+    args->block_size = 1000;
+    char *env = getenv("BCFTOOLS_PIPE_BATCH");  // smaller blocks are used by the tests
+    if ( env )
+    {
+        args->block_size = strtol(env, NULL, 10);
+        if ( args->block_size <= 0 ) error("Could not parse BCFTOOLS_PIPE_BATCH=%s\n", env);
+    }
+    args->nblocks = args->nstage + 2;
+    args->blocks  = (stage_block_t*) calloc(args->nblocks, sizeof(stage_block_t));
+    args->queue   = (queue_t*) calloc(args->nstage + 2, sizeof(queue_t));
+    for (i=0; i<args->nstage+2; i++) queue_init(&args->queue[i], args->nblocks + 1);
+    for (i=0; i<args->nblocks; i++)
+    {
+        block_expand(&args->blocks[i], args->block_size);
+        queue_push(&args->queue[args->nstage+1], &args->blocks[i]);
+    }
+    for (i=0; i<args->nstage; i++)
+    {
+        args->stage[i].in  = &args->queue[i];
+        args->stage[i].out = &args->queue[i+1];
+    }
+}
+
+static void destroy_data(args_t *args)
+{
+    int i, j;
+    for (i=0; i<args->nstage; i++)
+    {
+        stage_t *stage = &args->stage[i];
+        if ( stage->ctx ) stage->cmd->destroy(stage->ctx);
+        for (j=0; j<stage->argc; j++) free(stage->argv[j]);
+        free(stage->argv);
+    }
+    free(args->stage);
+    for (i=0; i<args->nblocks; i++)
+    {
+        for (j=0; j<args->blocks[i].m; j++) bcf_destroy(args->blocks[i].recs[j]);
+        free(args->blocks[i].recs);
+    }
+    free(args->blocks);
+    if ( args->queue )
+        for (i=0; i<args->nstage+2; i++) queue_destroy(&args->queue[i]);
+    free(args->queue);
+    bcf_hdr_destroy(args->hdr);
+}
+
+static void run_pipeline(args_t *args)
+{
+    int i;
+    for (i=0; i<args->nstage; i++)
+        if ( pthread_create(&args->stage[i].tid, NULL, run_stage, &args->stage[i]) ) error("Failed to create a thread\n");
+    if ( pthread_create(&args->writer, NULL, run_writer, args) ) error("Failed to create a thread\n");
+
+    // read blocks of records and pass them to the first stage, the last one
+    // is marked and passed also when empty for the stages to flush
+    queue_t *free_blocks = &args->queue[args->nstage+1];
+    int ret = 0;
+    while ( ret==0 )
+    {
+        stage_block_t *blk = queue_pop(free_blocks);
+        block_expand(blk, args->block_size);
+        while ( blk->n < args->block_size )
+        {
+            bcf1_t *rec = blk->recs[blk->n];
+            ret = bcf_read(args->in_fh, args->hdr, rec);
+            if ( ret < -1 ) error("Error encountered while parsing the input\n");
+            if ( ret == -1 ) break;
+            if ( rec->errcode ) error("Error encountered while parsing the input at %s:%d\n", bcf_seqname(args->hdr,rec), rec->pos+1);
+            blk->n++;
+        }
+        blk->eof = ret==0 ? 0 : 1;
+        queue_push(&args->queue[0], blk);
+    }
+
+    for (i=0; i<args->nstage; i++)
+        if ( pthread_join(args->stage[i].tid, NULL) ) error("Failed to join a thread\n");
+    if ( pthread_join(args->writer, NULL) ) error("Failed to join a thread\n");
+
+    if ( hts_close(args->out_fh)!=0 ) error("Close failed: %s\n", args->output_fname);
+    bcftools_perf_input(args->in_fh);
+    if ( hts_close(args->in_fh)!=0 ) error("Close failed: %s\n", args->fname);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "\n");
+    fprintf(stderr, "About:   Run a chain of commands in a single process. The records are passed from stage to\n");
+    fprintf(stderr, "         stage in memory and each stage runs in its own thread. Supported are view, filter,\n");
+    fprintf(stderr, "         norm, annotate and plugins which implement the batch API and write VCF. Options which\n");
+    fprintf(stderr, "         depend on the reader, such as regions or a VCF with annotations, are not supported.\n");
+    fprintf(stderr, "Usage:   bcftools pipe [OPTIONS] '<command> [args] ; <command> [args] ; ...' [<file>]\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "        --no-version               do not append version and command line to the header\n");
+    fprintf(stderr, "    -o, --output <file>            write output to a file [standard output]\n");
+    fprintf(stderr, "    -O, --output-type <b|u|z|v>    b: compressed BCF, u: uncompressed BCF, z: compressed VCF, v: uncompressed VCF [v]\n");
+    fprintf(stderr, "        --threads <int>            number of extra compression/decompression threads [0]\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Example:\n");
+    fprintf(stderr, "   bcftools pipe -Ob -o out.bcf 'view -i \"QUAL>10\" ; norm -m- ; +fill-tags ; filter -s LowDP -e \"INFO/DP<10\"' in.bcf\n");
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int main_vcfpipe(int argc, char *argv[])
+{
+    int c;
+    args_t *args = (args_t*) calloc(1,sizeof(args_t));
+    args->argc = argc; args->argv = argv;
+    args->output_fname = "-";
+    args->output_type  = FT_VCF;
+    args->n_threads = -1;
+    args->record_cmd_line = 1;
+
+    static struct option loptions[] =
+    {
+        {"output",required_argument,NULL,'o'},
+        {"output-type",required_argument,NULL,'O'},
+        {"threads",required_argument,NULL,9},
+        {"no-version",no_argument,NULL,8},
+        {"help",no_argument,NULL,'h'},
+        {NULL,0,NULL,0}
+    };
+    // "+" stops at the pipeline, the stages may start with options
+    while ((c = getopt_long(argc, argv, "+o:O:h?",loptions,NULL)) >= 0)
+    {
+        switch (c)
+        {
+            case 'o': args->output_fname = optarg; break;
+            case 'O':
+                switch (optarg[0]) {
+                    case 'b': args->output_type = FT_BCF_GZ; break;
+                    case 'u': args->output_type = FT_BCF; break;
+                    case 'z': args->output_type = FT_VCF_GZ; break;
+                    case 'v': args->output_type = FT_VCF; break;
+                    default: error("The output type \"%s\" not recognised\n", optarg);
+                }
+                break;
+            case  9 : args->n_threads = strtol(optarg, 0, 0); break;
+            case  8 : args->record_cmd_line = 0; break;
+            case 'h':
+            case '?': usage(); break;
+            default: error("Unknown argument: %s\n", optarg);
+        }
+    }
+    if ( optind>=argc ) usage();
+    if ( optind+2 < argc ) error("Expected one pipeline and at most one input file\n");
+    parse_pipeline(args, argv[optind]);
+    if ( optind+1 < argc ) args->fname = argv[optind+1];
+    else if ( !isatty(fileno((FILE *)stdin)) ) args->fname = "-";  // reading from stdin
+    else usage();
+
+    args->n_threads = bcftools_threads(args->n_threads);
+    init_data(args);
+    run_pipeline(args);
+    destroy_data(args);
+    free(args);
+    return 0;
+}
@@ -38,6 +38,7 @@ THE SOFTWARE.  */
 #include <htslib/kseq.h>
 #include <htslib/khash_str2int.h>
 #include <dlfcn.h>
+#include <pthread.h>
 #include "bcftools.h"
 #include "vcmp.h"
 #include "filter.h"
@@ -68,6 +69,46 @@ typedef struct _plugin_t plugin_t;
  *
  *   void destroy(void)
  *      - called after all lines have been processed to clean up
+ *
+ *
+ *   Plugin API v2:
+ *   -------------
+ *   Used instead of init/process/destroy when init2 is present. The plugin
+ *   state is kept in a context object rather than in global variables and
+ *   the records are passed in blocks.
+ *
+ *   void *init2(int argc, char **argv, bcf_hdr_t *in_hdr, bcf_hdr_t *out_hdr, int *ret)
+ *      - called once at startup, returns the plugin's context. The value of
+ *      *ret has the same meaning as the return value of init()
+ *
+ *   int process_batch(void *ctx, bcf1_t **recs, int nrecs)
+ *      - called for blocks of consecutive VCF records which are modified in
+ *      place. Set recs[i] to NULL for no output. Return 0 on success or
+ *      negative value on error.
+ *
+ *   int process_batch_txt(void *ctx, bcf1_t **recs, int nrecs, kstring_t *txt)
+ *      - optional, used instead of process_batch() by plugins which print
+ *      text output. The text is appended to txt and printed to stdout in
+ *      the original order of the blocks, also when run in parallel.
+ *
+ *   void destroy2(void *ctx)
+ *      - called after all lines have been processed to clean up
+ *
+ *   int flags(void)
+ *      - optional, returns a bitmask of PLUGIN_* flags defined in bcftools.h.
+ *      With PLUGIN_THREAD_SAFE, process_batch() can be called concurrently
+ *      on different blocks with the same context and --threads then also
+ *      sets the number of worker threads. The output order is preserved.
+ *
+ *
+ *   Plugin chains:
+ *   -------------
+ *   Several plugins can be run in a single pass, separated by ":::" on the
+ *   command line. The output header of each plugin is the input header of
+ *   the next one and the records are passed from one plugin to the next in
+ *   memory. If all plugins implement the v2 API, the records are processed in
+ *   blocks, otherwise one record at a time. Plugins with process_batch() can
+ *   also be stages of "bcftools pipe", see plugin_stage_init().
  */
 typedef void (*dl_version_f) (const char **, const char **);
 typedef int (*dl_run_f) (int, char **);
@@ -76,6 +117,11 @@ typedef char* (*dl_about_f) (void);
 typedef char* (*dl_usage_f) (void);
 typedef bcf1_t* (*dl_process_f) (bcf1_t *);
 typedef void (*dl_destroy_f) (void);
+typedef void* (*dl_init2_f) (int, char **, bcf_hdr_t *, bcf_hdr_t *, int *);
+typedef int (*dl_process_batch_f) (void *, bcf1_t **, int);
+typedef int (*dl_process_batch_txt_f) (void *, bcf1_t **, int, kstring_t *);
+typedef void (*dl_destroy2_f) (void *);
+typedef int (*dl_flags_f) (void);
 
 struct _plugin_t
 {
@@ -88,9 +134,36 @@ struct _plugin_t
     dl_usage_f usage;
     dl_process_f process;
     dl_destroy_f destroy;
-    void *handle;
+    dl_init2_f init2;
+    dl_process_batch_f process_batch;
+    dl_process_batch_txt_f process_batch_txt;
+    dl_destroy2_f destroy2;
+    dl_flags_f flags;
+    void *handle, *ctx;
+    bcf_hdr_t *hdr_out;
 };
 
+// A block of records for process_batch(). The records are owned by recs,
+// out is what is passed to the plugins and can be modified by them
+typedef struct
+{
+    bcf1_t **recs, **out;
+    int n, m, nout, ret;
+    kstring_t txt;      // text output of process_batch_txt()
+    plugin_t *plugins;
+    int nplugins;
+}
+batch_t;
+
+// A worker thread which keeps running for the whole run and processes the
+// block with its index whenever the main thread starts a new round
+typedef struct
+{
+    struct _args_t *args;
+    pthread_t tid;
+    int ibatch;
+}
+worker_t;
 
 struct _args_t;
 
@@ -136,10 +209,19 @@ typedef struct _args_t
     char *filter_str;
     int filter_logic;   // include or exclude sites which match the filters? One of FLT_INCLUDE/FLT_EXCLUDE
 
-    plugin_t plugin;
+    plugin_t *plugins;  // a chain of plugins, the first is the one given on the command line
+    int nplugins, mplugins;
     int nplugin_paths;
     char **plugin_paths;
 
+    batch_t *batch;     // one block per worker thread for process_batch()
+    int nbatch, ibatch, batch_size;
+    worker_t *workers;  // nbatch-1 workers, the first block is processed by the main thread
+    pthread_mutex_t lock;
+    pthread_cond_t start_cond, done_cond;
+    int round, nactive, npending, quit;
+    kstring_t txt;      // text output of process_batch_txt() when not run in blocks
+
     char **argv, *output_fname, *regions_list, *targets_list;
     int argc, drop_header, verbose, record_cmd_line;
 }
@@ -269,6 +351,13 @@ static int load_plugin(args_t *args, const char *fname, int exit_on_error, plugi
     else
         if ( args->verbose > 1 ) fprintf(stderr,"\tinit     .. ok\n");
 
+    plugin->init2 = (dl_init2_f) dlsym(plugin->handle, "init2");
+    ret = dlerror();
+    if ( ret )
+        plugin->init2 = NULL;
+    else
+        if ( args->verbose > 1 ) fprintf(stderr,"\tinit2    .. ok\n");
+
     plugin->run = (dl_run_f) dlsym(plugin->handle, "run");
     ret = dlerror();
     if ( ret )
@@ -276,7 +365,7 @@ static int load_plugin(args_t *args, const char *fname, int exit_on_error, plugi
     else
         if ( args->verbose > 1 ) fprintf(stderr,"\trun      .. ok\n");
 
-    if ( !plugin->init && !plugin->run )
+    if ( !plugin->init && !plugin->init2 && !plugin->run )
     {
         if ( exit_on_error ) error("Could not initialize %s, neither run or init found \n", plugin->name);
         else if ( args->verbose > 1 ) fprintf(stderr,"\tinit/run .. not found\n");
@@ -307,6 +396,35 @@ static int load_plugin(args_t *args, const char *fname, int exit_on_error, plugi
 
     if ( plugin->run ) return 0;
 
+    if ( plugin->init2 )
+    {
+        plugin->process_batch_txt = (dl_process_batch_txt_f) dlsym(plugin->handle, "process_batch_txt");
+        ret = dlerror();
+        if ( ret ) plugin->process_batch_txt = NULL;
+
+        plugin->process_batch = (dl_process_batch_f) dlsym(plugin->handle, "process_batch");
+        ret = dlerror();
+        if ( ret ) plugin->process_batch = NULL;
+        if ( !plugin->process_batch && !plugin->process_batch_txt )
+        {
+            if ( exit_on_error ) error("Could not initialize %s: %s\n", plugin->name, ret);
+            return -1;
+        }
+
+        plugin->destroy2 = (dl_destroy2_f) dlsym(plugin->handle, "destroy2");
+        ret = dlerror();
+        if ( ret )
+        {
+            if ( exit_on_error ) error("Could not initialize %s: %s\n", plugin->name, ret);
+            return -1;
+        }
+
+        plugin->flags = (dl_flags_f) dlsym(plugin->handle, "flags");
+        ret = dlerror();
+        if ( ret ) plugin->flags = NULL;
+        return 0;
+    }
+
     plugin->process = (dl_process_f) dlsym(plugin->handle, "process");
     ret = dlerror();
     if ( ret )
@@ -326,22 +444,28 @@ static int load_plugin(args_t *args, const char *fname, int exit_on_error, plugi
     return 0;
 }
 
-static void init_plugin(args_t *args)
+static void init_plugin(args_t *args, plugin_t *plugin, bcf_hdr_t *hdr_in)
 {
     static int warned_bcftools = 0, warned_htslib = 0;
 
-    int ret = args->plugin.init(args->plugin.argc,args->plugin.argv,args->hdr,args->hdr_out);
+    int ret;
+    plugin->hdr_out = bcf_hdr_dup(hdr_in);
+    optind = 0;     // the plugins of a chain parse their options in turn
+    if ( plugin->init2 )
+        plugin->ctx = plugin->init2(plugin->argc,plugin->argv,hdr_in,plugin->hdr_out,&ret);
+    else
+        ret = plugin->init(plugin->argc,plugin->argv,hdr_in,plugin->hdr_out);
     if ( ret<0 ) error("The plugin exited with an error.\n");
     const char *bver, *hver;
-    args->plugin.version(&bver, &hver);
+    plugin->version(&bver, &hver);
     if ( strcmp(bver,bcftools_version()) && !warned_bcftools )
     {
-        fprintf(stderr,"WARNING: bcftools version mismatch .. bcftools at %s, the plugin \"%s\" at %s\n", bcftools_version(),args->plugin.name,bver);
+        fprintf(stderr,"WARNING: bcftools version mismatch .. bcftools at %s, the plugin \"%s\" at %s\n", bcftools_version(),plugin->name,bver);
         warned_bcftools = 1;
     }
     if ( strcmp(hver,hts_version()) && !warned_htslib )
     {
-        fprintf(stderr,"WARNING: htslib version mismatch .. bcftools at %s, the plugin \"%s\" at %s\n", hts_version(),args->plugin.name,hver);
+        fprintf(stderr,"WARNING: htslib version mismatch .. bcftools at %s, the plugin \"%s\" at %s\n", hts_version(),plugin->name,hver);
         warned_htslib = 1;
     }
     args->drop_header += ret;
@@ -410,9 +534,20 @@ static int list_plugins(args_t *args)
 static void init_data(args_t *args)
 {
     args->hdr = args->files->readers[0].header;
-    args->hdr_out = bcf_hdr_dup(args->hdr);
 
-    init_plugin(args);
+    // The output header of each plugin in the chain is the input header of the next one
+    int i, nv2 = 0, nsafe = 0;
+    bcf_hdr_t *hdr = args->hdr;
+    for (i=0; i<args->nplugins; i++)
+    {
+        plugin_t *plugin = &args->plugins[i];
+        init_plugin(args, plugin, hdr);
+        hdr = plugin->hdr_out;
+        if ( bcf_hdr_sync(hdr)<0 ) error("Failed to update the header of the plugin \"%s\"\n", plugin->name);
+        if ( plugin->process_batch || plugin->process_batch_txt ) nv2++;
+        if ( plugin->flags && plugin->flags() & PLUGIN_THREAD_SAFE ) nsafe++;
+    }
+    args->hdr_out = hdr;
 
     if ( args->filter_str )
         args->filter = filter_init(args->hdr, args->filter_str);
@@ -422,20 +557,72 @@ static void init_data(args_t *args)
     {
         args->out_fh = hts_open(args->output_fname,hts_bcf_wmode(args->output_type));
         if ( args->out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->output_fname, strerror(errno));
-        if ( args->n_threads ) hts_set_threads(args->out_fh, args->n_threads);
+        bcftools_set_threads(args->out_fh, args->n_threads);
         bcf_hdr_write(args->out_fh, args->hdr_out);
     }
+
+    // Blocks of records can be used only if all plugins in the chain support them
+    if ( nv2==args->nplugins )
+    {
+        args->nbatch = nsafe==args->nplugins && args->n_threads > 1 ? args->n_threads : 1;
+        args->batch  = (batch_t*) calloc(args->nbatch, sizeof(batch_t));
+        args->batch_size = 1000;
+        char *env = getenv("BCFTOOLS_PLUGIN_BATCH");  // smaller blocks are used by the tests
+        if ( env )
+        {
+            args->batch_size = strtol(env, NULL, 10);
+            if ( args->batch_size <= 0 ) error("Could not parse BCFTOOLS_PLUGIN_BATCH=%s\n", env);
+        }
+        for (i=0; i<args->nbatch; i++)
+        {
+            args->batch[i].plugins  = args->plugins;
+            args->batch[i].nplugins = args->nplugins;
+        }
+    }
+}
+
+static void stop_workers(args_t *args)
+{
+    int i;
+    pthread_mutex_lock(&args->lock);
+    args->quit = 1;
+    pthread_cond_broadcast(&args->start_cond);
+    pthread_mutex_unlock(&args->lock);
+    for (i=0; i<args->nbatch-1; i++)
+        if ( pthread_join(args->workers[i].tid, NULL) ) error("Failed to join a thread\n");
+    free(args->workers);
+    pthread_mutex_destroy(&args->lock);
+    pthread_cond_destroy(&args->start_cond);
+    pthread_cond_destroy(&args->done_cond);
 }
 
 static void destroy_data(args_t *args)
 {
-    free(args->plugin.name);
-    if ( args->plugin.destroy ) args->plugin.destroy();
-    dlclose(args->plugin.handle);
-    if ( args->hdr_out ) bcf_hdr_destroy(args->hdr_out);
+    int i, j;
+    if ( args->workers ) stop_workers(args);
+    for (i=0; i<args->nbatch; i++)
+    {
+        batch_t *batch = &args->batch[i];
+        for (j=0; j<batch->m; j++)
+            if ( batch->recs[j] ) bcf_destroy1(batch->recs[j]);
+        free(batch->recs);
+        free(batch->out);
+        free(batch->txt.s);
+    }
+    free(args->batch);
+    free(args->txt.s);
+    for (i=0; i<args->nplugins; i++)
+    {
+        plugin_t *plugin = &args->plugins[i];
+        free(plugin->name);
+        if ( plugin->destroy ) plugin->destroy();
+        if ( plugin->destroy2 ) plugin->destroy2(plugin->ctx);
+        dlclose(plugin->handle);
+        if ( plugin->hdr_out ) bcf_hdr_destroy(plugin->hdr_out);
+    }
+    free(args->plugins);
     if ( args->nplugin_paths>0 )
     {
-        int i;
         for (i=0; i<args->nplugin_paths; i++) free(args->plugin_paths[i]);
         free(args->plugin_paths);
     }
@@ -444,12 +631,262 @@ static void destroy_data(args_t *args)
     if (args->out_fh) hts_close(args->out_fh);
 }
 
+static void *run_batch(void *data)
+{
+    batch_t *batch = (batch_t*) data;
+    memcpy(batch->out, batch->recs, sizeof(*batch->recs)*batch->n);
+    batch->nout = batch->n;
+    int i, j, k;
+    for (i=0; i<batch->nplugins; i++)
+    {
+        plugin_t *plugin = &batch->plugins[i];
+        batch->ret = plugin->process_batch_txt ?
+            plugin->process_batch_txt(plugin->ctx, batch->out, batch->nout, &batch->txt) :
+            plugin->process_batch(plugin->ctx, batch->out, batch->nout);
+        if ( batch->ret<0 ) break;
+
+        // records removed by this plugin are not passed to the next one
+        for (j=0,k=0; j<batch->nout; j++)
+            if ( batch->out[j] ) batch->out[k++] = batch->out[j];
+        batch->nout = k;
+    }
+    return NULL;
+}
+
+static void *run_worker(void *data)
+{
+    worker_t *worker = (worker_t*) data;
+    args_t *args = worker->args;
+    int round = 0;
+    pthread_mutex_lock(&args->lock);
+    while ( 1 )
+    {
+        while ( round==args->round && !args->quit ) pthread_cond_wait(&args->start_cond, &args->lock);
+        if ( args->quit ) break;
+        round = args->round;
+        if ( worker->ibatch >= args->nactive ) continue;   // fewer blocks in this round
+
+        pthread_mutex_unlock(&args->lock);
+        run_batch(&args->batch[worker->ibatch]);
+        pthread_mutex_lock(&args->lock);
+        if ( --args->npending==0 ) pthread_cond_signal(&args->done_cond);
+    }
+    pthread_mutex_unlock(&args->lock);
+    return NULL;
+}
+
+// The workers are started on the first flush, inputs which fit in a single
+// block never need them
+static void start_workers(args_t *args)
+{
+    int i;
+    pthread_mutex_init(&args->lock, NULL);
+    pthread_cond_init(&args->start_cond, NULL);
+    pthread_cond_init(&args->done_cond, NULL);
+    args->workers = (worker_t*) calloc(args->nbatch-1, sizeof(worker_t));
+    for (i=0; i<args->nbatch-1; i++)
+    {
+        args->workers[i].args   = args;
+        args->workers[i].ibatch = i+1;
+        if ( pthread_create(&args->workers[i].tid, NULL, run_worker, &args->workers[i]) ) error("Failed to create a thread\n");
+    }
+}
+
+// Pass a single record through the chain, used when a plugin does not support blocks
+static bcf1_t *run_chain(args_t *args, bcf1_t *rec)
+{
+    int i;
+    for (i=0; i<args->nplugins && rec; i++)
+    {
+        plugin_t *plugin = &args->plugins[i];
+        if ( plugin->process ) { rec = plugin->process(rec); continue; }
+        int ret = plugin->process_batch_txt ?
+            plugin->process_batch_txt(plugin->ctx, &rec, 1, &args->txt) :
+            plugin->process_batch(plugin->ctx, &rec, 1);
+        if ( ret<0 ) error("The plugin exited with an error.\n");
+    }
+    if ( args->txt.l )
+    {
+        fwrite(args->txt.s, 1, args->txt.l, stdout);
+        args->txt.l = 0;
+    }
+    return rec;
+}
+
+// Process the blocks collected so far, in parallel if the plugin is thread-safe,
+// and write the records in the original order
+static void flush_batches(args_t *args)
+{
+    int i, j, nbatch = args->ibatch + 1;
+    if ( !args->batch[args->ibatch].n ) nbatch--;
+    if ( nbatch==1 ) run_batch(&args->batch[0]);
+    else if ( nbatch > 1 )
+    {
+        if ( !args->workers ) start_workers(args);
+        pthread_mutex_lock(&args->lock);
+        args->nactive  = nbatch;
+        args->npending = nbatch - 1;
+        args->round++;
+        pthread_cond_broadcast(&args->start_cond);
+        pthread_mutex_unlock(&args->lock);
+
+        run_batch(&args->batch[0]);
+
+        pthread_mutex_lock(&args->lock);
+        while ( args->npending ) pthread_cond_wait(&args->done_cond, &args->lock);
+        pthread_mutex_unlock(&args->lock);
+    }
+    for (i=0; i<nbatch; i++)
+    {
+        batch_t *batch = &args->batch[i];
+        if ( batch->ret<0 ) error("The plugin exited with an error.\n");
+        if ( batch->txt.l )
+        {
+            fwrite(batch->txt.s, 1, batch->txt.l, stdout);
+            batch->txt.l = 0;
+        }
+        if ( args->out_fh )
+        {
+            for (j=0; j<batch->nout; j++)
+                bcf_write1(args->out_fh, args->hdr_out, batch->out[j]);
+        }
+        batch->n = 0;
+    }
+    args->ibatch = 0;
+}
+
+// Take over the current reader's record, it will be overwritten by the next
+// bcf_sr_next_line() call otherwise
+static void push_batch(args_t *args)
+{
+    batch_t *batch = &args->batch[args->ibatch];
+    if ( batch->n >= args->batch_size )
+    {
+        if ( args->ibatch + 1 >= args->nbatch ) flush_batches(args);
+        else args->ibatch++;
+        batch = &args->batch[args->ibatch];
+    }
+    if ( batch->n >= batch->m )
+    {
+        int m = batch->m;
+        hts_expand0(bcf1_t*, batch->n+1, batch->m, batch->recs);
+        batch->out = (bcf1_t**) realloc(batch->out, sizeof(bcf1_t*)*batch->m);
+        for (; m<batch->m; m++) batch->recs[m] = bcf_init1();
+    }
+    bcf1_t **rec_ptr = &args->files->readers[0].buffer[0];
+    bcf1_t *tmp = batch->recs[batch->n]; batch->recs[batch->n] = *rec_ptr; *rec_ptr = tmp;
+    batch->n++;
+}
+
+// Split the plugin arguments at ":::" into a chain of plugins, each given as
+// "+name [-- OPTIONS]". The argv array is modified in place.
+static void init_chain(args_t *args)
+{
+    int argc = args->plugins[0].argc, i, j;
+    char **argv = args->plugins[0].argv;
+    for (i=1; i<argc; i++)
+    {
+        if ( strcmp(argv[i],":::") ) continue;
+        args->plugins[args->nplugins-1].argc = argv + i - args->plugins[args->nplugins-1].argv;
+        if ( i+1>=argc ) error("Expected a plugin name after \":::\"\n");
+
+        // the plugin name serves as argv[0], "--" separating the options is optional
+        char *name = argv[++i];
+        if ( name[0]=='+' ) name++;
+        if ( i+1<argc && !strcmp(argv[i+1],"--") ) argv[++i] = name;
+
+        hts_expand0(plugin_t, args->nplugins+1, args->mplugins, args->plugins);
+        plugin_t *plugin = &args->plugins[args->nplugins++];
+        load_plugin(args, name, 1, plugin);
+        if ( plugin->run ) error("The plugin \"%s\" cannot be used in a chain\n", plugin->name);
+
+        // v1 plugins keep their state in global variables
+        for (j=0; j<args->nplugins-1; j++)
+            if ( args->plugins[j].handle==plugin->handle && !plugin->init2 )
+                error("The plugin \"%s\" can be used only once in a chain\n", plugin->name);
+
+        plugin->argv = argv + i;
+        plugin->argc = argc - i;
+    }
+}
+
+// A plugin as a stage of "bcftools pipe", see bcftools.h
+typedef struct
+{
+    plugin_t *plugin;
+    bcf1_t **out;   // process_batch() drops records by setting the pointers to NULL
+    int mout;
+}
+plugin_stage_t;
+
+void *plugin_stage_init(int argc, char **argv, bcf_hdr_t *hdr_in, bcf_hdr_t **hdr_out)
+{
+    args_t args;
+    memset(&args, 0, sizeof(args));
+    args.nplugin_paths = -1;
+
+    plugin_t *plugin = (plugin_t*) calloc(1, sizeof(plugin_t));
+    load_plugin(&args, argv[0], 1, plugin);
+    int i;
+    for (i=0; i<args.nplugin_paths; i++) free(args.plugin_paths[i]);
+    free(args.plugin_paths);
+
+    if ( !plugin->init2 ) error("The plugin \"%s\" does not implement process_batch() and cannot be used in a pipe\n", plugin->name);
+    if ( plugin->process_batch_txt ) error("The plugin \"%s\" does not write VCF and cannot be used in a pipe\n", plugin->name);
+    plugin->argc = argc;
+    plugin->argv = argv;
+    init_plugin(&args, plugin, hdr_in);
+    if ( args.drop_header ) error("The plugin \"%s\" does not write VCF and cannot be used in a pipe\n", plugin->name);
+    if ( bcf_hdr_sync(plugin->hdr_out)<0 ) error("Failed to update the header of the plugin \"%s\"\n", plugin->name);
+    *hdr_out = plugin->hdr_out;
+
+    plugin_stage_t *stage = (plugin_stage_t*) calloc(1, sizeof(plugin_stage_t));
+    stage->plugin = plugin;
+    return stage;
+}
+
+void plugin_stage_process(void *ctx, stage_block_t *blk)
+{
+    plugin_stage_t *stage = (plugin_stage_t*) ctx;
+    plugin_t *plugin = stage->plugin;
+    if ( !blk->n ) return;
+
+    hts_expand(bcf1_t*, blk->n, stage->mout, stage->out);
+    memcpy(stage->out, blk->recs, sizeof(*blk->recs)*blk->n);
+    if ( plugin->process_batch(plugin->ctx, stage->out, blk->n)<0 )
+        error("The plugin \"%s\" exited with an error.\n", plugin->name);
+
+    // the records are modified in place, move the dropped ones past n
+    int i, n = 0;
+    for (i=0; i<blk->n; i++)
+    {
+        if ( !stage->out[i] ) continue;
+        if ( i!=n ) { bcf1_t *tmp = blk->recs[n]; blk->recs[n] = blk->recs[i]; blk->recs[i] = tmp; }
+        n++;
+    }
+    blk->n = n;
+}
+
+void plugin_stage_destroy(void *ctx)
+{
+    plugin_stage_t *stage = (plugin_stage_t*) ctx;
+    plugin_t *plugin = stage->plugin;
+    free(stage->out);
+    free(stage);
+    plugin->destroy2(plugin->ctx);
+    dlclose(plugin->handle);
+    bcf_hdr_destroy(plugin->hdr_out);
+    free(plugin->name);
+    free(plugin);
+}
+
 static void usage(args_t *args)
 {
     fprintf(stderr, "\n");
     fprintf(stderr, "About:   Run user defined plugin\n");
     fprintf(stderr, "Usage:   bcftools plugin <name> [OPTIONS] <file> [-- PLUGIN_OPTIONS]\n");
     fprintf(stderr, "         bcftools +name [OPTIONS] <file>  [-- PLUGIN_OPTIONS]\n");
+    fprintf(stderr, "         bcftools +name [OPTIONS] <file>  [-- PLUGIN_OPTIONS] [::: +name2 [-- PLUGIN2_OPTIONS]] ...\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "VCF input options:\n");
     fprintf(stderr, "   -e, --exclude <expr>        exclude sites for which the expression is true\n");
@@ -462,7 +899,7 @@ static void usage(args_t *args)
     fprintf(stderr, "       --no-version            do not append version and command line to the header\n");
     fprintf(stderr, "   -o, --output <file>         write output to a file [standard output]\n");
     fprintf(stderr, "   -O, --output-type <type>    'b' compressed BCF; 'u' uncompressed BCF; 'z' compressed VCF; 'v' uncompressed VCF [v]\n");
-    fprintf(stderr, "       --threads <int>         number of extra output compression threads [0]\n");
+    fprintf(stderr, "       --threads <int>         number of extra compression/decompression threads, also worker threads for thread-safe plugins [0]\n");
     fprintf(stderr, "Plugin options:\n");
     fprintf(stderr, "   -h, --help                  list plugin's options\n");
     fprintf(stderr, "   -l, --list-plugins          list available plugins. See BCFTOOLS_PLUGINS environment variable and man page for details\n");
@@ -500,7 +937,7 @@ int main_plugin(int argc, char *argv[])
     args->argc    = argc; args->argv = argv;
     args->output_fname = "-";
     args->output_type = FT_VCF;
-    args->n_threads = 0;
+    args->n_threads = -1;
     args->record_cmd_line = 1;
     args->nplugin_paths = -1;
     int regions_is_file = 0, targets_is_file = 0, plist_only = 0, usage_only = 0, version_only = 0;
@@ -514,10 +951,12 @@ int main_plugin(int argc, char *argv[])
         plugin_name = argv[1]; 
         argc--; 
         argv++; 
-        load_plugin(args, plugin_name, 1, &args->plugin);
-        if ( args->plugin.run )
+        hts_expand0(plugin_t, 1, args->mplugins, args->plugins);
+        args->nplugins = 1;
+        load_plugin(args, plugin_name, 1, &args->plugins[0]);
+        if ( args->plugins[0].run )
         {
-            int ret = args->plugin.run(argc, argv);
+            int ret = args->plugins[0].run(argc, argv);
             destroy_data(args);
             free(args);
             return ret;
@@ -577,7 +1016,7 @@ int main_plugin(int argc, char *argv[])
     if ( version_only )
     {
         const char *bver, *hver;
-        args->plugin.version(&bver, &hver);
+        args->plugins[0].version(&bver, &hver);
         printf("bcftools  %s using htslib %s\n", bcftools_version(), hts_version());
         printf("plugin at %s using htslib %s\n\n", bver, hver);
         return 0;
@@ -585,30 +1024,33 @@ int main_plugin(int argc, char *argv[])
 
     if ( usage_only )
     {
-        if ( args->plugin.usage )
-            fprintf(stderr,"%s",args->plugin.usage());
+        if ( args->plugins[0].usage )
+            fprintf(stderr,"%s",args->plugins[0].usage());
         else
             fprintf(stderr,"Usage: bcftools +%s [General Options] -- [Plugin Options]\n",plugin_name);
         return 0;
     }
 
     char *fname = NULL;
-    if ( optind>=argc || argv[optind][0]=='-' )
+    if ( optind>=argc || argv[optind][0]=='-' || !strcmp(argv[optind],":::") )
     {
         if ( !isatty(fileno((FILE *)stdin)) ) fname = "-";  // reading from stdin
         else usage(args);
-        args->plugin.argc = argc - optind + 1;
-        args->plugin.argv = argv + optind - 1;
+        args->plugins[0].argc = argc - optind + 1;
+        args->plugins[0].argv = argv + optind - 1;
     }
     else
     {
         fname = argv[optind];
-        args->plugin.argc = argc - optind;
-        args->plugin.argv = argv + optind;
+        args->plugins[0].argc = argc - optind;
+        args->plugins[0].argv = argv + optind;
     }
     optind = 0;
+    init_chain(args);
 
     args->files = bcf_sr_init();
+    args->n_threads = bcftools_threads(args->n_threads);
+    bcftools_sr_set_threads(args->files, args->n_threads);
     if ( args->regions_list )
     {
         if ( bcf_sr_set_regions(args->files, args->regions_list, regions_is_file)<0 )
@@ -632,11 +1074,17 @@ int main_plugin(int argc, char *argv[])
             if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
             if ( !pass ) continue;
         }
-        line = args->plugin.process(line);
-        if ( line ) bcf_write1(args->out_fh, args->hdr_out, line);
+        if ( args->batch )
+        {
+            push_batch(args);
+            continue;
+        }
+        line = run_chain(args, line);
+        if ( line && args->out_fh ) bcf_write1(args->out_fh, args->hdr_out, line);
     }
+    if ( args->batch ) flush_batches(args);
     destroy_data(args);
-    bcf_sr_destroy(args->files);
+    bcftools_sr_destroy(args->files);
     free(args);
     return 0;
 }
@@ -36,6 +36,7 @@ THE SOFTWARE.  */
 #include "bcftools.h"
 #include "filter.h"
 #include "convert.h"
+#include "perf.h"
 
 
 // Logic of the filters: include or exclude sites which match the filters?
@@ -52,7 +53,7 @@ typedef struct
     bcf_hdr_t *header;
     int nsamples, *samples, sample_is_file;
     char **argv, *format_str, *sample_list, *targets_list, *regions_list, *vcf_list, *fn_out;
-    int argc, list_columns, print_header, allow_undef_tags;
+    int argc, list_columns, print_header, allow_undef_tags, n_threads;
     FILE *out;
 }
 args_t;
@@ -128,15 +129,20 @@ static void query_vcf(args_t *args)
         fwrite(str.s, str.l, 1, args->out);
     }
 
-    while ( bcf_sr_next_line(args->files) )
+    while ( perf_beg(PERF_READ), bcf_sr_next_line(args->files) )
     {
+        perf_end(PERF_READ, 1);
         if ( !bcf_sr_has_line(args->files,0) ) continue;
         bcf1_t *line = args->files->readers[0].buffer[0];
+        perf_beg(PERF_UNPACK);
         bcf_unpack(line, args->files->max_unpack);
+        perf_end(PERF_UNPACK, 1);
 
         if ( args->filter )
         {
+            perf_beg(PERF_FILTER);
             int pass = filter_test(args->filter, line, NULL);
+            perf_end(PERF_FILTER, 1);
             if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
             if ( !pass ) continue;
         }
@@ -144,8 +150,13 @@ static void query_vcf(args_t *args)
         str.l = 0;
         convert_line(args->convert, line, &str);
         if ( str.l )
+        {
+            perf_beg(PERF_WRITE);
             fwrite(str.s, str.l, 1, args->out);
+            perf_end(PERF_WRITE, 1);
+        }
     }
+    perf_end(PERF_READ, 0);
     if ( str.m ) free(str.s);
 }
 
@@ -194,6 +205,7 @@ static void usage(void)
     fprintf(stderr, "    -S, --samples-file <file>         file of samples to include\n");
     fprintf(stderr, "    -t, --targets <region>            similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>         similar to -R but streams rather than index-jumps\n");
+    fprintf(stderr, "        --threads <int>               number of extra decompression threads [0]\n");
     fprintf(stderr, "    -u, --allow-undef-tags            print \".\" for undefined tags\n");
     fprintf(stderr, "    -v, --vcf-list <file>             process multiple VCFs listed in the file\n");
     fprintf(stderr, "\n");
@@ -208,6 +220,7 @@ int main_vcfquery(int argc, char *argv[])
     int c, collapse = 0;
     args_t *args = (args_t*) calloc(1,sizeof(args_t));
     args->argc   = argc; args->argv = argv;
+    args->n_threads = -1;
     int regions_is_file = 0, targets_is_file = 0;
 
     static struct option loptions[] =
@@ -229,6 +242,7 @@ int main_vcfquery(int argc, char *argv[])
         {"collapse",1,0,'c'},
         {"vcf-list",1,0,'v'},
         {"allow-undef-tags",0,0,'u'},
+        {"threads",1,0,9},
         {0,0,0,0}
     };
     while ((c = getopt_long(argc, argv, "hlr:R:f:a:s:S:Ht:T:c:v:i:e:o:u",loptions,NULL)) >= 0) {
@@ -273,6 +287,7 @@ int main_vcfquery(int argc, char *argv[])
             case 'u': args->allow_undef_tags = 1; break;
             case 's': args->sample_list = optarg; break;
             case 'S': args->sample_list = optarg; args->sample_is_file = 1; break;
+            case  9 : args->n_threads = strtol(optarg, 0, 0); break;
             case 'h':
             case '?': usage();
             default: error("Unknown argument: %s\n", optarg);
@@ -285,6 +300,7 @@ int main_vcfquery(int argc, char *argv[])
         if ( !isatty(fileno((FILE *)stdin)) ) fname = "-";
     }
     else fname = argv[optind];
+    args->n_threads = bcftools_threads(args->n_threads);
 
     if ( args->list_columns )
     {
@@ -306,6 +322,7 @@ int main_vcfquery(int argc, char *argv[])
         if ( !fname ) usage();
         args->files = bcf_sr_init();
         args->files->collapse = collapse;
+        bcftools_sr_set_threads(args->files, args->n_threads);
         if ( optind+1 < argc ) args->files->require_index = 1;
         if ( args->regions_list && bcf_sr_set_regions(args->files, args->regions_list, regions_is_file)<0 )
             error("Failed to read the regions: %s\n", args->regions_list);
@@ -323,7 +340,7 @@ int main_vcfquery(int argc, char *argv[])
         query_vcf(args);
         free(args->format_str);
         destroy_data(args);
-        bcf_sr_destroy(args->files);
+        bcftools_sr_destroy(args->files);
         fclose(args->out);
         free(args);
         return 0;
@@ -338,6 +355,7 @@ int main_vcfquery(int argc, char *argv[])
     {
         args->files = bcf_sr_init();
         args->files->collapse = collapse;
+        bcftools_sr_set_threads(args->files, args->n_threads);
         if ( args->regions_list && bcf_sr_set_regions(args->files, args->regions_list, regions_is_file)<0 )
             error("Failed to read the regions: %s\n", args->regions_list);
         if ( optind < argc ) args->files->require_index = 1;
@@ -360,7 +378,7 @@ int main_vcfquery(int argc, char *argv[])
         }
         query_vcf(args);
         destroy_data(args);
-        bcf_sr_destroy(args->files);
+        bcftools_sr_destroy(args->files);
     }
     fclose(args->out);
     destroy_list(fnames, nfiles);
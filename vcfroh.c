@@ -335,7 +335,7 @@ static void destroy_data(args_t *args)
     free(args->rids);
     free(args->rid_offs);
     hmm_destroy(args->hmm);
-    bcf_sr_destroy(args->files);
+    bcftools_sr_destroy(args->files);
     free(args->AFs); free(args->pdg);
     free(args->genmap);
     free(args->itmp);
@@ -1075,6 +1075,7 @@ int main_vcfroh(int argc, char *argv[])
     args_t *args  = (args_t*) calloc(1,sizeof(args_t));
     args->argc    = argc; args->argv = argv;
     args->files   = bcf_sr_init();
+    args->n_threads = -1;
     args->t2AZ    = 6.7e-8;
     args->t2HW    = 5e-9;
     args->rec_rate = 0;
@@ -1193,8 +1194,8 @@ int main_vcfroh(int argc, char *argv[])
         if ( bcf_sr_set_targets(args->files, args->af_fname, 1, 3)<0 )
             error("Failed to read the targets: %s\n", args->af_fname);
     }
-    if ( args->n_threads && bcf_sr_set_threads(args->files, args->n_threads)<0)
-        error("Failed to create threads\n");
+    args->n_threads = bcftools_threads(args->n_threads);
+    bcftools_sr_set_threads(args->files, args->n_threads);
     if ( !bcf_sr_add_reader(args->files, fname) ) error("Failed to open %s: %s\n", fname,bcf_sr_strerror(args->files->errnum));
 
     init_data(args);
@@ -0,0 +1,799 @@
+/*  vcfshard.c -- run a command on genome shards in parallel and stitch the outputs.
+
+    Copyright (C) 2017 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.  */
+
+/*
+    Runs a command on genome shards in parallel:
+
+        bcftools shard -n 64 -Ob -o out.bcf -W in.bcf -- view -i 'QUAL>10'
+
+    The shards are planned from the index of the input: the contigs are
+    weighted by their number of records and split into pieces of equal
+    length. Each shard runs in a forked copy of this process which calls the
+    command directly, with its own readers, and writes compressed BCF to a
+    temporary file. With -W the shard files are indexed by the workers too.
+
+    A record belongs to the shard in which it starts, the command is given
+    the shard both as -r (index jump) and -t (keep only records which start
+    in the region). Only the commands listed in shard_cmds[] and the plugins
+    in shard_plugins[] are accepted, they process records independently of
+    each other. Options which look at neighbouring records, the -g/-G of
+    filter, are rejected. norm cannot be split this way, left-aligned indels
+    could move before the start of their shard and out of order.
+
+    When the output is compressed BCF, the shards are stitched by copying
+    their BGZF blocks, only the header and the records sharing its last
+    block are recompressed. The CSI indexes of the shards are then merged
+    with their offsets adjusted. Other output types are re-encoded.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <htslib/vcf.h>
+#include <htslib/bgzf.h>
+#include <htslib/tbx.h> // for hts_get_bgzfp()
+#include <htslib/kstring.h>
+#include <htslib/ksort.h>
+#include "bcftools.h"
+#include "perf.h"
+#include "bgzf_remap.h"
+
+#define SHARD_VCF   1   // the command writes VCF/BCF, the shards are written as compressed BCF
+#define SHARD_TEXT  2   // the command writes text, the shards are concatenated
+
+typedef struct
+{
+    const char *alias;
+    int type;
+}
+shard_cmd_t;
+
+static const shard_cmd_t shard_cmds[] =
+{
+    { "filter", SHARD_VCF },
+    { "plugin", SHARD_VCF },
+    { "query",  SHARD_TEXT },
+    { "view",   SHARD_VCF },
+    { NULL, 0 }
+};
+
+// Plugins which write VCF and process each record on its own
+static const char *shard_plugins[] =
+{
+    "fill-AN-AC", "fill-from-fasta", "fill-tags", "fixploidy", "GTsubset",
+    "impute-info", "missing2ref", "setGT", "tag2tag", NULL
+};
+
+static void check_plugin(const char *name)
+{
+    const char *base = strrchr(name,'/');
+    base = base ? base+1 : name;
+    size_t len = strlen(base);
+    if ( len>3 && !strcmp(".so",base+len-3) ) len -= 3;
+    int i;
+    for (i=0; shard_plugins[i]; i++)
+        if ( strlen(shard_plugins[i])==len && !strncmp(shard_plugins[i],base,len) ) return;
+    kstring_t str = {0,0,0};
+    for (i=0; shard_plugins[i]; i++) { if ( i ) kputs(", ",&str); kputs(shard_plugins[i],&str); }
+    error("The plugin \"%s\" cannot be sharded, only plugins which write VCF and process records independently are supported: %s\n", name, str.s);
+}
+
+typedef struct
+{
+    char *region, *fname;
+    pid_t pid;
+}
+shard_t;
+
+typedef struct
+{
+    char **argv, *fname, *output_fname, *tmp_prefix, *tmp_dir;
+    int argc, output_type, nshards, njobs, write_index, record_cmd_line;
+    const shard_cmd_t *cmd;
+    char **cmd_argv;        // the command line of the shards, NULL-terminated
+    int cmd_argc, mcmd_argv, iregion, ioutput;
+    shard_t *shard;
+    int nshard, mshard;
+}
+args_t;
+
+static void push_arg(args_t *args, char *arg)
+{
+    args->cmd_argc++;
+    hts_expand(char*, args->cmd_argc, args->mcmd_argv, args->cmd_argv);
+    args->cmd_argv[args->cmd_argc-1] = arg;
+}
+
+/*
+    Build the command line of the shards. The options which differ between
+    shards are placed right after the command name (and the plugin name),
+    before any "--" which would pass them to a plugin, and are filled in by
+    run_shard().
+*/
+static void init_command(args_t *args, int argc, char **argv)
+{
+    int i, iarg = 0;
+    if ( argv[0][0]=='+' )
+    {
+        push_arg(args, "plugin");
+        push_arg(args, argv[0]+1);
+        iarg = 1;
+    }
+    else if ( !strcmp("plugin",argv[0]) && argc>1 )
+    {
+        push_arg(args, argv[0]);
+        push_arg(args, argv[1]);
+        iarg = 2;
+    }
+    else
+    {
+        push_arg(args, argv[0]);
+        iarg = 1;
+    }
+    for (i=0; shard_cmds[i].alias; i++)
+        if ( !strcmp(args->cmd_argv[0], shard_cmds[i].alias) ) break;
+    if ( !shard_cmds[i].alias ) error("The command \"%s\" cannot be sharded\n", args->cmd_argv[0]);
+    args->cmd = &shard_cmds[i];
+    if ( !strcmp("plugin",args->cmd->alias) ) check_plugin(args->cmd_argv[1]);
+
+    // the regions are given by the shards and the output is a temporary file
+    for (i=iarg; i<argc && strcmp("--",argv[i]); i++)
+    {
+        char *arg = argv[i];
+        if ( arg[0]=='-' && arg[1] && strchr("rRtT",arg[1]) )
+            error("The option %s cannot be used, the regions are given by the shards\n", arg);
+        if ( !strncmp("--regions",arg,9) || !strncmp("--targets",arg,9) )
+            error("The option %s cannot be used, the regions are given by the shards\n", arg);
+        if ( !strcmp("-o",arg) || !strncmp("--output",arg,8) || (args->cmd->type==SHARD_VCF && !strncmp("-O",arg,2)) )
+            error("The option %s cannot be used, see the options of bcftools shard\n", arg);
+        if ( args->cmd->type==SHARD_TEXT && (!strcmp("-H",arg) || !strcmp("--print-header",arg)) )
+            error("The option %s cannot be used, the header would be repeated in each shard\n", arg);
+        if ( !strcmp("view",args->cmd->alias) && (!strcmp("-h",arg) || !strcmp("-H",arg) || !strcmp("--header-only",arg) || !strcmp("--no-header",arg)) )
+            error("The option %s cannot be used, the header is written by each shard\n", arg);
+        if ( !strcmp("filter",args->cmd->alias) && (!strncmp("-g",arg,2) || !strncmp("-G",arg,2) || !strncmp("--SnpGap",arg,8) || !strncmp("--IndelGap",arg,10)) )
+            error("The option %s cannot be used, it needs the records across the shard borders\n", arg);
+    }
+
+    if ( args->cmd->type==SHARD_VCF )
+    {
+        push_arg(args, "-Ob");
+        push_arg(args, "--no-version");
+    }
+    args->iregion = args->cmd_argc;
+    push_arg(args, "-r"); push_arg(args, NULL);
+    push_arg(args, "-t"); push_arg(args, NULL);
+    args->ioutput = args->cmd_argc;
+    push_arg(args, "-o"); push_arg(args, NULL);
+    push_arg(args, args->fname);
+    for (i=iarg; i<argc; i++) push_arg(args, argv[i]);
+    push_arg(args, NULL);
+    args->cmd_argc--;
+}
+
+static void add_shard(args_t *args, const char *chr, int64_t beg, int64_t end)
+{
+    args->nshard++;
+    hts_expand0(shard_t, args->nshard, args->mshard, args->shard);
+    shard_t *shard = &args->shard[args->nshard-1];
+    kstring_t str = {0,0,0};
+    if ( end ) ksprintf(&str, "%s:%"PRId64"-%"PRId64, chr, beg+1, end);
+    else kputs(chr, &str);
+    shard->region = str.s;
+    str.s = NULL; str.l = str.m = 0;
+    ksprintf(&str, "%s/%05d.%s", args->tmp_dir, args->nshard-1, args->cmd->type==SHARD_VCF ? "bcf" : "txt");
+    shard->fname = str.s;
+}
+
+/*
+    Each contig gets a number of shards proportional to its number of
+    records, the contig is then split into pieces of equal length. Contigs
+    of unknown length are not split.
+*/
+static void plan_shards(args_t *args)
+{
+    htsFile *fp = hts_open(args->fname,"r");
+    if ( !fp ) error("Failed to open %s: %s\n", args->fname, strerror(errno));
+    bcf_hdr_t *hdr = bcf_hdr_read(fp);
+    if ( !hdr ) error("Failed to read the header of %s\n", args->fname);
+
+    tbx_t *tbx = NULL;
+    hts_idx_t *idx = NULL;
+    if ( hts_get_format(fp)->format==vcf )
+    {
+        tbx = tbx_index_load(args->fname);
+        if ( !tbx ) error("Could not load the index of %s, the file must be indexed\n", args->fname);
+    }
+    else
+    {
+        idx = bcf_index_load(args->fname);
+        if ( !idx ) error("Could not load the index of %s, the file must be indexed\n", args->fname);
+    }
+
+    // the tabix index knows only contigs with records, BCF uses the header IDs
+    int i, nseq;
+    const char **seq = NULL;
+    if ( tbx ) seq = tbx_seqnames(tbx, &nseq);
+    else nseq = hdr->n[BCF_DT_CTG];
+
+    uint64_t *nrec = (uint64_t*) calloc(nseq, sizeof(uint64_t)), nrec_tot = 0, unmapped;
+    for (i=0; i<nseq; i++)
+    {
+        if ( hts_idx_get_stat(tbx ? tbx->idx : idx, i, &nrec[i], &unmapped) < 0 ) nrec[i] = 0;
+        nrec_tot += nrec[i];
+    }
+    if ( !nrec_tot ) error("No records found in the index of %s, is the index up to date?\n", args->fname);
+
+    for (i=0; i<nseq; i++)
+    {
+        if ( !nrec[i] ) continue;
+        const char *chr = tbx ? seq[i] : bcf_hdr_id2name(hdr, i);
+        bcf_hrec_t *hrec = bcf_hdr_get_hrec(hdr, BCF_HL_CTG, "ID", chr, NULL);
+        int hkey = hrec ? bcf_hrec_find_key(hrec, "length") : -1;
+        int64_t len = hkey<0 ? 0 : strtoll(hrec->vals[hkey], NULL, 10);
+
+        int j, n = (double)nrec[i] / nrec_tot * args->nshards + 0.5;
+        if ( n < 1 ) n = 1;
+        if ( len <= 0 || n == 1 ) { add_shard(args, chr, 0, 0); continue; }
+        if ( n > len ) n = len;
+        for (j=0; j<n; j++)
+        {
+            int64_t beg = len * j / n, end = len * (j+1) / n;
+            // the last shard takes also records beyond the declared contig length
+            add_shard(args, chr, beg, j+1<n ? end : INT32_MAX);
+        }
+    }
+
+    free(nrec);
+    free(seq);
+    if ( tbx ) tbx_destroy(tbx);
+    if ( idx ) hts_idx_destroy(idx);
+    bcf_hdr_destroy(hdr);
+    if ( hts_close(fp)!=0 ) error("Close failed: %s\n", args->fname);
+}
+
+static void run_shard(args_t *args, shard_t *shard)
+{
+    // the report of the shard process is the one written, shards would overwrite it
+    perf_enabled = 0;
+    optind = 0;     // reinitialize getopt, the shard's own options were parsed with "+"
+
+    args->cmd_argv[args->iregion+1] = shard->region;
+    args->cmd_argv[args->iregion+3] = shard->region;
+    args->cmd_argv[args->ioutput+1] = shard->fname;
+    int ret = bcftools_cmd(args->cmd_argc, args->cmd_argv);
+    if ( !ret && args->write_index && bcf_index_build(shard->fname, 14)!=0 )
+        error("Failed to index %s\n", shard->fname);
+    exit(ret);
+}
+
+static void kill_shards(args_t *args)
+{
+    int i;
+    for (i=0; i<args->nshard; i++)
+        if ( args->shard[i].pid > 0 ) kill(args->shard[i].pid, SIGTERM);
+    for (i=0; i<args->nshard; i++)
+        if ( args->shard[i].pid > 0 ) waitpid(args->shard[i].pid, NULL, 0);
+}
+
+/*
+    The temporary files are removed also when error() exits, by the process
+    which created them and not by the forked shards.
+*/
+static args_t *tmp_args = NULL;
+static pid_t tmp_owner = 0;
+
+static void remove_tmp_files(args_t *args)
+{
+    tmp_args = NULL;
+    kstring_t str = {0,0,0};
+    int i;
+    for (i=0; i<args->nshard; i++)
+    {
+        unlink(args->shard[i].fname);
+        str.l = 0;
+        ksprintf(&str, "%s.csi", args->shard[i].fname);
+        unlink(str.s);
+    }
+    free(str.s);
+    if ( rmdir(args->tmp_dir)!=0 ) fprintf(stderr, "Warning: could not remove the temporary directory %s: %s\n", args->tmp_dir, strerror(errno));
+}
+
+static void remove_tmp_files_at_exit(void)
+{
+    if ( tmp_args && getpid()==tmp_owner ) remove_tmp_files(tmp_args);
+}
+
+// Run up to njobs shards at a time, stop at the first failure
+static void run_shards(args_t *args)
+{
+    int i, nrunning = 0, next = 0, failed = -1;
+    fflush(stdout);
+    fflush(stderr);
+    while ( next < args->nshard || nrunning )
+    {
+        if ( failed<0 && next < args->nshard && nrunning < args->njobs )
+        {
+            shard_t *shard = &args->shard[next];
+            shard->pid = fork();
+            if ( shard->pid < 0 ) { kill_shards(args); error("fork: %s\n", strerror(errno)); }
+            if ( !shard->pid ) run_shard(args, shard);
+            next++;
+            nrunning++;
+            continue;
+        }
+        if ( !nrunning ) break;
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if ( pid < 0 )
+        {
+            if ( errno==EINTR ) continue;
+            error("waitpid: %s\n", strerror(errno));
+        }
+        for (i=0; i<args->nshard; i++) if ( args->shard[i].pid==pid ) break;
+        if ( i==args->nshard ) continue;
+        args->shard[i].pid = 0;
+        nrunning--;
+        if ( WIFEXITED(status) && !WEXITSTATUS(status) ) continue;
+        if ( failed<0 )
+        {
+            failed = i;
+            if ( WIFSIGNALED(status) )
+                fprintf(stderr, "The shard %s was killed by signal %d\n", args->shard[i].region, WTERMSIG(status));
+            else
+                fprintf(stderr, "The shard %s failed with the exit status %d\n", args->shard[i].region, WEXITSTATUS(status));
+            kill_shards(args);
+            nrunning = 0;
+        }
+    }
+    if ( failed>=0 ) error("Failed to run the command on shard %s\n", args->shard[failed].region);
+}
+
+static void concat_text(args_t *args)
+{
+    FILE *out = strcmp("-",args->output_fname) ? fopen(args->output_fname, "w") : stdout;
+    if ( !out ) error("Failed to open %s: %s\n", args->output_fname, strerror(errno));
+    char *buf = (char*) malloc(BUFSIZ);
+    int i;
+    for (i=0; i<args->nshard; i++)
+    {
+        FILE *fp = fopen(args->shard[i].fname, "r");
+        if ( !fp ) error("Failed to open %s: %s\n", args->shard[i].fname, strerror(errno));
+        size_t n;
+        while ( (n = fread(buf, 1, BUFSIZ, fp)) > 0 )
+            if ( fwrite(buf, 1, n, out)!=n ) error("Failed to write %s: %s\n", args->output_fname, strerror(errno));
+        if ( ferror(fp) ) error("Failed to read %s\n", args->shard[i].fname);
+        fclose(fp);
+    }
+    free(buf);
+    if ( out!=stdout && fclose(out)!=0 ) error("Close failed: %s\n", args->output_fname);
+}
+
+// The shards run the same command on the same input, their headers differ
+// only when the VCF input uses undefined tags which are added on the fly
+static bcf_hdr_t *stitch_header(args_t *args)
+{
+    int i;
+    bcf_hdr_t *hdr = NULL;
+    kstring_t str = {0,0,0}, tmp = {0,0,0};
+    for (i=0; i<args->nshard; i++)
+    {
+        htsFile *fp = hts_open(args->shard[i].fname, "r");
+        if ( !fp ) error("Failed to open %s: %s\n", args->shard[i].fname, strerror(errno));
+        bcf_hdr_t *shard_hdr = bcf_hdr_read(fp);
+        if ( !shard_hdr ) error("Failed to read the header of %s\n", args->shard[i].fname);
+        tmp.l = 0;
+        bcf_hdr_format(shard_hdr, 1, &tmp);
+        if ( !hdr ) { hdr = shard_hdr; kputsn(tmp.s, tmp.l, &str); }
+        else
+        {
+            if ( tmp.l!=str.l || memcmp(tmp.s,str.s,str.l) ) error("The headers of the shards differ, are all tags defined in the header? Converting the input to BCF first will fix this.\n");
+            bcf_hdr_destroy(shard_hdr);
+        }
+        hts_close(fp);
+    }
+    free(str.s);
+    free(tmp.s);
+    if ( args->record_cmd_line ) bcf_hdr_append_version(hdr, args->argc, args->argv, "bcftools_shard");
+    return hdr;
+}
+
+/*
+    Write the header and copy the BGZF blocks of all shards as they are,
+    except for the records which share the last block with the header of
+    the shard. EOF blocks of the shards are dropped, the final one is added
+    by hts_close().
+*/
+static void stitch_bcf(args_t *args, bcf_hdr_t *hdr, voff_map_t *maps)
+{
+    htsFile *out = hts_open(args->output_fname, "wb");
+    if ( !out ) error("Failed to open %s: %s\n", args->output_fname, strerror(errno));
+    if ( bcf_hdr_write(out, hdr)!=0 ) error("Failed to write %s\n", args->output_fname);
+    BGZF *bgzf_out = hts_get_bgzfp(out);
+
+    int i;
+    for (i=0; i<args->nshard; i++)
+    {
+        htsFile *fp = hts_open(args->shard[i].fname, "r");
+        if ( !fp ) error("Failed to open %s: %s\n", args->shard[i].fname, strerror(errno));
+        bcf_hdr_t *shard_hdr = bcf_hdr_read(fp);
+        if ( !shard_hdr ) error("Failed to read the header of %s\n", args->shard[i].fname);
+        bcf_hdr_destroy(shard_hdr);
+        int ret = bgzf_remap_copy(hts_get_bgzfp(fp), bgzf_out, &maps[i]);
+        if ( ret==-1 ) error("Could not parse the BGZF blocks of %s\n", args->shard[i].fname);
+        if ( ret<0 ) error("Failed to write %s\n", args->output_fname);
+        if ( hts_close(fp)!=0 ) error("Close failed: %s\n", args->shard[i].fname);
+    }
+    if ( hts_close(out)!=0 ) error("Close failed: %s\n", args->output_fname);
+}
+
+static void stitch_records(args_t *args, bcf_hdr_t *hdr)
+{
+    htsFile *out = hts_open(args->output_fname, hts_bcf_wmode(args->output_type));
+    if ( !out ) error("Failed to open %s: %s\n", args->output_fname, strerror(errno));
+    bcftools_set_threads(out, -1);
+    if ( bcf_hdr_write(out, hdr)!=0 ) error("Failed to write %s\n", args->output_fname);
+    bcf1_t *rec = bcf_init();
+    int i;
+    for (i=0; i<args->nshard; i++)
+    {
+        htsFile *fp = hts_open(args->shard[i].fname, "r");
+        if ( !fp ) error("Failed to open %s: %s\n", args->shard[i].fname, strerror(errno));
+        bcf_hdr_t *shard_hdr = bcf_hdr_read(fp);
+        if ( !shard_hdr ) error("Failed to read the header of %s\n", args->shard[i].fname);
+        int ret;
+        while ( (ret = bcf_read(fp, shard_hdr, rec))==0 )
+            if ( bcf_write(out, hdr, rec)!=0 ) error("Failed to write %s\n", args->output_fname);
+        if ( ret < -1 ) error("Failed to read %s\n", args->shard[i].fname);
+        bcf_hdr_destroy(shard_hdr);
+        if ( hts_close(fp)!=0 ) error("Close failed: %s\n", args->shard[i].fname);
+    }
+    bcf_destroy(rec);
+    if ( hts_close(out)!=0 ) error("Close failed: %s\n", args->output_fname);
+}
+
+/*
+    Merging of the CSI indexes of the shards, see hts_idx_save() for the
+    format. The bins of all shards are collected per reference with offsets
+    mapped to the output, bins present in more shards are joined: the chunk
+    lists are concatenated in the shard order, which is also the order of
+    offsets. The pseudo-bin holds the offsets spanned by the reference and
+    the number of mapped and unmapped records.
+*/
+typedef struct
+{
+    uint32_t bin;
+    int ishard, nchunk;
+    uint64_t loff, *chunk;  // nchunk pairs of beg,end
+}
+csi_bin_t;
+
+typedef struct
+{
+    csi_bin_t *bin;
+    int nbin, mbin;
+}
+csi_ref_t;
+
+#define csi_bin_lt(a,b) ((a).bin < (b).bin || ((a).bin==(b).bin && (a).ishard < (b).ishard))
+KSORT_INIT(csi_bin, csi_bin_t, csi_bin_lt)
+
+static void merge_csi(args_t *args, voff_map_t *maps)
+{
+    union { uint32_t i; char c[4]; } endian = { 1 };
+    if ( !endian.c[0] )
+    {
+        // big-endian, index the output from scratch
+        if ( bcf_index_build(args->output_fname, 14)!=0 ) error("Failed to index %s\n", args->output_fname);
+        return;
+    }
+
+    kstring_t str = {0,0,0};
+    csi_ref_t *refs = NULL;
+    int32_t nref = 0, hdr0[3], i, j, k;
+    uint32_t meta_bin = 0;
+    uint64_t n_no_coor = 0;
+    char *meta = NULL;
+
+    #define IDX_READ(dst,n) if ( bgzf_read(in,(dst),(n))!=(n) ) error("Failed to read %s\n", str.s)
+    int ishard;
+    for (ishard=0; ishard<args->nshard; ishard++)
+    {
+        str.l = 0;
+        ksprintf(&str,"%s.csi",args->shard[ishard].fname);
+        BGZF *in = bgzf_open(str.s,"r");
+        if ( !in ) error("Failed to read %s\n", str.s);
+
+        char magic[4];
+        int32_t hdr[3], n, nbin;
+        IDX_READ(magic,4);
+        if ( memcmp(magic,"CSI\1",4) ) error("Not a CSI index: %s\n", str.s);
+        IDX_READ(hdr,12);           // min_shift, n_lvls, l_meta
+        char *tmp = (char*) malloc(hdr[2]);
+        IDX_READ(tmp,hdr[2]);
+        if ( !ishard )
+        {
+            memcpy(hdr0,hdr,12);
+            meta = tmp;
+            meta_bin = ((1ULL<<(3*hdr[1]+3)) - 1) / 7 + 1;
+        }
+        else
+        {
+            if ( memcmp(hdr,hdr0,12) || memcmp(tmp,meta,hdr[2]) ) error("The indexes of the shards differ: %s\n", str.s);
+            free(tmp);
+        }
+        IDX_READ(&n,4);
+        if ( n > nref )
+        {
+            refs = (csi_ref_t*) realloc(refs, sizeof(csi_ref_t)*n);
+            memset(refs + nref, 0, sizeof(csi_ref_t)*(n - nref));
+            nref = n;
+        }
+        for (i=0; i<n; i++)
+        {
+            csi_ref_t *ref = &refs[i];
+            IDX_READ(&nbin,4);
+            for (j=0; j<nbin; j++)
+            {
+                ref->nbin++;
+                hts_expand0(csi_bin_t, ref->nbin, ref->mbin, ref->bin);
+                csi_bin_t *bin = &ref->bin[ref->nbin-1];
+                bin->ishard = ishard;
+                IDX_READ(&bin->bin,4);
+                IDX_READ(&bin->loff,8);
+                IDX_READ(&bin->nchunk,4);
+                bin->loff  = map_voffset(&maps[ishard], bin->loff);
+                bin->chunk = (uint64_t*) malloc(sizeof(uint64_t)*2*bin->nchunk);
+                IDX_READ(bin->chunk, 16*bin->nchunk);
+                for (k=0; k<bin->nchunk; k++)
+                {
+                    if ( bin->bin==meta_bin && k ) continue;
+                    bin->chunk[2*k]   = map_voffset(&maps[ishard], bin->chunk[2*k]);
+                    bin->chunk[2*k+1] = map_voffset(&maps[ishard], bin->chunk[2*k+1]);
+                }
+            }
+        }
+        uint64_t nnc;
+        if ( bgzf_read(in,&nnc,8)==8 ) n_no_coor += nnc;
+        bgzf_close(in);
+    }
+    #undef IDX_READ
+
+    str.l = 0;
+    ksprintf(&str,"%s.csi",args->output_fname);
+    BGZF *out = bgzf_open(str.s,"w");
+    if ( !out ) error("Failed to write %s: %s\n", str.s, strerror(errno));
+    #define IDX_WRITE(src,n) if ( bgzf_write(out,(src),(n))!=(n) ) error("Failed to write %s\n", str.s)
+    IDX_WRITE("CSI\1",4);
+    IDX_WRITE(hdr0,12);
+    IDX_WRITE(meta,hdr0[2]);
+    IDX_WRITE(&nref,4);
+    for (i=0; i<nref; i++)
+    {
+        csi_ref_t *ref = &refs[i];
+        ks_mergesort(csi_bin, ref->nbin, ref->bin, NULL);
+
+        // join the bins of the same number
+        int nbin = 0;
+        for (j=0; j<ref->nbin; j++)
+        {
+            csi_bin_t *src = &ref->bin[j];
+            if ( !nbin || ref->bin[nbin-1].bin!=src->bin ) { ref->bin[nbin++] = *src; continue; }
+            csi_bin_t *dst = &ref->bin[nbin-1];
+            if ( src->bin==meta_bin )
+            {
+                if ( src->chunk[1] > dst->chunk[1] ) dst->chunk[1] = src->chunk[1];
+                dst->chunk[2] += src->chunk[2];
+                dst->chunk[3] += src->chunk[3];
+            }
+            else
+            {
+                dst->chunk = (uint64_t*) realloc(dst->chunk, sizeof(uint64_t)*2*(dst->nchunk + src->nchunk));
+                memcpy(dst->chunk + 2*dst->nchunk, src->chunk, sizeof(uint64_t)*2*src->nchunk);
+                dst->nchunk += src->nchunk;
+            }
+            free(src->chunk);
+        }
+        ref->nbin = nbin;
+
+        IDX_WRITE(&ref->nbin,4);
+        for (j=0; j<ref->nbin; j++)
+        {
+            csi_bin_t *bin = &ref->bin[j];
+            IDX_WRITE(&bin->bin,4);
+            IDX_WRITE(&bin->loff,8);
+            IDX_WRITE(&bin->nchunk,4);
+            IDX_WRITE(bin->chunk,16*bin->nchunk);
+            free(bin->chunk);
+        }
+        free(ref->bin);
+    }
+    IDX_WRITE(&n_no_coor,8);
+    #undef IDX_WRITE
+    if ( bgzf_close(out)<0 ) error("Error closing %s\n", str.s);
+
+    free(refs);
+    free(meta);
+    free(str.s);
+}
+
+static void stitch_shards(args_t *args)
+{
+    if ( args->cmd->type==SHARD_TEXT ) { concat_text(args); return; }
+
+    bcf_hdr_t *hdr = stitch_header(args);
+    if ( args->output_type==FT_BCF_GZ )
+    {
+        voff_map_t *maps = (voff_map_t*) calloc(args->nshard, sizeof(voff_map_t));
+        stitch_bcf(args, hdr, maps);
+        if ( args->write_index ) merge_csi(args, maps);
+        free(maps);
+    }
+    else
+    {
+        stitch_records(args, hdr);
+        if ( args->write_index && bcf_index_build(args->output_fname, 14)!=0 )
+            error("Failed to index %s\n", args->output_fname);
+    }
+    bcf_hdr_destroy(hdr);
+}
+
+static void init_tmp_dir(args_t *args)
+{
+    kstring_t str = {0,0,0};
+    const char *prefix = args->tmp_prefix;
+    if ( !prefix ) prefix = getenv("TMPDIR");
+    if ( !prefix ) prefix = "/tmp";
+    ksprintf(&str, "%s/bcftools-shard.XXXXXX", prefix);
+    args->tmp_dir = mkdtemp(str.s);
+    if ( !args->tmp_dir ) error("mkdtemp(%s) failed: %s\n", str.s, strerror(errno));
+    tmp_args  = args;
+    tmp_owner = getpid();
+    atexit(remove_tmp_files_at_exit);
+}
+
+static void destroy_data(args_t *args)
+{
+    int i;
+    for (i=0; i<args->nshard; i++)
+    {
+        free(args->shard[i].region);
+        free(args->shard[i].fname);
+    }
+    free(args->shard);
+    free(args->cmd_argv);
+    free(args->tmp_dir);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "\n");
+    fprintf(stderr, "About:   Split the genome into shards planned from the index of the input, run the command on\n");
+    fprintf(stderr, "         the shards in parallel and stitch the outputs in order. A record belongs to the shard\n");
+    fprintf(stderr, "         in which it starts. Supported commands: filter, plugin, query, view.\n");
+    fprintf(stderr, "Usage:   bcftools shard [OPTIONS] <file> -- <command> [<args>]\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -j, --jobs <int>               number of shards to run at a time [number of CPUs]\n");
+    fprintf(stderr, "    -n, --nshards <int>            approximate number of shards [4 x jobs]\n");
+    fprintf(stderr, "        --no-version               do not append version and command line to the header\n");
+    fprintf(stderr, "    -o, --output <file>            output file name [stdout]\n");
+    fprintf(stderr, "    -O, --output-type <b|u|z|v>    b: compressed BCF, u: uncompressed BCF, z: compressed VCF, v: uncompressed VCF [v]\n");
+    fprintf(stderr, "    -T, --temp-dir <dir>           directory for temporary files [$TMPDIR or /tmp]\n");
+    fprintf(stderr, "    -W, --write-index              index the output, requires -o and -Ob or -Oz\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Example:\n");
+    fprintf(stderr, "   bcftools shard -n 64 -Ob -o out.bcf -W in.bcf -- view -i 'QUAL>10'\n");
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int main_vcfshard(int argc, char *argv[])
+{
+    int c;
+    args_t *args = (args_t*) calloc(1,sizeof(args_t));
+    args->argc   = argc; args->argv = argv;
+    args->output_fname = "-";
+    args->output_type = FT_VCF;
+    args->record_cmd_line = 1;
+
+    static struct option loptions[] =
+    {
+        {"jobs",required_argument,NULL,'j'},
+        {"nshards",required_argument,NULL,'n'},
+        {"output",required_argument,NULL,'o'},
+        {"output-type",required_argument,NULL,'O'},
+        {"temp-dir",required_argument,NULL,'T'},
+        {"write-index",no_argument,NULL,'W'},
+        {"no-version",no_argument,NULL,8},
+        {"help",no_argument,NULL,'h'},
+        {NULL,0,NULL,0}
+    };
+    char *tmp;
+    int output_type_set = 0;
+    // "+" stops at the input file, the command's options follow "--"
+    while ((c = getopt_long(argc, argv, "+j:n:o:O:T:Wh?",loptions,NULL)) >= 0)
+    {
+        switch (c)
+        {
+            case 'j':
+                args->njobs = strtol(optarg,&tmp,10);
+                if ( *tmp || args->njobs<=0 ) error("Could not parse: --jobs %s\n", optarg);
+                break;
+            case 'n':
+                args->nshards = strtol(optarg,&tmp,10);
+                if ( *tmp || args->nshards<=0 ) error("Could not parse: --nshards %s\n", optarg);
+                break;
+            case 'o': args->output_fname = optarg; break;
+            case 'O':
+                output_type_set = 1;
+                switch (optarg[0]) {
+                    case 'b': args->output_type = FT_BCF_GZ; break;
+                    case 'u': args->output_type = FT_BCF; break;
+                    case 'z': args->output_type = FT_VCF_GZ; break;
+                    case 'v': args->output_type = FT_VCF; break;
+                    default: error("The output type \"%s\" not recognised\n", optarg);
+                };
+                break;
+            case 'T': args->tmp_prefix = optarg; break;
+            case 'W': args->write_index = 1; break;
+            case  8 : args->record_cmd_line = 0; break;
+            case 'h':
+            case '?': usage(); break;
+            default: error("Unknown argument: %s\n", optarg);
+        }
+    }
+    if ( optind+2 >= argc || strcmp("--",argv[optind+1]) ) usage();
+    args->fname = argv[optind];
+    init_command(args, argc-optind-2, argv+optind+2);
+
+    if ( args->cmd->type==SHARD_TEXT && output_type_set ) error("The --output-type option cannot be used with \"%s\"\n", args->cmd->alias);
+    if ( args->write_index )
+    {
+        if ( args->cmd->type==SHARD_TEXT ) error("The --write-index option cannot be used with \"%s\"\n", args->cmd->alias);
+        if ( !strcmp("-",args->output_fname) ) error("The --write-index option requires -o\n");
+        if ( !(args->output_type & FT_GZ) ) error("The --write-index option requires compressed output, -Ob or -Oz\n");
+    }
+    if ( !args->njobs )
+    {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        args->njobs = ncpu > 0 ? ncpu : 1;
+    }
+    if ( !args->nshards ) args->nshards = 4 * args->njobs;
+
+    init_tmp_dir(args);
+    plan_shards(args);
+    run_shards(args);
+    stitch_shards(args);
+    remove_tmp_files(args);
+    destroy_data(args);
+    free(args);
+    return 0;
+}
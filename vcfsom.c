@@ -36,6 +36,7 @@ THE SOFTWARE.  */
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include "bcftools.h"
 
 #define SOM_TRAIN    1
@@ -76,10 +77,21 @@ typedef struct
 
     int rand_seed, good_class, bad_class;
     char **argv, *fname, *prefix;
-    int argc, action, train_bad, merge;
+    int argc, action, train_bad, merge, nthreads;
 }
 args_t;
 
+// Work unit of a thread: train the SOMs isom%nthreads==ithread or score the
+// vectors [beg,end)
+typedef struct
+{
+    args_t *args;
+    int ithread, beg, end;
+    double *dat, *score;
+    int *iskip;
+}
+worker_t;
+
 static void usage(void);
 FILE *open_file(char **fname, const char *mode, const char *fmt, ...);
 void mkdir_p(const char *fmt, ...);
@@ -238,6 +250,24 @@ static void som_create_plot(som_t *som, char *prefix)
     fclose(fp);
     free(fname);
 }
+// Squared euclidean distance. The independent partial sums break the
+// dependency chain of the accumulator so that the compiler can keep several
+// multiply-adds in flight or pack them into vector registers.
+static inline double som_dist2(const double *restrict vec, const double *restrict ptr, int n)
+{
+    double d0 = 0, d1 = 0, d2 = 0, d3 = 0;
+    int k;
+    for (k=0; k+4<=n; k+=4)
+    {
+        double x0 = vec[k]   - ptr[k];
+        double x1 = vec[k+1] - ptr[k+1];
+        double x2 = vec[k+2] - ptr[k+2];
+        double x3 = vec[k+3] - ptr[k+3];
+        d0 += x0*x0; d1 += x1*x1; d2 += x2*x2; d3 += x3*x3;
+    }
+    for (; k<n; k++) d0 += (vec[k] - ptr[k]) * (vec[k] - ptr[k]);
+    return (d0 + d1) + (d2 + d3);
+}
 // Find the best matching unit: the node with minimum distance from the input vector
 static inline int som_find_bmu(som_t *som, double *vec, double *dist)
 {
@@ -245,12 +275,10 @@ static inline int som_find_bmu(som_t *som, double *vec, double *dist)
     double min_dist = HUGE_VAL;
     int min_idx = 0;
 
-    int i, k;
+    int i;
     for (i=0; i<som->size; i++)
     {
-        double dist = 0;
-        for (k=0; k<som->kdim; k++)
-            dist += (vec[k] - ptr[k]) * (vec[k] - ptr[k]);
+        double dist = som_dist2(vec, ptr, som->kdim);
         if ( dist < min_dist )
         {
             min_dist = dist;
@@ -267,14 +295,12 @@ static inline double som_get_score(som_t *som, double *vec, double bmu_th)
     double *ptr = som->w;
     double min_dist = HUGE_VAL;
 
-    int i, k;
+    int i;
     for (i=0; i<som->size; i++)
     {
         if ( som->c[i] >= bmu_th )
         {
-            double dist = 0;
-            for (k=0; k<som->kdim; k++)
-                dist += (vec[k] - ptr[k]) * (vec[k] - ptr[k]);
+            double dist = som_dist2(vec, ptr, som->kdim);
             if ( dist < min_dist ) min_dist = dist;
         }
         ptr += som->kdim;
@@ -397,42 +423,111 @@ static void destroy_data(args_t *args)
 #define MERGE_MIN 0
 #define MERGE_MAX 1
 #define MERGE_AVG 2
-static double get_min_score(args_t *args, int iskip)
+static double get_min_score(args_t *args, double *vals, int iskip)
 {
     int i;
     double score, min_score = HUGE_VAL;
     for (i=0; i<args->nfold; i++)
     {
         if ( i==iskip ) continue;
-        score = som_get_score(args->som[i], args->vals, args->bmu_th);
+        score = som_get_score(args->som[i], vals, args->bmu_th);
         if ( i==0 || score < min_score ) min_score = score;
     }
     return min_score;
 }
-static double get_max_score(args_t *args, int iskip)
+static double get_max_score(args_t *args, double *vals, int iskip)
 {
     int i;
     double score, max_score = -HUGE_VAL;
     for (i=0; i<args->nfold; i++)
     {
         if ( i==iskip ) continue;
-        score = som_get_score(args->som[i], args->vals, args->bmu_th);
+        score = som_get_score(args->som[i], vals, args->bmu_th);
         if ( i==0 || max_score < score ) max_score = score;
     }
     return max_score;
 }
-static double get_avg_score(args_t *args, int iskip)
+static double get_avg_score(args_t *args, double *vals, int iskip)
 {
     int i, n = 0;
     double score = 0;
     for (i=0; i<args->nfold; i++)
     {
         if ( i==iskip ) continue;
-        score += som_get_score(args->som[i], args->vals, args->bmu_th);
+        score += som_get_score(args->som[i], vals, args->bmu_th);
         n++;
     }
     return score/n;
 }
+static double get_score(args_t *args, double *vals, int iskip)
+{
+    double score = 0;
+    switch (args->merge)
+    {
+        case MERGE_MIN: score = get_min_score(args, vals, iskip); break;
+        case MERGE_MAX: score = get_max_score(args, vals, iskip); break;
+        case MERGE_AVG: score = get_avg_score(args, vals, iskip); break;
+    }
+    return 1.0 - score/sqrt(args->som[0]->kdim);
+}
+
+static void *train_worker(void *data)
+{
+    worker_t *w = (worker_t*) data;
+    args_t *args = w->args;
+    int i;
+    for (i=0; i<w->end; i++)
+    {
+        int is_good = args->train_class[i] & 1;
+        int isom    = args->train_class[i] >> 1;
+        if ( isom % args->nthreads != w->ithread ) continue;
+        if ( is_good || args->train_bad )
+            som_train_site(args->som[isom], args->train_dat+i*args->mvals, is_good);
+    }
+    return NULL;
+}
+static void *score_worker(void *data)
+{
+    worker_t *w = (worker_t*) data;
+    args_t *args = w->args;
+    int i;
+    for (i=w->beg; i<w->end; i++)
+        w->score[i] = get_score(args, w->dat+i*args->mvals, w->iskip ? w->iskip[i] : -1);
+    return NULL;
+}
+/*
+ *  run_workers() - run func in args->nthreads threads, the data are split
+ *  into contiguous blocks. The maps are read-only while scoring and each
+ *  is trained by a single thread, therefore no locking is needed.
+ */
+static void run_workers(args_t *args, void *(*func)(void*), int n, double *dat, double *score, int *iskip)
+{
+    int i, nthr = args->nthreads > 1 ? args->nthreads : 1;
+    worker_t *w = (worker_t*) calloc(nthr, sizeof(worker_t));
+    pthread_t *tid = (pthread_t*) malloc(sizeof(pthread_t)*nthr);
+    for (i=0; i<nthr; i++)
+    {
+        w[i].args    = args;
+        w[i].ithread = i;
+        w[i].beg     = (int)((int64_t)n*i/nthr);
+        w[i].end     = (int)((int64_t)n*(i+1)/nthr);
+        w[i].dat     = dat;
+        w[i].score   = score;
+        w[i].iskip   = iskip;
+        if ( func==train_worker ) { w[i].beg = 0; w[i].end = n; }
+    }
+    if ( nthr==1 ) func(&w[0]);
+    else
+    {
+        for (i=0; i<nthr; i++)
+            if ( pthread_create(&tid[i], NULL, func, &w[i]) ) error("Failed to create a thread\n");
+        for (i=0; i<nthr; i++)
+            if ( pthread_join(tid[i], NULL) ) error("Failed to join a thread\n");
+    }
+    free(tid);
+    free(w);
+}
+
 static int cmpfloat_desc(const void *a, const void *b)
 {
     float fa = *((float*)a);
@@ -511,14 +606,8 @@ static void do_train(args_t *args)
     args->som = (som_t**) malloc(sizeof(som_t*)*args->nfold);
     for (i=0; i<args->nfold; i++) args->som[i] = som_init(args);
 
-    // train
-    for (i=0; i<ntrain; i++)
-    {
-        int is_good = args->train_class[i] & 1;
-        int isom    = args->train_class[i] >> 1;
-        if ( is_good || args->train_bad )
-            som_train_site(args->som[isom], args->train_dat+i*args->mvals, is_good);
-    }
+    // train, the maps are independent and can be trained in parallel
+    run_workers(args, train_worker, ntrain, NULL, NULL, NULL);
 
     // norm and create plots
     for (i=0; i<args->nfold; i++)
@@ -535,27 +624,22 @@ static void do_train(args_t *args)
     // evaluate
     float *good = (float*) malloc(sizeof(float)*ngood); assert(good);
     float *bad  = (float*) malloc(sizeof(float)*nbad); assert(bad);
+    double *score = (double*) malloc(sizeof(double)*ntrain); assert(score);
+    int *iskip = (int*) malloc(sizeof(int)*ntrain); assert(iskip);
+    for (i=0; i<ntrain; i++)
+        iskip[i] = args->nfold==1 ? -1 : args->train_class[i] >> 1;    // this vector was used for training isom-th SOM, skip
+    run_workers(args, score_worker, ntrain, args->train_dat, score, iskip);
     igood = ibad = 0;
-    double max_score = sqrt(args->som[0]->kdim);
     for (i=0; i<ntrain; i++)
     {
-        double score = 0;
         int is_good = args->train_class[i] & 1;
-        int isom    = args->train_class[i] >> 1;    // this vector was used for training isom-th SOM, skip
-        if ( args->nfold==1 ) isom = -1;
-        memcpy(args->vals, args->train_dat+i*args->mvals, args->mvals*sizeof(double));
-        switch (args->merge)
-        {
-            case MERGE_MIN: score = get_min_score(args, isom); break;
-            case MERGE_MAX: score = get_max_score(args, isom); break;
-            case MERGE_AVG: score = get_avg_score(args, isom); break;
-        }
-        score = 1.0 - score/max_score;
         if ( is_good )
-            good[igood++] = score;
+            good[igood++] = score[i];
         else
-            bad[ibad++] = score;
+            bad[ibad++] = score[i];
     }
+    free(score);
+    free(iskip);
     qsort(good, ngood, sizeof(float), cmpfloat_desc);
     qsort(bad, nbad, sizeof(float), cmpfloat_desc);
     FILE *fp = NULL;
@@ -594,20 +678,25 @@ static void do_train(args_t *args)
 
 static void do_classify(args_t *args)
 {
+    // the sites are read in batches, scored in parallel and printed in the input order
+    int i, n = 0, mbatch = args->nthreads > 1 ? 10000*args->nthreads : 1;
+    double *dat = (double*) malloc(sizeof(double)*mbatch*args->mvals); assert(dat);
+    double *score = (double*) malloc(sizeof(double)*mbatch); assert(score);
     annots_reader_reset(args);
-    double max_score = sqrt(args->som[0]->kdim);
-    while ( annots_reader_next(args) )
+    while ( 1 )
     {
-        double score = 0;
-        switch (args->merge)
-        {
-            case MERGE_MIN: score = get_min_score(args, -1); break;
-            case MERGE_MAX: score = get_max_score(args, -1); break;
-            case MERGE_AVG: score = get_avg_score(args, -1); break;
-        }
-        printf("%e\n", 1.0 - score/max_score);
+        int ret = annots_reader_next(args);
+        if ( ret ) memcpy(dat+n*args->mvals, args->vals, args->mvals*sizeof(double));
+        if ( ret && ++n < mbatch ) continue;
+        if ( !n ) break;
+        run_workers(args, score_worker, n, dat, score, NULL);
+        for (i=0; i<n; i++) printf("%e\n", score[i]);
+        n = 0;
+        if ( !ret ) break;
     }
     annots_reader_close(args);
+    free(dat);
+    free(score);
 }
 
 static void usage(void)
@@ -622,6 +711,7 @@ static void usage(void)
     fprintf(stderr, "    -p, --prefix <string>              prefix of output files\n");
     fprintf(stderr, "    -s, --size <int>                   map size [20]\n");
     fprintf(stderr, "    -t, --train                        \n");
+    fprintf(stderr, "        --threads <int>                number of threads for training and scoring [0]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Classifying options:\n");
     fprintf(stderr, "    -c, --classify                     \n");
@@ -669,6 +759,7 @@ int main_vcfsom(int argc, char *argv[])
         {"merge",1,0,'m'},
         {"train",0,0,'t'},
         {"classify",0,0,'c'},
+        {"threads",1,0,9},
         {0,0,0,0}
     };
     while ((c = getopt_long(argc, argv, "htcp:n:r:b:l:s:f:d:m:e",loptions,NULL)) >= 0) {
@@ -692,6 +783,7 @@ int main_vcfsom(int argc, char *argv[])
                 if ( args->ndim<2 ) error("Expected -d >=2, got %d\n", args->ndim);
                 if ( args->ndim>3 ) fprintf(stderr,"Warning: This will take a long time and is not going to make the results better: -d %d\n", args->ndim);
                 break;
+            case  9 : args->nthreads = strtol(optarg, 0, 0); break;
             case 't': args->action = SOM_TRAIN; break;
             case 'c': args->action = SOM_CLASSIFY; break;
             case 'h':
@@ -0,0 +1,456 @@
+/*  vcfsort.c -- sort VCF/BCF files with bounded memory.
+
+    Copyright (C) 2017 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.  */
+
+/*
+    External memory sort. Records are read in their packed form, without
+    unpacking, into an in-memory run until the memory limit is reached. The
+    run is then sorted and written to a temporary BCF. With --threads, the
+    sorting and compression of a full run proceeds in a background thread
+    while the next run is being read, the memory limit then covers both
+    runs. Finally the runs are merged with a heap. When there are too many
+    runs to keep open at once, groups of consecutive runs are first merged
+    into intermediate runs.
+
+    The sort is stable: records with the same chromosome and position keep
+    their input order, runs are merged with ties broken by the run number.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <htslib/vcf.h>
+#include <htslib/ksort.h>
+#include <htslib/kstring.h>
+#include "bcftools.h"
+#include "kheap.h"
+#include "perf.h"
+
+#define MAX_OPEN_RUNS 256   // the number of runs merged at once, limited by open file descriptors
+
+typedef struct
+{
+    char *fname;
+    htsFile *fh;
+    bcf_hdr_t *hdr;
+    bcf1_t *rec;
+}
+blk_t;
+
+struct _args_t;
+
+typedef struct
+{
+    bcf1_t **rec;           // the records, nrec used; up to mrec allocated and recycled
+    size_t nrec, mrec, mem;
+    char *fname;            // the run is being written to this file
+    bcf_hdr_t *hdr;         // a private copy of the header for the writer thread
+    struct _args_t *args;
+}
+run_t;
+
+typedef struct _args_t
+{
+    bcf_hdr_t *hdr;
+    char **argv, *fname, *output_fname, *tmp_dir, *tmp_prefix;
+    int argc, output_type, n_threads, record_cmd_line, write_index;
+    size_t max_mem, max_run_mem;
+    run_t run[2];
+    int irun;               // the run being filled
+    int spilling;           // the other run is being written by the background thread
+    pthread_t tid;
+    blk_t *blk;
+    int nblk, mblk, ntmp;
+}
+args_t;
+
+static inline int cmp_bcf_pos(bcf1_t *a, bcf1_t *b)
+{
+    if ( a->rid != b->rid ) return a->rid < b->rid ? -1 : 1;
+    if ( a->pos != b->pos ) return a->pos < b->pos ? -1 : 1;
+    return 0;
+}
+
+typedef bcf1_t *bcf1_p;
+#define bcf1_lt(a,b) (cmp_bcf_pos((a),(b)) < 0)
+KSORT_INIT(rec, bcf1_p, bcf1_lt)
+
+// Blocks are compared by their current record, ties go to the earlier run so
+// that the merge is stable. The blocks come from a single array, comparing
+// the pointers gives the order of runs.
+static inline int blk_is_smaller(blk_t **a, blk_t **b)
+{
+    int ret = cmp_bcf_pos((*a)->rec, (*b)->rec);
+    if ( ret ) return ret < 0 ? 1 : 0;
+    return *a < *b ? 1 : 0;
+}
+KHEAP_INIT(blk, blk_t*, blk_is_smaller)
+typedef khp_blk_t blk_heap_t;
+
+static char *tmp_fname(args_t *args)
+{
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s/%05d.bcf", args->tmp_dir, args->ntmp++);
+    return str.s;
+}
+
+static void init_tmp_dir(args_t *args)
+{
+    kstring_t str = {0,0,0};
+    const char *prefix = args->tmp_prefix;
+    if ( !prefix ) prefix = getenv("TMPDIR");
+    if ( !prefix ) prefix = "/tmp";
+    ksprintf(&str, "%s/bcftools-sort.XXXXXX", prefix);
+    args->tmp_dir = mkdtemp(str.s);
+    if ( !args->tmp_dir ) error("mkdtemp(%s) failed: %s\n", str.s, strerror(errno));
+}
+
+static htsFile *open_tmp(args_t *args, const char *fname, const char *mode)
+{
+    htsFile *fh = hts_open(fname, mode);
+    if ( !fh ) error("Cannot open the temporary file %s: %s\n", fname, strerror(errno));
+    // temporary files are not registered for the performance report, so use the pool directly
+    htsThreadPool *p = bcftools_thread_pool(args->n_threads);
+    if ( p ) hts_set_opt(fh, HTS_OPT_THREAD_POOL, p);
+    return fh;
+}
+
+static void *write_run(void *arg)
+{
+    run_t *run = (run_t*) arg;
+    ks_mergesort(rec, run->nrec, run->rec, NULL);
+
+    htsFile *fh = open_tmp(run->args, run->fname, "wb1");
+    if ( bcf_hdr_write(fh, run->hdr)!=0 ) error("Cannot write to %s\n", run->fname);
+    size_t i;
+    for (i=0; i<run->nrec; i++)
+        if ( bcf_write(fh, run->hdr, run->rec[i])!=0 ) error("Cannot write to %s\n", run->fname);
+    if ( hts_close(fh)!=0 ) error("Close failed: %s\n", run->fname);
+    bcf_hdr_destroy(run->hdr);
+    run->hdr = NULL;
+    return NULL;
+}
+
+static void wait_for_run(args_t *args)
+{
+    if ( !args->spilling ) return;
+    if ( pthread_join(args->tid, NULL) ) error("Failed to join a thread\n");
+    args->spilling = 0;
+}
+
+static void new_blk(args_t *args, char *fname)
+{
+    args->nblk++;
+    hts_expand0(blk_t, args->nblk, args->mblk, args->blk);
+    args->blk[args->nblk-1].fname = fname;
+}
+
+// Sort the current run and write it to a temporary file, in the background
+// with --threads. The header is duplicated because the reader may still add
+// undefined tags to it while the run is written.
+static void spill_run(args_t *args)
+{
+    wait_for_run(args);
+    if ( !args->tmp_dir ) init_tmp_dir(args);
+
+    run_t *run = &args->run[args->irun];
+    run->args  = args;
+    run->fname = tmp_fname(args);
+    run->hdr   = bcf_hdr_dup(args->hdr);
+    new_blk(args, run->fname);
+
+    if ( args->n_threads > 0 )
+    {
+        if ( pthread_create(&args->tid, NULL, write_run, run) ) error("Failed to create a thread\n");
+        args->spilling = 1;
+        args->irun ^= 1;
+    }
+    else
+        write_run(run);
+
+    run = &args->run[args->irun];
+    run->nrec = 0;
+    run->mem  = 0;
+}
+
+static void read_runs(args_t *args)
+{
+    htsFile *in = hts_open(args->fname, "r");
+    if ( !in ) error("Could not read %s: %s\n", args->fname, strerror(errno));
+    bcftools_set_threads(in, args->n_threads);
+    args->hdr = bcf_hdr_read(in);
+    if ( !args->hdr ) error("Could not read VCF/BCF headers from %s\n", args->fname);
+    if ( args->record_cmd_line ) bcf_hdr_append_version(args->hdr, args->argc, args->argv, "bcftools_sort");
+
+    while ( 1 )
+    {
+        run_t *run = &args->run[args->irun];
+        hts_expand0(bcf1_t*, run->nrec+1, run->mrec, run->rec);
+        if ( !run->rec[run->nrec] ) run->rec[run->nrec] = bcf_init();
+        bcf1_t *rec = run->rec[run->nrec];
+
+        perf_beg(PERF_READ);
+        int ret = bcf_read(in, args->hdr, rec);
+        perf_end(PERF_READ, ret<0 ? 0 : 1);
+        if ( ret < -1 ) error("Error encountered while parsing the input\n");
+        if ( ret == -1 ) break;
+        if ( rec->errcode ) error("Error encountered while parsing the input at %s:%d\n", bcf_seqname(args->hdr,rec), rec->pos+1);
+
+        // the recycled records keep their buffers, count the allocated size
+        run->nrec++;
+        run->mem += sizeof(bcf1_t) + rec->shared.m + rec->indiv.m;
+        if ( run->mem >= args->max_run_mem ) spill_run(args);
+    }
+    bcftools_perf_input(in);
+    if ( hts_close(in)!=0 ) error("Close failed: %s\n", args->fname);
+
+    // the last run is kept in memory if nothing was written so far
+    if ( args->nblk && args->run[args->irun].nrec ) spill_run(args);
+    wait_for_run(args);
+}
+
+static void open_blk(args_t *args, blk_t *blk, blk_heap_t *heap)
+{
+    blk->fh  = open_tmp(args, blk->fname, "r");
+    blk->hdr = bcf_hdr_read(blk->fh);
+    if ( !blk->hdr ) error("Could not read the header of %s\n", blk->fname);
+    blk->rec = bcf_init();
+    int ret = bcf_read(blk->fh, blk->hdr, blk->rec);
+    if ( ret < -1 ) error("Error reading %s\n", blk->fname);
+    if ( ret == -1 ) return;
+    khp_insert(blk, heap, &blk);
+}
+
+static void close_blk(blk_t *blk)
+{
+    if ( hts_close(blk->fh)!=0 ) error("Close failed: %s\n", blk->fname);
+    bcf_hdr_destroy(blk->hdr);
+    bcf_destroy(blk->rec);
+    unlink(blk->fname);
+    free(blk->fname);
+    memset(blk, 0, sizeof(*blk));
+}
+
+// Merge n consecutive runs into the output. The headers of the runs are
+// snapshots of the growing input header, the IDs are therefore compatible
+// with the final header.
+static void merge_blks(args_t *args, blk_t *blks, int n, htsFile *out)
+{
+    blk_heap_t *heap = khp_init(blk);
+    int i;
+    for (i=0; i<n; i++) open_blk(args, &blks[i], heap);
+    while ( heap->ndat )
+    {
+        blk_t *blk = heap->dat[0];
+        perf_beg(PERF_WRITE);
+        if ( bcf_write(out, args->hdr, blk->rec)!=0 ) error("Failed to write the output\n");
+        perf_end(PERF_WRITE, 1);
+        khp_delete(blk, heap);
+        int ret = bcf_read(blk->fh, blk->hdr, blk->rec);
+        if ( ret < -1 ) error("Error reading %s\n", blk->fname);
+        if ( ret == -1 ) continue;
+        khp_insert(blk, heap, &blk);
+    }
+    for (i=0; i<n; i++) close_blk(&blks[i]);
+    khp_destroy(blk, heap);
+}
+
+// Reduce the number of runs by merging groups of consecutive runs, so that
+// the order of runs, and therefore the stability, is preserved
+static void merge_passes(args_t *args)
+{
+    while ( args->nblk > MAX_OPEN_RUNS )
+    {
+        int i, j, nnew = 0;
+        for (i=0; i<args->nblk; i+=MAX_OPEN_RUNS)
+        {
+            int n = args->nblk - i < MAX_OPEN_RUNS ? args->nblk - i : MAX_OPEN_RUNS;
+            char *fname = tmp_fname(args);
+            htsFile *fh = open_tmp(args, fname, "wb1");
+            if ( bcf_hdr_write(fh, args->hdr)!=0 ) error("Cannot write to %s\n", fname);
+            merge_blks(args, args->blk + i, n, fh);
+            if ( hts_close(fh)!=0 ) error("Close failed: %s\n", fname);
+            args->blk[nnew++].fname = fname;
+        }
+        for (j=nnew; j<args->nblk; j++) memset(&args->blk[j], 0, sizeof(blk_t));
+        args->nblk = nnew;
+    }
+}
+
+static void write_output(args_t *args)
+{
+    htsFile *out = hts_open(args->output_fname, hts_bcf_wmode(args->output_type));
+    if ( !out ) error("Cannot write to \"%s\": %s\n", args->output_fname, strerror(errno));
+    bcftools_set_threads(out, args->n_threads);
+    if ( bcf_hdr_write(out, args->hdr)!=0 ) error("Cannot write to \"%s\"\n", args->output_fname);
+
+    if ( !args->nblk )
+    {
+        // everything fit in memory
+        run_t *run = &args->run[args->irun];
+        ks_mergesort(rec, run->nrec, run->rec, NULL);
+        size_t i;
+        for (i=0; i<run->nrec; i++)
+        {
+            perf_beg(PERF_WRITE);
+            if ( bcf_write(out, args->hdr, run->rec[i])!=0 ) error("Failed to write the output\n");
+            perf_end(PERF_WRITE, 1);
+        }
+    }
+    else
+    {
+        merge_passes(args);
+        merge_blks(args, args->blk, args->nblk, out);
+    }
+    if ( hts_close(out)!=0 ) error("Close failed: %s\n", args->output_fname);
+
+    if ( args->write_index )
+    {
+        if ( bcf_index_build3(args->output_fname, NULL, 14, args->n_threads) < 0 )
+            error("Failed to index %s\n", args->output_fname);
+    }
+}
+
+static void destroy_data(args_t *args)
+{
+    int i;
+    size_t j;
+    for (i=0; i<2; i++)
+    {
+        for (j=0; j<args->run[i].mrec; j++)
+            if ( args->run[i].rec[j] ) bcf_destroy(args->run[i].rec[j]);
+        free(args->run[i].rec);
+    }
+    free(args->blk);
+    if ( args->tmp_dir )
+    {
+        if ( rmdir(args->tmp_dir)!=0 ) fprintf(stderr, "Warning: could not remove the temporary directory %s: %s\n", args->tmp_dir, strerror(errno));
+        free(args->tmp_dir);
+    }
+    bcf_hdr_destroy(args->hdr);
+}
+
+static size_t parse_mem(char *str)
+{
+    char *tmp;
+    double mem = strtod(str, &tmp);
+    if ( tmp==str || mem<=0 ) error("Could not parse: --max-mem %s\n", str);
+    if ( !strcasecmp("k",tmp) ) mem *= 1000;
+    else if ( !strcasecmp("m",tmp) ) mem *= 1000*1000;
+    else if ( !strcasecmp("g",tmp) ) mem *= 1000*1000*1000;
+    else if ( *tmp ) error("Could not parse: --max-mem %s\n", str);
+    return mem;
+}
+
+static void usage(args_t *args)
+{
+    fprintf(stderr, "\n");
+    fprintf(stderr, "About:   Sort VCF/BCF file by chromosome and position. Records at the same position keep\n");
+    fprintf(stderr, "         their input order. Files larger than the memory limit are sorted in runs which\n");
+    fprintf(stderr, "         are written to temporary files and merged.\n");
+    fprintf(stderr, "Usage:   bcftools sort [OPTIONS] <FILE.vcf>\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -m, --max-mem <float>[kMG]     maximum memory to use [768M]\n");
+    fprintf(stderr, "        --no-version               do not append version and command line to the header\n");
+    fprintf(stderr, "    -o, --output <file>            output file name [stdout]\n");
+    fprintf(stderr, "    -O, --output-type <b|u|z|v>    b: compressed BCF, u: uncompressed BCF, z: compressed VCF, v: uncompressed VCF [v]\n");
+    fprintf(stderr, "    -T, --temp-dir <dir>           directory for temporary files [$TMPDIR or /tmp]\n");
+    fprintf(stderr, "        --threads <int>            number of extra threads for sorting and compression [0]\n");
+    fprintf(stderr, "    -W, --write-index              index the output, requires -o and -Ob or -Oz\n");
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int main_vcfsort(int argc, char *argv[])
+{
+    int c;
+    args_t *args  = (args_t*) calloc(1,sizeof(args_t));
+    args->argc    = argc; args->argv = argv;
+    args->output_fname = "-";
+    args->output_type = FT_VCF;
+    args->n_threads = -1;
+    args->record_cmd_line = 1;
+    args->max_mem = 768*1000*1000;
+
+    static struct option loptions[] =
+    {
+        {"max-mem",required_argument,NULL,'m'},
+        {"temp-dir",required_argument,NULL,'T'},
+        {"output",required_argument,NULL,'o'},
+        {"output-type",required_argument,NULL,'O'},
+        {"write-index",no_argument,NULL,'W'},
+        {"threads",required_argument,NULL,9},
+        {"no-version",no_argument,NULL,8},
+        {"help",no_argument,NULL,'h'},
+        {NULL,0,NULL,0}
+    };
+    while ((c = getopt_long(argc, argv, "m:T:o:O:Wh?",loptions,NULL)) >= 0)
+    {
+        switch (c)
+        {
+            case 'm': args->max_mem = parse_mem(optarg); break;
+            case 'T': args->tmp_prefix = optarg; break;
+            case 'o': args->output_fname = optarg; break;
+            case 'O':
+                switch (optarg[0]) {
+                    case 'b': args->output_type = FT_BCF_GZ; break;
+                    case 'u': args->output_type = FT_BCF; break;
+                    case 'z': args->output_type = FT_VCF_GZ; break;
+                    case 'v': args->output_type = FT_VCF; break;
+                    default: error("The output type \"%s\" not recognised\n", optarg);
+                };
+                break;
+            case 'W': args->write_index = 1; break;
+            case  9 : args->n_threads = strtol(optarg, 0, 0); break;
+            case  8 : args->record_cmd_line = 0; break;
+            case 'h':
+            case '?': usage(args); break;
+            default: error("Unknown argument: %s\n", optarg);
+        }
+    }
+
+    if ( optind>=argc )
+    {
+        if ( !isatty(fileno((FILE *)stdin)) ) args->fname = "-";  // reading from stdin
+        else usage(args);
+    }
+    else args->fname = argv[optind];
+    if ( args->write_index )
+    {
+        if ( !strcmp("-",args->output_fname) ) error("The --write-index option requires -o\n");
+        if ( !(args->output_type & FT_GZ) ) error("The --write-index option requires compressed output, -Ob or -Oz\n");
+    }
+    args->n_threads = bcftools_threads(args->n_threads);
+    args->max_run_mem = args->n_threads > 0 ? args->max_mem / 2 : args->max_mem;
+
+    read_runs(args);
+    write_output(args);
+    destroy_data(args);
+    free(args);
+    return 0;
+}
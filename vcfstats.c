@@ -40,6 +40,7 @@ THE SOFTWARE.  */
 #include "bcftools.h"
 #include "filter.h"
 #include "bin.h"
+#include "perf.h"
 
 // Logic of the filters: include or exclude sites which match the filters?
 #define FLT_INCLUDE 1
@@ -1021,8 +1022,9 @@ static void do_vcf_stats(args_t *args)
 {
     bcf_srs_t *files = args->files;
     assert( sizeof(int)>files->nreaders );
-    while ( bcf_sr_next_line(files) )
+    while ( perf_beg(PERF_READ), bcf_sr_next_line(files) )
     {
+        perf_end(PERF_READ, 1);
         bcf_sr_t *reader = NULL;
         bcf1_t *line = NULL;
         int ret = 0, i, pass = 1;
@@ -1031,7 +1033,9 @@ static void do_vcf_stats(args_t *args)
             if ( !bcf_sr_has_line(files,i) ) continue;
             if ( args->filter[i] )
             {
+                perf_beg(PERF_FILTER);
                 int is_ok = filter_test(args->filter[i], bcf_sr_get_line(files,i), NULL);
+                perf_end(PERF_FILTER, 1);
                 if ( args->filter_logic & FLT_EXCLUDE ) is_ok = is_ok ? 0 : 1;
                 if ( !is_ok ) { pass = 0; break; }
             }
@@ -1077,6 +1081,7 @@ static void do_vcf_stats(args_t *args)
         if ( bcf_get_info_int32(reader->header,line,"DP",&args->tmp_iaf,&args->ntmp_iaf)==1 )
             (*idist(&stats->dp_sites, args->tmp_iaf[0]))++;    
     }
+    perf_end(PERF_READ, 0);
 }
 
 static void print_header(args_t *args)
@@ -1588,6 +1593,7 @@ int main_vcfstats(int argc, char *argv[])
     args->files  = bcf_sr_init();
     args->argc   = argc; args->argv = argv;
     args->dp_min = 0; args->dp_max = 500; args->dp_step = 1;
+    args->n_threads = -1;
     int regions_is_file = 0, targets_is_file = 0;
 
     static struct option loptions[] =
@@ -1675,8 +1681,8 @@ int main_vcfstats(int argc, char *argv[])
         error("Failed to read the targets: %s\n", args->targets_list);
     if ( args->regions_list && bcf_sr_set_regions(args->files, args->regions_list, regions_is_file)<0 )
         error("Failed to read the regions: %s\n", args->regions_list);
-    if ( args->n_threads && bcf_sr_set_threads(args->files, args->n_threads)<0)
-        error("Failed to create threads\n");
+    args->n_threads = bcftools_threads(args->n_threads);
+    bcftools_sr_set_threads(args->files, args->n_threads);
 
     while (fname)
     {
@@ -1690,7 +1696,7 @@ int main_vcfstats(int argc, char *argv[])
     do_vcf_stats(args);
     print_stats(args);
     destroy_stats(args);
-    bcf_sr_destroy(args->files);
+    bcftools_sr_destroy(args->files);
     free(args);
     return 0;
 }
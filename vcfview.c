@@ -37,6 +37,7 @@ THE SOFTWARE.  */
 #include <htslib/vcfutils.h>
 #include "bcftools.h"
 #include "filter.h"
+#include "perf.h"
 #include "htslib/khash_str2int.h"
 
 #define FLT_INCLUDE 1
@@ -71,17 +72,18 @@ typedef struct _args_t
     float min_af, max_af;
     char *fn_ref, *fn_out, **samples;
     int sample_is_file, force_samples;
-    char *include_types, *exclude_types;
+    char *include_types, *exclude_types, *apply_filters;
     int include, exclude;
-    int record_cmd_line;
+    int record_cmd_line, targets_is_file, regions_is_file;
     htsFile *out;
+    bcf1_t **recs;      // the records of a block in the pipe
+    int mrecs;
 }
 args_t;
 
 static void init_data(args_t *args)
 {
     int i;
-    args->hdr = args->files->readers[0].header;
 
     if (args->calc_ac && args->update_info)
     {
@@ -216,18 +218,6 @@ static void init_data(args_t *args)
         free(type_list);
     }
 
-    // setup output
-    char modew[8];
-    strcpy(modew, "w");
-    if (args->clevel >= 0 && args->clevel <= 9) sprintf(modew + 1, "%d", args->clevel);
-    if (args->output_type==FT_BCF) strcat(modew, "bu");         // uncompressed BCF
-    else if (args->output_type & FT_BCF) strcat(modew, "b");    // compressed BCF
-    else if (args->output_type & FT_GZ) strcat(modew,"z");      // compressed VCF
-    args->out = hts_open(args->fn_out ? args->fn_out : "-", modew);
-    if ( !args->out ) error("%s: %s\n", args->fn_out,strerror(errno));
-    if ( args->n_threads > 0)
-        hts_set_opt(args->out, HTS_OPT_THREAD_POOL, args->files->p);
-
     // headers: hdr=full header, hsub=subset header, hnull=sites only header
     if (args->sites_only){
         args->hnull = bcf_hdr_subset(args->hdr, 0, 0, 0);
@@ -327,7 +317,9 @@ int subset_vcf(args_t *args, bcf1_t *line)
 
     if ( args->filter )
     {
+        perf_beg(PERF_FILTER);
         int ret = filter_test(args->filter, line, NULL);
+        perf_end(PERF_FILTER, 1);
         if ( args->filter_logic==FLT_INCLUDE ) { if ( !ret ) return 0; }
         else if ( ret ) return 0;
     }
@@ -527,20 +519,18 @@ static void usage(args_t *args)
     exit(1);
 }
 
-int main_vcfview(int argc, char *argv[])
+static args_t *parse_args(int argc, char *argv[])
 {
     int c;
     args_t *args  = (args_t*) calloc(1,sizeof(args_t));
     args->argc    = argc; args->argv = argv;
-    args->files   = bcf_sr_init();
     args->clevel  = -1;
     args->print_header = 1;
     args->update_info = 1;
     args->output_type = FT_VCF;
-    args->n_threads = 0;
+    args->n_threads = -1;
     args->record_cmd_line = 1;
     args->min_ac = args->max_ac = args->min_af = args->max_af = -1;
-    int targets_is_file = 0, regions_is_file = 0;
 
     static struct option loptions[] =
     {
@@ -608,9 +598,9 @@ int main_vcfview(int argc, char *argv[])
             case 'h': args->header_only = 1; break;
 
             case 't': args->targets_list = optarg; break;
-            case 'T': args->targets_list = optarg; targets_is_file = 1; break;
+            case 'T': args->targets_list = optarg; args->targets_is_file = 1; break;
             case 'r': args->regions_list = optarg; break;
-            case 'R': args->regions_list = optarg; regions_is_file = 1; break;
+            case 'R': args->regions_list = optarg; args->regions_is_file = 1; break;
 
             case 's': args->sample_names = optarg; break;
             case 'S': args->sample_names = optarg; args->sample_is_file = 1; break;
@@ -619,7 +609,7 @@ int main_vcfview(int argc, char *argv[])
             case 'I': args->update_info = 0; break;
             case 'G': args->sites_only = 1; break;
 
-            case 'f': args->files->apply_filters = optarg; break;
+            case 'f': args->apply_filters = optarg; break;
             case 'k': args->known = 1; break;
             case 'n': args->novel = 1; break;
             case 'm':
@@ -702,6 +692,51 @@ int main_vcfview(int argc, char *argv[])
     if ( args->phased > FLT_EXCLUDE ) error("Only one of -p or -P can be given.\n");
 
     if ( args->sample_names && args->update_info) args->calc_ac = 1;
+    return args;
+}
+
+// The view command as a stage of "bcftools pipe", see bcftools.h
+void *view_stage_init(int argc, char **argv, bcf_hdr_t *hdr_in, bcf_hdr_t **hdr_out)
+{
+    optind = 0;
+    args_t *args = parse_args(argc, argv);
+    if ( optind < argc ) error("Unexpected argument of \"view\" in the pipe: %s\n", argv[optind]);
+    if ( args->fn_out || args->output_type!=FT_VCF || args->clevel>=0 || args->n_threads>=0 )
+        error("The output options of \"view\" are not supported in the pipe, see the options of \"pipe\"\n");
+    if ( args->header_only || !args->print_header ) error("The options -h and -H of \"view\" are not supported in the pipe\n");
+    if ( args->regions_list || args->targets_list || args->apply_filters )
+        error("The options -r, -R, -t, -T and -f of \"view\" apply when reading and are not supported in the pipe\n");
+    args->record_cmd_line = 0;
+    args->hdr = bcf_hdr_dup(hdr_in);
+    init_data(args);
+    *hdr_out = args->hnull ? args->hnull : (args->hsub ? args->hsub : args->hdr);
+    return args;
+}
+
+void view_stage_process(void *stage, stage_block_t *blk)
+{
+    args_t *args = (args_t*) stage;
+    int i, n = stage_block_take(blk, &args->recs, &args->mrecs);
+    for (i=0; i<n; i++)
+        if ( subset_vcf(args, args->recs[i]) ) stage_block_push(blk, &args->recs[i]);
+}
+
+void view_stage_destroy(void *stage)
+{
+    args_t *args = (args_t*) stage;
+    int i;
+    for (i=0; i<args->mrecs; i++) bcf_destroy(args->recs[i]);
+    free(args->recs);
+    destroy_data(args);
+    bcf_hdr_destroy(args->hdr);
+    free(args);
+}
+
+int main_vcfview(int argc, char *argv[])
+{
+    args_t *args = parse_args(argc, argv);
+    args->files = bcf_sr_init();
+    args->files->apply_filters = args->apply_filters;
 
     char *fname = NULL;
     if ( optind>=argc )
@@ -714,7 +749,7 @@ int main_vcfview(int argc, char *argv[])
     // read in the regions from the command line
     if ( args->regions_list )
     {
-        if ( bcf_sr_set_regions(args->files, args->regions_list, regions_is_file)<0 )
+        if ( bcf_sr_set_regions(args->files, args->regions_list, args->regions_is_file)<0 )
             error("Failed to read the regions: %s\n", args->regions_list);
     }
     else if ( optind+1 < argc )
@@ -729,14 +764,28 @@ int main_vcfview(int argc, char *argv[])
     }
     if ( args->targets_list )
     {
-        if ( bcf_sr_set_targets(args->files, args->targets_list, targets_is_file, 0)<0 )
+        if ( bcf_sr_set_targets(args->files, args->targets_list, args->targets_is_file, 0)<0 )
             error("Failed to read the targets: %s\n", args->targets_list);
     }
 
-    if ( bcf_sr_set_threads(args->files, args->n_threads)<0 ) error("Failed to create threads\n");
+    args->n_threads = bcftools_threads(args->n_threads);
+    bcftools_sr_set_threads(args->files, args->n_threads);
     if ( !bcf_sr_add_reader(args->files, fname) ) error("Failed to open %s: %s\n", fname,bcf_sr_strerror(args->files->errnum));
 
+    args->hdr = args->files->readers[0].header;
     init_data(args);
+
+    // setup output
+    char modew[8];
+    strcpy(modew, "w");
+    if (args->clevel >= 0 && args->clevel <= 9) sprintf(modew + 1, "%d", args->clevel);
+    if (args->output_type==FT_BCF) strcat(modew, "bu");         // uncompressed BCF
+    else if (args->output_type & FT_BCF) strcat(modew, "b");    // compressed BCF
+    else if (args->output_type & FT_GZ) strcat(modew,"z");      // compressed VCF
+    args->out = hts_open(args->fn_out ? args->fn_out : "-", modew);
+    if ( !args->out ) error("%s: %s\n", args->fn_out,strerror(errno));
+    bcftools_set_threads(args->out, args->n_threads);
+
     bcf_hdr_t *out_hdr = args->hnull ? args->hnull : (args->hsub ? args->hsub : args->hdr);
     if (args->print_header)
         bcf_hdr_write(args->out, out_hdr);
@@ -746,19 +795,25 @@ int main_vcfview(int argc, char *argv[])
     int ret = 0;
     if (!args->header_only)
     {
-        while ( bcf_sr_next_line(args->files) )
+        while ( perf_beg(PERF_READ), bcf_sr_next_line(args->files) )
         {
+            perf_end(PERF_READ, 1);
             bcf1_t *line = args->files->readers[0].buffer[0];
             if ( line->errcode && out_hdr!=args->hdr ) error("Undefined tags in the header, cannot proceed in the sample subset mode.\n");
             if ( subset_vcf(args, line) )
+            {
+                perf_beg(PERF_WRITE);
                 bcf_write1(args->out, out_hdr, line);
+                perf_end(PERF_WRITE, 1);
+            }
         }
+        perf_end(PERF_READ, 0);
         ret = args->files->errnum;
         if ( ret ) fprintf(stderr,"Error: %s\n", bcf_sr_strerror(args->files->errnum));
     }
     hts_close(args->out);
     destroy_data(args);
-    bcf_sr_destroy(args->files);
+    bcftools_sr_destroy(args->files);
     free(args);
     return ret;
 }